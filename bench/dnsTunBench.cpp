@@ -0,0 +1,350 @@
+/*
+ * Micro-benchmarks of the codec, dns and packet layers.
+ *     dnsTunBench [-f filter] [-t ms] [-o out.json] [-b baseline.json] [-r percent]
+ * -f runs the benchmarks whose name contains filter, -t is the time each repetition runs for, -o writes the results as
+ * JSON, -b compares them with a previous -o and exits with 1 if one got slower by more than -r percent (10 by default).
+ * The baseline is only comparable on the machine and with the build type it was taken with.
+ * */
+#include "Packet.h"
+#include "Log.h"
+#include "BlockingQueue.hpp"
+#include "LockFreeQueue.hpp"
+#include "DnsServerChannel.h"
+#include "../src/protocol/packetProcess.h"
+#include "../src/lib/base36.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+//the repetitions of a benchmark, the median is reported
+#define BENCH_REPETITIONS 5
+#define BENCH_DEFAULT_MS 200
+#define BENCH_DEFAULT_THRESHOLD 10
+
+using namespace std;
+using namespace ucsmq;
+
+#define BENCH_DOMAIN "tun.k72vb42ffx.xyz"
+
+//results are added up here so the compiler can not drop the work
+static volatile uint64_t sink;
+
+struct Benchmark {
+    const char* name;
+    //bytes handled per operation, 0 if a throughput makes no sense
+    size_t bytes;
+    function<void(uint64_t iterations)> run;
+};
+
+struct Result {
+    string name;
+    uint64_t iterations;
+    double nsPerOp;
+    double mbPerSec;
+};
+
+static string payload(size_t n){
+    string s(n,0);
+    for(size_t i=0;i<n;i++) s[i]=(char)(i*131+7);
+    return s;
+}
+
+static Packet headOf(packet_t type,const string& data){
+    Packet packet;
+    packet.dnsTransactionId=0x1234;
+    packet.sessionId=4321;
+    packet.groupId=7;
+    packet.dataId=3;
+    packet.type=type;
+    packet.dnsQueryType=TXT;
+    packet.data=Buffer::copyOf(data.data(),data.size());
+    return packet;
+}
+
+static vector<Benchmark> benchmarks(){
+    static auto domain = cstrToDomain(BENCH_DOMAIN);
+    static DomainSuffix suffix(domain);
+    vector<Benchmark> all;
+
+    static auto raw = payload(180);
+    static char encoded[512];
+    static auto encodedLen = base36encode(encoded,raw.data(),raw.size());
+    all.push_back({"base36encode",raw.size(),[](uint64_t n){
+        char dst[512];
+        for(uint64_t i=0;i<n;i++) sink+=base36encode(dst,raw.data(),raw.size());
+    }});
+    all.push_back({"base36decode",raw.size(),[](uint64_t n){
+        char dst[512];
+        for(uint64_t i=0;i<n;i++) sink+=base36decode(dst,encoded,encodedLen);
+    }});
+
+    //an upload segment as the client sends it and a download as the server answers it
+    static uint8_t query[DNS_SINGLE_QUERY_SIZE];
+    static ssize_t queryLen=0;
+    static uint8_t response[1024];
+    static ssize_t responseLen=0;
+    static auto segment = payload(100);
+    {
+        auto packet = headOf(PACKET_UPLOAD,segment);
+        queryLen = Packet::queryBytes(query,sizeof(query),packet,suffix);
+        Packet received;
+        Packet::wireQueryToPacket(received,query,queryLen,suffix);
+        auto packetDown = received.getResponsePacket(PACKET_DOWNLOAD);
+        auto down = payload(MAX_RESPONSE_DATA_LEN);
+        packetDown.data=Buffer::copyOf(down.data(),down.size());
+        responseLen = Packet::responseBytes(response,sizeof(response),packetDown);
+    }
+
+    all.push_back({"dns_resolve_query",(size_t)queryLen,[](uint64_t n){
+        for(uint64_t i=0;i<n;i++){
+            Dns dns;
+            sink+=Dns::resolve(dns,query,queryLen);
+        }
+    }});
+    all.push_back({"dns_resolve_response",(size_t)responseLen,[](uint64_t n){
+        for(uint64_t i=0;i<n;i++){
+            Dns dns;
+            sink+=Dns::resolve(dns,response,responseLen);
+        }
+    }});
+    static Dns queryDns, responseDns;
+    Dns::resolve(queryDns,query,queryLen);
+    Dns::resolve(responseDns,response,responseLen);
+    all.push_back({"dns_bytes_query",(size_t)queryLen,[](uint64_t n){
+        uint8_t buf[1024];
+        for(uint64_t i=0;i<n;i++) sink+=Dns::bytes(queryDns,buf,sizeof(buf));
+    }});
+    all.push_back({"dns_bytes_response",(size_t)responseLen,[](uint64_t n){
+        uint8_t buf[1024];
+        for(uint64_t i=0;i<n;i++) sink+=Dns::bytes(responseDns,buf,sizeof(buf));
+    }});
+
+    all.push_back({"packet_to_dns_query",segment.size(),[](uint64_t n){
+        auto packet = headOf(PACKET_UPLOAD,segment);
+        for(uint64_t i=0;i<n;i++){
+            Dns dns;
+            Packet::packetToDnsQuery(dns,packet.dnsTransactionId,packet,domain);
+            sink+=dns.questions;
+        }
+    }});
+    all.push_back({"dns_query_to_packet",segment.size(),[](uint64_t n){
+        for(uint64_t i=0;i<n;i++){
+            DnsView view;
+            DnsView::parse(view,query,queryLen);
+            Packet packet;
+            Packet::dnsQueryToPacket(packet,view,domain);
+            sink+=packet.data.size;
+        }
+    }});
+    //the paths the channels take instead, straight between a Packet and the datagram
+    all.push_back({"packet_query_bytes",segment.size(),[](uint64_t n){
+        auto packet = headOf(PACKET_UPLOAD,segment);
+        uint8_t buf[DNS_SINGLE_QUERY_SIZE];
+        for(uint64_t i=0;i<n;i++) sink+=Packet::queryBytes(buf,sizeof(buf),packet,suffix);
+    }});
+    all.push_back({"wire_query_to_packet",segment.size(),[](uint64_t n){
+        for(uint64_t i=0;i<n;i++){
+            Packet packet;
+            sink+=Packet::wireQueryToPacket(packet,query,queryLen,suffix);
+        }
+    }});
+    all.push_back({"packet_response_bytes",MAX_RESPONSE_DATA_LEN,[](uint64_t n){
+        Packet received;
+        Packet::wireQueryToPacket(received,query,queryLen,suffix);
+        auto packetDown = received.getResponsePacket(PACKET_DOWNLOAD);
+        auto down = payload(MAX_RESPONSE_DATA_LEN);
+        packetDown.data=Buffer::copyOf(down.data(),down.size());
+        uint8_t buf[1024];
+        for(uint64_t i=0;i<n;i++) sink+=Packet::responseBytes(buf,sizeof(buf),packetDown);
+    }});
+    all.push_back({"wire_response_to_packet",MAX_RESPONSE_DATA_LEN,[](uint64_t n){
+        for(uint64_t i=0;i<n;i++){
+            Packet packet;
+            sink+=bytesToPacketResp(packet,response,responseLen);
+        }
+    }});
+
+    static auto group = payload(4096);
+    all.push_back({"disaggregate_4k",group.size(),[](uint64_t n){
+        AggregatedPacket aggregated={Buffer::copyOf(group.data(),group.size())};
+        for(uint64_t i=0;i<n;i++){
+            auto g = disaggregateToQueryPacketGroup(aggregated,4321,7,TXT,PACKET_UPLOAD,suffix);
+            sink+=g.segments.size();
+        }
+    }});
+    all.push_back({"aggregate_packets_4k",group.size(),[](uint64_t n){
+        vector<Packet> packets;
+        for(size_t offset=0;offset<group.size();offset+=MAX_RESPONSE_DATA_LEN){
+            packets.push_back(headOf(PACKET_DOWNLOAD,group.substr(offset,MAX_RESPONSE_DATA_LEN)));
+        }
+        for(uint64_t i=0;i<n;i++) sink+=aggregatePackets(packets).size;
+    }});
+
+    //one thread, so the cost of the queue itself and not of waking a consumer
+    all.push_back({"blocking_queue_push_pop",0,[](uint64_t n){
+        BlockingQueue<uint64_t> queue;
+        uint64_t v;
+        for(uint64_t i=0;i<n;i++){
+            queue.push(i);
+            queue.pop(v);
+            sink+=v;
+        }
+    }});
+    all.push_back({"spsc_queue_push_pop",0,[](uint64_t n){
+        SpscQueue<uint64_t> queue;
+        uint64_t v;
+        for(uint64_t i=0;i<n;i++){
+            queue.tryPush(uint64_t(i));
+            queue.tryPop(v);
+            sink+=v;
+        }
+    }});
+    all.push_back({"mpsc_queue_push_pop",0,[](uint64_t n){
+        MpscQueue<uint64_t> queue;
+        uint64_t v;
+        for(uint64_t i=0;i<n;i++){
+            queue.tryPush(uint64_t(i));
+            queue.tryPop(v);
+            sink+=v;
+        }
+    }});
+    return all;
+}
+
+static double elapsedNs(const Benchmark& b,uint64_t iterations){
+    auto start = chrono::steady_clock::now();
+    b.run(iterations);
+    return (double)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now()-start).count();
+}
+
+static Result measure(const Benchmark& b,int ms){
+    double target = (double)ms*1e6;
+    //grow the iterations until a run is long enough to scale from
+    uint64_t iterations=1;
+    double ns = elapsedNs(b,iterations);
+    while (ns<target/10 && iterations<((uint64_t)1<<40)){
+        iterations*=ns<target/1000 ? 100 : 10;
+        ns = elapsedNs(b,iterations);
+    }
+    iterations = max<uint64_t>(1,(uint64_t)((double)iterations*target/ns));
+    vector<double> perOp;
+    for(int i=0;i<BENCH_REPETITIONS;i++){
+        perOp.push_back(elapsedNs(b,iterations)/(double)iterations);
+    }
+    sort(perOp.begin(),perOp.end());
+    double median = perOp[BENCH_REPETITIONS/2];
+    return {b.name,iterations,median,b.bytes==0 ? 0 : (double)b.bytes/median*1e3};
+}
+
+static const char* buildType(){
+#ifdef NDEBUG
+    return "release";
+#else
+    return "debug";
+#endif
+}
+
+static int writeJson(const string& path,const vector<Result>& results){
+    ofstream out(path,ios::trunc);
+    //one benchmark per line, readBaseline relies on it
+    out<<"{\n  \"build\": \""<<buildType()<<"\",\n  \"benchmarks\": [\n";
+    char line[256];
+    for(size_t i=0;i<results.size();i++){
+        const auto& r = results[i];
+        snprintf(line,sizeof(line),"    {\"name\": \"%s\", \"iterations\": %llu, \"ns_per_op\": %.3f, \"mb_per_s\": %.3f}%s\n",
+                 r.name.c_str(),(unsigned long long)r.iterations,r.nsPerOp,r.mbPerSec,i+1<results.size() ? "," : "");
+        out<<line;
+    }
+    out<<"  ]\n}\n";
+    if(!out.good()){
+        LOG_PRINTF(LOG_ERROR,"failed to write %s",path.c_str());
+        return -1;
+    }
+    return 1;
+}
+
+//the ns_per_op by name of a file written by writeJson
+static int readBaseline(const string& path,map<string,double>& baseline,string& build){
+    ifstream in(path);
+    if(!in.good()){
+        LOG_PRINTF(LOG_ERROR,"failed to read %s",path.c_str());
+        return -1;
+    }
+    string line;
+    while (getline(in,line)){
+        auto b = line.find("\"build\": \"");
+        if(b!=string::npos){
+            b+=10;
+            build=line.substr(b,line.find('"',b)-b);
+            continue;
+        }
+        auto n = line.find("\"name\": \"");
+        auto t = line.find("\"ns_per_op\": ");
+        if(n==string::npos || t==string::npos) continue;
+        n+=9;
+        baseline[line.substr(n,line.find('"',n)-n)]=strtod(line.c_str()+t+13, nullptr);
+    }
+    return 1;
+}
+
+static void usage(const char* name){
+    fprintf(stderr,"usage: %s [-f filter] [-t ms] [-o out.json] [-b baseline.json] [-r percent]\n",name);
+    exit(2);
+}
+
+int main(int argc,char** args){
+    const char *filter="",*out=nullptr,*baselinePath=nullptr;
+    int ms=BENCH_DEFAULT_MS;
+    double threshold=BENCH_DEFAULT_THRESHOLD;
+    for(int i=1;i<argc;i++){
+        if(i+1>=argc) usage(args[0]);
+        if(strcmp(args[i],"-f")==0) filter=args[++i];
+        else if(strcmp(args[i],"-t")==0) ms=atoi(args[++i]);
+        else if(strcmp(args[i],"-o")==0) out=args[++i];
+        else if(strcmp(args[i],"-b")==0) baselinePath=args[++i];
+        else if(strcmp(args[i],"-r")==0) threshold=atof(args[++i]);
+        else usage(args[0]);
+    }
+    if(ms<=0) usage(args[0]);
+    Log::level=LOG_WARN;
+
+    map<string,double> baseline;
+    string baselineBuild;
+    if(baselinePath!= nullptr){
+        if(readBaseline(baselinePath,baseline,baselineBuild)<0) return 2;
+        if(baselineBuild!=buildType()){
+            fprintf(stderr,"warning: the baseline is a %s build, this is a %s build\n",baselineBuild.c_str(),buildType());
+        }
+    }
+
+    vector<Result> results;
+    int regressions=0;
+    printf("%-26s %14s %12s %12s %10s\n","benchmark","iterations","ns/op","MB/s",baseline.empty() ? "" : "vs base");
+    for(const auto& b : benchmarks()){
+        if(strstr(b.name,filter)== nullptr) continue;
+        auto r = measure(b,ms);
+        results.push_back(r);
+        printf("%-26s %14llu %12.1f %12.1f",r.name.c_str(),(unsigned long long)r.iterations,r.nsPerOp,r.mbPerSec);
+        auto it = baseline.find(r.name);
+        if(it!=baseline.end() && it->second>0){
+            double change = (r.nsPerOp/it->second-1)*100;
+            bool slower = change>threshold;
+            regressions+=slower;
+            printf(" %+9.1f%%%s",change,slower ? "  REGRESSION" : "");
+        }
+        printf("\n");
+        fflush(stdout);
+    }
+    if(out!= nullptr && writeJson(out,results)<0) return 2;
+    if(regressions>0){
+        printf("%d benchmark(s) slower than the baseline by more than %.1f%%\n",regressions,threshold);
+        return 1;
+    }
+    return 0;
+}
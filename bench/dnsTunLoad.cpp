@@ -0,0 +1,445 @@
+/*
+ * Drives many concurrent sessions against a server and reports what it can hold.
+ *     dnsTunLoad [-n sessions] [-m echo:70,bulk:20,idle:10] [-s size] [-d seconds] [-t think_ms] [-T threads] [-L loops]
+ *                [-R reactors] [-W workers] [-P port] [-w capture.pcap] [-a host:port] [-l latency_ms] [-S seed]
+ * Unless -a names a server, an echo server with -R reactors and -W workers runs in a child process on port, so that its
+ * CPU time is its own; -w writes its traffic to a pcap file, for dnsTunReplay. -l puts an ImpairedResolver of that
+ * one way latency in between, the polls then pace as over a real resolver. -s is a size in bytes, min-max for a uniform draw or eMEAN for an exponential one.
+ * echo sessions send a message, wait for its echo and think -t ms; bulk ones keep their send buffer full;
+ * idle ones only poll. The sessions share the sockets of -L client loops and are driven by -T threads.
+ * */
+#include "DnsClientChannel.h"
+#include "DnsServerChannel.h"
+#include "ImpairedResolver.h"
+#include "Pcap.h"
+#include "Metrics.h"
+#include "Log.h"
+#include "../src/lib/Random.h"
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+
+#define LOAD_DOMAIN "tun.k72vb42ffx.xyz"
+#define LOAD_DEFAULT_PORT 18153
+//seconds an authentication may take, and how often a session id taken on the server is drawn again
+#define LOAD_OPEN_TIMEOUT 5
+#define LOAD_OPEN_ATTEMPTS 3
+#define LOAD_MAX_MESSAGE_SIZE 65536
+//how long a driver thread sleeps after a pass over its sessions that moved nothing
+#define LOAD_IDLE_SLEEP_US 200
+
+using namespace std;
+using namespace ucsmq;
+
+enum workload_t {
+    WORKLOAD_ECHO,
+    WORKLOAD_BULK,
+    WORKLOAD_IDLE
+};
+
+static const char* workloadName(int w){
+    switch (w) {
+        case WORKLOAD_ECHO: return "echo";
+        case WORKLOAD_BULK: return "bulk";
+        default: return "idle";
+    }
+}
+
+struct SizeDistribution {
+    size_t min=64;
+    size_t max=64;
+    //exponential with this mean if >0, capped at LOAD_MAX_MESSAGE_SIZE
+    double mean=0;
+    size_t draw(Random& random) const {
+        if(mean>0){
+            double u = ((double)(random.next()>>11)+1)*0x1.0p-53;
+            return std::max<size_t>(1,std::min<size_t>(LOAD_MAX_MESSAGE_SIZE,(size_t)llround(-log(u)*mean)));
+        }
+        if(max<=min) return min;
+        return min+random.below((uint32_t)(max-min+1));
+    }
+    bool parse(const char* s){
+        if(s[0]=='e'){
+            mean=atof(s+1);
+            return mean>0;
+        }
+        auto dash = strchr(s,'-');
+        min=(size_t)atol(s);
+        max= dash!= nullptr ? (size_t)atol(dash+1) : min;
+        return min>0 && max>=min && max<=LOAD_MAX_MESSAGE_SIZE;
+    }
+    string toString() const {
+        if(mean>0) return "exponential, mean "+to_string((size_t)mean);
+        if(max>min) return to_string(min)+"-"+to_string(max);
+        return to_string(min);
+    }
+};
+
+struct Options {
+    int sessions=100;
+    //shares of the sessions, in percent
+    int mix[3]={100,0,0};
+    SizeDistribution size;
+    int seconds=10;
+    int thinkMs=0;
+    int threads=4;
+    size_t loops=2;
+    size_t reactors=1;
+    size_t workers=1;
+    int port=LOAD_DEFAULT_PORT;
+    const char* server= nullptr;
+    const char* capture= nullptr;
+    double latencyMs=0;
+    uint64_t seed=1;
+};
+
+struct Session {
+    unique_ptr<DnsClientChannel> channel;
+    int workload;
+    bool waiting=false;
+    size_t expected=0;
+    size_t received=0;
+    chrono::steady_clock::time_point sentAt;
+    chrono::steady_clock::time_point nextSend;
+};
+
+//what a driver thread measured, merged once the run is over
+struct DriverStats {
+    Histogram latency;
+    uint64_t written=0;
+    uint64_t echoed=0;
+    uint64_t messages=0;
+    uint64_t opened=0;
+    uint64_t openFailures=0;
+    uint64_t lost=0;
+};
+
+struct Run {
+    const Options& options;
+    SA_IN target;
+    ClientReactor& reactor;
+    //one block of the largest message, every write shares a slice of it
+    Buffer payload;
+    atomic<int> openers;
+    atomic<bool> measuring;
+    atomic<bool> stopping;
+    Run(const Options& options_,const SA_IN& target_,ClientReactor& reactor_) : options(options_),target(target_),reactor(reactor_){
+        size_t n = options.size.mean>0 ? LOAD_MAX_MESSAGE_SIZE : options.size.max;
+        payload = Buffer::build(n,[n](uint8_t* p){
+            for(size_t i=0;i<n;i++) p[i]=(uint8_t)('a'+i%26);
+            return n;
+        });
+        openers.store(options.threads);
+        measuring.store(false);
+        stopping.store(false);
+    }
+};
+
+static int workloadOf(const Options& options,int i){
+    //spread the workloads over the sessions, whatever their count
+    int slot = (int)((uint64_t)i*100/options.sessions);
+    if(slot<options.mix[WORKLOAD_ECHO]) return WORKLOAD_ECHO;
+    if(slot<options.mix[WORKLOAD_ECHO]+options.mix[WORKLOAD_BULK]) return WORKLOAD_BULK;
+    return WORKLOAD_IDLE;
+}
+
+static bool openSession(Run& run,Session& s,DriverStats& stats){
+    for(int attempt=0;attempt<LOAD_OPEN_ATTEMPTS;attempt++){
+        s.channel.reset(new DnsClientChannel(run.target,LOAD_DOMAIN,"load",run.reactor));
+        if(s.channel->open(LOAD_OPEN_TIMEOUT)>0) return true;
+        //most likely a session id already taken on the server, a new channel draws another one
+        stats.openFailures++;
+    }
+    s.channel.reset();
+    return false;
+}
+
+//one pass of a session, return whether it moved
+static bool step(Run& run,Session& s,Random& random,DriverStats& stats,chrono::steady_clock::time_point now){
+    bool moved=false;
+    bool measuring = run.measuring.load(memory_order_relaxed);
+    while (true){
+        BufferChain chain;
+        if(s.channel->read(chain,NO_WAIT)<0){
+            if(errno!=EAGAIN){
+                stats.lost++;
+                s.channel.reset();
+                return true;
+            }
+            break;
+        }
+        moved=true;
+        if(measuring) stats.echoed+=chain.size;
+        if(!s.waiting) continue;
+        s.received+=chain.size;
+        if(s.received>=s.expected){
+            s.waiting=false;
+            if(measuring){
+                stats.latency.record((uint64_t)chrono::duration_cast<chrono::microseconds>(now-s.sentAt).count());
+                stats.messages++;
+            }
+            s.nextSend=now+chrono::milliseconds(run.options.thinkMs);
+        }
+    }
+    if(s.workload==WORKLOAD_IDLE || run.stopping.load(memory_order_relaxed)) return moved;
+    while (s.workload==WORKLOAD_BULK || (!s.waiting && now>=s.nextSend)){
+        auto size = run.options.size.draw(random);
+        if(s.channel->write(run.payload.slice(0,size),NO_WAIT)<0) break;
+        moved=true;
+        if(measuring) stats.written+=size;
+        if(s.workload==WORKLOAD_ECHO){
+            s.waiting=true;
+            s.expected=size;
+            s.received=0;
+            s.sentAt=now;
+        }
+    }
+    return moved;
+}
+
+static void driving(Run& run,int index,DriverStats& stats){
+    const auto& options = run.options;
+    auto& random = Random::local();
+    vector<Session> sessions;
+    for(int i=index;i<options.sessions;i+=options.threads){
+        sessions.emplace_back();
+        auto& s = sessions.back();
+        s.workload=workloadOf(options,i);
+        if(openSession(run,s,stats)) stats.opened++;
+    }
+    run.openers.fetch_sub(1);
+    while (!run.stopping.load()){
+        bool moved=false;
+        auto now = chrono::steady_clock::now();
+        for(auto& s : sessions){
+            if(s.channel && step(run,s,random,stats,now)) moved=true;
+        }
+        if(!moved) this_thread::sleep_for(chrono::microseconds(LOAD_IDLE_SLEEP_US));
+    }
+    for(auto& s : sessions){
+        if(s.channel) s.channel->close();
+    }
+}
+
+//the echo server of test/EchoServer.hpp, without the printing
+static void serve(const Options& options,int readyfd){
+    //SIGTERM ends the server, once the capture is written out. Blocked before any thread starts, they all inherit it
+    sigset_t term;
+    sigemptyset(&term);
+    sigaddset(&term,SIGTERM);
+    pthread_sigmask(SIG_BLOCK,&term, nullptr);
+    PcapWriter capture;
+    auto addr = inetAddr("127.0.0.1",(unsigned short)options.port);
+    DnsServerChannel server(addr,LOAD_DOMAIN);
+    server.reactorCount=options.reactors;
+    server.workerCount=options.workers;
+    if(options.capture!= nullptr){
+        if(capture.open(options.capture)<0) _exit(1);
+        server.capture=&capture;
+    }
+    thread([&term,&capture](){
+        int sig;
+        sigwait(&term,&sig);
+        capture.close();
+        _exit(0);
+    }).detach();
+    char ready = server.open()>0 ? 1 : 0;
+    if(write(readyfd,&ready,1)!=1 || !ready) _exit(1);
+    while (auto conn = server.accept()){
+        thread([conn](){
+            while (true){
+                Buffer buf;
+                if(conn->read(buf)<0 || conn->write(buf)<0) break;
+            }
+        }).detach();
+    }
+    _exit(0);
+}
+
+//user and system time of a process, in seconds
+static double cpuSeconds(pid_t pid){
+    ifstream in("/proc/"+to_string(pid)+"/stat");
+    string stat((istreambuf_iterator<char>(in)),istreambuf_iterator<char>());
+    //the fields after the command name, which may hold spaces
+    auto p = stat.rfind(')');
+    if(p==string::npos) return -1;
+    unsigned long long utime=0,stime=0;
+    if(sscanf(stat.c_str()+p+2,"%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu",&utime,&stime)!=2) return -1;
+    return (double)(utime+stime)/(double)sysconf(_SC_CLK_TCK);
+}
+
+static double ms(uint64_t us){
+    return (double)us/1000;
+}
+
+static bool parseMix(const char* s,int mix[3]){
+    mix[0]=mix[1]=mix[2]=0;
+    string spec(s);
+    size_t start=0;
+    while (start<spec.size()){
+        auto end = spec.find(',',start);
+        if(end==string::npos) end=spec.size();
+        auto item = spec.substr(start,end-start);
+        auto colon = item.find(':');
+        int share = colon==string::npos ? 100 : atoi(item.c_str()+colon+1);
+        auto name = item.substr(0,colon);
+        int w=-1;
+        for(int i=WORKLOAD_ECHO;i<=WORKLOAD_IDLE;i++){
+            if(name==workloadName(i)) w=i;
+        }
+        if(w<0 || share<0) return false;
+        mix[w]=share;
+        start=end+1;
+    }
+    return mix[0]+mix[1]+mix[2]==100;
+}
+
+static void usage(const char* name){
+    fprintf(stderr,"usage: %s [-n sessions] [-m echo:70,bulk:20,idle:10] [-s size|min-max|eMEAN] [-d seconds] [-t think_ms] [-T threads]\n"
+                   "       [-L loops] [-R reactors] [-W workers] [-P port] [-w capture.pcap] [-a host:port] [-l latency_ms] [-S seed]\n",name);
+    exit(2);
+}
+
+int main(int argc,char** args){
+    Options options;
+    for(int i=1;i<argc;i++){
+        if(i+1>=argc || args[i][0]!='-' || strlen(args[i])!=2) usage(args[0]);
+        const char* v = args[++i];
+        switch (args[i-1][1]) {
+            case 'n': options.sessions=atoi(v); break;
+            case 'm': if(!parseMix(v,options.mix)) usage(args[0]); break;
+            case 's': if(!options.size.parse(v)) usage(args[0]); break;
+            case 'd': options.seconds=atoi(v); break;
+            case 't': options.thinkMs=atoi(v); break;
+            case 'T': options.threads=atoi(v); break;
+            case 'L': options.loops=(size_t)atol(v); break;
+            case 'R': options.reactors=(size_t)atol(v); break;
+            case 'W': options.workers=(size_t)atol(v); break;
+            case 'P': options.port=atoi(v); break;
+            case 'w': options.capture=v; break;
+            case 'a': options.server=v; break;
+            case 'l': options.latencyMs=atof(v); break;
+            case 'S': options.seed=strtoull(v, nullptr,10); break;
+            default: usage(args[0]);
+        }
+    }
+    if(options.sessions<=0 || options.seconds<=0 || options.threads<=0 || options.loops==0) usage(args[0]);
+    if(options.threads>options.sessions) options.threads=options.sessions;
+
+    //before any thread exists, the child gets a clean process
+    pid_t child=-1;
+    SA_IN serverAddr;
+    if(options.server== nullptr){
+        int fds[2];
+        if(pipe(fds)<0) return 1;
+        child=fork();
+        if(child<0) return 1;
+        if(child==0){
+            ::close(fds[0]);
+            //the server goes with the run, however it ends
+            prctl(PR_SET_PDEATHSIG,SIGTERM);
+            Log::level=LOG_WARN;
+            serve(options,fds[1]);
+        }
+        ::close(fds[1]);
+        char ready=0;
+        if(read(fds[0],&ready,1)!=1 || !ready){
+            fprintf(stderr,"the server failed to open on port %d\n",options.port);
+            waitpid(child, nullptr,0);
+            return 1;
+        }
+        ::close(fds[0]);
+        serverAddr=inetAddr("127.0.0.1",(unsigned short)options.port);
+    }else{
+        const char* colon = strrchr(options.server,':');
+        if(colon== nullptr) usage(args[0]);
+        serverAddr=inetAddr(string(options.server,colon).c_str(),(unsigned short)atoi(colon+1));
+    }
+    Log::level=LOG_WARN;
+    Random::seedAll(options.seed);
+
+    unique_ptr<ImpairedResolver> resolver;
+    SA_IN target = serverAddr;
+    if(options.latencyMs>0){
+        resolver.reset(new ImpairedResolver(inetAddr("127.0.0.1",0),serverAddr));
+        resolver->impairment.latencyMs=options.latencyMs;
+        if(resolver->start()<0) return 1;
+        target=resolver->address();
+    }
+
+    ClientReactor reactor(options.loops,true);
+    Run run(options,target,reactor);
+    vector<unique_ptr<DriverStats>> stats;
+    vector<thread> threads;
+    auto openStart = chrono::steady_clock::now();
+    for(int t=0;t<options.threads;t++){
+        stats.emplace_back(new DriverStats);
+        threads.emplace_back(driving,std::ref(run),t,std::ref(*stats.back()));
+    }
+    while (run.openers.load()>0){
+        this_thread::sleep_for(chrono::milliseconds(1));
+    }
+    double openSeconds = chrono::duration<double>(chrono::steady_clock::now()-openStart).count();
+
+    auto cpuStart = child>0 ? cpuSeconds(child) : -1;
+    auto start = chrono::steady_clock::now();
+    run.measuring.store(true);
+    this_thread::sleep_for(chrono::seconds(options.seconds));
+    run.measuring.store(false);
+    double elapsed = chrono::duration<double>(chrono::steady_clock::now()-start).count();
+    auto cpuEnd = child>0 ? cpuSeconds(child) : -1;
+    run.stopping.store(true);
+    for(auto& t : threads){
+        t.join();
+    }
+    reactor.stop();
+    if(resolver) resolver->stop();
+    if(child>0){
+        kill(child,SIGTERM);
+        waitpid(child, nullptr,0);
+    }
+
+    DriverStats total;
+    HistogramSnapshot latency;
+    for(const auto& s : stats){
+        latency.merge(s->latency.snapshot());
+        total.written+=s->written;
+        total.echoed+=s->echoed;
+        total.messages+=s->messages;
+        total.opened+=s->opened;
+        total.openFailures+=s->openFailures;
+        total.lost+=s->lost;
+    }
+    int shares[3]={0,0,0};
+    for(int i=0;i<options.sessions;i++){
+        shares[workloadOf(options,i)]++;
+    }
+    printf("sessions: %llu of %d opened in %.2f s, %.1f sessions/s, %llu authentications failed, %llu lost during the run\n",
+           (unsigned long long)total.opened,options.sessions,openSeconds,(double)total.opened/openSeconds,
+           (unsigned long long)total.openFailures,(unsigned long long)total.lost);
+    printf("mix: %d echo, %d bulk, %d idle, %s byte messages, %d ms think time, %.1f ms to the server\n",shares[WORKLOAD_ECHO],
+           shares[WORKLOAD_BULK],shares[WORKLOAD_IDLE],options.size.toString().c_str(),options.thinkMs,options.latencyMs);
+    printf("goodput: %.1f KB/s written, %.1f KB/s echoed back over %.1f s\n",(double)total.written/1024/elapsed,
+           (double)total.echoed/1024/elapsed,elapsed);
+    if(latency.count>0){
+        printf("echo latency: p50 %.3f ms, p99 %.3f ms, p999 %.3f ms, max %.3f ms (%llu messages, %.1f/s)\n",ms(latency.quantile(0.5)),
+               ms(latency.quantile(0.99)),ms(latency.quantile(0.999)),ms(latency.max),(unsigned long long)latency.count,
+               (double)latency.count/elapsed);
+    }
+    if(cpuStart>=0 && cpuEnd>=0 && total.opened>0){
+        double cpu = (cpuEnd-cpuStart)/elapsed;
+        printf("server cpu: %.1f%% of a core, %.1f us of cpu per session per second\n",cpu*100,cpu*1e6/(double)total.opened);
+    }
+    return 0;
+}
@@ -0,0 +1,228 @@
+/*
+ * End-to-end throughput and latency of the tunnel on loopback, through an ImpairedResolver.
+ *     dnsTunLoopback [-w bulk|interactive] [-c clients] [-d seconds] [-s bytes] [-P port]
+ *                    [-l latency_ms] [-j jitter_ms] [-p loss] [-o reorder] [-u duplicate] [-q qps] [-m max_response] [-N max_name] [-S seed]
+ * An echo server runs on port, the resolver on port+1. bulk keeps every client writing messages of -s bytes and counts
+ * what comes back, interactive sends one message at a time and times its echo. Without -w both run.
+ * */
+#include "DnsClientChannel.h"
+#include "DnsServerChannel.h"
+#include "ImpairedResolver.h"
+#include "Metrics.h"
+#include "Log.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define LOOPBACK_DOMAIN "tun.k72vb42ffx.xyz"
+#define LOOPBACK_DEFAULT_PORT 18053
+#define BULK_MESSAGE_SIZE 4096
+#define INTERACTIVE_MESSAGE_SIZE 64
+//seconds a read waits for an echo
+#define ECHO_TIMEOUT 5
+
+using namespace std;
+using namespace ucsmq;
+
+struct Options {
+    const char* workload= nullptr;
+    int clients=4;
+    int seconds=5;
+    size_t size=0;
+    int port=LOOPBACK_DEFAULT_PORT;
+    Impairment impairment;
+};
+
+static void echoing(DnsServerChannel& server){
+    while (true){
+        auto conn = server.accept();
+        if(!conn) break;
+        thread([conn](){
+            while (true){
+                Buffer buf;
+                if(conn->read(buf)<0 || conn->write(buf)<0) break;
+            }
+        }).detach();
+    }
+}
+
+static double ms(uint64_t us){
+    return (double)us/1000;
+}
+
+static void printLatency(const char* name,const HistogramSnapshot& h){
+    printf("  %-20s p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, p999 %.3f ms, max %.3f ms (%llu samples)\n",name,ms(h.quantile(0.5)),
+           ms(h.quantile(0.9)),ms(h.quantile(0.99)),ms(h.quantile(0.999)),ms(h.max),(unsigned long long)h.count);
+}
+
+static vector<unique_ptr<DnsClientChannel>> connect(const Options& options,const SA_IN& resolverAddr){
+    vector<unique_ptr<DnsClientChannel>> clients;
+    for(int i=0;i<options.clients;i++){
+        unique_ptr<DnsClientChannel> client(new DnsClientChannel(resolverAddr,LOOPBACK_DOMAIN,"bench"));
+        if(client->open(ECHO_TIMEOUT)<0){
+            LOG_PRINTF(LOG_ERROR,"client %d failed to connect",i);
+            continue;
+        }
+        clients.push_back(std::move(client));
+    }
+    return clients;
+}
+
+static void report(const vector<unique_ptr<DnsClientChannel>>& clients){
+    HistogramSnapshot rtt;
+    uint64_t queries=0,retransmits=0,pollTimeouts=0;
+    for(const auto& client : clients){
+        auto m = client->metrics();
+        rtt.merge(m.rtt);
+        queries+=m.queriesSent;
+        retransmits+=m.retransmits;
+        pollTimeouts+=m.pollTimeouts;
+    }
+    printf("  %-20s %llu, %llu segments and %llu polls sent again\n","queries",(unsigned long long)queries,
+           (unsigned long long)retransmits,(unsigned long long)pollTimeouts);
+    printLatency("query rtt",rtt);
+}
+
+static void bulk(const Options& options,const SA_IN& resolverAddr){
+    size_t size = options.size>0 ? options.size : BULK_MESSAGE_SIZE;
+    auto clients = connect(options,resolverAddr);
+    atomic<uint64_t> sent(0),echoed(0);
+    atomic<bool> sending(true);
+    vector<thread> threads;
+    auto start = chrono::steady_clock::now();
+    for(auto& client : clients){
+        auto c = client.get();
+        threads.emplace_back([c,size,&sent,&sending](){
+            string message(size,'b');
+            while (sending.load()){
+                if(c->write(message.data(),message.size(),1)<0) continue;
+                sent+=size;
+            }
+        });
+        threads.emplace_back([c,&echoed](){
+            while (true){
+                BufferChain chain;
+                auto n = c->read(chain,ECHO_TIMEOUT);
+                if(n<0) break;
+                echoed+=n;
+            }
+        });
+    }
+    this_thread::sleep_for(chrono::seconds(options.seconds));
+    //what comes back after this is not counted
+    uint64_t done = echoed.load();
+    double elapsed = chrono::duration<double>(chrono::steady_clock::now()-start).count();
+    sending.store(false);
+    for(auto& client : clients){
+        client->close();
+    }
+    for(auto& t : threads){
+        t.join();
+    }
+    printf("bulk: %zu clients, %zu byte messages, %.1f s\n",clients.size(),size,elapsed);
+    printf("  %-20s %.1f KB/s written, %.1f KB/s echoed back\n","goodput",(double)sent.load()/1024/elapsed,(double)done/1024/elapsed);
+    report(clients);
+}
+
+static void interactive(const Options& options,const SA_IN& resolverAddr){
+    size_t size = options.size>0 ? options.size : INTERACTIVE_MESSAGE_SIZE;
+    auto clients = connect(options,resolverAddr);
+    vector<unique_ptr<Histogram>> latencies;
+    vector<thread> threads;
+    atomic<uint64_t> lost(0);
+    auto deadline = chrono::steady_clock::now()+chrono::seconds(options.seconds);
+    for(auto& client : clients){
+        latencies.emplace_back(new Histogram);
+        auto c = client.get();
+        auto h = latencies.back().get();
+        threads.emplace_back([c,h,size,deadline,&lost](){
+            string message(size,'i');
+            while (chrono::steady_clock::now()<deadline){
+                auto sentAt = chrono::steady_clock::now();
+                Bytes echo;
+                if(c->write(message.data(),message.size(),ECHO_TIMEOUT)<0 || c->read(echo,ECHO_TIMEOUT)<0){
+                    lost++;
+                    break;
+                }
+                h->record((uint64_t)chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now()-sentAt).count());
+            }
+        });
+    }
+    for(auto& t : threads){
+        t.join();
+    }
+    for(auto& client : clients){
+        client->close();
+    }
+    HistogramSnapshot latency;
+    for(const auto& h : latencies){
+        latency.merge(h->snapshot());
+    }
+    printf("interactive: %zu clients, %zu byte messages, %d s\n",clients.size(),size,options.seconds);
+    printf("  %-20s %.1f messages/s, %llu clients gave up\n","rate",(double)latency.count/options.seconds,(unsigned long long)lost.load());
+    printLatency("message round trip",latency);
+    report(clients);
+}
+
+static void usage(const char* name){
+    fprintf(stderr,"usage: %s [-w bulk|interactive] [-c clients] [-d seconds] [-s bytes] [-P port]\n"
+                   "       [-l latency_ms] [-j jitter_ms] [-p loss] [-o reorder] [-u duplicate] [-q qps] [-m max_response] [-N max_name] [-S seed]\n",name);
+    exit(2);
+}
+
+int main(int argc,char** args){
+    Options options;
+    auto& im = options.impairment;
+    for(int i=1;i<argc;i++){
+        if(i+1>=argc || args[i][0]!='-' || strlen(args[i])!=2) usage(args[0]);
+        const char* v = args[++i];
+        switch (args[i-1][1]) {
+            case 'w': options.workload=v; break;
+            case 'c': options.clients=atoi(v); break;
+            case 'd': options.seconds=atoi(v); break;
+            case 's': options.size=(size_t)atol(v); break;
+            case 'P': options.port=atoi(v); break;
+            case 'l': im.latencyMs=atof(v); break;
+            case 'j': im.jitterMs=atof(v); break;
+            case 'p': im.lossRate=atof(v); break;
+            case 'o': im.reorderRate=atof(v); break;
+            case 'u': im.duplicateRate=atof(v); break;
+            case 'q': im.qpsLimit=atof(v); break;
+            case 'm': im.maxResponseSize=(size_t)atol(v); break;
+            case 'N': im.maxQueryNameLen=(size_t)atol(v); break;
+            case 'S': im.seed=strtoull(v, nullptr,10); break;
+            default: usage(args[0]);
+        }
+    }
+    bool runBulk = options.workload== nullptr || strcmp(options.workload,"bulk")==0;
+    bool runInteractive = options.workload== nullptr || strcmp(options.workload,"interactive")==0;
+    if((!runBulk && !runInteractive) || options.clients<=0 || options.seconds<=0) usage(args[0]);
+    Log::level=LOG_WARN;
+
+    auto serverAddr = inetAddr("127.0.0.1",(unsigned short)options.port);
+    DnsServerChannel server(serverAddr,LOOPBACK_DOMAIN);
+    if(server.open()<0) return 1;
+    thread(echoing,std::ref(server)).detach();
+    ImpairedResolver resolver(inetAddr("127.0.0.1",(unsigned short)(options.port+1)),serverAddr);
+    resolver.impairment=im;
+    if(resolver.start()<0) return 1;
+
+    printf("latency %.1f ms, jitter %.1f ms, loss %.3f, reorder %.3f, duplicate %.3f, qps limit %.0f, max response %zu, max name %zu\n",
+           im.latencyMs,im.jitterMs,im.lossRate,im.reorderRate,im.duplicateRate,im.qpsLimit,im.maxResponseSize,im.maxQueryNameLen);
+    if(runBulk) bulk(options,resolver.address());
+    if(runInteractive) interactive(options,resolver.address());
+
+    auto s = resolver.stats();
+    printf("resolver: %llu queries, %llu responses, %llu lost, %llu reordered, %llu duplicated, %llu rate limited, %llu truncated, "
+           "%llu refused\n",(unsigned long long)s.queries,(unsigned long long)s.responses,(unsigned long long)s.lost,
+           (unsigned long long)s.reordered,(unsigned long long)s.duplicated,(unsigned long long)s.rateLimited,
+           (unsigned long long)s.truncated,(unsigned long long)s.refused);
+    resolver.stop();
+    server.close();
+    return 0;
+}
@@ -0,0 +1,253 @@
+/*
+ * Seeded scenarios of the tunnel in a Simulation: virtual time, an in-memory network, no threads.
+ *     dnsTunSim [-w bulk|interactive] [-c clients] [-d seconds] [-s bytes] [-n runs]
+ *               [-l latency_ms] [-j jitter_ms] [-p loss] [-o reorder] [-u duplicate] [-q qps] [-m max_response] [-N max_name] [-S seed]
+ * Every run echoes the messages of the clients through a server for -d simulated seconds and checks what comes back.
+ * -n runs the seeds from -S on. A seed always gives the same digest, the exit status is 1 if an echo was wrong or missing.
+ * */
+#include "DnsClientChannel.h"
+#include "DnsServerChannel.h"
+#include "Simulation.h"
+#include "Metrics.h"
+#include "Log.h"
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+#define SIM_DOMAIN "tun.k72vb42ffx.xyz"
+#define BULK_MESSAGE_SIZE 4096
+#define INTERACTIVE_MESSAGE_SIZE 64
+//virtual time between two turns of the application
+#define SIM_STEP_MS 1
+//simulated seconds a client may take to authenticate
+#define SIM_OPEN_TIMEOUT 10
+
+using namespace std;
+using namespace ucsmq;
+
+struct Options {
+    const char* workload="bulk";
+    int clients=4;
+    int seconds=60;
+    size_t size=0;
+    int runs=1;
+    uint64_t seed=1;
+    Impairment impairment;
+    Options(){
+        impairment.latencyMs=20;
+        impairment.jitterMs=5;
+        impairment.lossRate=0.01;
+    }
+};
+
+struct RunResult {
+    uint64_t echoed=0;
+    uint64_t messages=0;
+    uint64_t wrong=0;
+    uint64_t queries=0;
+    uint64_t retransmits=0;
+    HistogramSnapshot roundTrip;
+    SimNetworkStats network;
+    double wallSeconds=0;
+    uint64_t digest=0;
+    bool failed=false;
+};
+
+//FNV-1a over what the run measured, equal digests mean equal runs
+static void fold(uint64_t& digest,uint64_t v){
+    if(digest==0) digest=0xcbf29ce484222325ull;
+    for(int i=0;i<8;i++){
+        digest^=(v>>(i*8))&0xff;
+        digest*=0x100000001b3ull;
+    }
+}
+
+static uint8_t pattern(int client,uint64_t seq,size_t i){
+    return (uint8_t)(seq*131+i*7+client);
+}
+
+static Buffer message(int client,uint64_t seq,size_t size){
+    return Buffer::build(size,[client,seq,size](uint8_t* p){
+        for(size_t i=0;i<size;i++) p[i]=pattern(client,seq,i);
+        return size;
+    });
+}
+
+struct SimClient {
+    unique_ptr<DnsClientChannel> channel;
+    int index;
+    uint64_t nextSeq=0;
+    //sent and not echoed yet, with the virtual time they were sent
+    deque<pair<uint64_t,Clock::time_point>> inFlight;
+};
+
+struct EchoConnection {
+    ClientConnectionPtr conn;
+    //read and not written back yet, the send buffer was full
+    deque<Buffer> pending;
+};
+
+//the server side of the application: accept, then write back every message as it came
+static void echo(DnsServerChannel& server,vector<EchoConnection>& conns){
+    while (auto conn = server.accept(NO_WAIT)){
+        conns.push_back({conn,{}});
+    }
+    for(auto& ec : conns){
+        while (true){
+            if(ec.pending.empty()){
+                Buffer buf;
+                if(ec.conn->read(buf,NO_WAIT)<0) break;
+                ec.pending.push_back(std::move(buf));
+            }
+            if(ec.conn->write(ec.pending.front(),NO_WAIT)<0) break;
+            ec.pending.pop_front();
+        }
+    }
+}
+
+static bool verify(const SimClient& c,uint64_t seq,const Buffer& buf,size_t size){
+    if(buf.size!=size) return false;
+    for(size_t i=0;i<size;i++){
+        if(buf.data[i]!=pattern(c.index,seq,i)) return false;
+    }
+    return true;
+}
+
+static RunResult run(const Options& options,uint64_t seed){
+    RunResult result;
+    bool bulk = strcmp(options.workload,"bulk")==0;
+    size_t size = options.size>0 ? options.size : (bulk ? BULK_MESSAGE_SIZE : INTERACTIVE_MESSAGE_SIZE);
+    auto wallStart = chrono::steady_clock::now();
+
+    Simulation simulation(seed);
+    simulation.network().impairment=options.impairment;
+    auto serverAddr = inetAddr("10.0.0.53",53);
+    DnsServerChannel server(serverAddr,SIM_DOMAIN);
+    if(server.open()<0){
+        result.failed=true;
+        return result;
+    }
+    ClientReactor reactor;
+    vector<SimClient> clients(options.clients);
+    for(int i=0;i<options.clients;i++){
+        clients[i].index=i;
+        clients[i].channel.reset(new DnsClientChannel(serverAddr,SIM_DOMAIN,"sim",reactor));
+        if(clients[i].channel->open(SIM_OPEN_TIMEOUT)<0){
+            LOG_PRINTF(LOG_ERROR,"client %d failed to connect",i);
+            result.failed=true;
+        }
+    }
+    vector<EchoConnection> conns;
+    Histogram roundTrip;
+    auto measureFrom = simulation.now();
+    auto end = measureFrom+chrono::seconds(options.seconds);
+    while (simulation.now()<end && !result.failed){
+        simulation.runFor(chrono::milliseconds(SIM_STEP_MS));
+        echo(server,conns);
+        for(auto& c : clients){
+            while (true){
+                Buffer buf;
+                if(c.channel->read(buf,NO_WAIT)<0) break;
+                if(c.inFlight.empty() || !verify(c,c.inFlight.front().first,buf,size)){
+                    result.wrong++;
+                    continue;
+                }
+                auto us = (uint64_t)chrono::duration_cast<chrono::microseconds>(simulation.now()-c.inFlight.front().second).count();
+                roundTrip.record(us);
+                fold(result.digest,us);
+                c.inFlight.pop_front();
+                result.echoed+=size;
+                result.messages++;
+            }
+            //bulk keeps the send buffer full, interactive waits for the echo of its message
+            while (bulk || c.inFlight.empty()){
+                if(c.channel->write(message(c.index,c.nextSeq,size),NO_WAIT)<0) break;
+                c.inFlight.emplace_back(c.nextSeq++,simulation.now());
+            }
+        }
+    }
+    for(auto& c : clients){
+        auto m = c.channel->metrics();
+        result.queries+=m.queriesSent;
+        result.retransmits+=m.retransmits+m.pollTimeouts;
+        c.channel->close();
+    }
+    server.close();
+    result.roundTrip=roundTrip.snapshot();
+    result.network=simulation.network().stats();
+    for(auto v : {result.echoed,result.messages,result.wrong,result.queries,result.retransmits,result.network.datagrams,
+                  result.network.lost}){
+        fold(result.digest,v);
+    }
+    if(result.wrong>0 || result.messages==0) result.failed=true;
+    result.wallSeconds=chrono::duration<double>(chrono::steady_clock::now()-wallStart).count();
+    return result;
+}
+
+static double ms(uint64_t us){
+    return (double)us/1000;
+}
+
+static void usage(const char* name){
+    fprintf(stderr,"usage: %s [-w bulk|interactive] [-c clients] [-d seconds] [-s bytes] [-n runs]\n"
+                   "       [-l latency_ms] [-j jitter_ms] [-p loss] [-o reorder] [-u duplicate] [-q qps] [-m max_response] [-N max_name] [-S seed]\n",name);
+    exit(2);
+}
+
+int main(int argc,char** args){
+    Options options;
+    auto& im = options.impairment;
+    for(int i=1;i<argc;i++){
+        if(i+1>=argc || args[i][0]!='-' || strlen(args[i])!=2) usage(args[0]);
+        const char* v = args[++i];
+        switch (args[i-1][1]) {
+            case 'w': options.workload=v; break;
+            case 'c': options.clients=atoi(v); break;
+            case 'd': options.seconds=atoi(v); break;
+            case 's': options.size=(size_t)atol(v); break;
+            case 'n': options.runs=atoi(v); break;
+            case 'l': im.latencyMs=atof(v); break;
+            case 'j': im.jitterMs=atof(v); break;
+            case 'p': im.lossRate=atof(v); break;
+            case 'o': im.reorderRate=atof(v); break;
+            case 'u': im.duplicateRate=atof(v); break;
+            case 'q': im.qpsLimit=atof(v); break;
+            case 'm': im.maxResponseSize=(size_t)atol(v); break;
+            case 'N': im.maxQueryNameLen=(size_t)atol(v); break;
+            case 'S': options.seed=strtoull(v, nullptr,10); break;
+            default: usage(args[0]);
+        }
+    }
+    if((strcmp(options.workload,"bulk")!=0 && strcmp(options.workload,"interactive")!=0) || options.clients<=0 ||
+        options.seconds<=0 || options.runs<=0) usage(args[0]);
+    Log::level=LOG_WARN;
+
+    printf("%s: %d clients, %d s simulated, latency %.1f ms, jitter %.1f ms, loss %.3f, reorder %.3f, duplicate %.3f, qps limit %.0f, "
+           "max response %zu, max name %zu\n",options.workload,options.clients,options.seconds,im.latencyMs,im.jitterMs,im.lossRate,
+           im.reorderRate,im.duplicateRate,im.qpsLimit,im.maxResponseSize,im.maxQueryNameLen);
+    int failures=0;
+    double wall=0;
+    for(int r=0;r<options.runs;r++){
+        uint64_t seed = options.seed+r;
+        auto res = run(options,seed);
+        wall+=res.wallSeconds;
+        if(res.failed) failures++;
+        const auto& h = res.roundTrip;
+        const auto& n = res.network;
+        printf("seed %llu: %s %.1f KB/s, %llu messages, round trip p50 %.3f ms, p99 %.3f ms, max %.3f ms, %llu queries, %llu sent again, "
+               "%llu datagrams, %llu lost, %.2f s wall, digest %016llx\n",(unsigned long long)seed,res.failed ? "FAILED" : "ok",
+               (double)res.echoed/1024/options.seconds,(unsigned long long)res.messages,ms(h.quantile(0.5)),ms(h.quantile(0.99)),
+               ms(h.max),(unsigned long long)res.queries,(unsigned long long)res.retransmits,(unsigned long long)n.datagrams,
+               (unsigned long long)n.lost,res.wallSeconds,(unsigned long long)res.digest);
+        if(res.wrong>0) printf("  %llu echoes did not match what was sent\n",(unsigned long long)res.wrong);
+        if(n.truncated+n.refused>0) printf("  %llu responses truncated, %llu queries refused for their names\n",
+                                           (unsigned long long)n.truncated,(unsigned long long)n.refused);
+    }
+    printf("%d runs, %d failed, %.1f s simulated in %.2f s\n",options.runs,failures,(double)options.seconds*options.runs,wall);
+    return failures>0 ? 1 : 0;
+}
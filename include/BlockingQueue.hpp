@@ -4,6 +4,7 @@
 #include <mutex>
 #include <condition_variable>
 #include <atomic>
+#include <vector>
 
 namespace ucsmq{
     enum pop_result{
@@ -32,24 +33,46 @@ namespace ucsmq{
         }
         bool isBlockingQueue(){return shouldBlock.load();}
         ~BlockingQueue(){unblock();}
+        //the consumers only wait on an empty queue, so only the first element has to wake them
         void push(const T& value) {
+            bool wasEmpty;
             {
                 std::unique_lock<std::mutex> lock(mutex);
+                wasEmpty=queue.empty();
                 queue.push(value);
             }
-            cv.notify_all();
+            if(wasEmpty) cv.notify_all();
         }
         void push(T&& value) {
+            bool wasEmpty;
             {
                 std::unique_lock<std::mutex> lock(mutex);
+                wasEmpty=queue.empty();
                 queue.push(std::move(value));
             }
-            cv.notify_all();
+            if(wasEmpty) cv.notify_all();
+        }
+        //push all the values under one lock and at most one signal
+        void pushBatch(std::vector<T>&& values) {
+            if(values.empty()) return;
+            bool wasEmpty;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wasEmpty=queue.empty();
+                for(auto& value : values){
+                    queue.push(std::move(value));
+                }
+            }
+            values.clear();
+            if(wasEmpty) cv.notify_all();
         }
 
+        //timeout in seconds, 0: wait, <0: do not wait
         pop_result pop(T& out,int timeout=0){
             std::unique_lock<std::mutex> lock(mutex);
-            if (timeout>0) {
+            if(timeout<0){
+                if(!cvSatisfied()) return POP_TIMEOUT;
+            }else if (timeout>0) {
                 if(!cv.wait_for(lock,std::chrono::seconds(timeout),[this] { return cvSatisfied();})){
                     return POP_TIMEOUT;
                 }
@@ -65,6 +88,37 @@ namespace ucsmq{
         }
 
 
+        //wait like pop(), then take up to max elements at once
+        pop_result popBatch(std::vector<T>& out,size_t max,int timeout=0){
+            std::unique_lock<std::mutex> lock(mutex);
+            if (timeout>0) {
+                if(!cv.wait_for(lock,std::chrono::seconds(timeout),[this] { return cvSatisfied();})){
+                    return POP_TIMEOUT;
+                }
+            }else{
+                cv.wait(lock,[this] { return cvSatisfied();});
+            }
+            if(queue.empty()){
+                return POP_INVALID;
+            }
+            for(size_t i=0;i<max && !queue.empty();i++){
+                out.push_back(std::move(queue.front()));
+                queue.pop();
+            }
+            return POP_SUCCESSFULLY;
+        }
+
+        //take every element without waiting, return how many
+        size_t drainTo(std::vector<T>& out){
+            std::unique_lock<std::mutex> lock(mutex);
+            size_t n=queue.size();
+            while (!queue.empty()){
+                out.push_back(std::move(queue.front()));
+                queue.pop();
+            }
+            return n;
+        }
+
         size_t size(){
             std::unique_lock<std::mutex> lock(mutex);
             return queue.size();
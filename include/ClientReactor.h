@@ -0,0 +1,62 @@
+#ifndef DNSTUN_CLIENTREACTOR_H
+#define DNSTUN_CLIENTREACTOR_H
+#include "EventLoop.h"
+#include "udp.h"
+#include "Packet.h"
+#include "Metrics.h"
+#include <unordered_map>
+#include <memory>
+
+#define DEFAULT_CLIENT_REACTOR_LOOPS 1
+
+namespace ucsmq{
+    class DnsClientChannel;
+
+    //one loop of a ClientReactor, and the socket its channels share when sharing is enabled
+    struct ClientLoop {
+        EventLoop loop;
+        int sockfd;
+        UdpBatch inBatch;
+        UdpBatch outBatch;
+        std::unordered_map<session_id_t,DnsClientChannel*> channels;
+        //flushes of the shared socket that dropped queries
+        Counter drops;
+        ClientLoop() : sockfd(-1){}
+    };
+
+    /*
+     * Runs the state machines of many DnsClientChannels on a few event loops, one per core at most.
+     * By default every channel keeps its own connected socket, watched by the loop it is assigned to.
+     * With shareSockets, the channels of a loop send through one socket bound to localAddr
+     * and the responses are routed to them by session id.
+     * */
+    class ClientReactor {
+        friend class DnsClientChannel;
+        std::vector<std::unique_ptr<ClientLoop>> loops;
+        std::atomic<size_t> nextLoop;
+        std::mutex lock;
+        bool started;
+        bool shareSockets;
+        SA_IN localAddr;
+        ClientLoop& assign();
+        void receiveShared(ClientLoop& cl);
+        //return -1 and fail the channels of the loop if the shared socket is broken
+        int flush(ClientLoop& cl);
+        void stopLocked();
+    public:
+        explicit ClientReactor(size_t loopCount=DEFAULT_CLIENT_REACTOR_LOOPS,bool shareSockets_=false,const SA_IN& localAddr_=ADDR_ZERO);
+        ClientReactor(const ClientReactor&)=delete;
+        ~ClientReactor();
+        //return -1 if a loop or a shared socket can not be created
+        int start();
+        //close the channels first
+        void stop();
+        bool isSharingSockets() const {return shareSockets;}
+        //flushes of the shared sockets that dropped queries, the timers of the channels send them again
+        uint64_t droppedFlushes() const;
+        //the reactor of the channels created without one, a single loop started on first use
+        static ClientReactor& defaultReactor();
+    };
+}
+
+#endif //DNSTUN_CLIENTREACTOR_H
@@ -0,0 +1,30 @@
+#ifndef DNSTUN_CLOCK_H
+#define DNSTUN_CLOCK_H
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+namespace ucsmq{
+    /*
+     * The time of the timers, the retransmissions and the traces. The steady clock, unless a Simulation drives a
+     * virtual one: then time only moves when the simulation advances it.
+     * */
+    struct Clock {
+        using time_point = std::chrono::steady_clock::time_point;
+        using duration = std::chrono::steady_clock::duration;
+        static time_point now(){
+            if(!virtualTime.load(std::memory_order_relaxed)) return std::chrono::steady_clock::now();
+            return time_point(duration(virtualNow.load(std::memory_order_relaxed)));
+        }
+        static bool isVirtual(){return virtualTime.load(std::memory_order_relaxed);}
+        //switch to the virtual clock at start, or back to the steady clock
+        static void useVirtual(bool on,time_point start=time_point());
+        //move the virtual clock, never backwards
+        static void advanceTo(time_point t);
+    private:
+        static std::atomic<bool> virtualTime;
+        static std::atomic<int64_t> virtualNow;
+    };
+}
+
+#endif //DNSTUN_CLOCK_H
@@ -1,13 +1,19 @@
 #ifndef DNSTUN_DNSCLIENTCHANNEL_H
 #define DNSTUN_DNSCLIENTCHANNEL_H
-#include "BlockingQueue.hpp"
+#include "LockFreeQueue.hpp"
 #include "net.h"
 #include "Packet.h"
 #include "DnsServerChannel.h"
+#include "ClientReactor.h"
+#include "Metrics.h"
 #include <atomic>
-#include <thread>
+#include <future>
 #define DEFAULT_ACK_TIMEOUT 1
 #define DEFAULT_POLL_TIMEOUT 1
+//seconds between two measures of the path
+#define DEFAULT_PROBE_INTERVAL 60
+//candidates of a probe ladder, the largest first
+#define PROBE_STEPS 16
 
 namespace ucsmq{
     enum dns_client_channel_err_t{
@@ -17,49 +23,185 @@ namespace ucsmq{
         DCCE_PEER_CLOSED
     };
 
+    //counted on the loop of the channel
+    struct ClientChannelCounters {
+        Counter queriesSent;
+        Counter wireBytesSent;
+        Counter responses;
+        Counter wireBytesReceived;
+        Counter segmentsSent;
+        //segments sent again after an ack timeout
+        Counter retransmits;
+        Counter polls;
+        Counter pollTimeouts;
+        Counter downloadNothing;
+        Counter discards;
+        //queries the own socket of the channel dropped, a shared socket counts them in its ClientReactor
+        Counter queriesDropped;
+        //queries measuring the path
+        Counter probes;
+        //payload bytes acked by the server, and received in whole groups from it
+        Counter goodputBytesUp;
+        Counter goodputBytesDown;
+        //microseconds from a query to its response, retransmitted queries are left out
+        Histogram rtt;
+    };
+
+    struct ClientChannelMetrics {
+        uint64_t queriesSent=0;
+        uint64_t wireBytesSent=0;
+        uint64_t responses=0;
+        uint64_t wireBytesReceived=0;
+        uint64_t segmentsSent=0;
+        uint64_t retransmits=0;
+        uint64_t polls=0;
+        uint64_t pollTimeouts=0;
+        uint64_t downloadNothing=0;
+        uint64_t discards=0;
+        uint64_t queriesDropped=0;
+        uint64_t probes=0;
+        uint64_t goodputBytesUp=0;
+        uint64_t goodputBytesDown=0;
+        //bytes waiting in the send and the receive buffer
+        size_t sendQueueBytes=0;
+        size_t recvQueueBytes=0;
+        HistogramSnapshot rtt;
+        void writeTo(MetricsText& text,const std::string& labels) const;
+    };
+
+    /*
+     * The channel has no thread of its own: its upload and download state machines run on a loop of a ClientReactor,
+     * the default one unless another is given. read() and write() keep their blocking behaviour on top of the buffers.
+     * */
     class DnsClientChannel {
+        friend class ClientReactor;
         int sockfd;
         SA_IN remoteAddr;
         SA_IN localAddr;
         session_id_t sessionId;
         std::vector<Bytes> myDomain;
+        DomainSuffix domainSuffix;
         std::string userId;
-        BlockingQueue<AggregatedPacket> uploadBuffer;
-        BlockingQueue<Packet> ackBuffer;
-        BlockingQueue<Packet> downloadBuffer;
-        BlockingQueue<AggregatedPacket> inboundBuffer;
+        OutboundBuffer uploadBuffer;
+        //its room is advertised to the server in every poll
+        InboundBuffer inboundBuffer;
         std::atomic<bool> running;
         std::atomic<int> err;
         group_id_t channelGroupId;
 
-        std::thread uploadThread;
-        std::thread dispatchThread;
-        std::thread downloadThread;
-        int authenticate(int timeout=NO_TIMEOUT);
-        void uploading();
-        void dispatching();
-        void downloading();
-        int sendDnsQuery(const Dns& dns);
-        int recvPacketResp(Packet &packet, Dns &dnsResp, int timeout=NO_TIMEOUT);
-        int sendGroup(const PacketGroup& group);
+        ClientReactor& reactor;
+        ClientLoop* clientLoop;
+        //write() and close() hold it while posting to the loop, nothing is posted after close() detached the channel
+        std::mutex postLock;
+        std::atomic<bool> uploadScheduled;
+
+        //state on the loop
+        std::shared_ptr<std::promise<int>> authResult;
+        bool uploadingGroup;
+        //the next group, held back while the server has no room for it
+        bool uploadPending;
+        AggregatedPacket pendingUpload;
+        uint32_t peerWindow;
+        timer_id_t windowTimer;
+        PacketGroup uploadGroup;
+        size_t segIdx;
+        timer_id_t ackTimer;
+        group_id_t downGroupId;
+        data_id_t downDataId;
+        std::vector<Packet> downPackets;
+        timer_id_t pollTimer;
+        //when the outstanding segment and poll were sent, zero once answered or sent again
+        Clock::time_point segmentSentAt;
+        Clock::time_point pollSentAt;
+        //the type of the polls for downDataId of downGroupId, sent again with it so that the segment fits the response
+        record_t pollType;
+        group_id_t pollGroupId;
+        data_id_t pollDataId;
+        ClientChannelCounters counters;
+
+        //the path as the last probe round measured it, the queries are sized by it
+        PathLimits limits;
+        //the record types the path answers, bit i stands for recordTypeAt(i)
+        uint8_t recordTypes;
+        //the group id of the probes of a round, their data id tells the probe apart
+        group_id_t probeRound;
+        //the step of the ladders sent last, -1 when no round is running
+        int probeStep;
+        //bit i: the i-th step of the ladder was answered, by probe kind and record type
+        uint32_t probesAnswered[2][RECORD_TYPE_COUNT];
+        //the names the name probes had on the wire
+        uint16_t probeNameLens[RECORD_TYPE_COUNT][PROBE_STEPS];
+        //the times PROBE_LIMITS may still be sent until the server acknowledges it
+        int limitsAttempts;
+        timer_id_t probeTimer;
+        //the server does not know probes, the default limits stay
+        bool probeUnsupported;
+
+        int attach();
+        void detach();
+        void onReadable();
+        void onPacket(Packet& packet);
+        void onAuthenticated(const Packet& packetResp);
+        void scheduleUpload();
+        void startUpload();
+        void beginGroup();
+        void sendSegment(bool retransmit=false);
+        void onAck(const Packet& packetAck);
+        void sendPoll(bool retransmit=false);
+        void onDownload(Packet& packetDown);
+        //probe rounds measure the path from the largest candidates down, and run again every probeInterval
+        void startProbe();
+        void sendProbeStep();
+        void sendProbe(probe_t kind,int typeIndex,int step);
+        void onProbe(const Packet& packetProbe);
+        void finishProbe();
+        //the response limits are sent to the server until it acknowledges them
+        void sendLimits();
+        void scheduleProbe();
+        //record the round trip of the query sent at sentAt and clear it
+        void sampleRtt(Clock::time_point& sentAt);
+        void stopTimers();
+        //encode(buf,size) writes the query into the send buffer and returns its size, -1 if it does not fit
+        template<typename F>
+        int sendQuery(F&& encode);
         void closeBuffers();
 
     public:
         std::string name;
         int ackTimeout;
         int pollTimeout;
-        DnsClientChannel(const SA_IN& remoteAddr_,SA_IN& localAddr_,const char* myDomain_,const std::string& userId_):
-                remoteAddr(remoteAddr_),localAddr(localAddr_),myDomain(cstrToDomain(myDomain_)),userId(userId_),ackTimeout(DEFAULT_ACK_TIMEOUT),pollTimeout(DEFAULT_POLL_TIMEOUT),channelGroupId(0),sessionId(0){running.store(false),err.store(DCCE_NULL);}
-        DnsClientChannel(const SA_IN& remoteAddr_,const char* myDomain_,const std::string& userId_):
-                remoteAddr(remoteAddr_),localAddr(ADDR_ZERO),myDomain(cstrToDomain(myDomain_)),userId(userId_),ackTimeout(DEFAULT_ACK_TIMEOUT),pollTimeout(DEFAULT_POLL_TIMEOUT),channelGroupId(0),sessionId(0){running.store(false),err.store(DCCE_NULL);}
+        //seconds between two probe rounds measuring the path, 0: the default limits are kept. Set it before open()
+        int probeInterval;
+        //bytes buffered per direction, set them before open()
+        size_t sendBufferSize;
+        size_t recvBufferSize;
+        DnsClientChannel(const SA_IN& remoteAddr_,SA_IN& localAddr_,const char* myDomain_,const std::string& userId_,ClientReactor& reactor_=ClientReactor::defaultReactor()):
+                sockfd(-1),remoteAddr(remoteAddr_),localAddr(localAddr_),sessionId(0),myDomain(cstrToDomain(myDomain_)),userId(userId_),channelGroupId(0),reactor(reactor_),clientLoop(nullptr),
+                ackTimeout(DEFAULT_ACK_TIMEOUT),pollTimeout(DEFAULT_POLL_TIMEOUT),probeInterval(DEFAULT_PROBE_INTERVAL),sendBufferSize(DEFAULT_SEND_BUFFER_SIZE),recvBufferSize(DEFAULT_RECV_BUFFER_SIZE){init();}
+        DnsClientChannel(const SA_IN& remoteAddr_,const char* myDomain_,const std::string& userId_,ClientReactor& reactor_=ClientReactor::defaultReactor()):
+                sockfd(-1),remoteAddr(remoteAddr_),localAddr(ADDR_ZERO),sessionId(0),myDomain(cstrToDomain(myDomain_)),userId(userId_),channelGroupId(0),reactor(reactor_),clientLoop(nullptr),
+                ackTimeout(DEFAULT_ACK_TIMEOUT),pollTimeout(DEFAULT_POLL_TIMEOUT),probeInterval(DEFAULT_PROBE_INTERVAL),sendBufferSize(DEFAULT_SEND_BUFFER_SIZE),recvBufferSize(DEFAULT_RECV_BUFFER_SIZE){init();}
         ~DnsClientChannel();
         int open(int timeout=NO_TIMEOUT);
         void close();
-        ssize_t write(const void* buf, size_t len);
+        //timeout in seconds while the send buffer is full, 0: block, NO_WAIT: fail with errno EAGAIN
+        ssize_t write(const void* buf, size_t len,int timeout=0);
+        //timeout in seconds while nothing is received, 0: block, NO_WAIT: fail with errno EAGAIN
         ssize_t read(void *dst, int timeout=0);
         ssize_t read(Bytes& dst,int timeout=0);
-        ssize_t write(const Bytes& src);
+        ssize_t write(const Bytes& src,int timeout=0);
+        //share the payload with the channel instead of copying it
+        ssize_t read(Buffer& dst,int timeout=0);
+        ssize_t write(const Buffer& src,int timeout=0);
+        //the group as the received segments, a scatter list that is never copied
+        ssize_t read(BufferChain& dst,int timeout=0);
         bool noConnErr();
+        //safe to take from any thread
+        ClientChannelMetrics metrics() const;
+        //the limits of the last probe round, state of the loop: take them on it, in a Simulation or once closed
+        PathLimits pathLimits() const {return limits;}
+    private:
+        void init();
     };
 }
 
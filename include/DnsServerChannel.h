@@ -1,11 +1,17 @@
 #ifndef DNSTUN_DNSSERVERCHANNEL_H
 #define DNSTUN_DNSSERVERCHANNEL_H
 #include "BlockingQueue.hpp"
+#include "LockFreeQueue.hpp"
+#include "SessionTable.hpp"
 #include "net.h"
 #include "Packet.h"
+#include "udp.h"
+#include "EventLoop.h"
+#include "Metrics.h"
 #include <atomic>
 #include <thread>
 #include <map>
+#include <unordered_map>
 
 namespace ucsmq{
     enum dns_server_channel_err_t{
@@ -25,35 +31,179 @@ namespace ucsmq{
 
     class DnsServerChannel;
     class ConnectionManager;
+    class PcapWriter;
+    struct ReactorState;
 
-#define MAX_RESPONSE_DATA_LEN 85
 #define DEFAULT_CLIENT_IDLE_TIMEOUT 5
 #define DEFAULT_DOWNLOADED_PACKETS_STORAGE_LIMIT 3
-    class ClientConnection {
+#define DEFAULT_REACTOR_COUNT 1
+#define DEFAULT_WORKER_COUNT 1
+//how often a worker frees the sessions removed from the table
+#define EPOCH_COLLECT_INTERVAL_MS 1000
+//the download payloads a client may ask for with PROBE_RESPONSE and PROBE_LIMITS
+#define PROBE_MIN_RESPONSE_DATA 16
+#define PROBE_MAX_RESPONSE_DATA 1024
+//bytes a connection may hold in each direction
+#define DEFAULT_SEND_BUFFER_SIZE (256*1024)
+#define DEFAULT_RECV_BUFFER_SIZE (256*1024)
+
+    //counted by the worker of the connection
+    struct ConnectionCounters {
+        Counter polls;
+        Counter downloadNothing;
+        Counter uploads;
+        //segments and acks sent again because the client did not get them
+        Counter retransmits;
+        Counter discards;
+        //queries measuring the path of the client
+        Counter probes;
+        //payload bytes received in whole groups, and sent in new segments
+        Counter goodputBytesUp;
+        Counter goodputBytesDown;
+    };
+
+    struct ConnectionMetrics {
+        uint64_t polls=0;
+        uint64_t downloadNothing=0;
+        uint64_t uploads=0;
+        uint64_t retransmits=0;
+        uint64_t discards=0;
+        uint64_t probes=0;
+        uint64_t goodputBytesUp=0;
+        uint64_t goodputBytesDown=0;
+        //bytes waiting in the send and the receive buffer
+        size_t sendQueueBytes=0;
+        size_t recvQueueBytes=0;
+        void add(const ConnectionCounters& counters);
+        //prefix: of the metric names
+        void writeTo(MetricsText& text,const std::string& labels,const std::string& prefix="dnstun_connection_") const;
+    };
+
+    //the counters of one reactor or worker of a DnsServerChannel
+    struct ServerCounters {
+        Counter queriesReceived;
+        Counter wireBytesReceived;
+        Counter invalidQueries;
+        Counter sessionsNotFound;
+        Counter authentications;
+        Counter authenticationFailures;
+        Counter responsesSent;
+        Counter wireBytesSent;
+        //responses too large for a datagram, a server failure was sent instead
+        Counter oversizedResponses;
+        //the connections run by a worker
+        ConnectionCounters connections;
+    };
+
+    struct ServerChannelMetrics {
+        uint64_t queriesReceived=0;
+        uint64_t wireBytesReceived=0;
+        uint64_t invalidQueries=0;
+        uint64_t sessionsNotFound=0;
+        uint64_t authentications=0;
+        uint64_t authenticationFailures=0;
+        uint64_t responsesSent=0;
+        uint64_t wireBytesSent=0;
+        uint64_t oversizedResponses=0;
+        size_t activeSessions=0;
+        //queries received by each reactor, how the kernel spreads the sources among them
+        std::vector<uint64_t> reactorQueries;
+        //every connection since open(), the queues of the active ones
+        ConnectionMetrics connections;
+        void writeTo(MetricsText& text,const std::string& labels) const;
+    };
+
+    class ClientConnection;
+    //the packets of one received batch going to the same worker
+    using Delivery = std::vector<std::pair<std::shared_ptr<ClientConnection>,Packet>>;
+
+    /*
+     * Drives the state machines of the ClientConnections assigned to it on one EventLoop.
+     * A reactor hands over the packets of a received batch in a single task,
+     * and the responses produced while handling them leave in a single sendBatch.
+     * */
+    class ConnectionWorker {
+        friend class ClientConnection;
         friend class DnsServerChannel;
+        EventLoop loop;
+        UdpBatch outBatch;
         int sockfd;
+        std::atomic<int>* err;
+        ServerCounters* counters;
+        //the capture of the channel and the address its responses leave from
+        PcapWriter* capture;
+        SA_IN localAddr;
+        int sendPacketResp(const Packet& packet);
+        int flush();
+        void deliver(Delivery&& delivery);
+        //a removed session is otherwise only freed by the next removal
+        void collectRetired();
+    public:
+        ConnectionWorker(int sockfd_,std::atomic<int>* err_,ServerCounters* counters_);
+        ConnectionWorker(const ConnectionWorker&)=delete;
+        void start();
+        void stop();
+    };
+
+    //a segment already sent in a downloaded group, kept to answer repeated polls
+    struct SentSegment{
+        packet_type_t type;
+        Buffer data;
+    };
+
+    /*
+     * The connection has no thread of its own. The reactors hand its packets to its ConnectionWorker,
+     * which runs the upload and download state machines below, one packet at a time.
+     * */
+    class ClientConnection : public std::enable_shared_from_this<ClientConnection> {
+        friend class DnsServerChannel;
+        friend class ConnectionManager;
+        friend class ConnectionWorker;
+        ConnectionWorker* worker;
         session_id_t sessionId;
         std::atomic<int>* err;
         std::atomic<int> connErr;
         std::weak_ptr<ConnectionManager> manager;
         std::atomic<bool> running;
-        BlockingQueue<AggregatedPacket> inboundBuffer;
-        BlockingQueue<Packet> uploadBuffer;
-        BlockingQueue<AggregatedPacket> downloadBuffer;
-        BlockingQueue<Packet> pollBuffer;
-        std::thread uploadThread;
-        std::thread downloadThread;
+        //filled by the worker, drained by the application reading the connection. Its room is advertised to the client
+        InboundBuffer inboundBuffer;
+        //filled by the writers, drained by the worker
+        OutboundBuffer downloadBuffer;
+
+        //upload state, the group being received
+        std::vector<Packet> uploadPackets;
+        group_id_t uploadGroupId;
+        data_id_t uploadDataId;
+
+        //download state, the group being sent
         group_id_t connGroupId;
+        bool sendingGroup;
+        //downloadGroup waits for the client to advertise room for it
+        bool groupPending;
+        AggregatedPacket downloadGroup;
+        //how much of downloadGroup is sent, the segments are slices of it
+        size_t downloadOffset;
+        std::vector<SentSegment> sentSegments;
+        std::list<std::pair<group_id_t,std::vector<SentSegment>>> downloadedPackets;
+        //what the responses carry on the path of the client, sent by it once measured
+        PathLimits limits;
 
-        std::list<std::pair<group_id_t,std::vector<Packet>>> downloadedPackets;
+        Clock::time_point lastPoll;
+        ConnectionCounters counters;
+        //counted for the connection and for its worker
+        void count(Counter ConnectionCounters::*counter,uint64_t n=1);
 
-        void addDownloadedPackets(group_id_t groupId ,std::vector<Packet>& packets);
+        //called on the worker
+        void onPacket(Packet& packet);
+        void onUpload(Packet& packetUpload);
+        void onPoll(const Packet& packetPoll);
+        void onProbe(const Packet& packetProbe);
+        void checkIdle();
+        void addDownloadedPackets(group_id_t groupId ,std::vector<SentSegment>& segments);
         int downloadPreviousPacket(const Packet& packetPoll);
+        int sendSegment(const Packet& packetPoll);
         void stop();
-        void uploading();
-        void downloading();
         int sendPacketResp(const Packet& packet);
-        int sendGroup(const AggregatedPacket &aggregatedPacket);
         void handleIdle();
         void closeBuffer();
     public:
@@ -63,60 +213,106 @@ namespace ucsmq{
         int idleTimeout;
         void close();
         void open();
-        ClientConnection(int sockfd_,session_id_t sessionId_,const User& user_,const std::shared_ptr<ConnectionManager>& manager_,std::atomic<int>* err_):
-                sockfd(sockfd_), sessionId(sessionId_),user(user_),manager(manager_),err(err_),connGroupId(0),idleTimeout(DEFAULT_CLIENT_IDLE_TIMEOUT),
-                downloadedPacketsStorageLimit(DEFAULT_DOWNLOADED_PACKETS_STORAGE_LIMIT)
+        ClientConnection(ConnectionWorker* worker_,session_id_t sessionId_,const User& user_,const std::shared_ptr<ConnectionManager>& manager_,std::atomic<int>* err_):
+                worker(worker_), sessionId(sessionId_),err(err_),manager(manager_),
+                uploadGroupId(0),uploadDataId(DATA_SEG_START),connGroupId(0),sendingGroup(false),groupPending(false),downloadOffset(0),
+                downloadedPacketsStorageLimit(DEFAULT_DOWNLOADED_PACKETS_STORAGE_LIMIT),user(user_),idleTimeout(DEFAULT_CLIENT_IDLE_TIMEOUT)
                 {
             connErr.store(CCE_NULL);
             running.store(false);
         }
         ~ClientConnection();
         bool noConnErr();
+        //timeout in seconds while nothing is received, 0: block, NO_WAIT: fail with errno EAGAIN
         ssize_t read(void *dst, int timeout=0);
-        ssize_t write(const void* src,size_t len);
+        //timeout in seconds while the send buffer is full, 0: block, NO_WAIT: fail with errno EAGAIN
+        ssize_t write(const void* src,size_t len,int timeout=0);
         ssize_t read(Bytes& dst,int timeout=0);
-        ssize_t write(const Bytes& src);
-        
+        ssize_t write(const Bytes& src,int timeout=0);
+        //share the payload with the connection instead of copying it
+        ssize_t read(Buffer& dst,int timeout=0);
+        ssize_t write(const Buffer& src,int timeout=0);
+        //the group as the received segments, a scatter list that is never copied
+        ssize_t read(BufferChain& dst,int timeout=0);
+        //safe to take from any thread
+        ConnectionMetrics metrics() const;
     };
 
     using ClientConnectionPtr = std::shared_ptr<ClientConnection>;
+    //every query looks its session up here, the lookups take no lock
     class ConnectionManager{
-        std::mutex lock;
-        std::map<session_id_t,ClientConnectionPtr> conns;
+        SessionTable<ClientConnection> conns;
         BlockingQueue<std::weak_ptr<ClientConnection>> acceptBuffer;
     public:
         bool exist(session_id_t id);
-        void remove(session_id_t id);
-        void add(session_id_t id, const ClientConnectionPtr &ptr);
-        ClientConnectionPtr accept();
+        //return false if there was no such session
+        bool remove(session_id_t id);
+        //return false if the session id is taken, another reactor may have authenticated the same session
+        bool add(session_id_t id, const ClientConnectionPtr &ptr);
+        //stop every connection, their blocked read() return
+        void stopAll();
+        ClientConnectionPtr accept(int timeout=0);
         ClientConnectionPtr get(session_id_t id);
+        size_t size() const;
+        void forEach(const std::function<void(const ClientConnectionPtr&)>& f);
         ~ConnectionManager();
     };
 
+    /*
+     * Every reactor owns a socket bound to localAddr and a dispatch thread receiving from it.
+     * With reactorCount>1 the sockets are opened with SO_REUSEPORT, so the kernel spreads the queries among them.
+     * Sessions live in the shared ConnectionManager, a query can be handled by any reactor.
+     * The reactors only decode and route, the sessions run on a fixed pool of workerCount ConnectionWorkers.
+     * */
     class DnsServerChannel {
-        int sockfd;
         UserWhiteList whiteList;
         std::shared_ptr<ConnectionManager> manager;
         SA_IN localAddr;
         std::vector<Bytes> myDomain;
+        DomainSuffix domainSuffix;
         std::atomic<bool> running;
         std::atomic<int> err;
-        std::thread dispatchThread;
-        int recvPacketQuery(Packet &packet, Dns &dns);
-        int sendPacketResp(const Packet &packet, const SA_IN &addr);
-        void dispatching();
-        void authenticate(const Packet &packet);
+        std::vector<int> sockfds;
+        std::vector<std::thread> dispatchThreads;
+        //instead of the threads in a Simulation
+        std::vector<std::unique_ptr<EventLoop>> reactorLoops;
+        std::vector<std::unique_ptr<ConnectionWorker>> workers;
+        //one per reactor, then one per worker
+        std::vector<std::unique_ptr<ServerCounters>> counters;
+        int resolvePacketQuery(const void *buf, size_t n, const SA_IN &source, Packet &packet, DnsView &dns);
+        void dispatching(int sockfd,ServerCounters& counters);
+        //decode the received batch, hand the packets over and send the responses, -1 if they could not be sent
+        int answerBatch(int sockfd,ReactorState& state,ServerCounters& counters);
+        //the packets of established sessions are collected in deliveries and handed over once the batch is decoded
+        void dispatch(int sockfd, Packet &packet, UdpBatch &outBatch, std::unordered_map<ConnectionWorker*,Delivery>& deliveries,ServerCounters& counters);
+        void authenticate(int sockfd, const Packet &packet, UdpBatch &outBatch,ServerCounters& counters);
         bool authenticateUserId(const std::string &userId);
-        int sendPacketResp(const Packet &packet);
+        //responses are queued in outBatch and sent together at the end of the received batch
+        int sendPacketResp(int sockfd, const Packet &packet, UdpBatch &outBatch,ServerCounters& counters);
+        int flushResp(int sockfd, UdpBatch &outBatch);
+        void closeSockets();
     public:
+        //set them before open()
+        size_t reactorCount;
+        bool pinReactors;
+        size_t workerCount;
+        //bytes each connection buffers per direction, set them before open()
+        size_t sendBufferSize;
+        size_t recvBufferSize;
+        //every datagram received and sent is written to it, for dnsTunReplay or wireshark. Set it before open()
+        PcapWriter* capture;
         DnsServerChannel(SA_IN& localAddr_,const char*myDomain_,const UserWhiteList& whiteList_ = UserWhiteList()):
-                localAddr(localAddr_),myDomain(cstrToDomain(myDomain_)),whiteList(whiteList_){
+                whiteList(whiteList_),localAddr(localAddr_),myDomain(cstrToDomain(myDomain_)),domainSuffix(myDomain),reactorCount(DEFAULT_REACTOR_COUNT),pinReactors(false),
+                workerCount(DEFAULT_WORKER_COUNT),sendBufferSize(DEFAULT_SEND_BUFFER_SIZE),recvBufferSize(DEFAULT_RECV_BUFFER_SIZE),capture(nullptr){
             running.store(false),err.store(DSCE_NULL);
             manager= std::make_shared<ConnectionManager>();
         }
         int open();
         void close();
-        ClientConnectionPtr accept();
+        //timeout in seconds, 0: block, NO_WAIT: return nullptr at once if no session is waiting
+        ClientConnectionPtr accept(int timeout=0);
+        //taken from any thread while the channel is open or after it is closed, not during open()
+        ServerChannelMetrics metrics() const;
     };
 
 
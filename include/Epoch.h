@@ -0,0 +1,28 @@
+#ifndef DNSTUN_EPOCH_H
+#define DNSTUN_EPOCH_H
+#include <functional>
+
+namespace ucsmq{
+    /*
+     * Epoch based reclamation, process wide. A reader pins the current epoch with a Guard while it dereferences
+     * shared pointers, a writer unlinks an object and retires it. The object is freed once the epoch moved twice,
+     * when no reader pinned before the unlink can still hold it. Pinning is two stores on a thread local record.
+     * */
+    class Epoch {
+    public:
+        class Guard {
+        public:
+            Guard();
+            ~Guard();
+            Guard(const Guard&)=delete;
+        };
+        //call deleter once it is safe, from a later retire() or collect() on any thread
+        static void retire(std::function<void()>&& deleter,const void* owner= nullptr);
+        //try to advance the epoch and free what has become safe, call it now and then even if nothing is retired
+        static void collect();
+        //call the deleters retired by owner now, once no reader can reach its objects anymore
+        static void release(const void* owner);
+    };
+}
+
+#endif //DNSTUN_EPOCH_H
@@ -0,0 +1,109 @@
+#ifndef DNSTUN_EVENTLOOP_H
+#define DNSTUN_EVENTLOOP_H
+#include <functional>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include "LockFreeQueue.hpp"
+#include "Clock.h"
+
+#define TIMER_WHEEL_TICK_MS 10
+#define TIMER_WHEEL_SLOTS 512
+#define EVENT_LOOP_QUEUE_CAPACITY 4096
+
+namespace ucsmq{
+    using timer_id_t = uint64_t;
+    class Simulation;
+
+    /*
+     * Hashed timer wheel. A timer further than TIMER_WHEEL_SLOTS ticks away stays in its slot for several rounds.
+     * Not thread safe, it belongs to the EventLoop driving it.
+     * */
+    class TimerWheel {
+        struct Timer{
+            timer_id_t id;
+            uint64_t expireTick;
+            std::function<void()> task;
+        };
+        std::vector<std::list<Timer>> slots;
+        std::unordered_map<timer_id_t,std::pair<size_t,std::list<Timer>::iterator>> index;
+        uint64_t currentTick;
+        timer_id_t nextId;
+    public:
+        explicit TimerWheel(uint64_t startTick=0) : slots(TIMER_WHEEL_SLOTS),currentTick(startTick),nextId(1){}
+        timer_id_t add(uint64_t ticks, std::function<void()>&& task);
+        void cancel(timer_id_t id);
+        //fire every timer expiring up to tick, return how many
+        size_t advance(uint64_t tick);
+        //the tick of the earliest timer, false if there is none
+        bool nextExpiry(uint64_t& tick) const;
+        bool empty() const {return index.empty();}
+        uint64_t tick() const {return currentTick;}
+    };
+
+    /*
+     * A thread running posted tasks, timers and the callbacks of the file descriptors it watches
+     * (epoll on linux, poll elsewhere). The tasks go through a lock-free ring, the poster only writes
+     * the wakeup fd when the loop is asleep. post() may be called from any thread,
+     * runAfter(), cancel(), watch() and unwatch() only from the tasks running on the loop.
+     * afterBurst is called on the loop after every round of events, e.g. to flush batched output.
+     * A loop started while a Simulation is running gets no thread, the simulation runs its rounds instead.
+     * */
+    class EventLoop {
+        friend class Simulation;
+    public:
+        using Task = std::function<void()>;
+        EventLoop();
+        EventLoop(const EventLoop&)=delete;
+        ~EventLoop();
+        int start();
+        //run the remaining tasks, then join the thread. Called by a task, the loop leaves once the task returns
+        //and is joined by the next stop() or by the destructor, which must not run on the loop
+        void stop();
+        void post(Task&& task);
+        //run task on the loop and wait for it, directly if called on the loop or if the loop is not running
+        void runSync(Task&& task);
+        timer_id_t runAfter(int ms, Task&& task);
+        void cancel(timer_id_t id);
+        //call onReadable on the loop whenever fd is readable, return -1 on failure
+        int watch(int fd, Task&& onReadable);
+        void unwatch(int fd);
+        bool inLoopThread() const {return simulation!= nullptr || std::this_thread::get_id()==thread.get_id();}
+        std::function<void()> afterBurst;
+    private:
+        MpscRing<Task> tasks;
+        //tasks posted while the ring is full, they keep their order behind it
+        std::mutex mutex;
+        std::vector<Task> overflow;
+        std::atomic<bool> overflowing;
+        std::atomic<bool> sleeping;
+        TimerWheel wheel;
+        std::unordered_map<int,std::shared_ptr<Task>> watchers;
+        std::thread thread;
+        std::atomic<bool> running;
+        Clock::time_point startTime;
+        //the simulation running the loop, nullptr for a loop with its own thread
+        Simulation* simulation;
+        int pollfd;
+        int wakeupfd[2];
+        uint64_t nowTick() const;
+        int pollTimeout();
+        void wakeup();
+        void push(Task&& task);
+        bool queueEmpty();
+        void runTasks(std::vector<Task>& burst);
+        void pollEvents(int timeout);
+        void looping();
+        //one round as looping() does it, with the fds readable() tells. return how many tasks, events and timers ran
+        size_t simulate(const std::function<bool(int)>& readable);
+        //when the earliest timer is due, false if there is none
+        bool nextTimer(Clock::time_point& t) const;
+    };
+}
+
+#endif //DNSTUN_EVENTLOOP_H
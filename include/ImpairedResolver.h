@@ -0,0 +1,123 @@
+#ifndef DNSTUN_IMPAIREDRESOLVER_H
+#define DNSTUN_IMPAIREDRESOLVER_H
+#include "net.h"
+#include "Metrics.h"
+#include "../src/lib/Random.h"
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <queue>
+#include <thread>
+#include <vector>
+
+namespace ucsmq{
+    //the fate of a datagram, drawn by Impairment::draw()
+    struct ImpairmentDraw {
+        //how many copies arrive, 0 if it is lost
+        int copies=1;
+        double delayMs[2]={0,0};
+        //copies held back by reorderDelayMs
+        int reordered=0;
+    };
+
+    //what happens to every datagram crossing the resolver, in either direction unless told otherwise
+    struct Impairment {
+        //one way delay
+        double latencyMs=0;
+        //a uniform random delay on top of latencyMs
+        double jitterMs=0;
+        //probability to drop a datagram
+        double lossRate=0;
+        //probability to hold a datagram reorderDelayMs more than the others, so that later ones overtake it
+        double reorderRate=0;
+        double reorderDelayMs=20;
+        //probability to deliver a datagram twice
+        double duplicateRate=0;
+        //queries per second a client may send, the extra ones are dropped. 0: no limit
+        double qpsLimit=0;
+        //larger responses are cut to their header and flagged truncated, as a resolver without EDNS does. 0: no limit
+        size_t maxResponseSize=0;
+        //queries with a longer name are dropped, as a resolver refusing long names does. 0: no limit
+        size_t maxQueryNameLen=0;
+        uint64_t seed=1;
+        //loss, duplication and delays, without the qps limit and the truncation which depend on the datagram
+        ImpairmentDraw draw(Random& random) const;
+        //whether a name of the query is longer than maxQueryNameLen on the wire
+        bool refuses(const uint8_t* query,size_t size) const;
+    };
+
+    struct ImpairedResolverStats {
+        uint64_t queries=0;
+        uint64_t responses=0;
+        uint64_t lost=0;
+        uint64_t reordered=0;
+        uint64_t duplicated=0;
+        uint64_t rateLimited=0;
+        uint64_t truncated=0;
+        uint64_t refused=0;
+    };
+
+    /*
+     * A stand-in for the recursive resolvers between a DnsClientChannel and a DnsServerChannel on one host. The clients
+     * send their queries to address(), every client gets an upstream socket of its own towards the server, the way a
+     * resolver uses its own source ports, and the datagrams cross with the delays and losses of impairment.
+     * A thread of its own forwards them, impairment must be set before start().
+     * */
+    class ImpairedResolver {
+        struct Client{
+            SA_IN addr;
+            int upstreamfd;
+            //token bucket of the qps limit
+            double tokens;
+            std::chrono::steady_clock::time_point refilled;
+        };
+        struct Delivery{
+            std::chrono::steady_clock::time_point due;
+            uint64_t order;
+            //-1: to the client at addr through the listening socket, else through this upstream socket
+            int upstreamfd;
+            SA_IN addr;
+            std::vector<uint8_t> data;
+            bool operator>(const Delivery& other) const {return due>other.due || (due==other.due && order>other.order);}
+        };
+        SA_IN listenAddr;
+        SA_IN upstreamAddr;
+        int listenfd;
+        std::vector<Client> clients;
+        std::map<std::pair<uint32_t,uint16_t>,size_t> clientIndex;
+        std::priority_queue<Delivery,std::vector<Delivery>,std::greater<Delivery>> deliveries;
+        uint64_t order;
+        Random random;
+        std::thread thread;
+        std::atomic<bool> running;
+        struct{
+            Counter queries;
+            Counter responses;
+            Counter lost;
+            Counter reordered;
+            Counter duplicated;
+            Counter rateLimited;
+            Counter truncated;
+            Counter refused;
+        } counters;
+        void forwarding();
+        Client* clientOf(const SA_IN& addr);
+        bool allow(Client& client);
+        void impair(int upstreamfd,const SA_IN& addr,const uint8_t* data,size_t size);
+        void deliverDue();
+    public:
+        Impairment impairment;
+        ImpairedResolver(const SA_IN& listenAddr_,const SA_IN& upstreamAddr_) : listenAddr(listenAddr_),upstreamAddr(upstreamAddr_),
+                listenfd(-1),order(0){running.store(false);}
+        ImpairedResolver(const ImpairedResolver&)=delete;
+        ~ImpairedResolver(){stop();}
+        //return -1 if the listening address can not be bound
+        int start();
+        void stop();
+        //where the clients send their queries, the port is the one bound if listenAddr asked for any
+        SA_IN address() const {return listenAddr;}
+        ImpairedResolverStats stats() const;
+    };
+}
+
+#endif //DNSTUN_IMPAIREDRESOLVER_H
@@ -0,0 +1,296 @@
+#ifndef DNSTUN_LOCKFREEQUEUE_HPP
+#define DNSTUN_LOCKFREEQUEUE_HPP
+#include "BlockingQueue.hpp"
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <chrono>
+#ifndef __linux__
+#include <condition_variable>
+#endif
+
+#define DEFAULT_QUEUE_CAPACITY 1024
+#define CACHE_LINE_SIZE 64
+
+namespace ucsmq{
+    enum push_result{
+        PUSH_SUCCESSFULLY=1,PUSH_INVALID=-1,PUSH_TIMEOUT=-2,PUSH_AGAIN=-3
+    };
+
+    //counts every element as 0, the queue is only bounded by its capacity
+    template <typename T>
+    struct NoWeight {
+        size_t operator()(const T&) const {return 0;}
+    };
+
+    /*
+     * Where the threads of a lock-free queue sleep. A waiter takes a ticket, checks its condition again and then waits on it.
+     * wake() costs a single load when nobody waits, it only enters the kernel (futex on linux) for a sleeping thread.
+     * */
+    class Parker {
+        std::atomic<uint32_t> seq;
+        std::atomic<int> waiters;
+#ifndef __linux__
+        std::mutex mutex;
+        std::condition_variable cv;
+#endif
+    public:
+        Parker(){seq.store(0);waiters.store(0);}
+        Parker(const Parker&)=delete;
+        uint32_t prepare();
+        void cancel();
+        //return false on timeout, ms<=0: no timeout
+        bool wait(uint32_t ticket,int ms);
+        void wake();
+        //wake even if no waiter registered yet
+        void wakeAll();
+    };
+
+    //single producer single consumer ring
+    template <typename T>
+    class SpscRing {
+        std::vector<T> ring;
+        size_t mask;
+        alignas(CACHE_LINE_SIZE) std::atomic<size_t> head;
+        alignas(CACHE_LINE_SIZE) std::atomic<size_t> tail;
+    public:
+        explicit SpscRing(size_t capacity) : ring(capacity),mask(capacity-1){head.store(0);tail.store(0);}
+        size_t capacity() const {return ring.size();}
+        size_t size() const {return tail.load(std::memory_order_acquire)-head.load(std::memory_order_acquire);}
+        bool tryPush(T& value){
+            auto t = tail.load(std::memory_order_relaxed);
+            if(t-head.load(std::memory_order_acquire)==ring.size()) return false;
+            ring[t&mask]=std::move(value);
+            tail.store(t+1,std::memory_order_release);
+            return true;
+        }
+        bool tryPop(T& out){
+            auto h = head.load(std::memory_order_relaxed);
+            if(h==tail.load(std::memory_order_acquire)) return false;
+            out=std::move(ring[h&mask]);
+            ring[h&mask]=T();
+            head.store(h+1,std::memory_order_release);
+            return true;
+        }
+    };
+
+    //multiple producers single consumer ring, the cells carry sequence numbers (Vyukov's bounded queue)
+    template <typename T>
+    class MpscRing {
+        struct Cell{
+            std::atomic<size_t> seq;
+            T data;
+        };
+        std::unique_ptr<Cell[]> cells;
+        size_t mask;
+        alignas(CACHE_LINE_SIZE) std::atomic<size_t> enqueuePos;
+        alignas(CACHE_LINE_SIZE) std::atomic<size_t> dequeuePos;
+    public:
+        explicit MpscRing(size_t capacity) : cells(new Cell[capacity]),mask(capacity-1){
+            for(size_t i=0;i<capacity;i++){
+                cells[i].seq.store(i,std::memory_order_relaxed);
+            }
+            enqueuePos.store(0);
+            dequeuePos.store(0);
+        }
+        size_t capacity() const {return mask+1;}
+        size_t size() const {return enqueuePos.load(std::memory_order_acquire)-dequeuePos.load(std::memory_order_acquire);}
+        bool tryPush(T& value){
+            Cell* cell;
+            auto pos = enqueuePos.load(std::memory_order_relaxed);
+            while (true){
+                cell = &cells[pos&mask];
+                auto seq = cell->seq.load(std::memory_order_acquire);
+                auto diff = (intptr_t)seq-(intptr_t)pos;
+                if(diff==0){
+                    if(enqueuePos.compare_exchange_weak(pos,pos+1,std::memory_order_relaxed)) break;
+                }else if(diff<0){
+                    return false;
+                }else{
+                    pos = enqueuePos.load(std::memory_order_relaxed);
+                }
+            }
+            cell->data=std::move(value);
+            cell->seq.store(pos+1,std::memory_order_release);
+            return true;
+        }
+        bool tryPop(T& out){
+            auto pos = dequeuePos.load(std::memory_order_relaxed);
+            auto cell = &cells[pos&mask];
+            auto seq = cell->seq.load(std::memory_order_acquire);
+            if((intptr_t)seq-(intptr_t)(pos+1)<0) return false;
+            out=std::move(cell->data);
+            cell->data=T();
+            cell->seq.store(pos+mask+1,std::memory_order_release);
+            dequeuePos.store(pos+1,std::memory_order_relaxed);
+            return true;
+        }
+    };
+
+    /*
+     * A bounded lock-free queue with the interface of BlockingQueue. push() blocks while the queue is full,
+     * pop() while it is empty, until unblock() is called. Only one thread may pop.
+     * Besides its capacity, the queue can be bounded by the total Weigh of its elements, e.g. their bytes.
+     * An element heavier than the limit is still accepted by an empty queue.
+     * */
+    template <typename T,typename Ring,typename Weigh=NoWeight<T>>
+    class ParkingQueue {
+        Ring ring;
+        Parker notEmpty;
+        Parker notFull;
+        std::atomic<bool> shouldBlock;
+        std::atomic<size_t> weight;
+        std::atomic<size_t> weightLimit;
+        static size_t roundUp(size_t n){
+            size_t c=2;
+            while (c<n) c<<=1;
+            return c;
+        }
+        bool reserve(size_t w){
+            auto limit = weightLimit.load();
+            auto cur = weight.load();
+            do{
+                if(limit>0 && cur>0 && cur+w>limit) return false;
+            } while (!weight.compare_exchange_weak(cur,cur+w));
+            return true;
+        }
+        bool pushOnce(T& value){
+            auto w = Weigh()(value);
+            if(!reserve(w)) return false;
+            if(!ring.tryPush(value)){
+                weight.fetch_sub(w);
+                return false;
+            }
+            notEmpty.wake();
+            return true;
+        }
+        push_result pushOrWait(T& value,int timeout){
+            auto deadline = std::chrono::steady_clock::now()+std::chrono::seconds(timeout);
+            while (true){
+                if(!shouldBlock.load()) return PUSH_INVALID;
+                if(pushOnce(value)) return PUSH_SUCCESSFULLY;
+                if(timeout<0) return PUSH_AGAIN;
+                auto ticket = notFull.prepare();
+                if(pushOnce(value)){
+                    notFull.cancel();
+                    return PUSH_SUCCESSFULLY;
+                }
+                if(!shouldBlock.load()){
+                    notFull.cancel();
+                    return PUSH_INVALID;
+                }
+                int ms=0;
+                if(timeout>0){
+                    ms=(int)std::chrono::duration_cast<std::chrono::milliseconds>(deadline-std::chrono::steady_clock::now()).count();
+                    if(ms<=0){
+                        notFull.cancel();
+                        return PUSH_TIMEOUT;
+                    }
+                }
+                notFull.wait(ticket,ms);
+            }
+        }
+    public:
+        explicit ParkingQueue(size_t capacity=DEFAULT_QUEUE_CAPACITY,size_t weightLimit_=0) : ring(roundUp(capacity)){
+            shouldBlock.store(true);
+            weight.store(0);
+            weightLimit.store(weightLimit_);
+        }
+        ParkingQueue(const ParkingQueue&)=delete;
+        ~ParkingQueue(){unblock();}
+        void unblock(){
+            shouldBlock.store(false);
+            notEmpty.wakeAll();
+            notFull.wakeAll();
+        }
+        bool isBlockingQueue(){return shouldBlock.load();}
+        //return false if the queue is unblocked before there is room for value
+        bool push(T&& value){return pushOrWait(value,0)==PUSH_SUCCESSFULLY;}
+        bool push(const T& value){
+            T copy(value);
+            return pushOrWait(copy,0)==PUSH_SUCCESSFULLY;
+        }
+        //timeout in seconds, 0: wait for room, <0: do not wait (PUSH_AGAIN). value is left untouched unless pushed
+        push_result push(T&& value,int timeout){return pushOrWait(value,timeout);}
+        //never blocks, return false and leave value untouched if the queue is full
+        bool tryPush(T&& value){return pushOnce(value);}
+        bool tryPop(T& out){
+            if(!ring.tryPop(out)) return false;
+            weight.fetch_sub(Weigh()(out));
+            notFull.wake();
+            return true;
+        }
+        //timeout in seconds, 0: wait until an element arrives or the queue is unblocked, <0: do not wait (POP_TIMEOUT)
+        pop_result pop(T& out,int timeout=0){
+            auto deadline = std::chrono::steady_clock::now()+std::chrono::seconds(timeout);
+            while (true){
+                if(tryPop(out)) return POP_SUCCESSFULLY;
+                if(!shouldBlock.load()) return tryPop(out) ? POP_SUCCESSFULLY : POP_INVALID;
+                if(timeout<0) return POP_TIMEOUT;
+                auto ticket = notEmpty.prepare();
+                if(tryPop(out)){
+                    notEmpty.cancel();
+                    return POP_SUCCESSFULLY;
+                }
+                if(!shouldBlock.load()){
+                    notEmpty.cancel();
+                    continue;
+                }
+                int ms=0;
+                if(timeout>0){
+                    ms=(int)std::chrono::duration_cast<std::chrono::milliseconds>(deadline-std::chrono::steady_clock::now()).count();
+                    if(ms<=0){
+                        notEmpty.cancel();
+                        return tryPop(out) ? POP_SUCCESSFULLY : POP_TIMEOUT;
+                    }
+                }
+                notEmpty.wait(ticket,ms);
+            }
+        }
+        //take up to max elements without waiting, the producers waiting for room are woken once
+        size_t drainTo(std::vector<T>& out,size_t max=SIZE_MAX){
+            size_t n=0,w=0;
+            T value;
+            while (n<max && ring.tryPop(value)){
+                w+=Weigh()(value);
+                out.push_back(std::move(value));
+                n++;
+            }
+            if(n>0){
+                weight.fetch_sub(w);
+                notFull.wake();
+            }
+            return n;
+        }
+        //wait like pop(), then take up to max elements
+        pop_result popBatch(std::vector<T>& out,size_t max,int timeout=0){
+            T first;
+            auto result = pop(first,timeout);
+            if(result!=POP_SUCCESSFULLY) return result;
+            out.push_back(std::move(first));
+            if(max>1) drainTo(out,max-1);
+            return POP_SUCCESSFULLY;
+        }
+        size_t size(){return ring.size();}
+        size_t capacity() const {return ring.capacity();}
+        size_t totalWeight() const {return weight.load();}
+        //0: no limit
+        void setWeightLimit(size_t limit){weightLimit.store(limit);}
+        //the weight the queue accepts right now, SIZE_MAX if it is empty or unlimited
+        size_t room() const {
+            auto limit = weightLimit.load();
+            auto cur = weight.load();
+            if(limit==0 || cur==0) return SIZE_MAX;
+            return cur<limit ? limit-cur : 0;
+        }
+    };
+
+    //a hand-off between exactly two threads, e.g. a connection and the application reading it
+    template <typename T,typename Weigh=NoWeight<T>>
+    using SpscQueue = ParkingQueue<T,SpscRing<T>,Weigh>;
+    //a sink several threads push into and one drains
+    template <typename T,typename Weigh=NoWeight<T>>
+    using MpscQueue = ParkingQueue<T,MpscRing<T>,Weigh>;
+}
+
+#endif //DNSTUN_LOCKFREEQUEUE_HPP
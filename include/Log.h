@@ -5,6 +5,24 @@
 #include <vector>
 #include <string>
 #include <mutex>
+#include <atomic>
+#include <cstdint>
+
+//the longest message kept, longer ones are cut
+#define LOG_RECORD_SIZE 1024
+//messages waiting for the writer thread, the ones that find it full are dropped and counted
+#define LOG_RING_CAPACITY 1024
+//a rate limited call site logs at most once per interval and counts the rest
+#define LOG_LIMIT_INTERVAL_MS 1000
+
+//levels below it are compiled out of LOG_PRINTF, their arguments are never evaluated
+#ifndef LOG_COMPILED_LEVEL
+#ifdef NDEBUG
+#define LOG_COMPILED_LEVEL LOG_INFO
+#else
+#define LOG_COMPILED_LEVEL LOG_TRACE
+#endif
+#endif
 
 namespace ucsmq{
     enum log_level_t{
@@ -16,14 +34,46 @@ namespace ucsmq{
         LOG_FATAL,
         LOG_OFF
     };
+    /*
+     * printf() formats the message on the calling thread and hands it to a writer thread through a lock-free ring,
+     * so logging never waits for the outs. Set timeFormat and outs before the first message.
+     * */
     struct Log{
         Log()=delete;
         static std::string timeFormat;
-        static log_level_t level;
+        static std::atomic<log_level_t> level;
         static std::vector<std::ostream*> outs;
+        static bool enabled(log_level_t lv){return lv>=level.load(std::memory_order_relaxed);}
         static void printf(log_level_t lv,const char* format, ...);
+        //write out every queued message before returning
+        static void flush();
+        //held while writing to outs
         static std::mutex lock;
     };
+
+    //the state of one rate limited call site
+    class LogLimit {
+        std::atomic<int64_t> next;
+        std::atomic<uint32_t> suppressed;
+    public:
+        LogLimit(){next.store(0);suppressed.store(0);}
+        //false if the site logged less than LOG_LIMIT_INTERVAL_MS ago, else takes the count of the messages held back since
+        bool allow(uint32_t& held);
+    };
 }
 
+#define LOG_PRINTF(lv,...) do{ \
+        if((lv)>=LOG_COMPILED_LEVEL && ucsmq::Log::enabled(lv)) ucsmq::Log::printf(lv,__VA_ARGS__); \
+    }while(0)
+
+//for messages a peer can trigger with every packet, the count of the ones held back follows the next one let through
+#define LOG_LIMITED(lv,...) do{ \
+        static ucsmq::LogLimit logLimit_; \
+        uint32_t logHeld_; \
+        if((lv)>=LOG_COMPILED_LEVEL && ucsmq::Log::enabled(lv) && logLimit_.allow(logHeld_)){ \
+            ucsmq::Log::printf(lv,__VA_ARGS__); \
+            if(logHeld_>0) ucsmq::Log::printf(lv,"%u similar messages suppressed",logHeld_); \
+        } \
+    }while(0)
+
 #endif
@@ -0,0 +1,105 @@
+#ifndef DNSTUN_METRICS_H
+#define DNSTUN_METRICS_H
+#include "net.h"
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <functional>
+#include <thread>
+#include <mutex>
+
+//2^HISTOGRAM_SUB_BITS buckets per power of two: a value is kept within 12.5%
+#define HISTOGRAM_SUB_BITS 3
+//larger values are counted in the last bucket
+#define HISTOGRAM_MAX_EXPONENT 40
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_EXPONENT-HISTOGRAM_SUB_BITS+2)<<HISTOGRAM_SUB_BITS)
+
+namespace ucsmq{
+    /*
+     * A count updated by one thread and read by any. An update is a plain load and store, no locked instruction,
+     * so every thread of a channel keeps its own counters and a snapshot sums them.
+     * */
+    class Counter {
+        std::atomic<uint64_t> v;
+    public:
+        Counter(){v.store(0,std::memory_order_relaxed);}
+        Counter(const Counter&)=delete;
+        void add(uint64_t n=1){v.store(v.load(std::memory_order_relaxed)+n,std::memory_order_relaxed);}
+        uint64_t value() const {return v.load(std::memory_order_relaxed);}
+    };
+
+    struct HistogramSnapshot {
+        std::vector<uint64_t> counts;
+        uint64_t count;
+        uint64_t sum;
+        uint64_t max;
+        HistogramSnapshot() : counts(HISTOGRAM_BUCKETS),count(0),sum(0),max(0){}
+        void merge(const HistogramSnapshot& other);
+        //the upper bound of the bucket the q quantile falls in, 0 if nothing was recorded
+        uint64_t quantile(double q) const;
+    };
+
+    //log-linear buckets like an HdrHistogram, written by one thread like Counter
+    class Histogram {
+        std::atomic<uint64_t> buckets[HISTOGRAM_BUCKETS];
+        Counter sum;
+        std::atomic<uint64_t> max;
+    public:
+        Histogram();
+        Histogram(const Histogram&)=delete;
+        void record(uint64_t v);
+        HistogramSnapshot snapshot() const;
+        static size_t bucketOf(uint64_t v);
+        //the largest value counted in bucket i
+        static uint64_t bucketUpper(size_t i);
+    };
+
+    //metrics in the Prometheus text format, the samples of a family are kept together whatever order they are added in
+    class MetricsText {
+        struct Family{
+            std::string name;
+            std::string help;
+            const char* type;
+            std::string samples;
+        };
+        std::vector<Family> families;
+        std::unordered_map<std::string,size_t> index;
+        std::string& samplesOf(const std::string& name,const char* help,const char* type);
+    public:
+        //labels as they go between the braces, e.g. channel="a", or empty
+        void counter(const std::string& name,const char* help,uint64_t value,const std::string& labels);
+        void gauge(const std::string& name,const char* help,double value,const std::string& labels);
+        //a summary of a few quantiles, scale converts the recorded unit, e.g. 1e-6 from microseconds to seconds
+        void summary(const std::string& name,const char* help,const HistogramSnapshot& h,const std::string& labels,double scale=1);
+        std::string str() const;
+    };
+
+    /*
+     * Renders the metrics of the sources added to it, e.g.
+     *     exporter.add([&](MetricsText& text){channel.metrics().writeTo(text,"channel=\"a\"");});
+     * to a file or to whoever connects to its local socket, a Prometheus scrape included.
+     * */
+    class MetricsExporter {
+        std::vector<std::function<void(MetricsText&)>> sources;
+        std::mutex lock;
+        int listenfd;
+        std::thread thread;
+        std::atomic<bool> running;
+        void serving();
+    public:
+        MetricsExporter() : listenfd(-1){running.store(false);}
+        MetricsExporter(const MetricsExporter&)=delete;
+        ~MetricsExporter(){stop();}
+        void add(std::function<void(MetricsText&)> source);
+        std::string render();
+        //written to a temporary file first and renamed, a reader never sees half of it
+        int writeFile(const std::string& path);
+        //answer every connection to addr with the text as an HTTP response, return -1 if addr can not be listened on
+        int serve(const SA_IN& addr);
+        void stop();
+    };
+}
+
+#endif //DNSTUN_METRICS_H
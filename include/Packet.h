@@ -4,7 +4,10 @@
 #include <stdint.h>
 #include <list>
 #include "../src/lib/Bytes.hpp"
+#include "../src/lib/Buffer.h"
 #include "../src/protocol/Dns.h"
+#include "../src/protocol/DnsView.h"
+#include "LockFreeQueue.hpp"
 #include <cstring>
 
 namespace ucsmq{
@@ -24,22 +27,69 @@ namespace ucsmq{
         PACKET_SESSION_CLOSED,
         PACKET_GROUP_ID_SYN,
         PACKET_DATA_ID_SYN,
-        PACKET_DISCARD
+        PACKET_DISCARD,
+        PACKET_PROBE
+    };
+
+    //what a PACKET_PROBE asks for, the first byte of its data
+    enum probe_t {
+        //nothing, the query made it through with the length of its name
+        PROBE_NAME=1,
+        //a response of the payload size that follows
+        PROBE_RESPONSE,
+        //the response sizes the client measured for every record type, the server uses them from then on
+        PROBE_LIMITS
     };
 
     const char* packetTypeName(int packet);
 
 
 #define DATA_SEG_START 0
+#define WINDOW_UNLIMITED UINT32_MAX
 
     using session_id_t = uint16_t;
     using group_id_t = uint16_t;
     using data_id_t = uint16_t;
     using packet_type_t=uint8_t;
 
+#define DNS_HEADER_SIZE 12
+//a query of a single question always fits
+#define DNS_SINGLE_QUERY_SIZE 512
+//payload of a download segment until the client measured its path
+#define MAX_RESPONSE_DATA_LEN 85
+//a name on the wire, its length bytes and the root label included
+#define MAX_NAME_LEN 255
+//the record types of the queries, randRecordType() picks among them
+#define RECORD_TYPE_COUNT 3
+#define ALL_RECORD_TYPES ((uint8_t)((1<<RECORD_TYPE_COUNT)-1))
+
+    //the domain of the tunnel as it is on the wire, serialized once instead of for every query
+    struct DomainSuffix{
+        //its labels and the root label
+        uint8_t bytes[UINT8_MAX+1];
+        size_t size;
+        //the labels with their lengths, what a question leaves room for
+        size_t len;
+        DomainSuffix() : size(1),len(0){bytes[0]=0;}
+        explicit DomainSuffix(const std::vector<Bytes>& domain);
+    };
+
+
+    //the index of type among the record types of the queries, -1 if queries are not sent with it
+    int recordTypeIndex(record_t type);
+    record_t recordTypeAt(int index);
+
+    //the largest query name and download payload a path carries, for each record type
+    struct PathLimits{
+        uint16_t queryName[RECORD_TYPE_COUNT];
+        uint16_t responseData[RECORD_TYPE_COUNT];
+        PathLimits();
+        size_t queryNameOf(record_t type) const;
+        size_t responseDataOf(record_t type) const;
+    };
 
     struct Packet {
-        Packet():dnsTransactionId(0),sessionId(0),groupId(0),dataId(0),type(0),qr(0), source(ADDR_ZERO),dnsQueryType(TXT){}
+        Packet():dnsTransactionId(0),dnsQueryType(TXT),sessionId(0),groupId(0),dataId(0),type(0),qr(0), source(ADDR_ZERO),questionCount(0){}
         uint16_t dnsTransactionId;
         record_t dnsQueryType;
         session_id_t sessionId;
@@ -49,11 +99,19 @@ namespace ucsmq{
 
         uint8_t qr;
         SA_IN source;
-        std::vector<Query> originalQueries;
-        Bytes data;
-        static int dnsRespToPacket(Packet& packet,const Dns& dns);
+        //the questions of the query, echoed by every response to it: uncompressed names, each followed by type and class
+        Buffer questions;
+        uint16_t questionCount;
+        Buffer data;
+        static int dnsRespToPacket(Packet& packet,const DnsView& dns);
         static int packetToDnsResp(Dns& dns,uint16_t transactionId ,const Packet& packet);
-        static int dnsQueryToPacket(Packet& packet,const Dns& dns, const std::vector<Bytes>& myDomain);
+        static int dnsQueryToPacket(Packet& packet,const DnsView& dns, const std::vector<Bytes>& myDomain);
+        /*
+         * Decode a query straight from the datagram: the labels are base36 decoded into packet.data and the question
+         * section is kept as it is for the responses. Return 1 if decoded, 0 if the query has to go through DnsView
+         * (compressed names), -1 if it is not a tunnel query, has a name over MAX_NAME_LEN or too many questions.
+         * */
+        static int wireQueryToPacket(Packet& packet,const void* buf,size_t size,const DomainSuffix& domain);
         static int packetToDnsQuery(Dns &dns, uint16_t transactionId,const Packet &packet , const std::vector<Bytes>& myDomain);
         static size_t
         dataToSingleQuery(Dns &dns, Packet &packet, BytesReader &br, uint16_t dnsTransactionId, record_t dnsQueryType,
@@ -61,9 +119,25 @@ namespace ucsmq{
                           const std::vector<Bytes> &myDomain);
         std::string toString() const;
         static int authentication(Dns &dns, Packet &packet, const char *userId, const std::vector<Bytes> &myDomain);
+        /*
+         * Write the dns message straight into buf without building a Dns, return its size or -1 if buf is too small.
+         * No name is longer than nameLimit on the wire.
+         * */
+        static ssize_t queryBytes(void* buf,size_t size,const Packet& packet,const DomainSuffix& domain,size_t nameLimit=MAX_TOTAL_DOMAIN_LEN);
+        //a query of one question holding the head of packet and as much of br as fits, br is advanced past it
+        static ssize_t singleQueryBytes(void* buf,size_t size,const Packet& packet,BytesReader& br,const DomainSuffix& domain,
+                                        size_t nameLimit=MAX_TOTAL_DOMAIN_LEN);
+        //answers the query the packet was taken from, its questions are echoed
+        static ssize_t responseBytes(void* buf,size_t size,const Packet& packet);
+        //a bare header answering the query with rcode, for a response that does not fit in buf. -1 if buf is too small
+        static ssize_t failureBytes(void* buf,size_t size,const Packet& packet,uint16_t rcode);
         static void
         poll(Dns &dns, Packet &packet, const std::vector<Bytes> &myDomain, session_id_t sessionId, group_id_t groupId = 0,
-             data_id_t dataId = 0);
+             data_id_t dataId = 0, uint32_t window = WINDOW_UNLIMITED);
+        //the free bytes of the receive buffer of the sender, advertised by polls, acks and empty downloads
+        void setWindow(uint32_t window);
+        //WINDOW_UNLIMITED if the packet does not carry a window
+        uint32_t window() const;
         Packet getResponsePacket(packet_t type, group_id_t groupId, data_id_t dataId) const ;
         Packet getResponsePacket(packet_t type) const ;
     private:
@@ -72,13 +146,26 @@ namespace ucsmq{
     };
 
     struct AggregatedPacket{
-        Bytes data;
+        Buffer data;
+    };
+
+    //the channel buffers are bounded by the bytes of the groups they hold
+    struct AggregatedPacketSize{
+        size_t operator()(const AggregatedPacket& packet) const {return packet.data.size;}
+    };
+    struct BufferChainSize{
+        size_t operator()(const BufferChain& chain) const {return chain.size;}
     };
+    //a received group stays a chain of its segments until the application reads it
+    using InboundBuffer = SpscQueue<BufferChain,BufferChainSize>;
+    using OutboundBuffer = MpscQueue<AggregatedPacket,AggregatedPacketSize>;
+    uint32_t windowOf(size_t room);
 
     struct DataSegment{
-        Dns dns;
+        //the query carrying packet, encoded once and sent again as it is
+        Buffer query;
         Packet packet;
-        DataSegment(Dns&& dns_,Packet&& packet_) : dns(dns_) , packet(packet_){}
+        DataSegment(Buffer&& query_,Packet&& packet_) : query(std::move(query_)) , packet(std::move(packet_)){}
         DataSegment()=default;
     };
 
@@ -91,9 +178,12 @@ namespace ucsmq{
 
     PacketGroup
     disaggregateToQueryPacketGroup(const AggregatedPacket &aggregatedPacket, session_id_t sessionId, group_id_t groupId,
-                                   record_t recordType, uint8_t packetType, const std::vector<Bytes> &myDomain);
+                                   record_t recordType, uint8_t packetType, const DomainSuffix &domain,
+                                   size_t nameLimit=MAX_TOTAL_DOMAIN_LEN);
 
     record_t randRecordType();
+    //one of the types whose bit is set in mask, bit i stands for recordTypeAt(i)
+    record_t randRecordType(uint8_t mask);
 }
 
 #endif
@@ -0,0 +1,71 @@
+#ifndef DNSTUN_PCAP_H
+#define DNSTUN_PCAP_H
+#include "net.h"
+#include "udp.h"
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <vector>
+
+//bytes of records a PcapWriter gathers before it writes them to the file
+#define PCAP_WRITE_BUFFER_SIZE (256*1024)
+#define PCAP_SNAPLEN 65535
+
+namespace ucsmq{
+    //an IPv4 UDP datagram of a capture
+    struct PcapDatagram {
+        //since the epoch, nanoseconds
+        uint64_t time;
+        SA_IN source;
+        SA_IN destination;
+        std::vector<uint8_t> payload;
+    };
+
+    //what readPcap() found in the frames of a file
+    struct PcapStats {
+        uint64_t frames=0;
+        uint64_t datagrams=0;
+        //not IPv4, or a link type it does not know
+        uint64_t notIpv4=0;
+        uint64_t notUdp=0;
+        //only the first fragment holds the udp header, they are all skipped
+        uint64_t fragments=0;
+        //cut by the snaplen of the capture
+        uint64_t truncated=0;
+    };
+
+    /*
+     * Writes datagrams to a classic pcap file, as raw IPv4 packets with a UDP header, so that tcpdump, wireshark and
+     * readPcap() can read them. The records are gathered in memory and written PCAP_WRITE_BUFFER_SIZE at a time:
+     * a batch costs one lock and a copy. Safe to call from any thread.
+     * */
+    class PcapWriter {
+        FILE* file;
+        std::mutex lock;
+        std::vector<uint8_t> buffer;
+        uint64_t count;
+        void append(const void* data,size_t n,const SA_IN& source,const SA_IN& destination,uint64_t time);
+        void flushLocked();
+    public:
+        PcapWriter() : file(nullptr),count(0){}
+        PcapWriter(const PcapWriter&)=delete;
+        ~PcapWriter(){close();}
+        //truncate path and write the file header, -1 on failure
+        int open(const std::string& path);
+        //write what is gathered and close the file
+        void close();
+        void write(const void* data,size_t n,const SA_IN& source,const SA_IN& destination);
+        //the datagrams of a batch, received on local from their addresses or sent from local to them
+        void writeBatch(UdpBatch& batch,const SA_IN& local,bool received);
+        uint64_t datagrams();
+    };
+
+    /*
+     * The IPv4 UDP datagrams of a pcap file, in the order they were captured. Ethernet (with VLAN tags), raw IP,
+     * BSD loopback and Linux cooked captures are understood, pcapng is not. Return -1 if path is not a pcap file.
+     * */
+    int readPcap(const std::string& path,std::vector<PcapDatagram>& datagrams,PcapStats* stats= nullptr);
+}
+
+#endif //DNSTUN_PCAP_H
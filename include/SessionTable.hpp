@@ -0,0 +1,70 @@
+#ifndef DNSTUN_SESSIONTABLE_HPP
+#define DNSTUN_SESSIONTABLE_HPP
+#include "Epoch.h"
+#include <atomic>
+#include <memory>
+#include <cstdint>
+
+//one slot per 16-bit session id
+#define SESSION_TABLE_SIZE 65536
+
+namespace ucsmq{
+    /*
+     * Maps a 16-bit session id to a shared_ptr<T>. The id indexes a fixed array, so a lookup is a single
+     * load without any lock or hashing. Readers copy the shared_ptr under an Epoch::Guard,
+     * the box of a removed slot is retired and freed once no reader can still see it, or with the table.
+     * Writers (insert/remove) are rare and may race each other, a slot changes only by compare-and-swap.
+     * */
+    template <typename T>
+    class SessionTable {
+        using Box = std::shared_ptr<T>;
+        std::unique_ptr<std::atomic<Box*>[]> slots;
+        std::atomic<size_t> count;
+    public:
+        SessionTable() : slots(new std::atomic<Box*>[SESSION_TABLE_SIZE]){
+            for(size_t i=0;i<SESSION_TABLE_SIZE;i++){
+                slots[i].store(nullptr,std::memory_order_relaxed);
+            }
+            count.store(0);
+        }
+        SessionTable(const SessionTable&)=delete;
+        //no reader is left, the removed boxes still waiting for the epoch go too
+        ~SessionTable(){
+            for(size_t i=0;i<SESSION_TABLE_SIZE;i++){
+                delete slots[i].load(std::memory_order_relaxed);
+            }
+            Epoch::release(this);
+        }
+        std::shared_ptr<T> get(uint16_t id) const {
+            Epoch::Guard guard;
+            auto box = slots[id].load(std::memory_order_acquire);
+            return box== nullptr ? nullptr : *box;
+        }
+        bool contains(uint16_t id) const {
+            return slots[id].load(std::memory_order_acquire)!= nullptr;
+        }
+        //return false if the id is taken
+        bool insert(uint16_t id,const std::shared_ptr<T>& ptr){
+            auto box = new Box(ptr);
+            Box* expected= nullptr;
+            if(!slots[id].compare_exchange_strong(expected,box)){
+                delete box;
+                return false;
+            }
+            count.fetch_add(1);
+            return true;
+        }
+        //return the removed element, nullptr if the slot was empty
+        std::shared_ptr<T> remove(uint16_t id){
+            auto box = slots[id].exchange(nullptr);
+            if(box== nullptr) return nullptr;
+            count.fetch_sub(1);
+            auto ptr = *box;
+            Epoch::retire([box](){delete box;},this);
+            return ptr;
+        }
+        size_t size() const {return count.load();}
+    };
+}
+
+#endif //DNSTUN_SESSIONTABLE_HPP
@@ -0,0 +1,139 @@
+#ifndef DNSTUN_SIMULATION_H
+#define DNSTUN_SIMULATION_H
+#include "Clock.h"
+#include "Transport.h"
+#include "ImpairedResolver.h"
+#include "../src/lib/Random.h"
+#include <deque>
+#include <functional>
+#include <map>
+#include <queue>
+#include <vector>
+
+//the simulated sockets are numbered from here, far above the ones of the system
+#define SIMULATION_FD_BASE (1<<20)
+#define SIMULATION_EPHEMERAL_PORT 32768
+//a datagram takes at least this long, so that two peers answering each other still move the clock
+#define SIMULATION_MIN_DELAY_US 50
+//datagrams a socket holds before it drops the next ones, as a full receive buffer does
+#define SIMULATION_SOCKET_QUEUE 4096
+//the virtual clock starts here, a zero time point means unset to the channels
+#define SIMULATION_START_TIME std::chrono::hours(1)
+
+namespace ucsmq{
+    class EventLoop;
+
+    struct SimNetworkStats {
+        uint64_t datagrams=0;
+        uint64_t delivered=0;
+        uint64_t lost=0;
+        uint64_t reordered=0;
+        uint64_t duplicated=0;
+        uint64_t rateLimited=0;
+        uint64_t truncated=0;
+        uint64_t refused=0;
+        //sent to an address nobody is bound to, or to a full socket
+        uint64_t unreachable=0;
+    };
+
+    /*
+     * The datagram transport of a Simulation, every socket lives in memory. A datagram sent is drawn an Impairment,
+     * queries against the qps limit of their source and maxQueryNameLen, responses against maxResponseSize, then queued
+     * until the virtual clock reaches its arrival. Sockets bound to the same address with reusePort share the sources among them
+     * by hash, as SO_REUSEPORT does. Not thread safe, everything runs on the thread of the simulation.
+     * */
+    class SimNetwork : public DatagramTransport {
+        struct Datagram{
+            SA_IN from;
+            std::vector<uint8_t> data;
+        };
+        struct Socket{
+            SA_IN addr;
+            SA_IN peer;
+            bool reusePort;
+            bool connected;
+            bool shut;
+            std::deque<Datagram> inbox;
+        };
+        struct InFlight{
+            Clock::time_point due;
+            uint64_t order;
+            SA_IN to;
+            Datagram datagram;
+            bool operator>(const InFlight& other) const {return due>other.due || (due==other.due && order>other.order);}
+        };
+        //token bucket of the qps limit of a source
+        struct Bucket{
+            double tokens;
+            Clock::time_point refilled;
+        };
+        using Key = std::pair<uint32_t,uint16_t>;
+        std::map<int,Socket> sockets;
+        //the sockets bound to an address, several with reusePort
+        std::map<Key,std::vector<int>> bound;
+        std::map<Key,Bucket> buckets;
+        std::priority_queue<InFlight,std::vector<InFlight>,std::greater<InFlight>> inFlight;
+        int nextFd;
+        uint16_t nextPort;
+        uint64_t order;
+        Random random;
+        SimNetworkStats counters;
+        static Key keyOf(const SA_IN& addr){return Key(addr.sin_addr.s_addr,addr.sin_port);}
+        Socket* find(int fd);
+        int bind(int fd,const SA_IN& addr,bool reusePort);
+        bool allow(const SA_IN& source);
+        int receiver(const SA_IN& from,const SA_IN& to);
+    public:
+        Impairment impairment;
+        explicit SimNetwork(uint64_t seed);
+        int open(const SA_IN* addr,bool reusePort) override;
+        int connect(int fd,const SA_IN& addr) override;
+        ssize_t sendto(int fd,const void* src,size_t size,const SA_IN* addr) override;
+        ssize_t recvfrom(int fd,void* dst,size_t size,SA_IN* addr) override;
+        int setNonBlocking(int fd) override {return find(fd)!= nullptr ? 0 : -1;}
+        int shutdown(int fd) override;
+        int close(int fd) override;
+        bool owns(int fd) const override {return sockets.count(fd)>0;}
+        bool readable(int fd) const;
+        //move the datagrams due by now into their sockets, return how many
+        size_t deliver(Clock::time_point now);
+        //when the next datagram arrives, false if none is in flight
+        bool nextArrival(Clock::time_point& t) const;
+        SimNetworkStats stats() const {return counters;}
+    };
+
+    /*
+     * A seeded discrete-event simulation of channels and their network on the calling thread. While it exists the
+     * clock is virtual, the sockets are those of network() and the EventLoops started get no thread: runFor() and
+     * runUntil() run their rounds, deliver the datagrams, and jump the clock to the next arrival or timer once
+     * nothing is left to do at the current time. The same seed and the same calls give the same run.
+     * Only one exists at a time. Create the channels after it, with a ClientReactor of their own rather than the
+     * default one, and destroy them before it. The reads and the writes of the channels must not block, call them
+     * with NO_WAIT between the runs; DnsClientChannel::open() runs the simulation itself until it is authenticated.
+     * */
+    class Simulation {
+        SimNetwork net;
+        std::vector<EventLoop*> loops;
+        Clock::time_point startTime;
+        static Simulation* currentSimulation;
+        bool runRound();
+        bool nextEvent(Clock::time_point& t) const;
+    public:
+        explicit Simulation(uint64_t seed=1);
+        Simulation(const Simulation&)=delete;
+        ~Simulation();
+        SimNetwork& network(){return net;}
+        Clock::time_point now() const {return Clock::now();}
+        //virtual time since the simulation started
+        Clock::duration elapsed() const {return Clock::now()-startTime;}
+        void runFor(Clock::duration d);
+        //run until done() returns true or timeout of virtual time has passed, return done()
+        bool runUntil(const std::function<bool()>& done,Clock::duration timeout);
+        void add(EventLoop* loop);
+        void remove(EventLoop* loop);
+        //nullptr when no simulation is running
+        static Simulation* current(){return currentSimulation;}
+    };
+}
+
+#endif //DNSTUN_SIMULATION_H
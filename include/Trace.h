@@ -0,0 +1,74 @@
+#ifndef DNSTUN_TRACE_H
+#define DNSTUN_TRACE_H
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+//events a thread keeps, the oldest are overwritten. A power of two
+#define TRACE_RING_SIZE 8192
+
+namespace ucsmq{
+    enum trace_event_t {
+        TRACE_SEGMENT_CREATED=1,
+        TRACE_QUERY_SENT,
+        TRACE_QUERY_RECEIVED,
+        TRACE_RESPONSE_SENT,
+        TRACE_RESPONSE_RECEIVED,
+        TRACE_RETRANSMIT,
+        TRACE_DISCARD,
+        TRACE_GROUP_EXPORTED
+    };
+
+    enum trace_side_t {
+        TRACE_CLIENT=0,
+        TRACE_SERVER
+    };
+
+    //an event as it is recorded and dumped
+    struct TraceEvent {
+        //Clock::now(), nanoseconds
+        uint64_t time;
+        //bytes of the query, of the response or of the payload
+        uint32_t size;
+        uint16_t sessionId;
+        uint16_t groupId;
+        uint16_t dataId;
+        uint8_t event;
+        uint8_t packetType;
+        uint8_t side;
+        uint8_t reserved;
+        //the ring it was recorded in, one per thread
+        uint16_t thread;
+    };
+    static_assert(sizeof(TraceEvent)==24,"TraceEvent is dumped as it is");
+
+    /*
+     * Packet lifecycle tracing. Every thread records into a ring of its own: an event costs a clock read
+     * and a 24 byte store, nothing is formatted or locked. Off until enable(true).
+     * */
+    struct Trace {
+        Trace()=delete;
+        static void enable(bool on);
+        static bool enabled(){return on.load(std::memory_order_relaxed);}
+        static void record(trace_event_t event,trace_side_t side,uint16_t sessionId,uint16_t groupId,uint16_t dataId,uint8_t packetType,uint32_t size);
+        //the events still in the rings of every thread, ordered by time
+        static std::vector<TraceEvent> collect();
+        //write collect() to path for dnsTunTrace, return -1 on failure
+        static int dump(const std::string& path);
+        static int load(const std::string& path,std::vector<TraceEvent>& events);
+        static const char* eventName(int event);
+    private:
+        static std::atomic<bool> on;
+    };
+}
+
+#ifdef DNSTUN_NO_TRACE
+#define TRACE_PACKET(event,side,packet,size) do{(void)(packet);}while(0)
+#else
+#define TRACE_PACKET(event,side,packet,size) do{ \
+        if(ucsmq::Trace::enabled()) ucsmq::Trace::record(event,side,(packet).sessionId,(packet).groupId,(packet).dataId,(packet).type,(uint32_t)(size)); \
+    }while(0)
+#endif
+
+#endif //DNSTUN_TRACE_H
@@ -0,0 +1,38 @@
+#ifndef DNSTUN_TRANSPORT_H
+#define DNSTUN_TRANSPORT_H
+#include "net.h"
+
+namespace ucsmq{
+    /*
+     * Where the functions of udp.h send and receive their datagrams: the sockets of the system, unless a transport is
+     * installed, e.g. the in-memory network of a Simulation. Then every socket created by udpSocket() and dialUdp() is
+     * one of its file descriptors, and setNonBlocking(), shutdownSocket() and closeSocket() are routed to it as well.
+     * The calls fail like the system ones, -1 with errno set.
+     * */
+    class DatagramTransport {
+    public:
+        virtual ~DatagramTransport()=default;
+        //a socket bound to addr, or to an ephemeral port if addr is null
+        virtual int open(const SA_IN* addr,bool reusePort)=0;
+        virtual int connect(int fd,const SA_IN& addr)=0;
+        //to addr, or to the connected peer if addr is null
+        virtual ssize_t sendto(int fd,const void* src,size_t size,const SA_IN* addr)=0;
+        //-1 with errno EAGAIN if nothing is queued, a transport without threads never blocks
+        virtual ssize_t recvfrom(int fd,void* dst,size_t size,SA_IN* addr)=0;
+        virtual int setNonBlocking(int fd)=0;
+        virtual int shutdown(int fd)=0;
+        virtual int close(int fd)=0;
+        virtual bool owns(int fd) const=0;
+
+        //nullptr: the sockets of the system
+        static DatagramTransport* installed(){return current;}
+        //not thread safe, install it before any socket is opened and remove it once they are all closed
+        static void install(DatagramTransport* transport){current=transport;}
+        //the installed transport if fd is one of its sockets, else nullptr
+        static DatagramTransport* of(int fd){return current!= nullptr && current->owns(fd) ? current : nullptr;}
+    private:
+        static DatagramTransport* current;
+    };
+}
+
+#endif //DNSTUN_TRANSPORT_H
@@ -16,6 +16,8 @@ typedef int socklen_t;
 #include <sys/types.h>
 #endif
 #define NO_TIMEOUT 0
+//timeout of the calls which may also fail at once with EAGAIN instead of blocking
+#define NO_WAIT (-1)
 #define SET_ZERO(o) memset(&o,0,sizeof(o))
 namespace ucsmq{
     typedef sockaddr_in SA_IN;
@@ -26,7 +28,12 @@ namespace ucsmq{
     std::string sockaddr_inStr(const SA_IN& addr);
     std::vector<Bytes> cstrToDomain(const char* str);
     int setSocketTimeout(int sockfd, int seconds);
+    int setNonBlocking(int sockfd);
     int closeSocket(int sockfd);
+    //wake up the threads blocked on sockfd, closeSocket alone does not do it on linux
+    int shutdownSocket(int sockfd);
+    //a tcp socket bound to addr and listening, -1 on failure
+    int listenTcp(const SA_IN& addr,int backlog);
     int isTimeOut();
     bool operator==(const SA_IN& addr1,const SA_IN& addr2);
     bool operator!=(const SA_IN& addr1,const SA_IN& addr2);
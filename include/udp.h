@@ -2,6 +2,10 @@
 #define DNS_UDP_H
 #include "net.h"
 #include <cstdlib>
+#include <vector>
+
+#define UDP_BATCH_SIZE 32
+#define UDP_DATAGRAM_SIZE 4096
 namespace ucsmq{
     struct UdpPacket {
         Bytes data;
@@ -9,10 +13,54 @@ namespace ucsmq{
         UdpPacket(const void* pData,size_t size,const SA_IN& remoteAddr_) : data(Bytes(pData,size)) , remoteAddr(remoteAddr_){}
     };
     int dialUdp(const SA_IN& remoteAddr,const SA_IN* localAddr);
-    int udpSocket(const SA_IN *pAddr= nullptr);
+    //reusePort: allow several sockets to bind the same address (SO_REUSEPORT), the kernel spreads datagrams among them
+    int udpSocket(const SA_IN *pAddr= nullptr,bool reusePort=false);
     ssize_t recvfromUdp(int sockfd, void* dst, size_t size, SA_IN* addr);
     ssize_t sendtoUdp(int sockfd, const void* src, size_t size, const SA_IN& addr);
     ssize_t sendUdp(int sockfd,const void* src,size_t size);
     ssize_t recvUdp(int sockfd,void* dst,size_t size,int timeout=0);
+
+    /*
+     * A reusable pool of datagram buffers for recvBatch and sendBatch.
+     * The buffers and the mmsghdr/iovec arrays pointing at them are built once,
+     * so moving a whole batch costs one system call and no allocation.
+     * */
+    class UdpBatch {
+        friend ssize_t recvBatch(int sockfd, UdpBatch& batch);
+        friend ssize_t sendBatch(int sockfd, UdpBatch& batch);
+        size_t bufSize;
+        size_t count;
+        std::vector<uint8_t> buffers;
+        std::vector<size_t> lens;
+        std::vector<SA_IN> addrs;
+#ifdef __linux__
+        std::vector<mmsghdr> hdrs;
+        std::vector<iovec> iovs;
+#endif
+    public:
+        explicit UdpBatch(size_t capacity=UDP_BATCH_SIZE,size_t bufSize_=UDP_DATAGRAM_SIZE);
+        UdpBatch(const UdpBatch&)=delete;
+        size_t capacity() const {return lens.size();}
+        size_t size() const {return count;}
+        bool full() const {return count==lens.size();}
+        size_t bufferSize() const {return bufSize;}
+        uint8_t* data(size_t i) {return buffers.data()+i*bufSize;}
+        size_t len(size_t i) const {return lens[i];}
+        const SA_IN& addr(size_t i) const {return addrs[i];}
+        //the buffer of the next datagram to send, fill it and then call add()
+        uint8_t* back() {return data(count);}
+        //false if the batch is full or len is 0 or larger than a buffer, the datagram is not added
+        bool add(size_t len,const SA_IN& addr);
+        void clear() {count=0;}
+    };
+    //block until at least one datagram arrives, then take all the queued ones that fit in the batch. return the number received, -1 on error
+    ssize_t recvBatch(int sockfd, UdpBatch& batch);
+    /*
+     * Send all the datagrams in the batch and clear it, one that fails is dropped and the rest are still sent.
+     * Return the number sent, or -1 with the error of the first failure if any was dropped.
+     * */
+    ssize_t sendBatch(int sockfd, UdpBatch& batch);
+    //the last send failure only dropped datagrams (full buffer, unreachable peer...), the socket can still be used
+    bool isDatagramDropped();
 }
 #endif //DNS_UDP_H
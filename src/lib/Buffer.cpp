@@ -0,0 +1,149 @@
+#include "Buffer.h"
+#include <mutex>
+#include <new>
+
+namespace ucsmq{
+#define SIZE_CLASSES (BUFFER_POOL_MAX_SHIFT-BUFFER_POOL_MIN_SHIFT+1)
+#define UNPOOLED (BUFFER_POOL_MAX_SHIFT+1)
+    //blocks the shared lists hold at most per size class, the rest goes back to the heap
+#define BUFFER_POOL_SHARED_LIMIT 4096
+
+    static uint32_t sizeClassOf(size_t size){
+        uint32_t shift=BUFFER_POOL_MIN_SHIFT;
+        while (shift<=BUFFER_POOL_MAX_SHIFT && ((size_t)1<<shift)<size) shift++;
+        return shift;
+    }
+
+    static BufferBlock* newBlock(size_t size,uint32_t sizeClass){
+        auto block = static_cast<BufferBlock*>(::operator new(sizeof(BufferBlock)+size));
+        block->sizeClass=sizeClass;
+        return block;
+    }
+
+    struct SharedLists {
+        std::mutex lock[SIZE_CLASSES];
+        std::vector<BufferBlock*> blocks[SIZE_CLASSES];
+    };
+
+    //never destroyed: threads still running at exit give their caches back to it
+    static SharedLists& sharedLists(){
+        static auto lists = new SharedLists;
+        return *lists;
+    }
+
+    //a Buffer may die after the cache of its thread, e.g. held by a static object
+    static thread_local bool localDestroyed=false;
+
+    struct LocalLists {
+        SharedLists& shared;
+        std::vector<BufferBlock*> blocks[SIZE_CLASSES];
+        LocalLists() : shared(sharedLists()){}
+        ~LocalLists(){
+            for(size_t i=0;i<SIZE_CLASSES;i++){
+                giveBack(i,blocks[i].size());
+            }
+            localDestroyed=true;
+        }
+        void giveBack(size_t i,size_t n){
+            auto& local = blocks[i];
+            std::lock_guard<std::mutex> guard(shared.lock[i]);
+            for(size_t k=0;k<n;k++){
+                auto block = local.back();
+                local.pop_back();
+                if(shared.blocks[i].size()<BUFFER_POOL_SHARED_LIMIT){
+                    shared.blocks[i].push_back(block);
+                }else{
+                    ::operator delete(block);
+                }
+            }
+        }
+        void takeSome(size_t i){
+            std::lock_guard<std::mutex> guard(shared.lock[i]);
+            auto& list = shared.blocks[i];
+            for(size_t k=0;k<BUFFER_POOL_LOCAL_LIMIT/2 && !list.empty();k++){
+                blocks[i].push_back(list.back());
+                list.pop_back();
+            }
+        }
+    };
+
+    static LocalLists* localLists(){
+        if(localDestroyed) return nullptr;
+        static thread_local LocalLists lists;
+        return &lists;
+    }
+
+    BufferBlock *BufferPool::allocate(size_t size) {
+        auto sizeClass = sizeClassOf(size);
+        BufferBlock* block;
+        auto local = sizeClass>BUFFER_POOL_MAX_SHIFT ? nullptr : localLists();
+        if(local== nullptr){
+            block = newBlock(size,UNPOOLED);
+        }else{
+            size_t i = sizeClass-BUFFER_POOL_MIN_SHIFT;
+            if(local->blocks[i].empty()) local->takeSome(i);
+            if(local->blocks[i].empty()){
+                block = newBlock((size_t)1<<sizeClass,sizeClass);
+            }else{
+                block = local->blocks[i].back();
+                local->blocks[i].pop_back();
+            }
+        }
+        block->refs.store(1,std::memory_order_relaxed);
+        return block;
+    }
+
+    void BufferPool::release(BufferBlock *block) {
+        auto local = block->sizeClass==UNPOOLED ? nullptr : localLists();
+        if(local== nullptr){
+            ::operator delete(block);
+            return;
+        }
+        size_t i = block->sizeClass-BUFFER_POOL_MIN_SHIFT;
+        local->blocks[i].push_back(block);
+        if(local->blocks[i].size()>BUFFER_POOL_LOCAL_LIMIT) local->giveBack(i,BUFFER_POOL_LOCAL_LIMIT/2);
+    }
+
+    Buffer Buffer::copyOf(const void *src, size_t len) {
+        if(len==0) return {};
+        return build(len,[src,len](uint8_t* p){
+            memcpy(p,src,len);
+            return len;
+        });
+    }
+
+    size_t BufferChain::copyTo(void *dst, size_t len) const {
+        auto p = static_cast<uint8_t*>(dst);
+        size_t n=0;
+        for(const auto& part : parts){
+            if(n==len) break;
+            size_t k = part.size<len-n ? part.size : len-n;
+            memcpy(p+n,part.data,k);
+            n+=k;
+        }
+        return n;
+    }
+
+    Buffer BufferChain::contiguous() const {
+        if(parts.size()==1) return parts.front();
+        if(size==0) return {};
+        return Buffer::build(size,[this](uint8_t* p){
+            return copyTo(p,size);
+        });
+    }
+
+    Bytes BufferChain::toBytes() const {
+        Bytes bytes(size);
+        copyTo(bytes.data,size);
+        return bytes;
+    }
+
+    int BufferChain::toIovec(struct iovec *iov, int n) const {
+        int i=0;
+        for(;i<n && i<(int)parts.size();i++){
+            iov[i].iov_base=(void*)parts[i].data;
+            iov[i].iov_len=parts[i].size;
+        }
+        return i;
+    }
+}
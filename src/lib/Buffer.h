@@ -0,0 +1,133 @@
+#ifndef DNS_BUFFER_H
+#define DNS_BUFFER_H
+#include "Bytes.hpp"
+#include <atomic>
+#include <sys/uio.h>
+
+//blocks from 64B to 64KB are recycled by the pool, larger ones come from the heap
+#define BUFFER_POOL_MIN_SHIFT 6
+#define BUFFER_POOL_MAX_SHIFT 16
+//blocks of each size a thread keeps for itself before it gives some back
+#define BUFFER_POOL_LOCAL_LIMIT 64
+
+namespace ucsmq{
+    struct BufferBlock {
+        std::atomic<uint32_t> refs;
+        //BUFFER_POOL_MAX_SHIFT+1: not pooled
+        uint32_t sizeClass;
+        uint8_t* bytes(){return reinterpret_cast<uint8_t*>(this+1);}
+    };
+
+    //size-class free lists, each thread caches blocks in front of the shared lists
+    class BufferPool {
+    public:
+        static BufferBlock* allocate(size_t size);
+        static void release(BufferBlock* block);
+    };
+
+    /*
+     * An immutable, reference counted view of a pooled block. Copying a Buffer or taking a slice of it
+     * only bumps the count, so a payload can be handed from the socket to the sessions and back to the
+     * retransmission store without being copied. The block returns to the pool with its last view.
+     * */
+    class Buffer {
+        BufferBlock* block;
+        void retain() const {if(block!= nullptr) block->refs.fetch_add(1,std::memory_order_relaxed);}
+        void releaseBlock(){
+            if(block!= nullptr && block->refs.fetch_sub(1,std::memory_order_acq_rel)==1) BufferPool::release(block);
+            block= nullptr;
+        }
+    public:
+        const uint8_t* data;
+        size_t size;
+        Buffer() : block(nullptr),data(nullptr),size(0){}
+        Buffer(const Buffer& other) : block(other.block),data(other.data),size(other.size){retain();}
+        Buffer(Buffer&& other) noexcept : block(other.block),data(other.data),size(other.size){
+            other.block= nullptr;
+            other.data= nullptr;
+            other.size=0;
+        }
+        Buffer& operator=(const Buffer& other){
+            if(this!=&other){
+                other.retain();
+                releaseBlock();
+                block=other.block;
+                data=other.data;
+                size=other.size;
+            }
+            return *this;
+        }
+        Buffer& operator=(Buffer&& other) noexcept{
+            if(this!=&other){
+                releaseBlock();
+                block=other.block;
+                data=other.data;
+                size=other.size;
+                other.block= nullptr;
+                other.data= nullptr;
+                other.size=0;
+            }
+            return *this;
+        }
+        ~Buffer(){releaseBlock();}
+
+        //the only copies into a buffer, every other operation shares its block
+        static Buffer copyOf(const void* src,size_t len);
+        static Buffer copyOf(const Bytes& src){return copyOf(src.data,src.size);}
+        //fill writes at most capacity bytes into the new block and returns how many it wrote
+        template<typename F>
+        static Buffer build(size_t capacity,F&& fill){
+            Buffer buffer;
+            buffer.block=BufferPool::allocate(capacity);
+            auto p = buffer.block->bytes();
+            buffer.data=p;
+            buffer.size=fill(p);
+            return buffer;
+        }
+
+        Buffer slice(size_t offset,size_t len) const {
+            if(offset>size) offset=size;
+            if(len>size-offset) len=size-offset;
+            Buffer s(*this);
+            s.data+=offset;
+            s.size=len;
+            return s;
+        }
+        BytesReader reader() const {return {data,size};}
+        Bytes toBytes() const {return {data,size};}
+        operator std::string () const {return {(const char*)data,size};}
+        std::string hexStr() const {
+            std::stringstream ss;
+            for(size_t i=0;i<size;i++){
+                ss << std::hex << std::setw(2) << std::setfill('0') << (int)data[i] << ' ';
+            }
+            return ss.str();
+        }
+    };
+
+    /*
+     * A message made of several Buffers, e.g. the segments of a reassembled group. Appending shares the part,
+     * so reassembly copies nothing; the bytes are gathered only when a contiguous copy is asked for.
+     * */
+    class BufferChain {
+    public:
+        std::vector<Buffer> parts;
+        size_t size;
+        BufferChain() : size(0){}
+        void append(const Buffer& part){
+            if(part.size==0) return;
+            parts.push_back(part);
+            size+=part.size;
+        }
+        void reserve(size_t n){parts.reserve(n);}
+        //copy at most len bytes into dst, return how many were copied
+        size_t copyTo(void* dst,size_t len) const;
+        //shares the only part, or gathers the parts into one new Buffer
+        Buffer contiguous() const;
+        Bytes toBytes() const;
+        //the scatter list of the chain, at most n entries. Return the entries filled
+        int toIovec(struct iovec* iov,int n) const;
+    };
+}
+
+#endif //DNS_BUFFER_H
@@ -36,11 +36,7 @@ namespace ucsmq{
         }
         Bytes(const char* cstr) : Bytes(cstr, strlen(cstr)){}
         Bytes(const std::string& str): Bytes(str.c_str(),str.size()){}
-        Bytes(const Bytes& other){
-            size=other.size;
-            data=new uint8_t [size];
-            memcpy(data,other.data,size);
-        }
+        Bytes(const Bytes& other) : Bytes(other.data,other.size){}
         Bytes(Bytes&& other) noexcept{
             size=other.size;
             data=other.data;
@@ -49,16 +45,18 @@ namespace ucsmq{
         }
         Bytes& operator=(const Bytes& other){
             if(this!=&other){
-                size=other.size;
+                auto newBuf = new uint8_t [other.size];
+                memcpy(newBuf,other.data,other.size);
                 delete[] data;
-                data=new uint8_t [size];
-                memcpy(data,other.data,size);
+                data=newBuf;
+                size=other.size;
             }
             return *this;
         }
         Bytes& operator=(Bytes&& other) noexcept{
+            if(this==&other) return *this;
+            delete[] data;
             size=other.size;
-            delete[] (char *)data;
             data=other.data;
             other.data= nullptr;
             other.size=0;
@@ -197,7 +195,7 @@ namespace ucsmq{
     public:
         BytesReader():p(nullptr),size(0),rp(0){}
         BytesReader(const Bytes& b) : p(b.data),size(b.size),rp(0){}
-        BytesReader(void *p_,size_t size_):p((uint8_t*)p_) , size(size_),rp(0){}
+        BytesReader(const void *p_,size_t size_):p((const uint8_t*)p_) , size(size_),rp(0){}
         BytesReader(const std::string& s) : p((uint8_t*)s.c_str()) , size(s.size()) , rp(0){}
         BytesReader(const char* cstr) : p((uint8_t*)cstr) , size(strlen(cstr)) , rp(0){}
 
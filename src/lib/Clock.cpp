@@ -0,0 +1,16 @@
+#include "Clock.h"
+
+namespace ucsmq{
+    std::atomic<bool> Clock::virtualTime(false);
+    std::atomic<int64_t> Clock::virtualNow(0);
+
+    void Clock::useVirtual(bool on, time_point start) {
+        virtualNow.store(start.time_since_epoch().count(),std::memory_order_relaxed);
+        virtualTime.store(on);
+    }
+
+    void Clock::advanceTo(time_point t) {
+        auto ticks = t.time_since_epoch().count();
+        if(ticks>virtualNow.load(std::memory_order_relaxed)) virtualNow.store(ticks,std::memory_order_relaxed);
+    }
+}
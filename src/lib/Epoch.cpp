@@ -0,0 +1,123 @@
+#include "Epoch.h"
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <cstdint>
+using namespace std;
+
+namespace ucsmq{
+    //0 is reserved for the records of the threads outside any guard
+    static atomic<uint64_t> globalEpoch(1);
+
+    struct EpochRecord {
+        atomic<uint64_t> local;
+        atomic<bool> inUse;
+        EpochRecord* next;
+    };
+    //records are never freed, a thread leaving gives its record to the next one
+    static atomic<EpochRecord*> records(nullptr);
+
+    struct Retired {
+        uint64_t epoch;
+        const void* owner;
+        function<void()> deleter;
+    };
+    static mutex retiredLock;
+    static vector<Retired> retiredList;
+
+    static EpochRecord* acquireRecord(){
+        for(auto rec=records.load();rec!= nullptr;rec=rec->next){
+            bool expected=false;
+            if(!rec->inUse.load() && rec->inUse.compare_exchange_strong(expected,true)) return rec;
+        }
+        auto rec = new EpochRecord;
+        rec->local.store(0);
+        rec->inUse.store(true);
+        rec->next=records.load();
+        while (!records.compare_exchange_weak(rec->next,rec));
+        return rec;
+    }
+
+    struct EpochHandle {
+        EpochRecord* rec;
+        int depth;
+        EpochHandle() : rec(acquireRecord()),depth(0){}
+        ~EpochHandle(){
+            rec->local.store(0);
+            rec->inUse.store(false);
+        }
+    };
+    static thread_local EpochHandle handle;
+
+    Epoch::Guard::Guard() {
+        if(handle.depth++>0) return;
+        handle.rec->local.store(globalEpoch.load());
+        //the loads made under the guard must not move before the pin is visible
+        atomic_thread_fence(memory_order_seq_cst);
+    }
+
+    Epoch::Guard::~Guard() {
+        if(--handle.depth>0) return;
+        handle.rec->local.store(0,memory_order_release);
+    }
+
+    void Epoch::retire(function<void()> &&deleter,const void* owner) {
+        {
+            lock_guard<mutex> guard(retiredLock);
+            retiredList.push_back({globalEpoch.load(),owner,std::move(deleter)});
+        }
+        collect();
+    }
+
+    void Epoch::release(const void *owner) {
+        vector<function<void()>> freed;
+        {
+            lock_guard<mutex> guard(retiredLock);
+            for(size_t i=0;i<retiredList.size();){
+                if(retiredList[i].owner==owner){
+                    freed.push_back(std::move(retiredList[i].deleter));
+                    retiredList[i]=std::move(retiredList.back());
+                    retiredList.pop_back();
+                }else{
+                    i++;
+                }
+            }
+        }
+        for(auto& deleter : freed){
+            deleter();
+        }
+    }
+
+    void Epoch::collect() {
+        atomic_thread_fence(memory_order_seq_cst);
+        auto epoch = globalEpoch.load();
+        bool quiescent=true;
+        for(auto rec=records.load();rec!= nullptr;rec=rec->next){
+            auto local = rec->local.load();
+            if(local!=0 && local!=epoch){
+                quiescent=false;
+                break;
+            }
+        }
+        //every pinned thread has seen the current epoch, move on
+        if(quiescent && globalEpoch.compare_exchange_strong(epoch,epoch+1)) epoch++;
+
+        vector<function<void()>> freed;
+        {
+            lock_guard<mutex> guard(retiredLock);
+            for(size_t i=0;i<retiredList.size();){
+                if(retiredList[i].epoch+2<=epoch){
+                    freed.push_back(std::move(retiredList[i].deleter));
+                    retiredList[i]=std::move(retiredList.back());
+                    retiredList.pop_back();
+                }else{
+                    i++;
+                }
+            }
+        }
+        //outside the lock, a deleter may retire more
+        for(auto& deleter : freed){
+            deleter();
+        }
+    }
+}
@@ -0,0 +1,322 @@
+#include "EventLoop.h"
+#include "Simulation.h"
+#include "Transport.h"
+#include <algorithm>
+#include <unistd.h>
+#include <fcntl.h>
+#include <future>
+#include <cassert>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#else
+#include <poll.h>
+#endif
+using namespace std;
+
+namespace ucsmq{
+    timer_id_t TimerWheel::add(uint64_t ticks, function<void()> &&task) {
+        if(ticks==0) ticks=1;
+        uint64_t expire = currentTick+ticks;
+        size_t slot = expire % slots.size();
+        timer_id_t id = nextId++;
+        slots[slot].push_back({id,expire,std::move(task)});
+        index[id]=make_pair(slot,--slots[slot].end());
+        return id;
+    }
+
+    void TimerWheel::cancel(timer_id_t id) {
+        auto it = index.find(id);
+        if(it==index.end()) return;
+        slots[it->second.first].erase(it->second.second);
+        index.erase(it);
+    }
+
+    size_t TimerWheel::advance(uint64_t tick) {
+        vector<function<void()>> expired;
+        size_t fired=0;
+        while (currentTick<tick){
+            currentTick++;
+            auto& slot = slots[currentTick % slots.size()];
+            for(auto it=slot.begin();it!=slot.end();){
+                if(it->expireTick<=currentTick){
+                    expired.push_back(std::move(it->task));
+                    index.erase(it->id);
+                    it=slot.erase(it);
+                }else{
+                    ++it;
+                }
+            }
+            //a task may add or cancel timers, run them once the wheel is consistent
+            for(auto& task : expired){
+                task();
+            }
+            fired+=expired.size();
+            expired.clear();
+        }
+        return fired;
+    }
+
+    bool TimerWheel::nextExpiry(uint64_t &tick) const {
+        if(index.empty()) return false;
+        tick=UINT64_MAX;
+        for(const auto& pa : index){
+            tick=min(tick,pa.second.second->expireTick);
+        }
+        return true;
+    }
+
+    EventLoop::EventLoop() : tasks(EVENT_LOOP_QUEUE_CAPACITY),simulation(nullptr) {
+        running.store(false);
+        overflowing.store(false);
+        sleeping.store(false);
+#ifdef __linux__
+        pollfd = epoll_create1(EPOLL_CLOEXEC);
+        wakeupfd[0] = wakeupfd[1] = eventfd(0,EFD_NONBLOCK|EFD_CLOEXEC);
+        epoll_event ev{};
+        ev.events=EPOLLIN;
+        ev.data.fd=wakeupfd[0];
+        epoll_ctl(pollfd,EPOLL_CTL_ADD,wakeupfd[0],&ev);
+#else
+        pollfd = -1;
+        if(pipe(wakeupfd)==0){
+            fcntl(wakeupfd[0],F_SETFL,O_NONBLOCK);
+            fcntl(wakeupfd[1],F_SETFL,O_NONBLOCK);
+        }
+#endif
+    }
+
+    EventLoop::~EventLoop() {
+        //a task can not destroy its own loop, the thread would go on running on it
+        assert(!thread.joinable() || this_thread::get_id()!=thread.get_id());
+        stop();
+#ifdef __linux__
+        ::close(pollfd);
+        ::close(wakeupfd[0]);
+#else
+        ::close(wakeupfd[0]);
+        ::close(wakeupfd[1]);
+#endif
+    }
+
+    int EventLoop::start() {
+        if(running.load()) return -1;
+        if(wakeupfd[0]<0) return -1;
+        //the thread of a loop stopped by its own task is still to be joined
+        if(thread.joinable()) thread.join();
+        running.store(true);
+        startTime=Clock::now();
+        if((simulation=Simulation::current())!= nullptr){
+            simulation->add(this);
+            return 1;
+        }
+        thread=std::thread(&EventLoop::looping,this);
+        return 1;
+    }
+
+    void EventLoop::stop() {
+        if(!running.exchange(false)){
+            //stopped by one of its tasks, the thread is joined here or by the destructor
+            if(thread.joinable() && this_thread::get_id()!=thread.get_id()) thread.join();
+            return;
+        }
+        if(simulation!= nullptr){
+            //what is left runs now, as the thread would before leaving
+            vector<Task> burst;
+            do{
+                burst.clear();
+                runTasks(burst);
+                if(afterBurst) afterBurst();
+            } while (!burst.empty());
+            simulation->remove(this);
+            simulation= nullptr;
+            return;
+        }
+        wakeup();
+        if(this_thread::get_id()!=thread.get_id()) thread.join();
+    }
+
+    void EventLoop::post(Task &&task) {
+        push(std::move(task));
+        //pairs with the fence in pollTimeout(): either the loop sees the task or we see it asleep
+        atomic_thread_fence(memory_order_seq_cst);
+        if(sleeping.load(memory_order_relaxed) && sleeping.exchange(false)) wakeup();
+    }
+
+    void EventLoop::push(Task &&task) {
+        if(!overflowing.load() && tasks.tryPush(task)) return;
+        lock_guard<std::mutex> guard(mutex);
+        //the loop may have drained the overflow meanwhile
+        if(!overflowing.load() && tasks.tryPush(task)) return;
+        overflowing.store(true);
+        overflow.push_back(std::move(task));
+    }
+
+    bool EventLoop::queueEmpty() {
+        return tasks.size()==0 && !overflowing.load();
+    }
+
+    void EventLoop::runTasks(vector<Task> &burst) {
+        //only the tasks already queued, the ones they post wait for the next round
+        size_t n = tasks.size();
+        Task task;
+        for(size_t i=0;i<n && tasks.tryPop(task);i++){
+            burst.push_back(std::move(task));
+        }
+        if(overflowing.load() && tasks.size()==0){
+            lock_guard<std::mutex> guard(mutex);
+            for(auto& t : overflow){
+                burst.push_back(std::move(t));
+            }
+            overflow.clear();
+            overflowing.store(false);
+        }
+        for(auto& t : burst){
+            t();
+        }
+    }
+
+    void EventLoop::runSync(Task &&task) {
+        if(inLoopThread() || !running.load()){
+            task();
+            return;
+        }
+        std::promise<void> done;
+        post([&task,&done](){
+            task();
+            done.set_value();
+        });
+        done.get_future().wait();
+    }
+
+    void EventLoop::wakeup() {
+        uint64_t one=1;
+        ssize_t n = ::write(wakeupfd[1],&one,sizeof(one));
+        (void)n;
+    }
+
+    timer_id_t EventLoop::runAfter(int ms, Task &&task) {
+        uint64_t ticks = (ms+TIMER_WHEEL_TICK_MS-1)/TIMER_WHEEL_TICK_MS;
+        return wheel.add(ticks,std::move(task));
+    }
+
+    void EventLoop::cancel(timer_id_t id) {
+        wheel.cancel(id);
+    }
+
+    int EventLoop::watch(int fd, Task &&onReadable) {
+#ifdef __linux__
+        //the sockets of a transport are polled by simulate()
+        if(DatagramTransport::of(fd)== nullptr){
+            epoll_event ev{};
+            ev.events=EPOLLIN;
+            ev.data.fd=fd;
+            if(epoll_ctl(pollfd,EPOLL_CTL_ADD,fd,&ev)<0) return -1;
+        }
+#endif
+        watchers[fd]=std::make_shared<Task>(std::move(onReadable));
+        return 1;
+    }
+
+    void EventLoop::unwatch(int fd) {
+        if(watchers.erase(fd)==0) return;
+#ifdef __linux__
+        if(DatagramTransport::of(fd)== nullptr) epoll_ctl(pollfd,EPOLL_CTL_DEL,fd, nullptr);
+#endif
+    }
+
+    uint64_t EventLoop::nowTick() const {
+        auto elapsed = chrono::duration_cast<chrono::milliseconds>(Clock::now()-startTime);
+        return elapsed.count()/TIMER_WHEEL_TICK_MS;
+    }
+
+    int EventLoop::pollTimeout() {
+        sleeping.store(true);
+        atomic_thread_fence(memory_order_seq_cst);
+        if(!queueEmpty() || !running.load()){
+            sleeping.store(false);
+            return 0;
+        }
+        if(wheel.empty()) return -1;
+        auto deadline = startTime+chrono::milliseconds((wheel.tick()+1)*TIMER_WHEEL_TICK_MS);
+        auto ms = chrono::duration_cast<chrono::milliseconds>(deadline-Clock::now()).count();
+        return ms<0 ? 0 : (int)ms;
+    }
+
+    void EventLoop::pollEvents(int timeout) {
+        std::vector<int> ready;
+#ifdef __linux__
+        epoll_event events[64];
+        int n = epoll_wait(pollfd,events,64,timeout);
+        for(int i=0;i<n;i++){
+            ready.push_back(events[i].data.fd);
+        }
+#else
+        std::vector<struct pollfd> fds;
+        fds.push_back({wakeupfd[0],POLLIN,0});
+        for(auto& pa : watchers){
+            fds.push_back({pa.first,POLLIN,0});
+        }
+        int n = poll(fds.data(),fds.size(),timeout);
+        for(int i=0;n>0 && i<(int)fds.size();i++){
+            if(fds[i].revents!=0) ready.push_back(fds[i].fd);
+        }
+#endif
+        for(int fd : ready){
+            if(fd==wakeupfd[0]){
+                uint64_t v;
+                while (::read(wakeupfd[0],&v,sizeof(v))>0);
+                continue;
+            }
+            //an earlier callback may have unwatched it, and the callback may unwatch itself
+            auto it = watchers.find(fd);
+            if(it==watchers.end()) continue;
+            auto callback = it->second;
+            (*callback)();
+        }
+    }
+
+    void EventLoop::looping() {
+        vector<Task> burst;
+        while (true){
+            pollEvents(pollTimeout());
+            sleeping.store(false);
+            runTasks(burst);
+            bool drained = burst.empty();
+            burst.clear();
+            wheel.advance(nowTick());
+            if(afterBurst) afterBurst();
+            if(drained && !running.load() && queueEmpty()) break;
+        }
+    }
+
+    size_t EventLoop::simulate(const function<bool(int)>& readable) {
+        size_t n=0;
+        vector<int> ready;
+        for(auto& pa : watchers){
+            if(readable(pa.first)) ready.push_back(pa.first);
+        }
+        //the order of a hash map is not part of the seed
+        sort(ready.begin(),ready.end());
+        for(int fd : ready){
+            auto it = watchers.find(fd);
+            if(it==watchers.end()) continue;
+            auto callback = it->second;
+            (*callback)();
+            n++;
+        }
+        vector<Task> burst;
+        runTasks(burst);
+        n+=burst.size();
+        n+=wheel.advance(nowTick());
+        if(afterBurst) afterBurst();
+        return n;
+    }
+
+    bool EventLoop::nextTimer(Clock::time_point &t) const {
+        uint64_t tick;
+        if(!wheel.nextExpiry(tick)) return false;
+        t=startTime+chrono::milliseconds(tick*TIMER_WHEEL_TICK_MS);
+        return true;
+    }
+}
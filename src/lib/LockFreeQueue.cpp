@@ -0,0 +1,70 @@
+#include "LockFreeQueue.hpp"
+#include <climits>
+#include <cerrno>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <ctime>
+#endif
+
+namespace ucsmq{
+#ifdef __linux__
+    static_assert(sizeof(std::atomic<uint32_t>)==sizeof(uint32_t),"futex word");
+    static long futex(std::atomic<uint32_t>* addr,int op,uint32_t val,const timespec* timeout){
+        return syscall(SYS_futex,reinterpret_cast<uint32_t*>(addr),op,val,timeout, nullptr,0);
+    }
+#endif
+
+    uint32_t Parker::prepare() {
+        waiters.fetch_add(1);
+        //pairs with the fence in wake(): either the waker sees us, or we see what it published
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        return seq.load();
+    }
+
+    void Parker::cancel() {
+        waiters.fetch_sub(1);
+    }
+
+    bool Parker::wait(uint32_t ticket, int ms) {
+        bool woken=true;
+#ifdef __linux__
+        if(ms>0){
+            timespec ts{ms/1000,(ms%1000)*1000000L};
+            woken = !(futex(&seq,FUTEX_WAIT_PRIVATE,ticket,&ts)<0 && errno==ETIMEDOUT);
+        }else{
+            futex(&seq,FUTEX_WAIT_PRIVATE,ticket, nullptr);
+        }
+#else
+        std::unique_lock<std::mutex> lock(mutex);
+        auto changed = [this,ticket](){return seq.load()!=ticket;};
+        if(ms>0){
+            woken = cv.wait_for(lock,std::chrono::milliseconds(ms),changed);
+        }else{
+            cv.wait(lock,changed);
+        }
+#endif
+        waiters.fetch_sub(1);
+        return woken;
+    }
+
+    void Parker::wake() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(waiters.load(std::memory_order_relaxed)==0) return;
+        wakeAll();
+    }
+
+    void Parker::wakeAll() {
+#ifdef __linux__
+        seq.fetch_add(1);
+        futex(&seq,FUTEX_WAKE_PRIVATE,INT_MAX, nullptr);
+#else
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            seq.fetch_add(1);
+        }
+        cv.notify_all();
+#endif
+    }
+}
@@ -1,11 +1,14 @@
 #include "Log.h"
+#include "LockFreeQueue.hpp"
 #include <iomanip>
 #include <ctime>
-#include <cstdarg> 
+#include <cstdarg>
+#include <chrono>
+#include <thread>
 using namespace std;
 
 namespace ucsmq{
-    log_level_t Log::level=LOG_TRACE;
+    atomic<log_level_t> Log::level(LOG_TRACE);
     vector<ostream*> Log::outs={&cout};
     string Log::timeFormat="[%Y-%m-%d %H:%M:%S]";
     mutex Log::lock;
@@ -23,27 +26,121 @@ namespace ucsmq{
                 return "ERROR";
             case LOG_FATAL:
                 return "FATAL";
+            case LOG_OFF:
+                return "OFF";
         }
         return "";
     }
 
+    struct LogRecord {
+        log_level_t level;
+        time_t time;
+        char text[LOG_RECORD_SIZE];
+    };
+
+    class LogWriter {
+        MpscRing<LogRecord> ring;
+        Parker notEmpty;
+        atomic<uint64_t> dropped;
+        //set at exit, the outs may be destroyed after it
+        bool closed;
+        static void write(const LogRecord& record){
+            tm localTime{};
+            localtime_r(&record.time,&localTime);
+            char time[256];
+            strftime(time, sizeof(time),Log::timeFormat.c_str(),&localTime);
+            for(auto* out : Log::outs){
+                *out<<levelStr(record.level)<<": "<<time<<" "<<record.text<<'\n';
+            }
+        }
+        void run(){
+            while (true){
+                drain();
+                auto ticket = notEmpty.prepare();
+                if(ring.size()>0){
+                    notEmpty.cancel();
+                    continue;
+                }
+                notEmpty.wait(ticket,0);
+            }
+        }
+    public:
+        LogWriter() : ring(LOG_RING_CAPACITY),closed(false){
+            dropped.store(0);
+            thread(&LogWriter::run,this).detach();
+        }
+        void push(LogRecord& record){
+            if(!ring.tryPush(record)){
+                dropped.fetch_add(1,memory_order_relaxed);
+                return;
+            }
+            notEmpty.wake();
+        }
+        //the ring has a single consumer: whoever holds the lock
+        void drain(bool close=false){
+            lock_guard<mutex> guard(Log::lock);
+            if(closed) return;
+            LogRecord record;
+            bool wrote=false;
+            while (ring.tryPop(record)){
+                write(record);
+                wrote=true;
+            }
+            auto n = dropped.exchange(0,memory_order_relaxed);
+            if(n>0){
+                record.level=LOG_WARN;
+                record.time=::time(nullptr);
+                snprintf(record.text,sizeof(record.text),"%llu log messages dropped",(unsigned long long)n);
+                write(record);
+                wrote=true;
+            }
+            if(wrote){
+                for(auto* out : Log::outs) out->flush();
+            }
+            closed=close;
+        }
+    };
+
+    //never destroyed: threads still running at exit may log
+    static LogWriter& logWriter(){
+        static auto writer = [](){
+            auto w = new LogWriter;
+            atexit([](){logWriter().drain(true);});
+            return w;
+        }();
+        return *writer;
+    }
+
     void Log::printf(log_level_t lv, const char *format, ...) {
-        lock_guard<mutex> guard(lock);
-        if(Log::level>lv) return;
-        time_t currentTime = time(nullptr);
-        tm localTime = *localtime(&currentTime);
-        char tmp[1024*16],time[256];
+        if(!enabled(lv)) return;
+        LogRecord record;
+        record.level=lv;
+        record.time=time(nullptr);
         va_list args;
         va_start(args,format);
-        for(auto* out : outs){
-            *out<<levelStr(lv)<<": ";
-            strftime(time, sizeof(time),timeFormat.c_str(),&localTime);
-            *out << time << " ";
-            std::vsprintf(tmp,format,args);
-            *out<<tmp<<endl;
-        }
+        vsnprintf(record.text,sizeof(record.text),format,args);
         va_end(args);
-        if(lv==LOG_FATAL) exit(1);
+        auto& writer = logWriter();
+        writer.push(record);
+        if(lv==LOG_FATAL){
+            writer.drain();
+            exit(1);
+        }
+    }
+
+    void Log::flush() {
+        logWriter().drain();
+    }
+
+    bool LogLimit::allow(uint32_t& held) {
+        auto now = (int64_t)chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+        auto t = next.load(memory_order_relaxed);
+        if(now<t || !next.compare_exchange_strong(t,now+LOG_LIMIT_INTERVAL_MS,memory_order_relaxed)){
+            suppressed.fetch_add(1,memory_order_relaxed);
+            return false;
+        }
+        held=suppressed.exchange(0,memory_order_relaxed);
+        return true;
     }
 
-}
\ No newline at end of file
+}
@@ -0,0 +1,209 @@
+#include "Metrics.h"
+#include "Log.h"
+#include <cmath>
+#include <cstdio>
+#include <cerrno>
+#include <fstream>
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+using namespace std;
+
+namespace ucsmq{
+#define SUB_BUCKETS ((uint64_t)1<<HISTOGRAM_SUB_BITS)
+
+    Histogram::Histogram() {
+        for(auto& bucket : buckets){
+            bucket.store(0,memory_order_relaxed);
+        }
+        max.store(0,memory_order_relaxed);
+    }
+
+    size_t Histogram::bucketOf(uint64_t v) {
+        if(v<SUB_BUCKETS) return (size_t)v;
+        int e = 63-__builtin_clzll(v);
+        if(e>HISTOGRAM_MAX_EXPONENT) return HISTOGRAM_BUCKETS-1;
+        //the power of two picks the row, the next HISTOGRAM_SUB_BITS bits the bucket in it
+        return ((size_t)(e-HISTOGRAM_SUB_BITS+1)<<HISTOGRAM_SUB_BITS) + (size_t)((v>>(e-HISTOGRAM_SUB_BITS))&(SUB_BUCKETS-1));
+    }
+
+    uint64_t Histogram::bucketUpper(size_t i) {
+        if(i<SUB_BUCKETS) return i;
+        int shift = (int)(i>>HISTOGRAM_SUB_BITS)-1;
+        uint64_t low = (SUB_BUCKETS+(i&(SUB_BUCKETS-1)))<<shift;
+        return low+((uint64_t)1<<shift)-1;
+    }
+
+    void Histogram::record(uint64_t v) {
+        auto& bucket = buckets[bucketOf(v)];
+        bucket.store(bucket.load(memory_order_relaxed)+1,memory_order_relaxed);
+        sum.add(v);
+        if(v>max.load(memory_order_relaxed)) max.store(v,memory_order_relaxed);
+    }
+
+    HistogramSnapshot Histogram::snapshot() const {
+        HistogramSnapshot h;
+        for(size_t i=0;i<HISTOGRAM_BUCKETS;i++){
+            h.counts[i]=buckets[i].load(memory_order_relaxed);
+            h.count+=h.counts[i];
+        }
+        h.sum=sum.value();
+        h.max=max.load(memory_order_relaxed);
+        return h;
+    }
+
+    void HistogramSnapshot::merge(const HistogramSnapshot &other) {
+        for(size_t i=0;i<HISTOGRAM_BUCKETS;i++){
+            counts[i]+=other.counts[i];
+        }
+        count+=other.count;
+        sum+=other.sum;
+        if(other.max>max) max=other.max;
+    }
+
+    uint64_t HistogramSnapshot::quantile(double q) const {
+        if(count==0) return 0;
+        auto rank = (uint64_t)ceil(q*(double)count);
+        if(rank==0) rank=1;
+        uint64_t seen=0;
+        for(size_t i=0;i<HISTOGRAM_BUCKETS;i++){
+            seen+=counts[i];
+            if(seen>=rank){
+                auto upper = Histogram::bucketUpper(i);
+                return upper<max ? upper : max;
+            }
+        }
+        return max;
+    }
+
+    string& MetricsText::samplesOf(const string &name, const char *help, const char *type) {
+        auto it = index.find(name);
+        if(it!=index.end()) return families[it->second].samples;
+        index.emplace(name,families.size());
+        families.push_back({name,help,type,""});
+        return families.back().samples;
+    }
+
+    static void appendSample(string& samples,const string& name,const string& labels,const char* value){
+        samples+=name;
+        if(!labels.empty()){
+            samples+='{';
+            samples+=labels;
+            samples+='}';
+        }
+        samples+=' ';
+        samples+=value;
+        samples+='\n';
+    }
+
+    void MetricsText::counter(const string &name, const char *help, uint64_t value, const string &labels) {
+        appendSample(samplesOf(name,help,"counter"),name,labels,to_string(value).c_str());
+    }
+
+    void MetricsText::gauge(const string &name, const char *help, double value, const string &labels) {
+        char buf[32];
+        snprintf(buf,sizeof(buf),"%.15g",value);
+        appendSample(samplesOf(name,help,"gauge"),name,labels,buf);
+    }
+
+    void MetricsText::summary(const string &name, const char *help, const HistogramSnapshot &h, const string &labels, double scale) {
+        auto& samples = samplesOf(name,help,"summary");
+        char buf[32];
+        for(const char* q : {"0.5","0.9","0.99","0.999"}){
+            snprintf(buf,sizeof(buf),"%.15g",(double)h.quantile(atof(q))*scale);
+            appendSample(samples,name,labels.empty() ? string("quantile=\"")+q+"\"" : labels+",quantile=\""+q+"\"",buf);
+        }
+        snprintf(buf,sizeof(buf),"%.15g",(double)h.sum*scale);
+        appendSample(samples,name+"_sum",labels,buf);
+        appendSample(samples,name+"_count",labels,to_string(h.count).c_str());
+    }
+
+    string MetricsText::str() const {
+        string text;
+        for(const auto& family : families){
+            text+="# HELP "+family.name+" "+family.help+"\n";
+            text+="# TYPE "+family.name+" "+family.type+"\n";
+            text+=family.samples;
+        }
+        return text;
+    }
+
+    void MetricsExporter::add(function<void(MetricsText &)> source) {
+        lock_guard<mutex> guard(lock);
+        sources.push_back(std::move(source));
+    }
+
+    string MetricsExporter::render() {
+        MetricsText text;
+        {
+            lock_guard<mutex> guard(lock);
+            for(const auto& source : sources){
+                source(text);
+            }
+        }
+        return text.str();
+    }
+
+    int MetricsExporter::writeFile(const string &path) {
+        auto tmp = path+".tmp";
+        {
+            ofstream out(tmp,ios::binary|ios::trunc);
+            out<<render();
+            if(!out.good()){
+                LOG_PRINTF(LOG_ERROR,"failed to write metrics to %s",tmp.c_str());
+                return -1;
+            }
+        }
+        if(rename(tmp.c_str(),path.c_str())<0){
+            LOG_PRINTF(LOG_ERROR,"failed to write metrics to %s : %s",path.c_str(),getLastErrorMessage().c_str());
+            return -1;
+        }
+        return 1;
+    }
+
+    int MetricsExporter::serve(const SA_IN &addr) {
+        if(running.load()) return -1;
+        listenfd = listenTcp(addr,16);
+        if(listenfd<0){
+            LOG_PRINTF(LOG_ERROR,"failed to serve metrics at %s : %s",sockaddr_inStr(addr).c_str(),getLastErrorMessage().c_str());
+            return -1;
+        }
+        running.store(true);
+        thread=std::thread(&MetricsExporter::serving,this);
+        return 1;
+    }
+
+    void MetricsExporter::serving() {
+        while (running.load()){
+            int fd = (int)accept(listenfd, nullptr, nullptr);
+            if(fd<0){
+                if(!running.load()) break;
+                if(errno==EINTR || errno==ECONNABORTED) continue;
+                LOG_PRINTF(LOG_ERROR,"metrics exporter : %s",getLastErrorMessage().c_str());
+                break;
+            }
+            //the request is read and ignored, whatever is asked for gets the metrics
+            setSocketTimeout(fd,1);
+            char request[4096];
+            recv(fd,request,sizeof(request),0);
+            auto body = render();
+            auto response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: "+to_string(body.size())+
+                    "\r\nConnection: close\r\n\r\n"+body;
+            size_t sent=0;
+            while (sent<response.size()){
+                auto n = send(fd,response.data()+sent,response.size()-sent,MSG_NOSIGNAL);
+                if(n<=0) break;
+                sent+=n;
+            }
+            closeSocket(fd);
+        }
+    }
+
+    void MetricsExporter::stop() {
+        if(!running.exchange(false)) return;
+        shutdownSocket(listenfd);
+        thread.join();
+        closeSocket(listenfd);
+        listenfd=-1;
+    }
+}
@@ -0,0 +1,45 @@
+#include "Random.h"
+#include <atomic>
+#include <chrono>
+#include <random>
+
+namespace ucsmq{
+    static uint64_t splitmix64(uint64_t& x){
+        uint64_t z = (x += 0x9e3779b97f4a7c15ull);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        return z ^ (z >> 31);
+    }
+
+    void Random::seed(uint64_t seed_) {
+        //splitmix64 spreads any seed, even 0, over the whole state
+        for(auto& x : s) x=splitmix64(seed_);
+    }
+
+    static uint64_t defaultSeed(){
+        auto now = (uint64_t)std::chrono::steady_clock::now().time_since_epoch().count();
+        return ((uint64_t)std::random_device()()<<32)^now;
+    }
+
+    static std::atomic<uint64_t> globalSeed(defaultSeed());
+    //bumped by seedAll(), a thread reseeds its generator when it sees a new one
+    static std::atomic<uint64_t> seedGeneration(0);
+    //threads asking for a generator since the last seedAll()
+    static std::atomic<uint64_t> streams(0);
+
+    Random &Random::local() {
+        static thread_local Random random;
+        auto gen = seedGeneration.load(std::memory_order_acquire);
+        if(random.generation!=gen){
+            random.seed(globalSeed.load(std::memory_order_relaxed)+0x9e3779b97f4a7c15ull*streams.fetch_add(1));
+            random.generation=gen;
+        }
+        return random;
+    }
+
+    void Random::seedAll(uint64_t seed) {
+        globalSeed.store(seed,std::memory_order_relaxed);
+        streams.store(0,std::memory_order_relaxed);
+        seedGeneration.fetch_add(1,std::memory_order_release);
+    }
+}
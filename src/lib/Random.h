@@ -0,0 +1,43 @@
+#ifndef DNS_RANDOM_H
+#define DNS_RANDOM_H
+#include <cstdint>
+
+namespace ucsmq{
+    /*
+     * xoshiro256** generator. Every thread has its own, so the encoders never contend on the lock of rand().
+     * Not for anything secret.
+     * */
+    class Random {
+        uint64_t s[4];
+        //the seedAll() generation of a thread's generator, UINT64_MAX: not seeded from it yet
+        uint64_t generation;
+        static uint64_t rotl(uint64_t x,int k){return (x<<k)|(x>>(64-k));}
+    public:
+        explicit Random(uint64_t seed_=0) : generation(UINT64_MAX){seed(seed_);}
+        void seed(uint64_t seed_);
+        uint64_t next(){
+            auto result = rotl(s[1]*5,7)*9;
+            auto t = s[1]<<17;
+            s[2]^=s[0];
+            s[3]^=s[1];
+            s[1]^=s[2];
+            s[0]^=s[3];
+            s[2]^=t;
+            s[3]=rotl(s[3],45);
+            return result;
+        }
+        //uniform in [0,n), n>0
+        uint32_t below(uint32_t n){return (uint32_t)(((next()>>32)*n)>>32);}
+        //uniform in [min,max)
+        int range(int min,int max){return min+(int)below((uint32_t)(max-min));}
+
+        //the generator of the calling thread
+        static Random& local();
+        /*
+         * Seed every thread's generator from seed, for reproducible runs: a thread's generator is derived from seed and
+         * the order in which the thread first asks for it after the call. By default the seed comes from the clock.
+         * */
+        static void seedAll(uint64_t seed);
+    };
+}
+#endif //DNS_RANDOM_H
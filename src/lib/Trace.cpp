@@ -0,0 +1,154 @@
+#include "Trace.h"
+#include "Log.h"
+#include "Clock.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+using namespace std;
+
+namespace ucsmq{
+#define TRACE_FILE_MAGIC "DNSTRACE"
+#define TRACE_FILE_VERSION 1
+
+    atomic<bool> Trace::on(false);
+
+    struct TraceRing {
+        TraceEvent events[TRACE_RING_SIZE];
+        //events ever recorded, the writer publishes an event by moving it
+        atomic<uint64_t> head;
+        //a thread is recording into it
+        atomic<bool> owned;
+        uint16_t id;
+    };
+
+    static mutex ringsLock;
+    //never destroyed: the events of a thread outlive it until its ring is reused
+    static vector<TraceRing*>& rings(){
+        static auto r = new vector<TraceRing*>;
+        return *r;
+    }
+
+    static TraceRing* acquireRing(){
+        lock_guard<mutex> guard(ringsLock);
+        for(auto ring : rings()){
+            bool owned=false;
+            if(ring->owned.compare_exchange_strong(owned,true)) return ring;
+        }
+        auto ring = new TraceRing;
+        ring->head.store(0);
+        ring->owned.store(true);
+        ring->id=(uint16_t)rings().size();
+        rings().push_back(ring);
+        return ring;
+    }
+
+    struct RingHolder {
+        TraceRing* ring= nullptr;
+        ~RingHolder(){
+            if(ring!= nullptr) ring->owned.store(false,memory_order_release);
+        }
+    };
+    static thread_local RingHolder holder;
+
+    void Trace::enable(bool on_) {
+        on.store(on_);
+    }
+
+    void Trace::record(trace_event_t event, trace_side_t side, uint16_t sessionId, uint16_t groupId, uint16_t dataId,
+                       uint8_t packetType, uint32_t size) {
+        auto ring = holder.ring;
+        if(ring== nullptr) ring = holder.ring = acquireRing();
+        auto h = ring->head.load(memory_order_relaxed);
+        auto& e = ring->events[h&(TRACE_RING_SIZE-1)];
+        e.time=(uint64_t)chrono::duration_cast<chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+        e.size=size;
+        e.sessionId=sessionId;
+        e.groupId=groupId;
+        e.dataId=dataId;
+        e.event=(uint8_t)event;
+        e.packetType=packetType;
+        e.side=(uint8_t)side;
+        e.reserved=0;
+        e.thread=ring->id;
+        ring->head.store(h+1,memory_order_release);
+    }
+
+    vector<TraceEvent> Trace::collect() {
+        vector<TraceEvent> events;
+        lock_guard<mutex> guard(ringsLock);
+        for(auto ring : rings()){
+            auto head = ring->head.load(memory_order_acquire);
+            auto first = head>TRACE_RING_SIZE ? head-TRACE_RING_SIZE : 0;
+            vector<TraceEvent> copy;
+            copy.reserve(head-first);
+            for(auto i=first;i<head;i++){
+                copy.push_back(ring->events[i&(TRACE_RING_SIZE-1)]);
+            }
+            //the writer went on while we copied, drop what it may have overwritten
+            auto now = ring->head.load(memory_order_acquire);
+            auto valid = now>=TRACE_RING_SIZE ? now-TRACE_RING_SIZE+1 : 0;
+            size_t skip = valid>first ? (size_t)(valid-first) : 0;
+            if(skip>copy.size()) skip=copy.size();
+            events.insert(events.end(),copy.begin()+(ptrdiff_t)skip,copy.end());
+        }
+        stable_sort(events.begin(),events.end(),[](const TraceEvent& a,const TraceEvent& b){return a.time<b.time;});
+        return events;
+    }
+
+    int Trace::dump(const string &path) {
+        auto events = collect();
+        ofstream out(path,ios::binary|ios::trunc);
+        uint32_t version=TRACE_FILE_VERSION,eventSize=sizeof(TraceEvent);
+        out.write(TRACE_FILE_MAGIC,8);
+        out.write((const char*)&version,sizeof(version));
+        out.write((const char*)&eventSize,sizeof(eventSize));
+        out.write((const char*)events.data(),(streamsize)(events.size()*sizeof(TraceEvent)));
+        if(!out.good()){
+            LOG_PRINTF(LOG_ERROR,"failed to dump the trace to %s",path.c_str());
+            return -1;
+        }
+        return 1;
+    }
+
+    int Trace::load(const string &path, vector<TraceEvent> &events) {
+        ifstream in(path,ios::binary);
+        char magic[8];
+        uint32_t version=0,eventSize=0;
+        in.read(magic,8);
+        in.read((char*)&version,sizeof(version));
+        in.read((char*)&eventSize,sizeof(eventSize));
+        if(!in.good() || memcmp(magic,TRACE_FILE_MAGIC,8)!=0 || version!=TRACE_FILE_VERSION || eventSize!=sizeof(TraceEvent)){
+            LOG_PRINTF(LOG_ERROR,"%s is not a trace dump",path.c_str());
+            return -1;
+        }
+        TraceEvent e;
+        while (in.read((char*)&e,sizeof(e))){
+            events.push_back(e);
+        }
+        return 1;
+    }
+
+    const char *Trace::eventName(int event) {
+        switch (event) {
+            case TRACE_SEGMENT_CREATED:
+                return "SEGMENT_CREATED";
+            case TRACE_QUERY_SENT:
+                return "QUERY_SENT";
+            case TRACE_QUERY_RECEIVED:
+                return "QUERY_RECEIVED";
+            case TRACE_RESPONSE_SENT:
+                return "RESPONSE_SENT";
+            case TRACE_RESPONSE_RECEIVED:
+                return "RESPONSE_RECEIVED";
+            case TRACE_RETRANSMIT:
+                return "RETRANSMIT";
+            case TRACE_DISCARD:
+                return "DISCARD";
+            case TRACE_GROUP_EXPORTED:
+                return "GROUP_EXPORTED";
+        }
+        return "UNKNOWN";
+    }
+}
@@ -1,4 +1,5 @@
 #include "base36.h"
+#include "Random.h"
 #define IS_DIGIT(c) ('0'<=c  &&  c<='9')
 #define IS_ALPHA(c) ( 'A'<=c && c<='Z' || 'a'<=c && c<='z')
 #define IS_UPPER(c) ('A'<=c && c<='Z')
@@ -7,7 +8,7 @@
 #define TO_UPPER(c) (c-('a'-'A'))
 #define IS_BASE36_CHAR(c) ( IS_DIGIT(c) || IS_ALPHA(c))
 namespace ucsmq{
-    inline int charValue(char ch){
+    constexpr int charValue(char ch){
         if (IS_DIGIT(ch)) return ch-'0';
         if(IS_ALPHA(ch)){
             if(IS_UPPER(ch)) ch= (char )TO_LOWER(ch);
@@ -15,32 +16,41 @@ namespace ucsmq{
         }
         return -1;
     }
+    //the value of every byte as a base36 character, -1 if it is none
+    struct CharValues{
+        int8_t v[UINT8_MAX+1];
+        constexpr CharValues() : v(){
+            for(int c=0;c<=UINT8_MAX;c++) v[c]=(int8_t)charValue((char)c);
+        }
+    };
+    static constexpr CharValues charValues;
+
     char itoc(int n){
         if(n<10) return (char)('0'+n);
         return (char)('a'+n-10);
     }
-    void randToUpper(char* p){
-        if(IS_ALPHA(*p) && (rand()&1)) *p= TO_UPPER(*p);
+    void randToUpper(char* p,uint64_t bit){
+        if(IS_ALPHA(*p) && bit) *p= TO_UPPER(*p);
     }
-    void encodeByte(void *dst,uint8_t b){
-        int v= b + (abs(rand())%5 )*(UINT8_MAX+1);
+    //r: random bits, the low half picks the multiple of 256 and two high bits the case
+    void encodeByte(void *dst,uint8_t b,uint64_t r){
+        int v= b + (int)(((r&UINT32_MAX)*5)>>32)*(UINT8_MAX+1);
         char low,high,*p=(char *)dst;
         low= itoc(v%36);
         high= itoc(v/36%36);
-        randToUpper(&low) , randToUpper(&high);
+        randToUpper(&low,r>>32&1) , randToUpper(&high,r>>33&1);
         p[0]=low,p[1]=high;
     }
-    uint8_t decodeWord(void *src){
-        char *p=(char *)src;
-        char low=p[0] , high=p[1];
-        int v = 36* charValue(high)+ charValue(low);
-        return (uint8_t)(v%(UINT8_MAX+1));
+    inline uint8_t decodeWord(const uint8_t *p){
+        //the encoder adds multiples of 256, they fall off the byte
+        return (uint8_t)(36*charValues.v[p[1]]+charValues.v[p[0]]);
     }
 
     ssize_t base36encode(void *dst,const void *src,size_t size){
         uint8_t *d=(uint8_t*)dst , *s=(uint8_t*)src;
+        auto& random = Random::local();
         for(size_t i=0;i<size;++i){
-            encodeByte(d,s[i]);
+            encodeByte(d,s[i],random.next());
             d+=2;
         }
         return d-(uint8_t*)dst;
@@ -48,7 +58,7 @@ namespace ucsmq{
     ssize_t base36decode(void *dst,const void *src,size_t size ){
         uint8_t *d=(uint8_t*)dst , *s=(uint8_t*)src;
         for(size_t i=0;i<size;i+=2){
-            if(!IS_BASE36_CHAR(s[i]) || !IS_BASE36_CHAR(s[i+1])) return -i;
+            if((charValues.v[s[i]]|charValues.v[s[i+1]])<0) return -i;
             *d = decodeWord(s+i);
             d++;
         }
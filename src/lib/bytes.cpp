@@ -13,11 +13,12 @@ namespace ucsmq{
     size_t copy(Writeable &w, Readable &r, size_t n){
         if(n > w.writableBytes()) n=w.writableBytes();
         if(n > r.readableBytes()) n=r.readableBytes();
-        if(n>0){
-            uint8_t * tmp = new uint8_t [n];
-            r.readBytes(tmp,n);
-            w.writeBytes(tmp,n);
-            delete[] tmp;
+        uint8_t tmp[512];
+        for(size_t left=n;left>0;){
+            size_t k = left<sizeof(tmp) ? left : sizeof(tmp);
+            r.readBytes(tmp,k);
+            w.writeBytes(tmp,k);
+            left-=k;
         }
         return n;
     }
@@ -0,0 +1,23 @@
+#include "threads.h"
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace ucsmq{
+    unsigned cpuCount() {
+        unsigned n = std::thread::hardware_concurrency();
+        return n==0 ? 1 : n;
+    }
+
+    int pinThread(std::thread &th, unsigned core) {
+#ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(core % cpuCount(), &set);
+        return pthread_setaffinity_np(th.native_handle(), sizeof(set), &set)==0 ? 0 : -1;
+#else
+        return -1;
+#endif
+    }
+}
@@ -0,0 +1,10 @@
+#ifndef DNS_THREADS_H
+#define DNS_THREADS_H
+#include <thread>
+namespace ucsmq{
+    //number of cores available to the process, at least 1
+    unsigned cpuCount();
+    //bind a thread to core (core % cpuCount()), return -1 if it is not supported on this platform
+    int pinThread(std::thread& th, unsigned core);
+}
+#endif
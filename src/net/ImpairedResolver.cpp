@@ -0,0 +1,206 @@
+#include "ImpairedResolver.h"
+#include "udp.h"
+#include "Log.h"
+#include <poll.h>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+using namespace std;
+
+namespace ucsmq{
+//how long the thread sleeps at most, i.e. how late it notices stop()
+#define IMPAIRED_RESOLVER_POLL_MS 50
+#define DNS_HEADER_LEN 12
+#define DNS_TC_BIT 0x02
+
+    int ImpairedResolver::start() {
+        if(running.load()) return -1;
+        listenfd = udpSocket(&listenAddr);
+        if(listenfd<0 || setNonBlocking(listenfd)<0){
+            LOG_PRINTF(LOG_ERROR,"failed to start ImpairedResolver at %s : %s",sockaddr_inStr(listenAddr).c_str(),getLastErrorMessage().c_str());
+            if(listenfd>=0) closeSocket(listenfd);
+            listenfd=-1;
+            return -1;
+        }
+        socklen_t len = sizeof(listenAddr);
+        getsockname(listenfd,(SA*)&listenAddr,&len);
+        random.seed(impairment.seed);
+        running.store(true);
+        thread=std::thread(&ImpairedResolver::forwarding,this);
+        return 1;
+    }
+
+    void ImpairedResolver::stop() {
+        if(!running.exchange(false)) return;
+        thread.join();
+        for(auto& client : clients){
+            closeSocket(client.upstreamfd);
+        }
+        clients.clear();
+        clientIndex.clear();
+        deliveries=decltype(deliveries)();
+        closeSocket(listenfd);
+        listenfd=-1;
+    }
+
+    void ImpairedResolver::forwarding() {
+        uint8_t buf[UDP_DATAGRAM_SIZE];
+        vector<pollfd> fds;
+        while (running.load()){
+            fds.resize(clients.size()+1);
+            fds[0]={listenfd,POLLIN,0};
+            for(size_t i=0;i<clients.size();i++){
+                fds[i+1]={clients[i].upstreamfd,POLLIN,0};
+            }
+            int timeout=IMPAIRED_RESOLVER_POLL_MS;
+            if(!deliveries.empty()){
+                auto wait = chrono::duration_cast<chrono::microseconds>(deliveries.top().due-chrono::steady_clock::now()).count();
+                timeout = wait<=0 ? 0 : min<int>(timeout,(int)((wait+999)/1000));
+            }
+            if(poll(fds.data(),fds.size(),timeout)<0 && errno!=EINTR){
+                LOG_PRINTF(LOG_ERROR,"ImpairedResolver : %s",getLastErrorMessage().c_str());
+                break;
+            }
+            if(fds[0].revents&POLLIN){
+                SA_IN addr;
+                ssize_t n;
+                while ((n=recvfromUdp(listenfd,buf,sizeof(buf),&addr))>=0){
+                    counters.queries.add();
+                    auto client = clientOf(addr);
+                    if(client== nullptr) continue;
+                    if(!allow(*client)){
+                        counters.rateLimited.add();
+                        continue;
+                    }
+                    if(impairment.refuses(buf,(size_t)n)){
+                        counters.refused.add();
+                        continue;
+                    }
+                    impair(client->upstreamfd,upstreamAddr,buf,(size_t)n);
+                }
+            }
+            for(size_t i=1;i<fds.size();i++){
+                if(!(fds[i].revents&POLLIN)) continue;
+                const auto& client = clients[i-1];
+                ssize_t n;
+                while ((n=recv(client.upstreamfd,(char*)buf,sizeof(buf),0))>=0){
+                    counters.responses.add();
+                    if(impairment.maxResponseSize>0 && (size_t)n>impairment.maxResponseSize && n>=DNS_HEADER_LEN){
+                        //what is left of it tells the client to retry over tcp, which the tunnel does not do
+                        counters.truncated.add();
+                        buf[2]|=DNS_TC_BIT;
+                        memset(buf+4,0,DNS_HEADER_LEN-4);
+                        n=DNS_HEADER_LEN;
+                    }
+                    impair(-1,client.addr,buf,(size_t)n);
+                }
+            }
+            deliverDue();
+        }
+    }
+
+    ImpairedResolver::Client *ImpairedResolver::clientOf(const SA_IN &addr) {
+        auto key = make_pair(addr.sin_addr.s_addr,addr.sin_port);
+        auto it = clientIndex.find(key);
+        if(it!=clientIndex.end()) return &clients[it->second];
+        int fd = dialUdp(upstreamAddr, nullptr);
+        if(fd<0 || setNonBlocking(fd)<0){
+            LOG_PRINTF(LOG_ERROR,"ImpairedResolver failed to open an upstream socket : %s",getLastErrorMessage().c_str());
+            if(fd>=0) closeSocket(fd);
+            return nullptr;
+        }
+        clientIndex.emplace(key,clients.size());
+        clients.push_back({addr,fd,impairment.qpsLimit,chrono::steady_clock::now()});
+        return &clients.back();
+    }
+
+    //a bucket of a second of queries, refilled at the qps limit
+    bool ImpairedResolver::allow(Client &client) {
+        if(impairment.qpsLimit<=0) return true;
+        auto now = chrono::steady_clock::now();
+        client.tokens=min(impairment.qpsLimit,client.tokens+chrono::duration<double>(now-client.refilled).count()*impairment.qpsLimit);
+        client.refilled=now;
+        if(client.tokens<1) return false;
+        client.tokens-=1;
+        return true;
+    }
+
+    static bool chance(Random& random,double rate){
+        if(rate<=0) return false;
+        return (double)(random.next()>>11)*0x1.0p-53<rate;
+    }
+
+    ImpairmentDraw Impairment::draw(Random &random) const {
+        ImpairmentDraw d;
+        if(chance(random,lossRate)){
+            d.copies=0;
+            return d;
+        }
+        d.copies = chance(random,duplicateRate) ? 2 : 1;
+        for(int i=0;i<d.copies;i++){
+            d.delayMs[i] = latencyMs+jitterMs*(double)(random.next()>>11)*0x1.0p-53;
+            if(chance(random,reorderRate)){
+                d.reordered++;
+                d.delayMs[i]+=reorderDelayMs;
+            }
+        }
+        return d;
+    }
+
+    bool Impairment::refuses(const uint8_t *query, size_t size) const {
+        if(maxQueryNameLen==0 || size<DNS_HEADER_LEN) return false;
+        size_t questions = (size_t)(query[4]<<8|query[5]),pos=DNS_HEADER_LEN;
+        for(size_t i=0;i<questions && pos<size;i++){
+            size_t start=pos;
+            //a pointer ends the name, it is not followed
+            while (pos<size && query[pos]!=0 && (query[pos]&0xc0)==0) pos+=1+query[pos];
+            pos+= pos<size && query[pos]!=0 ? 2 : 1;
+            if(pos-start>maxQueryNameLen) return true;
+            pos+=2*sizeof(uint16_t);
+        }
+        return false;
+    }
+
+    void ImpairedResolver::impair(int upstreamfd, const SA_IN &addr, const uint8_t *data, size_t size) {
+        auto d = impairment.draw(random);
+        if(d.copies==0){
+            counters.lost.add();
+            return;
+        }
+        if(d.copies>1) counters.duplicated.add();
+        counters.reordered.add(d.reordered);
+        auto now = chrono::steady_clock::now();
+        for(int i=0;i<d.copies;i++){
+            auto due = now+chrono::microseconds((int64_t)llround(d.delayMs[i]*1000));
+            deliveries.push({due,order++,upstreamfd,addr,vector<uint8_t>(data,data+size)});
+        }
+        deliverDue();
+    }
+
+    void ImpairedResolver::deliverDue() {
+        auto now = chrono::steady_clock::now();
+        while (!deliveries.empty() && deliveries.top().due<=now){
+            const auto& d = deliveries.top();
+            //a full socket buffer drops the datagram, as a congested resolver would
+            if(d.upstreamfd<0){
+                sendtoUdp(listenfd,d.data.data(),d.data.size(),d.addr);
+            }else{
+                sendUdp(d.upstreamfd,d.data.data(),d.data.size());
+            }
+            deliveries.pop();
+        }
+    }
+
+    ImpairedResolverStats ImpairedResolver::stats() const {
+        ImpairedResolverStats s;
+        s.queries=counters.queries.value();
+        s.responses=counters.responses.value();
+        s.lost=counters.lost.value();
+        s.reordered=counters.reordered.value();
+        s.duplicated=counters.duplicated.value();
+        s.rateLimited=counters.rateLimited.value();
+        s.truncated=counters.truncated.value();
+        s.refused=counters.refused.value();
+        return s;
+    }
+}
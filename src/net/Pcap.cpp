@@ -0,0 +1,247 @@
+#include "Pcap.h"
+#include "Log.h"
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+using namespace std;
+
+namespace ucsmq{
+#define PCAP_MAGIC 0xa1b2c3d4u
+#define PCAP_MAGIC_NS 0xa1b23c4du
+#define PCAP_FILE_HEADER_LEN 24
+#define PCAP_RECORD_HEADER_LEN 16
+#define PCAPNG_MAGIC 0x0a0d0d0au
+#define LINKTYPE_NULL 0
+#define LINKTYPE_ETHERNET 1
+#define LINKTYPE_RAW 101
+#define LINKTYPE_LINUX_SLL 113
+#define LINKTYPE_IPV4 228
+#define LINKTYPE_LINUX_SLL2 276
+#define ETHERTYPE_IPV4 0x0800
+#define ETHERTYPE_VLAN 0x8100
+#define ETHERTYPE_QINQ 0x88a8
+#define IPV4_HEADER_LEN 20
+#define UDP_HEADER_LEN 8
+#define IPPROTO_UDP_NUMBER 17
+
+    static void put16(uint8_t* p,uint16_t v){
+        p[0]=(uint8_t)(v>>8);
+        p[1]=(uint8_t)v;
+    }
+
+    static uint16_t get16(const uint8_t* p){
+        return (uint16_t)(p[0]<<8|p[1]);
+    }
+
+    static uint16_t ipChecksum(const uint8_t* p,size_t n){
+        uint32_t sum=0;
+        for(size_t i=0;i+1<n;i+=2){
+            sum+=get16(p+i);
+        }
+        while (sum>>16){
+            sum=(sum&0xffff)+(sum>>16);
+        }
+        return (uint16_t)~sum;
+    }
+
+    int PcapWriter::open(const string &path) {
+        close();
+        file=fopen(path.c_str(),"wb");
+        if(file== nullptr){
+            LOG_PRINTF(LOG_ERROR,"failed to open %s : %s",path.c_str(),strerror(errno));
+            return -1;
+        }
+        //in the byte order of this host, readers tell it from the magic
+        uint32_t header[6]={PCAP_MAGIC,0,0,0,PCAP_SNAPLEN,LINKTYPE_RAW};
+        //version 2.4
+        uint16_t version[2]={2,4};
+        memcpy(&header[1],version,sizeof(version));
+        auto p = (const uint8_t*)header;
+        lock_guard<mutex> guard(lock);
+        buffer.assign(p,p+PCAP_FILE_HEADER_LEN);
+        buffer.reserve(PCAP_WRITE_BUFFER_SIZE+UDP_DATAGRAM_SIZE);
+        count=0;
+        return 1;
+    }
+
+    void PcapWriter::close() {
+        lock_guard<mutex> guard(lock);
+        if(file== nullptr) return;
+        flushLocked();
+        fclose(file);
+        file= nullptr;
+    }
+
+    void PcapWriter::flushLocked() {
+        if(buffer.empty()) return;
+        if(fwrite(buffer.data(),1,buffer.size(),file)!=buffer.size()){
+            LOG_PRINTF(LOG_ERROR,"failed to write the capture : %s",strerror(errno));
+        }
+        buffer.clear();
+    }
+
+    void PcapWriter::append(const void *data, size_t n, const SA_IN &source, const SA_IN &destination, uint64_t time) {
+        if(n>PCAP_SNAPLEN-IPV4_HEADER_LEN-UDP_HEADER_LEN) n=PCAP_SNAPLEN-IPV4_HEADER_LEN-UDP_HEADER_LEN;
+        size_t len = IPV4_HEADER_LEN+UDP_HEADER_LEN+n;
+        uint32_t record[4]={(uint32_t)(time/1000000000),(uint32_t)(time%1000000000/1000),(uint32_t)len,(uint32_t)len};
+        auto at = buffer.size();
+        buffer.resize(at+PCAP_RECORD_HEADER_LEN+len);
+        auto p = buffer.data()+at;
+        memcpy(p,record,PCAP_RECORD_HEADER_LEN);
+        auto ip = p+PCAP_RECORD_HEADER_LEN;
+        memset(ip,0,IPV4_HEADER_LEN+UDP_HEADER_LEN);
+        ip[0]=0x45;
+        put16(ip+2,(uint16_t)len);
+        //don't fragment
+        ip[6]=0x40;
+        ip[8]=64;
+        ip[9]=IPPROTO_UDP_NUMBER;
+        memcpy(ip+12,&source.sin_addr.s_addr,4);
+        memcpy(ip+16,&destination.sin_addr.s_addr,4);
+        put16(ip+10,ipChecksum(ip,IPV4_HEADER_LEN));
+        auto udp = ip+IPV4_HEADER_LEN;
+        //the ports are in network order already, the checksum is optional over IPv4
+        memcpy(udp,&source.sin_port,2);
+        memcpy(udp+2,&destination.sin_port,2);
+        put16(udp+4,(uint16_t)(UDP_HEADER_LEN+n));
+        memcpy(udp+UDP_HEADER_LEN,data,n);
+        count++;
+    }
+
+    static uint64_t wallNanos(){
+        return (uint64_t)chrono::duration_cast<chrono::nanoseconds>(chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    void PcapWriter::write(const void *data, size_t n, const SA_IN &source, const SA_IN &destination) {
+        auto time = wallNanos();
+        lock_guard<mutex> guard(lock);
+        if(file== nullptr) return;
+        append(data,n,source,destination,time);
+        if(buffer.size()>=PCAP_WRITE_BUFFER_SIZE) flushLocked();
+    }
+
+    void PcapWriter::writeBatch(UdpBatch &batch, const SA_IN &local, bool received) {
+        if(batch.size()==0) return;
+        auto time = wallNanos();
+        lock_guard<mutex> guard(lock);
+        if(file== nullptr) return;
+        for(size_t i=0;i<batch.size();i++){
+            if(received) append(batch.data(i),batch.len(i),batch.addr(i),local,time);
+            else append(batch.data(i),batch.len(i),local,batch.addr(i),time);
+        }
+        if(buffer.size()>=PCAP_WRITE_BUFFER_SIZE) flushLocked();
+    }
+
+    uint64_t PcapWriter::datagrams() {
+        lock_guard<mutex> guard(lock);
+        return count;
+    }
+
+    static uint32_t swap32(uint32_t v){
+        return (v>>24)|((v>>8)&0xff00)|((v<<8)&0xff0000)|(v<<24);
+    }
+
+    //the offset of the IPv4 header in a frame, -1 if the frame holds something else
+    static long ipOffset(uint32_t linkType,const uint8_t* p,size_t n){
+        switch (linkType) {
+            case LINKTYPE_NULL:
+                //the address family in the byte order of the capturing host
+                if(n<4 || (p[0]!=AF_INET && p[3]!=AF_INET)) return -1;
+                return 4;
+            case LINKTYPE_ETHERNET:{
+                size_t off=12;
+                while (off+2<=n){
+                    auto type = get16(p+off);
+                    if(type==ETHERTYPE_IPV4) return (long)off+2;
+                    if(type!=ETHERTYPE_VLAN && type!=ETHERTYPE_QINQ) return -1;
+                    off+=4;
+                }
+                return -1;
+            }
+            case LINKTYPE_LINUX_SLL:
+                return n>=16 && get16(p+14)==ETHERTYPE_IPV4 ? 16 : -1;
+            case LINKTYPE_LINUX_SLL2:
+                return n>=20 && get16(p)==ETHERTYPE_IPV4 ? 20 : -1;
+            //DLT_RAW is 12 or 14 on some systems
+            case 12:
+            case 14:
+            case LINKTYPE_RAW:
+            case LINKTYPE_IPV4:
+                return 0;
+            default:
+                return -1;
+        }
+    }
+
+    int readPcap(const string &path, vector<PcapDatagram> &datagrams, PcapStats *stats) {
+        ifstream in(path,ios::binary);
+        uint32_t header[6];
+        if(!in.read((char*)header,PCAP_FILE_HEADER_LEN)){
+            LOG_PRINTF(LOG_ERROR,"%s is not a pcap file",path.c_str());
+            return -1;
+        }
+        bool swapped=false,nanos=false;
+        switch (header[0]) {
+            case PCAP_MAGIC: break;
+            case PCAP_MAGIC_NS: nanos=true; break;
+            default:
+                swapped=true;
+                nanos= swap32(header[0])==PCAP_MAGIC_NS;
+                if(swap32(header[0])!=PCAP_MAGIC && !nanos){
+                    if(header[0]==PCAPNG_MAGIC) LOG_PRINTF(LOG_ERROR,"%s is pcapng, save it as pcap first",path.c_str());
+                    else LOG_PRINTF(LOG_ERROR,"%s is not a pcap file",path.c_str());
+                    return -1;
+                }
+        }
+        auto host = [swapped](uint32_t v){return swapped ? swap32(v) : v;};
+        uint32_t linkType = host(header[5])&0xffff;
+        PcapStats s;
+        vector<uint8_t> frame;
+        uint32_t record[4];
+        while (in.read((char*)record,PCAP_RECORD_HEADER_LEN)){
+            uint32_t captured = host(record[2]),original = host(record[3]);
+            frame.resize(captured);
+            if(!in.read((char*)frame.data(),captured)) break;
+            s.frames++;
+            auto p = frame.data();
+            auto off = ipOffset(linkType,p,captured);
+            if(off<0 || captured<(size_t)off+IPV4_HEADER_LEN || (p[off]>>4)!=4){
+                s.notIpv4++;
+                continue;
+            }
+            auto ip = p+off;
+            size_t ihl = (size_t)(ip[0]&0x0f)*4;
+            if(ip[9]!=IPPROTO_UDP_NUMBER){
+                s.notUdp++;
+                continue;
+            }
+            //more fragments, or not the first one
+            if((get16(ip+6)&0x3fff)!=0){
+                s.fragments++;
+                continue;
+            }
+            size_t ipLen = min<size_t>(get16(ip+2),captured-off);
+            if(captured<original || ipLen<ihl+UDP_HEADER_LEN || get16(ip+ihl+4)<UDP_HEADER_LEN || get16(ip+ihl+4)>ipLen-ihl){
+                s.truncated++;
+                continue;
+            }
+            auto udp = ip+ihl;
+            size_t n = get16(udp+4)-UDP_HEADER_LEN;
+            PcapDatagram d;
+            d.time=(uint64_t)host(record[0])*1000000000+(uint64_t)host(record[1])*(nanos ? 1 : 1000);
+            SET_ZERO(d.source);
+            d.source.sin_family=AF_INET;
+            d.destination=d.source;
+            memcpy(&d.source.sin_addr.s_addr,ip+12,4);
+            memcpy(&d.destination.sin_addr.s_addr,ip+16,4);
+            memcpy(&d.source.sin_port,udp,2);
+            memcpy(&d.destination.sin_port,udp+2,2);
+            d.payload.assign(udp+UDP_HEADER_LEN,udp+UDP_HEADER_LEN+n);
+            datagrams.push_back(std::move(d));
+            s.datagrams++;
+        }
+        if(stats!= nullptr) *stats=s;
+        return 1;
+    }
+}
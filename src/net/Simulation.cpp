@@ -0,0 +1,301 @@
+#include "Simulation.h"
+#include "EventLoop.h"
+#include "Log.h"
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+using namespace std;
+
+namespace ucsmq{
+//rounds at one instant before the simulation gives up, something keeps posting without ever waiting
+#define SIMULATION_MAX_ROUNDS 1000000
+#define DNS_HEADER_LEN 12
+#define DNS_QR_BIT 0x80
+#define DNS_TC_BIT 0x02
+#define UDP_MAX_PAYLOAD 65507
+
+    SimNetwork::SimNetwork(uint64_t seed) : nextFd(SIMULATION_FD_BASE),nextPort(SIMULATION_EPHEMERAL_PORT),order(0),random(seed){}
+
+    SimNetwork::Socket *SimNetwork::find(int fd) {
+        auto it = sockets.find(fd);
+        if(it==sockets.end()){
+            errno=EBADF;
+            return nullptr;
+        }
+        return &it->second;
+    }
+
+    int SimNetwork::bind(int fd, const SA_IN &addr, bool reusePort) {
+        auto& fds = bound[keyOf(addr)];
+        for(int other : fds){
+            if(!reusePort || !sockets[other].reusePort){
+                errno=EADDRINUSE;
+                return -1;
+            }
+        }
+        fds.push_back(fd);
+        auto& socket = sockets[fd];
+        socket.addr=addr;
+        socket.reusePort=reusePort;
+        return 1;
+    }
+
+    int SimNetwork::open(const SA_IN *addr, bool reusePort) {
+        int fd = nextFd++;
+        auto& socket = sockets[fd];
+        socket.connected=socket.shut=false;
+        SA_IN local = addr!= nullptr ? *addr : ADDR_ZERO;
+        local.sin_family=AF_INET;
+        if(local.sin_port==0){
+            //the ports are handed out in order, so are they in every run of a seed
+            do{
+                local.sin_port=htons(nextPort++);
+                if(nextPort==0) nextPort=SIMULATION_EPHEMERAL_PORT;
+            } while (bound.count(keyOf(local))>0);
+        }
+        if(bind(fd,local,reusePort)<0){
+            sockets.erase(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    int SimNetwork::connect(int fd, const SA_IN &addr) {
+        auto socket = find(fd);
+        if(socket== nullptr) return -1;
+        socket->peer=addr;
+        socket->connected=true;
+        return 0;
+    }
+
+    //the same bucket of a second of queries as ImpairedResolver, in virtual time
+    bool SimNetwork::allow(const SA_IN &source) {
+        if(impairment.qpsLimit<=0) return true;
+        auto now = Clock::now();
+        auto it = buckets.find(keyOf(source));
+        if(it==buckets.end()) it = buckets.emplace(keyOf(source),Bucket{impairment.qpsLimit,now}).first;
+        auto& bucket = it->second;
+        bucket.tokens=min(impairment.qpsLimit,bucket.tokens+chrono::duration<double>(now-bucket.refilled).count()*impairment.qpsLimit);
+        bucket.refilled=now;
+        if(bucket.tokens<1) return false;
+        bucket.tokens-=1;
+        return true;
+    }
+
+    ssize_t SimNetwork::sendto(int fd, const void *src, size_t size, const SA_IN *addr) {
+        auto socket = find(fd);
+        if(socket== nullptr) return -1;
+        if(socket->shut){
+            errno=EPIPE;
+            return -1;
+        }
+        if(addr== nullptr && !socket->connected){
+            errno=ENOTCONN;
+            return -1;
+        }
+        if(size>UDP_MAX_PAYLOAD){
+            errno=EMSGSIZE;
+            return -1;
+        }
+        counters.datagrams++;
+        Datagram datagram{socket->addr,vector<uint8_t>((const uint8_t*)src,(const uint8_t*)src+size)};
+        auto& data = datagram.data;
+        //the limits of a resolver apply to the queries or to the responses, told apart by the QR bit
+        if(size>=DNS_HEADER_LEN){
+            bool response = (data[2]&DNS_QR_BIT)!=0;
+            if(!response && !allow(socket->addr)){
+                counters.rateLimited++;
+                return (ssize_t)size;
+            }
+            if(!response && impairment.refuses(data.data(),size)){
+                counters.refused++;
+                return (ssize_t)size;
+            }
+            if(response && impairment.maxResponseSize>0 && size>impairment.maxResponseSize){
+                counters.truncated++;
+                data[2]|=DNS_TC_BIT;
+                memset(data.data()+4,0,DNS_HEADER_LEN-4);
+                data.resize(DNS_HEADER_LEN);
+            }
+        }
+        auto draw = impairment.draw(random);
+        if(draw.copies==0){
+            counters.lost++;
+            return (ssize_t)size;
+        }
+        if(draw.copies>1) counters.duplicated++;
+        counters.reordered+=draw.reordered;
+        auto now = Clock::now();
+        auto to = addr!= nullptr ? *addr : socket->peer;
+        for(int i=0;i<draw.copies;i++){
+            auto us = max<int64_t>(SIMULATION_MIN_DELAY_US,(int64_t)llround(draw.delayMs[i]*1000));
+            inFlight.push({now+chrono::microseconds(us),order++,to,i+1<draw.copies ? datagram : std::move(datagram)});
+        }
+        return (ssize_t)size;
+    }
+
+    ssize_t SimNetwork::recvfrom(int fd, void *dst, size_t size, SA_IN *addr) {
+        auto socket = find(fd);
+        if(socket== nullptr) return -1;
+        if(socket->inbox.empty()){
+            errno=EAGAIN;
+            return -1;
+        }
+        auto& datagram = socket->inbox.front();
+        //the rest of a datagram larger than dst is lost, as with a real socket
+        size_t n = min(size,datagram.data.size());
+        memcpy(dst,datagram.data.data(),n);
+        if(addr!= nullptr) *addr=datagram.from;
+        socket->inbox.pop_front();
+        return (ssize_t)n;
+    }
+
+    int SimNetwork::shutdown(int fd) {
+        auto socket = find(fd);
+        if(socket== nullptr) return -1;
+        socket->shut=true;
+        return 0;
+    }
+
+    int SimNetwork::close(int fd) {
+        auto socket = find(fd);
+        if(socket== nullptr) return -1;
+        auto it = bound.find(keyOf(socket->addr));
+        if(it!=bound.end()){
+            auto& fds = it->second;
+            fds.erase(std::remove(fds.begin(),fds.end(),fd),fds.end());
+            if(fds.empty()) bound.erase(it);
+        }
+        sockets.erase(fd);
+        return 0;
+    }
+
+    bool SimNetwork::readable(int fd) const {
+        auto it = sockets.find(fd);
+        return it!=sockets.end() && !it->second.inbox.empty();
+    }
+
+    //a socket bound to any address answers from every address of the host, there is only one
+    static bool sameEndpoint(const SA_IN& a,const SA_IN& b){
+        if(a.sin_port!=b.sin_port) return false;
+        return a.sin_addr.s_addr==b.sin_addr.s_addr || a.sin_addr.s_addr==INADDR_ANY || b.sin_addr.s_addr==INADDR_ANY;
+    }
+
+    int SimNetwork::receiver(const SA_IN &from, const SA_IN &to) {
+        auto it = bound.find(keyOf(to));
+        if(it==bound.end()) it = bound.find(Key(INADDR_ANY,to.sin_port));
+        if(it==bound.end()) return -1;
+        const auto& fds = it->second;
+        //a source sticks to one of the sockets sharing the port
+        uint64_t h = ((uint64_t)from.sin_addr.s_addr<<16|from.sin_port)*0x9e3779b97f4a7c15ull;
+        int fd = fds[(h>>32)%fds.size()];
+        const auto& socket = sockets[fd];
+        //a connected socket only hears from its peer
+        if(socket.shut || (socket.connected && !sameEndpoint(socket.peer,from))) return -1;
+        return fd;
+    }
+
+    size_t SimNetwork::deliver(Clock::time_point now) {
+        size_t n=0;
+        while (!inFlight.empty() && inFlight.top().due<=now){
+            //the priority queue only hands out const references, the datagram is copied once on its way out
+            auto d = inFlight.top();
+            inFlight.pop();
+            int fd = receiver(d.datagram.from,d.to);
+            if(fd<0 || sockets[fd].inbox.size()>=SIMULATION_SOCKET_QUEUE){
+                counters.unreachable++;
+                continue;
+            }
+            sockets[fd].inbox.push_back(std::move(d.datagram));
+            counters.delivered++;
+            n++;
+        }
+        return n;
+    }
+
+    bool SimNetwork::nextArrival(Clock::time_point &t) const {
+        if(inFlight.empty()) return false;
+        t=inFlight.top().due;
+        return true;
+    }
+
+    Simulation* Simulation::currentSimulation= nullptr;
+
+    Simulation::Simulation(uint64_t seed) : net(seed),startTime(SIMULATION_START_TIME) {
+        if(currentSimulation!= nullptr) LOG_PRINTF(LOG_ERROR,"a Simulation is already running");
+        currentSimulation=this;
+        Clock::useVirtual(true,startTime);
+        DatagramTransport::install(&net);
+        Random::seedAll(seed);
+    }
+
+    Simulation::~Simulation() {
+        //the loops of channels not closed yet run what is left, then they run nowhere
+        auto left = loops;
+        for(auto loop : left){
+            loop->stop();
+        }
+        DatagramTransport::install(nullptr);
+        Clock::useVirtual(false);
+        currentSimulation= nullptr;
+    }
+
+    void Simulation::add(EventLoop *loop) {
+        loops.push_back(loop);
+    }
+
+    void Simulation::remove(EventLoop *loop) {
+        loops.erase(std::remove(loops.begin(),loops.end(),loop),loops.end());
+    }
+
+    bool Simulation::runRound() {
+        bool ran=false;
+        auto readable = [this](int fd){return net.readable(fd);};
+        //by index, a round may start or stop loops
+        for(size_t i=0;i<loops.size();i++){
+            if(loops[i]->simulate(readable)>0) ran=true;
+        }
+        if(net.deliver(Clock::now())>0) ran=true;
+        return ran;
+    }
+
+    bool Simulation::nextEvent(Clock::time_point &t) const {
+        bool any = net.nextArrival(t);
+        for(auto loop : loops){
+            Clock::time_point timer;
+            if(!loop->nextTimer(timer)) continue;
+            if(!any || timer<t) t=timer;
+            any=true;
+        }
+        return any;
+    }
+
+    bool Simulation::runUntil(const function<bool()> &done, Clock::duration timeout) {
+        auto deadline = Clock::now()+timeout;
+        size_t rounds=0;
+        while (!done()){
+            if(!runRound()){
+                Clock::time_point next;
+                if(!nextEvent(next) || next>deadline){
+                    Clock::advanceTo(deadline);
+                    return done();
+                }
+                if(next>Clock::now()){
+                    Clock::advanceTo(next);
+                    rounds=0;
+                    continue;
+                }
+            }
+            if(++rounds>=SIMULATION_MAX_ROUNDS){
+                LOG_PRINTF(LOG_ERROR,"the simulation does not move past %.3f s",chrono::duration<double>(elapsed()).count());
+                return done();
+            }
+        }
+        return true;
+    }
+
+    void Simulation::runFor(Clock::duration d) {
+        runUntil([](){return false;},d);
+    }
+}
@@ -1,6 +1,10 @@
 #include "net.h"
+#include "Transport.h"
 #include <cstring>
 #include "../lib/strings.h"
+#ifndef WIN32
+#include <fcntl.h>
+#endif
 
 namespace ucsmq{
     SA_IN inetAddr(const char *addrStr, unsigned short port) {
@@ -40,6 +44,7 @@ namespace ucsmq{
     }
 
     int closeSocket(int sockfd) {
+        if(auto transport = DatagramTransport::of(sockfd)) return transport->close(sockfd);
 #ifdef WIN32
         return closesocket(sockfd);
 #else
@@ -47,6 +52,27 @@ namespace ucsmq{
 #endif
     }
 
+    int shutdownSocket(int sockfd) {
+        if(auto transport = DatagramTransport::of(sockfd)) return transport->shutdown(sockfd);
+#ifdef WIN32
+        return shutdown(sockfd,SD_BOTH);
+#else
+        return shutdown(sockfd,SHUT_RDWR);
+#endif
+    }
+
+    int listenTcp(const SA_IN &addr, int backlog) {
+        int sockfd = (int)socket(AF_INET,SOCK_STREAM,0);
+        if(sockfd<0) return -1;
+        int on=1;
+        setsockopt(sockfd,SOL_SOCKET,SO_REUSEADDR,(const char*)&on,sizeof(on));
+        if(bind(sockfd,(const SA*)&addr,sizeof(addr))<0 || listen(sockfd,backlog)<0){
+            closeSocket(sockfd);
+            return -1;
+        }
+        return sockfd;
+    }
+
     std::vector<Bytes> cstrToDomain(const char *str) {
         const std::vector<std::string> &strs = splitString(str, '.');
         std::vector<Bytes> v;
@@ -57,12 +83,26 @@ namespace ucsmq{
     }
 
     int setSocketTimeout(int sockfd, int seconds) {
+        //the sockets of a transport never block, there is nothing to time out
+        if(DatagramTransport::of(sockfd)!= nullptr) return 0;
         struct timeval timeout;
         timeout.tv_sec = seconds;
         timeout.tv_usec = 0;
         return setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout));
     }
 
+    int setNonBlocking(int sockfd) {
+        if(auto transport = DatagramTransport::of(sockfd)) return transport->setNonBlocking(sockfd);
+#ifdef WIN32
+        u_long on=1;
+        return ioctlsocket(sockfd,FIONBIO,&on);
+#else
+        int flags = fcntl(sockfd,F_GETFL,0);
+        if(flags<0) return -1;
+        return fcntl(sockfd,F_SETFL,flags|O_NONBLOCK);
+#endif
+    }
+
     int isTimeOut() {
 #ifdef WIN32
         return WSAGetLastError() == WSAETIMEDOUT;
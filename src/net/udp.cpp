@@ -1,8 +1,11 @@
 #include "udp.h"
+#include "Transport.h"
 #include <iostream>
 #include <cstring>
 
 namespace ucsmq{
+    DatagramTransport* DatagramTransport::current= nullptr;
+
 #ifdef WIN32
     static int initWSA(){
         static int shouldWsa=1;
@@ -18,7 +21,8 @@ namespace ucsmq{
     }
 #endif
 
-    int udpSocket(const SA_IN *pAddr){
+    int udpSocket(const SA_IN *pAddr,bool reusePort){
+        if(auto transport = DatagramTransport::installed()) return transport->open(pAddr,reusePort);
 #ifdef WIN32
         if(initWSA()<0){
             return -1;
@@ -29,6 +33,20 @@ namespace ucsmq{
             std::cerr<<"Could not create socket"<<std::endl;
             return -1;
         }
+        if(reusePort){
+#ifdef SO_REUSEPORT
+            int on=1;
+            if(setsockopt(sockfd,SOL_SOCKET,SO_REUSEPORT,(char*)&on,sizeof(on))<0){
+                std::cerr<<"SO_REUSEPORT failed :"<< getLastErrorMessage() <<std::endl;
+                closeSocket(sockfd);
+                return -1;
+            }
+#else
+            std::cerr<<"SO_REUSEPORT is not supported on this platform"<<std::endl;
+            closeSocket(sockfd);
+            return -1;
+#endif
+        }
         if(pAddr!= nullptr){
             if (bind(sockfd, (SA *)pAddr, sizeof(SA_IN)) < 0) {
                 std::cerr<<"Bind failed :"<< getLastErrorMessage() <<std::endl;
@@ -39,6 +57,14 @@ namespace ucsmq{
     }
 
     int dialUdp(const SA_IN &remoteAddr, const SA_IN *pLocalAddr) {
+        if(auto transport = DatagramTransport::installed()){
+            int sockfd = transport->open(pLocalAddr,false);
+            if(sockfd>=0 && transport->connect(sockfd,remoteAddr)<0){
+                transport->close(sockfd);
+                return -1;
+            }
+            return sockfd;
+        }
 #ifdef WIN32
         if(initWSA()<0){
             return -1;
@@ -65,19 +91,23 @@ namespace ucsmq{
 
 
     ssize_t recvfromUdp(int sockfd, void* dst, size_t size, SA_IN* addr){
+        if(auto transport = DatagramTransport::of(sockfd)) return transport->recvfrom(sockfd,dst,size,addr);
         socklen_t len = sizeof(SA_IN);
         return recvfrom(sockfd,(char*)dst,size,0,(SA*)addr,&len);
     }
 
     ssize_t sendtoUdp(int sockfd, const void *src, size_t size, const SA_IN &addr) {
+        if(auto transport = DatagramTransport::of(sockfd)) return transport->sendto(sockfd,src,size,&addr);
         return sendto(sockfd,(char*)src,size,0,(SA*)&addr,sizeof(addr));
     }
 
     ssize_t sendUdp(int sockfd, const void *src, size_t size) {
+        if(auto transport = DatagramTransport::of(sockfd)) return transport->sendto(sockfd,src,size, nullptr);
         return send(sockfd,(char*)src,size,0);
     }
 
     ssize_t recvUdp(int sockfd, void *dst, size_t size,int timeout) {
+        if(auto transport = DatagramTransport::of(sockfd)) return transport->recvfrom(sockfd,dst,size, nullptr);
         if(timeout>0){
             if (setSocketTimeout(sockfd, timeout)<0){
                 return -1;
@@ -94,6 +124,150 @@ namespace ucsmq{
         }
         return n;
     }
+
+    UdpBatch::UdpBatch(size_t capacity, size_t bufSize_) :
+            bufSize(bufSize_),count(0),buffers(capacity*bufSize_),lens(capacity,0),addrs(capacity,ADDR_ZERO){
+#ifdef __linux__
+        hdrs.resize(capacity);
+        iovs.resize(capacity);
+        for(size_t i=0;i<capacity;i++){
+            iovs[i].iov_base=data(i);
+            iovs[i].iov_len=bufSize;
+            memset(&hdrs[i],0,sizeof(mmsghdr));
+            hdrs[i].msg_hdr.msg_name=&addrs[i];
+            hdrs[i].msg_hdr.msg_namelen=sizeof(SA_IN);
+            hdrs[i].msg_hdr.msg_iov=&iovs[i];
+            hdrs[i].msg_hdr.msg_iovlen=1;
+        }
+#endif
+    }
+
+    bool UdpBatch::add(size_t len, const SA_IN &addr) {
+        if(len==0 || len>bufSize || full()) return false;
+        lens[count]=len;
+        addrs[count]=addr;
+        count++;
+        return true;
+    }
+
+    ssize_t recvBatch(int sockfd, UdpBatch &batch) {
+        batch.count=0;
+        if(auto transport = DatagramTransport::of(sockfd)){
+            while (!batch.full()){
+                auto n = transport->recvfrom(sockfd,batch.back(),batch.bufSize,&batch.addrs[batch.count]);
+                if(n<0) break;
+                batch.lens[batch.count++]=n;
+            }
+            return batch.count>0 ? (ssize_t)batch.count : -1;
+        }
+#ifdef __linux__
+        for(size_t i=0;i<batch.capacity();i++){
+            batch.iovs[i].iov_len=batch.bufSize;
+            batch.hdrs[i].msg_hdr.msg_namelen=sizeof(SA_IN);
+        }
+        int n = recvmmsg(sockfd,batch.hdrs.data(),batch.capacity(),MSG_WAITFORONE, nullptr);
+        if(n<0) return -1;
+        for(int i=0;i<n;i++){
+            batch.lens[i]=batch.hdrs[i].msg_len;
+        }
+        batch.count=n;
+#else
+        auto n = recvfromUdp(sockfd,batch.data(0),batch.bufSize,&batch.addrs[0]);
+        if(n<0) return -1;
+        batch.lens[0]=n;
+        batch.count=1;
+#ifndef WIN32
+        while (!batch.full()){
+            socklen_t len = sizeof(SA_IN);
+            n = recvfrom(sockfd,batch.back(),batch.bufSize,MSG_DONTWAIT,(SA*)&batch.addrs[batch.count],&len);
+            if(n<0) break;
+            batch.lens[batch.count++]=n;
+        }
+#endif
+#endif
+        return batch.count;
+    }
+
+    ssize_t sendBatch(int sockfd, UdpBatch &batch) {
+        size_t sent=0,dropped=0;
+        int firstErr=0;
+        //a datagram that can not be sent is skipped, the ones behind it are still sent
+        auto drop = [&](){
+            if(dropped++==0) firstErr=errno;
+        };
+        if(auto transport = DatagramTransport::of(sockfd)){
+            for(size_t i=0;i<batch.count;i++){
+                if(transport->sendto(sockfd,batch.data(i),batch.lens[i],&batch.addrs[i])<0) drop();
+                else sent++;
+            }
+        }else{
+#ifdef __linux__
+            for(size_t i=0;i<batch.count;i++){
+                batch.iovs[i].iov_len=batch.lens[i];
+                batch.hdrs[i].msg_hdr.msg_namelen=sizeof(SA_IN);
+            }
+            //sendmmsg stops at the first datagram failing, it fails alone on the next call
+            size_t next=0;
+            while (next<batch.count){
+                int n = sendmmsg(sockfd,batch.hdrs.data()+next,batch.count-next,0);
+                if(n<0){
+                    if(errno==EINTR) continue;
+                    drop();
+                    next++;
+                    continue;
+                }
+                sent+=n;
+                next+=n;
+            }
+#else
+            for(size_t i=0;i<batch.count;i++){
+                if(sendtoUdp(sockfd,batch.data(i),batch.lens[i],batch.addrs[i])<0) drop();
+                else sent++;
+            }
+#endif
+        }
+        batch.count=0;
+        if(dropped>0){
+            errno=firstErr;
+            return -1;
+        }
+        return (ssize_t)sent;
+    }
+
+    bool isDatagramDropped() {
+#ifdef WIN32
+        switch (WSAGetLastError()) {
+            case WSAEWOULDBLOCK:
+            case WSAENOBUFS:
+            case WSAEHOSTUNREACH:
+            case WSAENETUNREACH:
+            case WSAECONNRESET:
+            case WSAEMSGSIZE:
+            case WSAEADDRNOTAVAIL:
+                return true;
+            default:
+                return false;
+        }
+#else
+        switch (errno) {
+            case EAGAIN:
+#if EWOULDBLOCK!=EAGAIN
+            case EWOULDBLOCK:
+#endif
+            case ENOBUFS:
+            case EHOSTUNREACH:
+            case ENETUNREACH:
+            case ECONNREFUSED:
+            case EMSGSIZE:
+            case EINVAL:
+            case EPERM:
+            case EACCES:
+                return true;
+            default:
+                return false;
+        }
+#endif
+    }
 }
 
 
@@ -0,0 +1,121 @@
+#include "ClientReactor.h"
+#include "DnsClientChannel.h"
+#include "Log.h"
+#include "packetProcess.h"
+#include "Trace.h"
+using namespace std;
+
+namespace ucsmq{
+    ClientReactor::ClientReactor(size_t loopCount, bool shareSockets_, const SA_IN &localAddr_) :
+            nextLoop(0),started(false),shareSockets(shareSockets_),localAddr(localAddr_){
+        if(loopCount==0) loopCount=1;
+        for(size_t i=0;i<loopCount;i++){
+            loops.push_back(std::make_unique<ClientLoop>());
+        }
+    }
+
+    ClientReactor::~ClientReactor() {
+        stop();
+    }
+
+    int ClientReactor::start() {
+        lock_guard<mutex> guard(lock);
+        if(started) return 1;
+        started=true;
+        for(auto& cl : loops){
+            if(shareSockets){
+                //only the first loop binds the port of localAddr, the responses to a loop must come back to its own socket
+                SA_IN addr = localAddr;
+                if(cl!=loops.front()) addr.sin_port=0;
+                if((cl->sockfd=udpSocket(&addr))<0 || setNonBlocking(cl->sockfd)<0){
+                    LOG_PRINTF(LOG_ERROR,"failed to open the socket of ClientReactor : %s",getLastErrorMessage().c_str());
+                    stopLocked();
+                    return -1;
+                }
+                auto p = cl.get();
+                cl->loop.watch(cl->sockfd,[this,p](){receiveShared(*p);});
+                cl->loop.afterBurst=[this,p](){flush(*p);};
+            }
+            if(cl->loop.start()<0){
+                LOG_PRINTF(LOG_ERROR,"failed to start the loop of ClientReactor");
+                stopLocked();
+                return -1;
+            }
+        }
+        return 1;
+    }
+
+    void ClientReactor::stop() {
+        lock_guard<mutex> guard(lock);
+        stopLocked();
+    }
+
+    void ClientReactor::stopLocked() {
+        if(!started) return;
+        for(auto& cl : loops){
+            cl->loop.stop();
+            if(cl->sockfd>=0){
+                cl->loop.unwatch(cl->sockfd);
+                closeSocket(cl->sockfd);
+                cl->sockfd=-1;
+            }
+        }
+        started=false;
+    }
+
+    ClientLoop &ClientReactor::assign() {
+        return *loops[nextLoop.fetch_add(1)%loops.size()];
+    }
+
+    int ClientReactor::flush(ClientLoop &cl) {
+        if(cl.outBatch.size()==0) return 1;
+        if(sendBatch(cl.sockfd,cl.outBatch)<0){
+            if(isDatagramDropped()){
+                LOG_LIMITED(LOG_WARN,"queries dropped : %s",getLastErrorMessage().c_str());
+                cl.drops.add();
+                return 1;
+            }
+            LOG_PRINTF(LOG_ERROR,"%s",getLastErrorMessage().c_str());
+            for(auto& it : cl.channels){
+                it.second->err.store(DCCE_NETWORK_ERR);
+                it.second->closeBuffers();
+            }
+            return -1;
+        }
+        return 1;
+    }
+
+    uint64_t ClientReactor::droppedFlushes() const {
+        uint64_t n=0;
+        for(auto& cl : loops) n+=cl->drops.value();
+        return n;
+    }
+
+    void ClientReactor::receiveShared(ClientLoop &cl) {
+        while (true){
+            auto n = recvBatch(cl.sockfd,cl.inBatch);
+            if(n<=0) break;
+            for(size_t i=0;i<(size_t)n;i++){
+                Packet packet;
+                if(bytesToPacketResp(packet,cl.inBatch.data(i),cl.inBatch.len(i))<0){
+                    continue;
+                }
+                auto it = cl.channels.find(packet.sessionId);
+                if(it==cl.channels.end()){
+                    LOG_PRINTF(LOG_DEBUG,"response of unknown session %u",packet.sessionId);
+                    continue;
+                }
+                it->second->counters.wireBytesReceived.add(cl.inBatch.len(i));
+                TRACE_PACKET(TRACE_RESPONSE_RECEIVED,TRACE_CLIENT,packet,cl.inBatch.len(i));
+                it->second->onPacket(packet);
+            }
+            //a partial batch means the socket is drained
+            if(!cl.inBatch.full()) break;
+        }
+    }
+
+    ClientReactor &ClientReactor::defaultReactor() {
+        static ClientReactor reactor;
+        return reactor;
+    }
+}
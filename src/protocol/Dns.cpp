@@ -1,6 +1,5 @@
 #include "Dns.h"
 #include "Log.h"
-#include <unordered_map>
 #include <iostream>
 using namespace std;
 namespace ucsmq{
@@ -233,52 +232,150 @@ namespace ucsmq{
                 dns.additions.push_back(move(a));
             }
         }catch (DNSResolutionException& e){
-            Log::printf(LOG_ERROR,"%s : %s",__FUNCTION__ ,e.what());
+            LOG_PRINTF(LOG_ERROR,"%s : %s",__FUNCTION__ ,e.what());
             return (uint8_t*)buf-p;
         }
         return p-(uint8_t*)buf;
     }
 
-    using CompressMap = unordered_map<SimpleBytes,uint16_t ,SimpleBytes::HashCode,SimpleBytes::Equals>;
-
     void writeDomainPointer(BytesWriter& bw, uint16_t prevDomainOffset) {
         uint16_t pos=0xc000u;
         pos|=prevDomainOffset;
         bw.writeNum(pos);
     }
 
-    bool compressDomain(uint8_t* start, size_t n, uint16_t offset, BytesWriter& bw, CompressMap& cmap){
-        SimpleBytes domain(start,n);
-        auto prevDomain = cmap.find(domain);
-        if(prevDomain==cmap.end()) {
-            cmap.insert(make_pair(domain,offset));
-            return false;
+//every suffix of the names written so far, a full table only stops compressing
+#define COMPRESS_TABLE_SIZE 128
+#define MAX_COMPRESSED_LABELS 32
+#define MAX_POINTER_OFFSET 0x3fff
+
+    static uint32_t hashLabel(uint32_t h,const Bytes& label){
+        for(size_t i=0;i<label.size;i++){
+            h=(h^label.data[i])*16777619u;
         }
-        auto prevDomainOffset = prevDomain->second;
-        writeDomainPointer(bw.jmp(offset),prevDomainOffset);
-        return true;
+        return (h^(uint32_t)label.size)*16777619u;
     }
 
+    /*
+     * The names of the message by the hash of each of their suffixes. Offset 0 is the header, it marks a free slot.
+     * A hit is checked against the message itself, so a collision only costs a comparison.
+     * */
+    struct CompressTable{
+        struct Entry{
+            uint32_t hash;
+            uint16_t offset;
+        };
+        Entry entries[COMPRESS_TABLE_SIZE];
+        const uint8_t* msg;
+        explicit CompressTable(const void* msg_) : entries(),msg((const uint8_t*)msg_){}
+
+        void insert(uint32_t hash,size_t offset){
+            if(offset>MAX_POINTER_OFFSET) return;
+            for(size_t k=0;k<COMPRESS_TABLE_SIZE;k++){
+                auto& e = entries[(hash+k)&(COMPRESS_TABLE_SIZE-1)];
+                if(e.offset==0){
+                    e={hash,(uint16_t)offset};
+                    return;
+                }
+            }
+        }
+
+        //the offset of a written name spelling the labels [begin,end), 0 if there is none
+        template<class IT>
+        uint16_t find(uint32_t hash,IT begin,IT end) const {
+            for(size_t k=0;k<COMPRESS_TABLE_SIZE;k++){
+                auto& e = entries[(hash+k)&(COMPRESS_TABLE_SIZE-1)];
+                if(e.offset==0) return 0;
+                if(e.hash==hash && equals(e.offset,begin,end)) return e.offset;
+            }
+            return 0;
+        }
+
+        template<class IT>
+        bool equals(size_t offset,IT begin,IT end) const {
+            auto p = msg+offset;
+            for(auto it=begin;it!=end;++it){
+                //the names were written by us, a pointer always leads backwards
+                while((*p&0xc0)==0xc0) p=msg+(((p[0]&0x3f)<<8)|p[1]);
+                //exact bytes, a resolver checking the case of its question must get it back unchanged
+                if(*p!=it->size || memcmp(p+1,it->data,it->size)!=0) return false;
+                p+=1+*p;
+            }
+            while((*p&0xc0)==0xc0) p=msg+(((p[0]&0x3f)<<8)|p[1]);
+            return *p==0;
+        }
+    };
+
     template<class IT>
-    static size_t writeLabeledData(BytesWriter& bw,IT begin,IT end,bool append0,CompressMap& cmap){
-        auto n0 = bw.writen();
-        auto p0= bw.writep();
+    static void writeLabels(BytesWriter& bw,IT begin,IT end){
         for(auto it=begin;it!=end;++it ){
-            if(it->size>MAX_LABEL_LEN) Log::printf(LOG_WARN,"length of label exceeds : %u",it->size);
+            if(it->size>MAX_LABEL_LEN) LOG_LIMITED(LOG_WARN,"length of label exceeds : %u",it->size);
             bw.writeNum((uint8_t)it->size);
             bw.writeBytes(*it);
         }
-        if(append0) bw.writeNum((uint8_t)0);
-        size_t n = bw.writen()-n0;
-        if(compressDomain(p0,n,n0,bw,cmap)){
-            return 2;
+    }
+
+    //the longest suffix of the name already in the message becomes a pointer to it (RFC 1035 4.1.4)
+    template<class IT>
+    static void writeName(BytesWriter& bw,IT begin,IT end,CompressTable& table){
+        size_t count = end-begin;
+        if(count>MAX_COMPRESSED_LABELS){
+            writeLabels(bw,begin,end);
+            bw.writeNum((uint8_t)0);
+            return;
+        }
+        uint32_t hashes[MAX_COMPRESSED_LABELS];
+        uint32_t h=2166136261u;
+        for(size_t i=count;i-->0;){
+            h=hashLabel(h,begin[i]);
+            hashes[i]=h;
+        }
+        size_t i=0;
+        uint16_t target=0;
+        for(;i<count && target==0;i++){
+            target=table.find(hashes[i],begin+i,end);
+        }
+        size_t literal = target==0 ? count : i-1;
+        for(size_t k=0;k<literal;k++){
+            //a label cut off by a full buffer must not be pointed at
+            if(bw.writableBytes()>begin[k].size) table.insert(hashes[k],bw.writen());
+            writeLabels(bw,begin+k,begin+k+1);
+        }
+        if(target!=0){
+            writeDomainPointer(bw,target);
         }else{
-            return n;
+            bw.writeNum((uint8_t)0);
         }
     }
 
+    //the data of a record, its names compressed. Return its length on the wire
+    template<class IT>
+    static size_t writeRecordData(BytesWriter& bw,uint16_t type,IT begin,IT end,CompressTable& table){
+        auto n0 = bw.writen();
+        if(begin==end) return 0;
+        if(!USE_LABEL(type)){
+            bw.writeBytes(*begin);
+        }else{
+            if(type==MX){
+                bw.writeBytes(*begin++);
+            }
+            if(DATA_SHOULD_APPEND0(type)){
+                writeName(bw,begin,end,table);
+            }else{
+                //the strings of a TXT record are not a name, they are never compressed
+                writeLabels(bw,begin,end);
+            }
+        }
+        return bw.writen()-n0;
+    }
+
+    //the data length is only known once the data is written
+    static void patchDataLen(void* buf,size_t dataLenPos,size_t dataLen){
+        BytesWriter(static_cast<uint8_t*>(buf)+dataLenPos,sizeof(uint16_t)).writeNum((uint16_t)dataLen);
+    }
+
     ssize_t Dns::bytes(const Dns &dns, void *buf, size_t size) {
-        CompressMap cmap;
+        CompressTable table(buf);
         BytesWriter bw(buf,size);
         bw.writeNum(dns.transactionId);
         bw.writeNum(dns.flags);
@@ -288,29 +385,27 @@ namespace ucsmq{
         bw.writeNum(dns.additionalRRs);
 
         for(auto& q : dns.queries){
-            writeLabeledData(bw,q.question.begin(),q.question.end(), true,cmap);
+            writeName(bw,q.question.begin(),q.question.end(),table);
             bw.writeNum(q.queryType);
             bw.writeNum(q.queryClass);
         }
 
         for(auto& ans : dns.answers){
-            writeLabeledData(bw,ans.name.begin(),ans.name.end(), true,cmap);
+            writeName(bw,ans.name.begin(),ans.name.end(),table);
             bw.writeNum(ans.ansType);
             bw.writeNum(ans.ansClass);
             bw.writeNum(ans.ttl);
+            auto dataLenPos = bw.writen();
             bw.writeNum(ans.dataLen);
             if(USE_LABEL(ans.ansType)){
-                if(ans.ansType==MX){
-                    bw.writeBytes(ans.data.front());
-                }
-                writeLabeledData(bw,ans.data.begin()+(ans.ansType==MX),ans.data.end(), DATA_SHOULD_APPEND0(ans.ansType),cmap);
+                patchDataLen(buf,dataLenPos,writeRecordData(bw,ans.ansType,ans.data.begin(),ans.data.end(),table));
             }else{
-                bw.writeBytes(ans.data.front());
+                writeRecordData(bw,ans.ansType,ans.data.begin(),ans.data.end(),table);
             }
         }
 
         for(auto& ns : dns.nameservers){
-            writeLabeledData(bw,ns.name.begin(),ns.name.end(), true,cmap);
+            writeName(bw,ns.name.begin(),ns.name.end(),table);
             bw.writeNum(ns.nsType);
             bw.writeNum(ns.nsClass);
             bw.writeNum(ns.ttl);
@@ -319,20 +414,16 @@ namespace ucsmq{
         }
 
         for(auto& add : dns.additions){
-            writeLabeledData(bw,add.name.begin(),add.name.end(), true,cmap);
+            writeName(bw,add.name.begin(),add.name.end(),table);
             bw.writeNum(add.addType);
             bw.writeNum(add.addClass);
             bw.writeNum(add.ttl);
+            auto dataLenPos = bw.writen();
             bw.writeNum(add.dataLen);
-
             if(USE_LABEL(add.addType)){
-                if(add.addType==MX){
-                    bw.writeBytes(add.data.front());
-                }
-                writeLabeledData(bw,add.data.begin()+(add.addType==MX)
-                                 ,add.data.end(), DATA_SHOULD_APPEND0(add.addType),cmap);
+                patchDataLen(buf,dataLenPos,writeRecordData(bw,add.addType,add.data.begin(),add.data.end(),table));
             }else{
-                bw.writeBytes(add.data.front());
+                writeRecordData(bw,add.addType,add.data.begin(),add.data.end(),table);
             }
         }
         return bw.writen();
@@ -89,7 +89,7 @@ namespace ucsmq{
         uint32_t ttl;
         uint16_t dataLen;
         std::vector<Bytes> data;
-        Answer() : ansType(ANY) , ansClass(1) ,dataLen (0){}
+        Answer() : ansType(ANY) , ansClass(1) ,ttl(0),dataLen (0){}
         std::string toString() const;
     };
 
@@ -1,258 +1,689 @@
 #include "DnsClientChannel.h"
 #include <functional>
+#include <cerrno>
 #include "Log.h"
 #include "udp.h"
 #include "packetProcess.h"
+#include "Trace.h"
+#include "Simulation.h"
+#include "../lib/Random.h"
 using namespace std;
+//between two steps of the probe ladders, the larger candidates are usually answered before the next step is sent
+#define PROBE_STEP_MS 20
+#define PROBE_LIMITS_ATTEMPTS 3
+//a response probe asks for more than its candidate: the labels of a download are split at random and its poll carries a window
+#define PROBE_RESPONSE_MARGIN(size) ((size)/16+8)
+//the data id of a probe: its kind, the index of its record type and its step
+#define PROBE_DATA_ID(kind,typeIndex,step) ((data_id_t)((kind)<<12|(typeIndex)<<8|(step)))
 
 namespace ucsmq{
+    //the wire lengths of the names, and the download payloads, a round tries. 0 ends a ladder
+    static const uint16_t probeNameLadder[PROBE_STEPS]={MAX_NAME_LEN,240,225,210,195,180,165,150,135,120,105,90,75,60,0,0};
+    static const uint16_t probeResponseLadder[PROBE_STEPS]={900,720,576,460,368,300,240,192,160,128,100,MAX_RESPONSE_DATA_LEN,
+                                                            64,48,32,PROBE_MIN_RESPONSE_DATA};
+
+    void DnsClientChannel::init() {
+        running.store(false);
+        err.store(DCCE_NULL);
+        uploadScheduled.store(false);
+        uploadingGroup=false;
+        uploadPending=false;
+        peerWindow=WINDOW_UNLIMITED;
+        windowTimer=0;
+        segIdx=0;
+        ackTimer=0;
+        downGroupId=0;
+        downDataId=DATA_SEG_START;
+        pollTimer=0;
+        segmentSentAt=pollSentAt=Clock::time_point();
+        pollType=TXT;
+        pollGroupId=0;
+        pollDataId=DATA_SEG_START;
+        limits=PathLimits();
+        recordTypes=ALL_RECORD_TYPES;
+        probeRound=0;
+        probeStep=-1;
+        limitsAttempts=0;
+        probeTimer=0;
+        probeUnsupported=false;
+        domainSuffix=DomainSuffix(myDomain);
+    }
+
+    //a simulation has no other thread to authenticate, it runs until the response arrives
+    static bool authenticatedIn(future<int>& authenticated,int timeout){
+        auto simulation = Simulation::current();
+        if(simulation!= nullptr){
+            auto limit = timeout>0 ? chrono::seconds(timeout) : chrono::hours(24);
+            return simulation->runUntil([&authenticated](){return authenticated.wait_for(chrono::seconds(0))==future_status::ready;},limit);
+        }
+        return timeout<=0 || authenticated.wait_for(chrono::seconds(timeout))==future_status::ready;
+    }
+
     int DnsClientChannel::open(int timeout) {
-        if(running.load()) return -1;
-        if((sockfd= dialUdp(remoteAddr,&localAddr))<0){
-            Log::printf(LOG_ERROR,"failed to open ClientDnsChannel : %s",getLastErrorMessage().c_str());
+        if(running.load() || clientLoop!= nullptr) return -1;
+        if(reactor.start()<0){
             err.store(DCCE_AUTHENTICATE_ERR);
             return -1;
         }
-        if(authenticate(timeout)<0){
+        clientLoop=&reactor.assign();
+        bool shared = reactor.isSharingSockets();
+        if(shared){
+            sockfd=clientLoop->sockfd;
+        }else if((sockfd= dialUdp(remoteAddr,&localAddr))<0 || setNonBlocking(sockfd)<0){
+            LOG_PRINTF(LOG_ERROR,"failed to open ClientDnsChannel : %s",getLastErrorMessage().c_str());
+            if(sockfd>=0) closeSocket(sockfd);
+            clientLoop= nullptr;
+            err.store(DCCE_AUTHENTICATE_ERR);
+            return -1;
+        }
+        init();
+        uploadBuffer.setWeightLimit(sendBufferSize);
+        inboundBuffer.setWeightLimit(recvBufferSize);
+
+        auto result = make_shared<promise<int>>();
+        auto authenticated = result->get_future();
+        bool attached=false;
+        clientLoop->loop.runSync([&](){
+            Packet packet;
+            //the responses on a shared socket are routed by session id, it must be unique on the loop
+            do{
+                sessionId=(session_id_t)Random::local().next();
+            } while (shared && clientLoop->channels.count(sessionId)>0);
+            packet.dnsTransactionId=(uint16_t)Random::local().next();
+            packet.sessionId=sessionId;
+            packet.type=PACKET_AUTHENTICATE;
+            packet.dnsQueryType=randRecordType();
+            uint8_t query[DNS_SINGLE_QUERY_SIZE];
+            BytesReader br(userId);
+            auto n = Packet::singleQueryBytes(query,sizeof(query),packet,br,domainSuffix);
+            if (n<0 || br.readableBytes()>0){
+                LOG_PRINTF(LOG_ERROR,"user id is too long");
+                return;
+            }
+            if(attach()<0){
+                LOG_PRINTF(LOG_ERROR,"failed to watch ClientDnsChannel : %s",getLastErrorMessage().c_str());
+                return;
+            }
+            attached=true;
+            authResult=result;
+            if(sendQuery([&query,n](void* buf,size_t size){
+                if((size_t)n>size) return (ssize_t)-1;
+                memcpy(buf,query,n);
+                return n;
+            })<0){
+                authResult.reset();
+                result->set_value(-1);
+            }
+        });
+
+        int ret=-1;
+        if(attached){
+            if(authenticatedIn(authenticated,timeout)){
+                ret=authenticated.get();
+            }else{
+                LOG_PRINTF(LOG_ERROR,"authentication timed out");
+            }
+        }
+        if(ret<0){
+            clientLoop->loop.runSync([this](){detach();});
+            if(!shared) closeSocket(sockfd);
+            clientLoop= nullptr;
+            err.store(DCCE_AUTHENTICATE_ERR);
             return -1;
         }
-        running.store(true);
+
         name=std::to_string(sessionId)+"@"+userId;
-        uploadThread=thread(std::bind(&DnsClientChannel::uploading, this));
-        dispatchThread=thread(std::bind(&DnsClientChannel::dispatching, this));
-        downloadThread=thread(std::bind(&DnsClientChannel::downloading, this ));
-        Log::printf(LOG_TRACE,"DnsClientChannel '%s' connected to %s",name.c_str(), sockaddr_inStr(remoteAddr).c_str());
+        {
+            lock_guard<mutex> guard(postLock);
+            running.store(true);
+            clientLoop->loop.post([this](){
+                sendPoll();
+                startUpload();
+                startProbe();
+            });
+        }
+        LOG_PRINTF(LOG_TRACE,"DnsClientChannel '%s' connected to %s",name.c_str(), sockaddr_inStr(remoteAddr).c_str());
         return 1;
     }
 
-    int DnsClientChannel::authenticate(int timeout) {
-        Dns dns,dnsResp;
-        Packet packet,packetResp;
-        packet.sessionId=rand();
-        if (Packet::authentication(dns, packet, userId.c_str(), myDomain) < 0){
-            Log::printf(LOG_ERROR,"user id is too long");
-            return -1;
+    int DnsClientChannel::attach() {
+        if(reactor.isSharingSockets()){
+            clientLoop->channels[sessionId]=this;
+            return 1;
         }
-        if(sendDnsQuery(dns)<0){
-            return -1;
+        return clientLoop->loop.watch(sockfd,[this](){onReadable();});
+    }
+
+    void DnsClientChannel::detach() {
+        stopTimers();
+        authResult.reset();
+        if(reactor.isSharingSockets()){
+            clientLoop->channels.erase(sessionId);
+        }else{
+            clientLoop->loop.unwatch(sockfd);
         }
-        if(recvPacketResp(packetResp, dnsResp, timeout) < 0){
-            Log::printf(LOG_ERROR,getLastErrorMessage().c_str());
-            return -1;
+    }
+
+    void DnsClientChannel::onReadable() {
+        auto& batch = clientLoop->inBatch;
+        while (true){
+            auto n = recvBatch(sockfd,batch);
+            if(n<0){
+                if(errno==EAGAIN || errno==EWOULDBLOCK) break;
+                //e.g. the port unreachable reported on the connected socket, stop watching it
+                if(running.load()) LOG_PRINTF(LOG_DEBUG,"%s",getLastErrorMessage().c_str());
+                err.store(DCCE_NETWORK_ERR);
+                closeBuffers();
+                stopTimers();
+                clientLoop->loop.unwatch(sockfd);
+                break;
+            }
+            for(size_t i=0;i<(size_t)n;i++){
+                counters.wireBytesReceived.add(batch.len(i));
+                Packet packet;
+                if(bytesToPacketResp(packet,batch.data(i),batch.len(i))<0){
+                    continue;
+                }
+                TRACE_PACKET(TRACE_RESPONSE_RECEIVED,TRACE_CLIENT,packet,batch.len(i));
+                onPacket(packet);
+            }
+            if(!batch.full()) break;
         }
+    }
+
+    void DnsClientChannel::onPacket(Packet &packet) {
+        counters.responses.add();
+        if(authResult){
+            if(packet.type==PACKET_AUTHENTICATION_SUCCESS || packet.type==PACKET_AUTHENTICATION_FAILURE){
+                onAuthenticated(packet);
+            }
+            return;
+        }
+        if(!running.load() || !noConnErr()) return;
+        switch (packet.type) {
+            case PACKET_ACK:
+                onAck(packet);
+                break;
+            case PACKET_DOWNLOAD:
+            case PACKET_GROUP_END:
+            case PACKET_DOWNLOAD_NOTHING:
+                onDownload(packet);
+                break;
+            case PACKET_PROBE:
+                onProbe(packet);
+                break;
+            case PACKET_INVALID_TYPE:
+                //a server older than the probes, the path keeps the default limits
+                if(probeRound>0 && packet.groupId==probeRound){
+                    if(probeUnsupported) break;
+                    LOG_PRINTF(LOG_INFO,"the server of %s does not take probes",name.c_str());
+                    probeUnsupported=true;
+                    probeStep=-1;
+                    limitsAttempts=0;
+                    clientLoop->loop.cancel(probeTimer);
+                    probeTimer=0;
+                    startUpload();
+                    break;
+                }
+                LOG_PRINTF(LOG_ERROR,"packet with unexpected type : %s",packet.toString().c_str());
+                break;
+            case PACKET_DISCARD:
+                counters.discards.add();
+                TRACE_PACKET(TRACE_DISCARD,TRACE_CLIENT,packet,0);
+                LOG_PRINTF(LOG_TRACE,"packet discard ,group id :%u,data id :%u",packet.groupId,packet.dataId);
+                break;
+            case PACKET_SESSION_NOT_FOUND:
+            case PACKET_SESSION_CLOSED:
+                err.store(DCCE_PEER_CLOSED);
+                closeBuffers();
+                stopTimers();
+                break;
+            default:
+                LOG_PRINTF(LOG_ERROR,"packet with unexpected type : %s",packet.toString().c_str());
+        }
+    }
+
+    void DnsClientChannel::onAuthenticated(const Packet &packetResp) {
+        auto result = std::move(authResult);
         if(packetResp.type != PACKET_AUTHENTICATION_SUCCESS){
-            Log::printf(LOG_ERROR,"authentication failure");
-            return -1;
+            LOG_PRINTF(LOG_ERROR,"authentication failure");
+            result->set_value(-1);
+            return;
         }
         sessionId=packetResp.sessionId;
-        name=std::to_string(sessionId)+"@"+userId;
-        return 1;
+        result->set_value(1);
     }
 
-    void DnsClientChannel::uploading() {
-        while (running.load()){
-            AggregatedPacket aggregatedPacket;
-            auto result=uploadBuffer.pop(aggregatedPacket);
-            if(result==POP_INVALID || !noConnErr()) break;
-            auto group = disaggregateToQueryPacketGroup(aggregatedPacket, sessionId, channelGroupId, randRecordType(),
-                                                        PACKET_UPLOAD, myDomain);
-            if (sendGroup(group)<0) break;
-            channelGroupId++;
+    void DnsClientChannel::startUpload() {
+        //the segments of a group are sized once, the first ones wait for the path to be measured
+        if(uploadingGroup || !running.load() || !noConnErr() || (probeRound==1 && probeStep>=0)) return;
+        if(!uploadPending){
+            if(!uploadBuffer.tryPop(pendingUpload)) return;
+            uploadPending=true;
+        }
+        if(peerWindow>=pendingUpload.data.size){
+            beginGroup();
+            return;
+        }
+        //the window may have opened without us hearing of it, send the group anyway after a while
+        if(windowTimer==0){
+            windowTimer=clientLoop->loop.runAfter(ackTimeout*1000,[this](){
+                windowTimer=0;
+                if(!uploadingGroup && uploadPending) beginGroup();
+            });
         }
     }
-    void DnsClientChannel::dispatching() {
-        while(running.load()){
-            Packet packet;
-            Dns dns;
-            if (recvPacketResp(packet, dns)<0){
-                if(!noConnErr()) break;
-                else continue;
-            }
-            switch (packet.type) {
-                case PACKET_ACK:
-                    ackBuffer.push(std::move(packet));
-                    break;
-                case PACKET_DOWNLOAD:
-                case PACKET_GROUP_END:
-                case PACKET_DOWNLOAD_NOTHING:
-                    downloadBuffer.push(std::move(packet));
-                    break;
-                case PACKET_DISCARD:
-                    Log::printf(LOG_TRACE,"packet discard ,group id :%u,data id :%u",packet.groupId,packet.dataId);
-                    break;
-                case PACKET_SESSION_NOT_FOUND:
-                case PACKET_SESSION_CLOSED:
-                    err.store(DCCE_PEER_CLOSED);
-                    closeBuffers();
-                    break;
-                default:
-                    Log::printf(LOG_ERROR,"packet with unexpected type : %s",packet.toString().c_str());
+
+    void DnsClientChannel::beginGroup() {
+        clientLoop->loop.cancel(windowTimer);
+        windowTimer=0;
+        auto type = randRecordType(recordTypes);
+        uploadGroup = disaggregateToQueryPacketGroup(pendingUpload, sessionId, channelGroupId, type,
+                                                     PACKET_UPLOAD, domainSuffix, limits.queryNameOf(type));
+        pendingUpload=AggregatedPacket();
+        uploadPending=false;
+        uploadingGroup=true;
+        segIdx=0;
+        if(Trace::enabled()){
+            for(const auto& segment : uploadGroup.segments){
+                TRACE_PACKET(TRACE_SEGMENT_CREATED,TRACE_CLIENT,segment.packet,segment.packet.data.size);
             }
         }
+        sendSegment();
     }
 
+    //stop and wait, the segment is sent again until its ack arrives
+    void DnsClientChannel::sendSegment(bool retransmit) {
+        const auto& segment = uploadGroup.segments[segIdx];
+        const auto& query = segment.query;
+        if (sendQuery([&query](void* buf,size_t size){
+            if(query.size>size) return (ssize_t)-1;
+            memcpy(buf,query.data,query.size);
+            return (ssize_t)query.size;
+        }) < 0) {
+            LOG_PRINTF(LOG_ERROR,"%s : %s" ,__FUNCTION__ ,getLastErrorMessage().c_str());
+            return;
+        }
+        counters.segmentsSent.add();
+        TRACE_PACKET(TRACE_QUERY_SENT,TRACE_CLIENT,segment.packet,query.size);
+        if(retransmit){
+            counters.retransmits.add();
+            TRACE_PACKET(TRACE_RETRANSMIT,TRACE_CLIENT,segment.packet,query.size);
+        }
+        //the ack of a segment sent twice can not be told apart, it is not sampled
+        segmentSentAt = retransmit ? Clock::time_point() : Clock::now();
+        ackTimer=clientLoop->loop.runAfter(ackTimeout*1000,[this](){
+            ackTimer=0;
+            sendSegment(true);
+        });
+    }
 
-    void DnsClientChannel::downloading() {
-        group_id_t groupId=0, dataId=DATA_SEG_START;
-        vector<Packet> packets;
-        while (running.load()){
-            DNS_POLL:
-            Dns dnsPoll; Packet packetPoll;
-            Packet::poll(dnsPoll, packetPoll, myDomain, sessionId, groupId, dataId);
-  // printf("poll %u,%u\n",packetPoll.groupId,packetPoll.dataId);
-            if (sendDnsQuery(dnsPoll)<0){
-                break;
-            }
+    void DnsClientChannel::onAck(const Packet &packetAck) {
+        if(!uploadingGroup) return;
+        if(!verifyPacket(packetAck,uploadGroup.groupId,uploadGroup.segments[segIdx].packet.dataId)){
+            return;
+        }
+        clientLoop->loop.cancel(ackTimer);
+        ackTimer=0;
+        sampleRtt(segmentSentAt);
+        counters.goodputBytesUp.add(uploadGroup.segments[segIdx].packet.data.size);
+        peerWindow=packetAck.window();
+        if(++segIdx<uploadGroup.segments.size()){
+            sendSegment();
+            return;
+        }
+        uploadingGroup=false;
+        channelGroupId++;
+        startUpload();
+    }
 
-            Packet packetDown;
-            auto result = downloadBuffer.pop(packetDown,pollTimeout);
-            if(result==POP_INVALID || !noConnErr()) break;
-            if(result==POP_TIMEOUT || packetDown.type == PACKET_DOWNLOAD_NOTHING ||
-            packetDown.groupId!=groupId || packetDown.dataId!=dataId){
-                goto DNS_POLL;
-            }
+    void DnsClientChannel::sendPoll(bool retransmit) {
+        clientLoop->loop.cancel(pollTimer);
+        pollTimer=0;
+        Packet packetPoll;
+        packetPoll.dnsTransactionId=(uint16_t)Random::local().next();
+        packetPoll.sessionId=sessionId;
+        packetPoll.groupId=downGroupId;
+        packetPoll.dataId=downDataId;
+        packetPoll.type=PACKET_POLL;
+        //the server may have sliced the segment for the type of an earlier poll, it is asked for with that type
+        if(pollGroupId!=downGroupId || pollDataId!=downDataId || !(recordTypes&(1<<recordTypeIndex(pollType)))){
+            pollType=randRecordType(recordTypes);
+            pollGroupId=downGroupId;
+            pollDataId=downDataId;
+        }
+        packetPoll.dnsQueryType=pollType;
+        packetPoll.setWindow(windowOf(inboundBuffer.room()));
+        ssize_t querySize=0;
+        if (sendQuery([this,&packetPoll,&querySize](void* buf,size_t size){
+            return querySize=Packet::queryBytes(buf,size,packetPoll,domainSuffix,limits.queryNameOf(pollType));
+        })<0){
+            return;
+        }
+        counters.polls.add();
+        TRACE_PACKET(TRACE_QUERY_SENT,TRACE_CLIENT,packetPoll,querySize);
+        if(retransmit){
+            counters.pollTimeouts.add();
+            TRACE_PACKET(TRACE_RETRANSMIT,TRACE_CLIENT,packetPoll,querySize);
+        }
+        pollSentAt = retransmit ? Clock::time_point() : Clock::now();
+        pollTimer=clientLoop->loop.runAfter(pollTimeout*1000,[this](){
+            pollTimer=0;
+            sendPoll(true);
+        });
+    }
 
-   // printf("down %u,%u,%s  ,  client %u,%u\n",packetDown.groupId,packetDown.dataId, packetTypeName(packetDown.type),groupId,dataId);
-            if(packetDown.dataId==DATA_SEG_START){
-                newPacketGroup(groupId, dataId, packetDown, packets);
-            }else if(packetDown.type==PACKET_GROUP_END){
-   // printf("export\n");
-                exportPackets(inboundBuffer,packets,groupId,dataId);
-                groupId++;
-            }else{
-   //::printf("add %u,%u\n",groupId,dataId);
-                packetGroupAdd(groupId, dataId, packetDown, packets);
+    void DnsClientChannel::onDownload(Packet &packetDown) {
+        //a late or duplicated answer to an older poll would be timed against the latest one
+        if(packetDown.groupId==downGroupId && packetDown.dataId==downDataId) sampleRtt(pollSentAt);
+        if(packetDown.type == PACKET_DOWNLOAD_NOTHING){
+            counters.downloadNothing.add();
+            peerWindow=packetDown.window();
+            if(!uploadingGroup && uploadPending && peerWindow>=pendingUpload.data.size) beginGroup();
+            sendPoll();
+            return;
+        }
+        if(packetDown.groupId!=downGroupId || packetDown.dataId!=downDataId){
+            sendPoll();
+            return;
+        }
+        if(packetDown.dataId==DATA_SEG_START){
+            newPacketGroup(downGroupId, downDataId, packetDown, downPackets);
+        }else if(packetDown.type==PACKET_GROUP_END){
+            auto n = exportPackets(inboundBuffer,downPackets,downGroupId,downDataId);
+            if(n<0){
+                //the application is not reading, ask for the group end again later
+                clientLoop->loop.cancel(pollTimer);
+                pollTimer=clientLoop->loop.runAfter(pollTimeout*1000,[this](){
+                    pollTimer=0;
+                    sendPoll();
+                });
+                return;
             }
+            counters.goodputBytesDown.add(n);
+            TRACE_PACKET(TRACE_GROUP_EXPORTED,TRACE_CLIENT,packetDown,n);
+            downGroupId++;
+        }else{
+            packetGroupAdd(downGroupId, downDataId, packetDown, downPackets);
         }
+        sendPoll();
     }
 
+    void DnsClientChannel::startProbe() {
+        if(probeInterval<=0 || probeUnsupported || !running.load() || !noConnErr()) return;
+        clientLoop->loop.cancel(probeTimer);
+        probeTimer=0;
+        probeRound++;
+        probeStep=-1;
+        limitsAttempts=0;
+        memset(probesAnswered,0,sizeof(probesAnswered));
+        memset(probeNameLens,0,sizeof(probeNameLens));
+        sendProbeStep();
+    }
 
-    int DnsClientChannel::sendGroup(const PacketGroup &group) {
-        vector<Packet> responses;
-        for(const auto& seg : group.segments) {
-            DNS_SEND:
-            if (sendDnsQuery(seg.dns) < 0) {
-                Log::printf(LOG_ERROR,"%s : %s" ,__FUNCTION__ ,getLastErrorMessage().c_str());
-                return -1;
-            }
-            PACKET_RECV:
-            Packet packetAck;
-            auto result = ackBuffer.pop(packetAck,ackTimeout);
-            if(result==POP_INVALID || !noConnErr()) return -1;
-            if(result==POP_TIMEOUT) goto DNS_SEND;
-            if(!verifyPacket(packetAck,group.groupId,seg.packet.dataId)){
-                goto PACKET_RECV;
+    /*
+     * A step sends the next candidates of the ladders that are not answered yet, for every record type.
+     * Once the ladders are sent, the last answers get a poll timeout to arrive.
+     * */
+    void DnsClientChannel::sendProbeStep() {
+        probeTimer=0;
+        if(++probeStep>=PROBE_STEPS){
+            probeTimer=clientLoop->loop.runAfter(pollTimeout*1000,[this](){
+                probeTimer=0;
+                finishProbe();
+            });
+            return;
+        }
+        for(int t=0;t<RECORD_TYPE_COUNT;t++){
+            if(probesAnswered[0][t]==0 && probeNameLadder[probeStep]>domainSuffix.size) sendProbe(PROBE_NAME,t,probeStep);
+            if(probesAnswered[1][t]==0 && probeResponseLadder[probeStep]>0) sendProbe(PROBE_RESPONSE,t,probeStep);
+        }
+        probeTimer=clientLoop->loop.runAfter(PROBE_STEP_MS,[this](){sendProbeStep();});
+    }
+
+    void DnsClientChannel::sendProbe(probe_t kind, int typeIndex, int step) {
+        Packet probe;
+        probe.dnsTransactionId=(uint16_t)Random::local().next();
+        probe.sessionId=sessionId;
+        probe.groupId=probeRound;
+        probe.dataId=PROBE_DATA_ID(kind,typeIndex,step);
+        probe.type=PACKET_PROBE;
+        probe.dnsQueryType=recordTypeAt(typeIndex);
+        //a name probe is padded up to its length, the name is cut where it reaches it
+        uint8_t data[MAX_NAME_LEN];
+        memset(data,0,sizeof(data));
+        BytesWriter bw(data,sizeof(data));
+        bw.writeNum((uint8_t)kind);
+        size_t nameLimit = MAX_TOTAL_DOMAIN_LEN,dataLen = sizeof(data);
+        if(kind==PROBE_NAME){
+            nameLimit=probeNameLadder[step];
+        }else if(kind==PROBE_RESPONSE){
+            bw.writeNum((uint16_t)(probeResponseLadder[step]+PROBE_RESPONSE_MARGIN(probeResponseLadder[step])));
+            //as long as the data of a poll, so that the echoed question is as long as its
+            dataLen=sizeof(uint8_t)+sizeof(uint32_t)+sizeof(uint16_t);
+        }else{
+            for(int t=0;t<RECORD_TYPE_COUNT;t++){
+                bw.writeNum((uint16_t)(recordTypes&(1<<t) ? limits.responseData[t] : 0));
             }
+            dataLen=bw.writen();
+        }
+        ssize_t querySize=0;
+        if(sendQuery([&](void* buf,size_t size){
+            BytesReader br(data,dataLen);
+            return querySize=Packet::singleQueryBytes(buf,size,probe,br,domainSuffix,nameLimit);
+        })<0){
+            return;
+        }
+        counters.probes.add();
+        TRACE_PACKET(TRACE_QUERY_SENT,TRACE_CLIENT,probe,querySize);
+        if(kind==PROBE_NAME){
+            probeNameLens[typeIndex][step]=(uint16_t)(querySize-DNS_HEADER_SIZE-2*sizeof(uint16_t));
         }
-        return 1;
     }
 
-    int DnsClientChannel::sendDnsQuery(const Dns &dns) {
-        if(!noConnErr()) return -1;
-        char buf[4096];
-        ssize_t n = Dns::bytes(dns, buf, sizeof(buf));
-        if (sendUdp(sockfd, buf, n)<0){
-            if(running.load()) Log::printf(LOG_DEBUG,getLastErrorMessage().c_str());
-            err.store(DCCE_NETWORK_ERR);
-            return -1;
+    void DnsClientChannel::onProbe(const Packet &packetProbe) {
+        if(packetProbe.groupId!=probeRound) return;
+        int kind = packetProbe.dataId>>12,typeIndex = (packetProbe.dataId>>8)&0xf,step = packetProbe.dataId&0xff;
+        if(kind==PROBE_LIMITS){
+            if(limitsAttempts==0) return;
+            limitsAttempts=0;
+            scheduleProbe();
+            return;
         }
-        return 1;
+        if(probeStep<0 || (kind!=PROBE_NAME && kind!=PROBE_RESPONSE) || typeIndex>=RECORD_TYPE_COUNT || step>=PROBE_STEPS) return;
+        //a response cut on the way is not an answer
+        if(kind==PROBE_RESPONSE && packetProbe.data.size!=probeResponseLadder[step]+PROBE_RESPONSE_MARGIN(probeResponseLadder[step])) return;
+        probesAnswered[kind-PROBE_NAME][typeIndex]|=1u<<step;
+        for(const auto& answered : probesAnswered){
+            for(auto bits : answered){
+                if(bits==0) return;
+            }
+        }
+        finishProbe();
     }
 
-    int DnsClientChannel::recvPacketResp(Packet &packet, Dns &dnsResp, int timeout) {
-        if(!noConnErr()) return -1;
-        char buf[4*1024];
-        auto n=recvUdp(sockfd,buf,sizeof (buf),timeout);
-        if ( n<0 ){
-            if( running.load()) Log::printf(LOG_DEBUG,getLastErrorMessage().c_str());
-            err.store(DCCE_NETWORK_ERR);
-            return -1;
+    //the largest candidate answered is the limit, a record type nothing was answered for is left out
+    void DnsClientChannel::finishProbe() {
+        clientLoop->loop.cancel(probeTimer);
+        probeTimer=0;
+        probeStep=-1;
+        PathLimits measured=limits;
+        uint8_t types=0;
+        for(int t=0;t<RECORD_TYPE_COUNT;t++){
+            auto names = probesAnswered[0][t],responses = probesAnswered[1][t];
+            if(names==0 || responses==0) continue;
+            types|=(uint8_t)(1<<t);
+            measured.queryName[t]=probeNameLens[t][__builtin_ctz(names)];
+            measured.responseData[t]=probeResponseLadder[__builtin_ctz(responses)];
         }
-        if (Dns::resolve(dnsResp, buf, n)<0){
-            return -1;
+        if(types==0){
+            LOG_PRINTF(LOG_WARN,"no probe of the path of %s was answered, its limits are kept",name.c_str());
+            scheduleProbe();
+            startUpload();
+            return;
         }
-        if(Packet::dnsRespToPacket(packet,dnsResp)<0){
-            return -1;
+        limits=measured;
+        recordTypes=types;
+        LOG_PRINTF(LOG_INFO,"path of %s : names of %u, %u and %u bytes, responses of %u, %u and %u bytes, record types 0x%x",
+                   name.c_str(),limits.queryName[0],limits.queryName[1],limits.queryName[2],limits.responseData[0],
+                   limits.responseData[1],limits.responseData[2],recordTypes);
+        limitsAttempts=PROBE_LIMITS_ATTEMPTS;
+        sendLimits();
+        startUpload();
+    }
+
+    void DnsClientChannel::sendLimits() {
+        probeTimer=0;
+        if(limitsAttempts<=0){
+            LOG_PRINTF(LOG_WARN,"the server did not acknowledge the limits of the path of %s",name.c_str());
+            limitsAttempts=0;
+            scheduleProbe();
+            return;
         }
-        return 1;
+        limitsAttempts--;
+        sendProbe(PROBE_LIMITS,recordTypeIndex(randRecordType(recordTypes)),0);
+        probeTimer=clientLoop->loop.runAfter(pollTimeout*1000,[this](){sendLimits();});
     }
 
+    void DnsClientChannel::scheduleProbe() {
+        clientLoop->loop.cancel(probeTimer);
+        probeTimer=clientLoop->loop.runAfter(probeInterval*1000,[this](){
+            probeTimer=0;
+            startProbe();
+        });
+    }
 
-    ssize_t DnsClientChannel::write(const void *buf, size_t len) {
-        if(!running.load()){
-            Log::printf(LOG_ERROR,"writing data to a closed DnsClientChannel");
-            return -1;
+    void DnsClientChannel::sampleRtt(Clock::time_point &sentAt) {
+        if(sentAt==Clock::time_point()) return;
+        auto rtt = chrono::duration_cast<chrono::microseconds>(Clock::now()-sentAt).count();
+        counters.rtt.record((uint64_t)rtt);
+        sentAt=Clock::time_point();
+    }
+
+    void DnsClientChannel::stopTimers() {
+        clientLoop->loop.cancel(ackTimer);
+        clientLoop->loop.cancel(pollTimer);
+        clientLoop->loop.cancel(windowTimer);
+        clientLoop->loop.cancel(probeTimer);
+        ackTimer=pollTimer=windowTimer=probeTimer=0;
+    }
+
+    template<typename F>
+    int DnsClientChannel::sendQuery(F&& encode) {
+        if(!noConnErr()) return -1;
+        if(reactor.isSharingSockets()){
+            //flushed by the loop once the burst is handled, the query is encoded right into its slot
+            auto& batch = clientLoop->outBatch;
+            ssize_t n = encode(batch.back(), batch.bufferSize());
+            if(n<0 || !batch.add(n,remoteAddr)) return -1;
+            counters.queriesSent.add();
+            counters.wireBytesSent.add(n);
+            if(batch.full()) return reactor.flush(*clientLoop);
+            return 1;
         }
-        int e=err.load();
-        if(!noConnErr() || e==DCCE_AUTHENTICATE_ERR){
+        char buf[4096];
+        ssize_t n = encode(buf, sizeof(buf));
+        if(n<0) return -1;
+        if (sendUdp(sockfd, buf, n)<0){
+            //a full send buffer only drops the query, the timers send it again
+            if(errno==EAGAIN || errno==EWOULDBLOCK){
+                counters.queriesDropped.add();
+                return 1;
+            }
+            if(running.load()) LOG_PRINTF(LOG_DEBUG,"%s",getLastErrorMessage().c_str());
+            err.store(DCCE_NETWORK_ERR);
+            closeBuffers();
             return -1;
         }
-        AggregatedPacket aggregatedPacket={Bytes(buf,len)};
-        uploadBuffer.push(std::move(aggregatedPacket));
-        return len;
+        counters.queriesSent.add();
+        counters.wireBytesSent.add(n);
+        return 1;
+    }
+
+    ssize_t DnsClientChannel::write(const void *buf, size_t len, int timeout) {
+        return write(Buffer::copyOf(buf,len),timeout);
+    }
+
+    void DnsClientChannel::scheduleUpload() {
+        //one pending task is enough, it uploads everything queued before it runs
+        if(uploadScheduled.exchange(true)) return;
+        lock_guard<mutex> guard(postLock);
+        if(!running.load()) return;
+        clientLoop->loop.post([this](){
+            uploadScheduled.store(false);
+            startUpload();
+        });
     }
 
     ssize_t DnsClientChannel::read(void *dst, int timeout) {
-        if(!running.load()){
-            Log::printf(LOG_ERROR,"writing data to a closed DnsClientChannel");
-            return -1;
-        }
-        int e=err.load();
-        if(!noConnErr()|| e==DCCE_AUTHENTICATE_ERR){
-            return -1;
-        }
-        AggregatedPacket packet;
-        if (inboundBuffer.pop(packet, timeout)==POP_SUCCESSFULLY){
-            memcpy(dst,packet.data.data,packet.data.size);
-            return packet.data.size;
-        }else{
-            return -1;
-        }
+        BufferChain chain;
+        auto n = read(chain,timeout);
+        if(n>0) chain.copyTo(dst,chain.size);
+        return n;
     }
 
     void DnsClientChannel::close() {
-        if(running.load()){
+        {
+            lock_guard<mutex> guard(postLock);
+            if(!running.load()) return;
             running.store(false);
-            closeBuffers();
-            closeSocket(sockfd);
-            dispatchThread.join();
-            uploadThread.join();
-            downloadThread.join();
-            Log::printf(LOG_TRACE,"DnsClientChannel '%s' closed",name.c_str());
         }
+        closeBuffers();
+        //nothing can be posted any more, the tasks already queued run before the detaching one
+        clientLoop->loop.runSync([this](){detach();});
+        if(!reactor.isSharingSockets()) closeSocket(sockfd);
+        clientLoop= nullptr;
+        LOG_PRINTF(LOG_TRACE,"DnsClientChannel '%s' closed",name.c_str());
     }
 
     DnsClientChannel::~DnsClientChannel() {
         close();
-        Log::printf(LOG_TRACE,"DnsClientChannel '%s' destroyed",name.c_str());
+        LOG_PRINTF(LOG_TRACE,"DnsClientChannel '%s' destroyed",name.c_str());
+    }
+
+    ssize_t DnsClientChannel::write(const Bytes &src, int timeout) {
+        return write(Buffer::copyOf(src),timeout);
     }
 
-    ssize_t DnsClientChannel::write(const Bytes &src) {
+    ssize_t DnsClientChannel::read(Bytes &dst, int timeout) {
+        BufferChain chain;
+        auto n = read(chain,timeout);
+        if(n>=0) dst=chain.toBytes();
+        return n;
+    }
+
+    ssize_t DnsClientChannel::write(const Buffer &src, int timeout) {
         if(!running.load()){
-            Log::printf(LOG_ERROR,"writing data to a closed DnsClientChannel");
+            LOG_PRINTF(LOG_ERROR,"writing data to a closed DnsClientChannel");
             return -1;
         }
-        int e=err.load();
-        if(e==DCCE_NETWORK_ERR || e==DCCE_AUTHENTICATE_ERR){
+        if(!noConnErr() || err.load()==DCCE_AUTHENTICATE_ERR){
             return -1;
         }
         AggregatedPacket aggregatedPacket={src};
-        uploadBuffer.push(std::move(aggregatedPacket));
+        if(pushOutbound(uploadBuffer,std::move(aggregatedPacket),timeout)<0){
+            return -1;
+        }
+        scheduleUpload();
         return src.size;
     }
 
-    ssize_t DnsClientChannel::read(Bytes &dst, int timeout) {
+    ssize_t DnsClientChannel::read(Buffer &dst, int timeout) {
+        BufferChain chain;
+        auto n = read(chain,timeout);
+        if(n>=0) dst=chain.contiguous();
+        return n;
+    }
+
+    ssize_t DnsClientChannel::read(BufferChain &dst, int timeout) {
         if(!running.load()){
-            Log::printf(LOG_ERROR,"writing data to a closed DnsClientChannel");
+            LOG_PRINTF(LOG_ERROR,"reading data from a closed DnsClientChannel");
             return -1;
         }
-        int e=err.load();
-        if(e==DCCE_NETWORK_ERR || e==DCCE_AUTHENTICATE_ERR){
+        if(!noConnErr() || err.load()==DCCE_AUTHENTICATE_ERR){
             return -1;
         }
-        AggregatedPacket packet;
-        if (inboundBuffer.pop(packet, timeout)==POP_SUCCESSFULLY){
-            dst=std::move(packet.data);
+        if (popInbound(inboundBuffer,dst,timeout)>0){
             return dst.size;
         }else{
             return -1;
@@ -261,7 +692,6 @@ namespace ucsmq{
 
     void DnsClientChannel::closeBuffers() {
         uploadBuffer.unblock();
-        downloadBuffer.unblock();
         inboundBuffer.unblock();
     }
 
@@ -269,9 +699,48 @@ namespace ucsmq{
         auto e = err.load();
         return !(e==DCCE_NETWORK_ERR || e==DCCE_PEER_CLOSED);
     }
-}
-
-
-
 
+    ClientChannelMetrics DnsClientChannel::metrics() const {
+        ClientChannelMetrics m;
+        m.queriesSent=counters.queriesSent.value();
+        m.wireBytesSent=counters.wireBytesSent.value();
+        m.responses=counters.responses.value();
+        m.wireBytesReceived=counters.wireBytesReceived.value();
+        m.segmentsSent=counters.segmentsSent.value();
+        m.retransmits=counters.retransmits.value();
+        m.polls=counters.polls.value();
+        m.pollTimeouts=counters.pollTimeouts.value();
+        m.downloadNothing=counters.downloadNothing.value();
+        m.discards=counters.discards.value();
+        m.queriesDropped=counters.queriesDropped.value();
+        m.probes=counters.probes.value();
+        m.goodputBytesUp=counters.goodputBytesUp.value();
+        m.goodputBytesDown=counters.goodputBytesDown.value();
+        m.sendQueueBytes=uploadBuffer.totalWeight();
+        m.recvQueueBytes=inboundBuffer.totalWeight();
+        m.rtt=counters.rtt.snapshot();
+        return m;
+    }
 
+    void ClientChannelMetrics::writeTo(MetricsText &text, const string &labels) const {
+        text.counter("dnstun_client_queries_sent_total","Queries sent to the server",queriesSent,labels);
+        text.counter("dnstun_client_wire_sent_bytes_total","Bytes of the queries sent",wireBytesSent,labels);
+        text.counter("dnstun_client_responses_total","Responses received",responses,labels);
+        text.counter("dnstun_client_wire_received_bytes_total","Bytes of the responses received",wireBytesReceived,labels);
+        text.counter("dnstun_client_segments_sent_total","Upload segments sent, retransmits included",segmentsSent,labels);
+        text.counter("dnstun_client_retransmits_total","Upload segments sent again after an ack timeout",retransmits,labels);
+        text.counter("dnstun_client_polls_total","Polls sent",polls,labels);
+        text.counter("dnstun_client_poll_timeouts_total","Polls sent again after a timeout",pollTimeouts,labels);
+        text.counter("dnstun_client_download_nothing_total","Polls answered with nothing to download",downloadNothing,labels);
+        text.gauge("dnstun_client_download_nothing_ratio","Share of the polls answered with nothing to download",
+                   polls==0 ? 0 : (double)downloadNothing/(double)polls,labels);
+        text.counter("dnstun_client_discards_total","Queries the server discarded",discards,labels);
+        text.counter("dnstun_client_queries_dropped_total","Queries the socket dropped, sent again by the timers",queriesDropped,labels);
+        text.counter("dnstun_client_probes_total","Queries sent to measure the path",probes,labels);
+        text.counter("dnstun_client_goodput_up_bytes_total","Payload bytes acked by the server",goodputBytesUp,labels);
+        text.counter("dnstun_client_goodput_down_bytes_total","Payload bytes of the groups downloaded",goodputBytesDown,labels);
+        text.gauge("dnstun_client_send_queue_bytes","Bytes waiting in the send buffer",(double)sendQueueBytes,labels);
+        text.gauge("dnstun_client_recv_queue_bytes","Bytes waiting in the receive buffer",(double)recvQueueBytes,labels);
+        text.summary("dnstun_client_rtt_seconds","Round trip of the queries answered at the first attempt",rtt,labels,1e-6);
+    }
+}
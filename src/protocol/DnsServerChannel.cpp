@@ -3,145 +3,270 @@
 #include "udp.h"
 #include <functional>
 #include "packetProcess.h"
+#include "Trace.h"
+#include "Pcap.h"
+#include "Simulation.h"
+#include "../lib/threads.h"
 using namespace std;
 
 
 
 namespace ucsmq{
 
-    static string lookupPreviousPacket(const std::list<std::pair<group_id_t,std::vector<Packet>>>& groups){
+    static string lookupPreviousPacket(const std::list<std::pair<group_id_t,std::vector<SentSegment>>>& groups){
         stringstream ss;
         for(const auto& pa : groups){
-            const auto& v =pa.second;
-            ss<<pa.first<<" : {"<< v.front().dataId << " ~ "<<v.back().dataId <<"}"<<endl;
+            ss<<pa.first<<" : {"<< DATA_SEG_START << " ~ "<<pa.second.size()-1 <<"}"<<endl;
         }
         return ss.str();
     }
 
-    int DnsServerChannel::recvPacketQuery(Packet &packet, Dns &dns) {
-        if(!running.load() || err.load() == DSCE_NETWORK_ERR) return -1;
-        char buf[6*1024];
-        SA_IN source;
-        auto n= recvfromUdp(sockfd,buf, sizeof(buf), &source);
-        if ( n<0 ){
-            if(running.load()) Log::printf(LOG_ERROR,getLastErrorMessage().c_str());
-            err.store(DSCE_NETWORK_ERR);
-            return -1;
-        }
-        if (Dns::resolve(dns, buf, n)<0){
-            return -1;
-        }
-        if(Packet::dnsQueryToPacket(packet,dns,myDomain)<0){
+    /*
+     * Write the response to packet at the back of outBatch. The question section echoed may leave no room for the
+     * answers, the resolver is then told of a server failure rather than left waiting. -1 if nothing could be written.
+     * */
+    static ssize_t respBytes(const Packet& packet,UdpBatch& outBatch,ServerCounters& counters){
+        ssize_t n = packetRespBytes(packet,outBatch.back(),outBatch.bufferSize());
+        if(n>=0) return n;
+        counters.oversizedResponses.add();
+        LOG_LIMITED(LOG_WARN,"response outgrows the datagram, %zu bytes of questions and %zu bytes of data",
+                    packet.questions.size,packet.data.size);
+        return Packet::failureBytes(outBatch.back(),outBatch.bufferSize(),packet,SERVER_FAILURE);
+    }
+
+    int DnsServerChannel::resolvePacketQuery(const void *buf, size_t n, const SA_IN &source, Packet &packet, DnsView &dns) {
+        auto decoded = Packet::wireQueryToPacket(packet,buf,n,domainSuffix);
+        if(decoded<0) return -1;
+        //compressed names are left to the full parser
+        if(decoded==0 && (DnsView::parse(dns, buf, n)<0 || Packet::dnsQueryToPacket(packet,dns,myDomain)<0)){
             return -1;
         }
-        dns.source=source;
         packet.source=source;
         return 1;
     }
 
 
-    void DnsServerChannel::dispatching() {
+    //what a reactor reuses from batch to batch
+    struct ReactorState {
+        UdpBatch inBatch,outBatch;
+        unordered_map<ConnectionWorker*,Delivery> deliveries;
+        //reused for every datagram, it only points into inBatch
+        DnsView dns;
+    };
+
+    void DnsServerChannel::dispatching(int sockfd,ServerCounters& counters) {
+        ReactorState state;
         while(running.load()){
-            Packet packet;
-            Dns dns;
-            if (recvPacketQuery(packet, dns) < 0){
-                if(err.load()==DSCE_NETWORK_ERR) break;
-                else continue;
-            }
-            if(packet.type==PACKET_AUTHENTICATE){
-                authenticate(packet);
-                continue;
+            auto n = recvBatch(sockfd,state.inBatch);
+            if(!running.load()) break;
+            if(n<0){
+                LOG_PRINTF(LOG_ERROR,"%s",getLastErrorMessage().c_str());
+                err.store(DSCE_NETWORK_ERR);
+                break;
             }
-            session_id_t sessionId =packet.sessionId;
-            if(!manager->exist(sessionId)) {
-                auto packetErr = packet.getResponsePacket(PACKET_SESSION_NOT_FOUND);
-                sendPacketResp(packetErr);
+            if(answerBatch(sockfd,state,counters)<0) break;
+        }
+    }
+
+    int DnsServerChannel::answerBatch(int sockfd, ReactorState &state, ServerCounters &counters) {
+        auto& inBatch = state.inBatch;
+        if(capture!= nullptr) capture->writeBatch(inBatch,localAddr,true);
+        for(size_t i=0;i<inBatch.size();i++){
+            counters.queriesReceived.add();
+            counters.wireBytesReceived.add(inBatch.len(i));
+            Packet packet;
+            if(resolvePacketQuery(inBatch.data(i),inBatch.len(i),inBatch.addr(i),packet,state.dns)<0){
+                counters.invalidQueries.add();
                 continue;
             }
+            TRACE_PACKET(TRACE_QUERY_RECEIVED,TRACE_SERVER,packet,inBatch.len(i));
+            dispatch(sockfd,packet,state.outBatch,state.deliveries,counters);
+        }
+        for(auto& pa : state.deliveries){
+            if(!pa.second.empty()) pa.first->deliver(std::move(pa.second));
+            pa.second.clear();
+        }
+        return flushResp(sockfd,state.outBatch);
+    }
 
-            auto connPtr = manager->get(sessionId);
-            if(connPtr->running.load()){
-                switch (packet.type) {
-                    case PACKET_POLL:
-                        connPtr->pollBuffer.push(std::move(packet));
-                        break;
-                    case PACKET_UPLOAD:
-                    case PACKET_GROUP_END:
-                        connPtr->uploadBuffer.push(std::move(packet));
-                        break;
-                    default:
-                        auto packetErr = packet.getResponsePacket(PACKET_INVALID_TYPE);
-                        sendPacketResp(packetErr);
-                        Log::printf(LOG_ERROR, "packet with unexpected type : %s", packet.toString().c_str());
-                }
-            }else{
-                auto packetErr = packet.getResponsePacket(PACKET_SESSION_CLOSED);
-                sendPacketResp(packetErr);
+    void DnsServerChannel::dispatch(int sockfd, Packet &packet, UdpBatch &outBatch, unordered_map<ConnectionWorker*,Delivery>& deliveries,ServerCounters& counters) {
+        if(packet.type==PACKET_AUTHENTICATE){
+            authenticate(sockfd, packet, outBatch, counters);
+            return;
+        }
+        session_id_t sessionId =packet.sessionId;
+        auto connPtr = manager->get(sessionId);
+        if(connPtr== nullptr) {
+            counters.sessionsNotFound.add();
+            auto packetErr = packet.getResponsePacket(PACKET_SESSION_NOT_FOUND);
+            sendPacketResp(sockfd, packetErr, outBatch, counters);
+            return;
+        }
+
+        if(connPtr->running.load()){
+            switch (packet.type) {
+                case PACKET_POLL:
+                case PACKET_UPLOAD:
+                case PACKET_GROUP_END:
+                case PACKET_PROBE:
+                    deliveries[connPtr->worker].emplace_back(connPtr,std::move(packet));
+                    break;
+                default:
+                    counters.invalidQueries.add();
+                    auto packetErr = packet.getResponsePacket(PACKET_INVALID_TYPE);
+                    sendPacketResp(sockfd, packetErr, outBatch, counters);
+                    LOG_PRINTF(LOG_ERROR, "packet with unexpected type : %s", packet.toString().c_str());
             }
+        }else{
+            auto packetErr = packet.getResponsePacket(PACKET_SESSION_CLOSED);
+            sendPacketResp(sockfd, packetErr, outBatch, counters);
         }
     }
 
 
-    void DnsServerChannel::authenticate(const Packet &packet) {
+    void DnsServerChannel::authenticate(int sockfd, const Packet &packet, UdpBatch &outBatch,ServerCounters& counters) {
         string userId = packet.data;
         auto sessionId = packet.sessionId;
         if(manager->exist(sessionId)){
             auto failure = packet.getResponsePacket(PACKET_AUTHENTICATION_FAILURE);
-            Log::printf(LOG_DEBUG,"replicated authentication packet , session id : %u,user id : %s",sessionId,userId.c_str());
-            if (sendPacketResp(failure)<0) return;
+            LOG_PRINTF(LOG_DEBUG,"replicated authentication packet , session id : %u,user id : %s",sessionId,userId.c_str());
+            sendPacketResp(sockfd, failure, outBatch, counters);
+            return;
         }
         if(!authenticateUserId(userId)){
+            counters.authenticationFailures.add();
             auto failure = packet.getResponsePacket(PACKET_AUTHENTICATION_FAILURE);
-            Log::printf(LOG_INFO,"authentication  failure session id : %u,user id : %s",sessionId,userId.c_str());
-            if (sendPacketResp(failure)<0) return;
+            LOG_PRINTF(LOG_INFO,"authentication  failure session id : %u,user id : %s",sessionId,userId.c_str());
+            sendPacketResp(sockfd, failure, outBatch, counters);
+            return;
         }
 
         User newUser = {userId};
-        auto connPtr = make_shared<ClientConnection>(sockfd,sessionId,newUser,manager,&err);
+        auto& worker = workers[sessionId % workers.size()];
+        auto connPtr = make_shared<ClientConnection>(worker.get(),sessionId,newUser,manager,&err);
+        connPtr->downloadBuffer.setWeightLimit(sendBufferSize);
+        connPtr->inboundBuffer.setWeightLimit(recvBufferSize);
         connPtr->open();
-        manager->add(sessionId,connPtr);
+        if(!manager->add(sessionId,connPtr)){
+            //the same authentication packet arrived at another reactor first
+            auto failure = packet.getResponsePacket(PACKET_AUTHENTICATION_FAILURE);
+            LOG_PRINTF(LOG_DEBUG,"replicated authentication packet , session id : %u,user id : %s",sessionId,userId.c_str());
+            sendPacketResp(sockfd, failure, outBatch, counters);
+            return;
+        }
+        counters.authentications.add();
         auto success = packet.getResponsePacket(PACKET_AUTHENTICATION_SUCCESS);
         success.sessionId=sessionId;
-        if (sendPacketResp(success)<0) return;
+        sendPacketResp(sockfd, success, outBatch, counters);
     }
 
-    int DnsServerChannel::sendPacketResp(const Packet &packet, const SA_IN &addr) {
+    int DnsServerChannel::sendPacketResp(int sockfd, const Packet &packet, UdpBatch &outBatch,ServerCounters& counters) {
         if(err.load()==DSCE_NETWORK_ERR ) return -1;
-        char buf[4096];
-        Dns dns;
-        Packet::packetToDnsResp(dns,packet.dnsTransactionId,packet);
-        ssize_t n = Dns::bytes(dns, buf, sizeof(buf));
-        if (sendtoUdp(sockfd,buf,n,addr)<0){
-            if(running.load()) Log::printf(LOG_ERROR,getLastErrorMessage().c_str());
+        ssize_t n = respBytes(packet,outBatch,counters);
+        if(n<0 || !outBatch.add(n,packet.source)) return 0;
+        counters.responsesSent.add();
+        counters.wireBytesSent.add(n);
+        TRACE_PACKET(TRACE_RESPONSE_SENT,TRACE_SERVER,packet,n);
+        if(outBatch.full()) return flushResp(sockfd,outBatch);
+        return 1;
+    }
+
+    int DnsServerChannel::flushResp(int sockfd, UdpBatch &outBatch) {
+        if(outBatch.size()==0) return 1;
+        if(capture!= nullptr) capture->writeBatch(outBatch,localAddr,false);
+        if (sendBatch(sockfd,outBatch)<0){
+            if(isDatagramDropped()){
+                LOG_LIMITED(LOG_WARN,"responses dropped : %s",getLastErrorMessage().c_str());
+                return 1;
+            }
+            if(running.load()) LOG_PRINTF(LOG_ERROR,"%s",getLastErrorMessage().c_str());
             err.store(DSCE_NETWORK_ERR);
             return -1;
         }
         return 1;
     }
 
-    ClientConnectionPtr DnsServerChannel::accept() {
-        return manager->accept();
+    ClientConnectionPtr DnsServerChannel::accept(int timeout) {
+        return manager->accept(timeout);
     }
 
     int DnsServerChannel::open() {
         if(running.load())  return -1;
-        sockfd= udpSocket(&localAddr);
-        if(sockfd<0){
-            Log::printf(LOG_ERROR,"%s",getLastErrorMessage().c_str());
-            return -1;
+        size_t n = reactorCount==0 ? 1 : reactorCount;
+        for(size_t i=0;i<n;i++){
+            int sockfd= udpSocket(&localAddr,n>1);
+            if(sockfd<0){
+                LOG_PRINTF(LOG_ERROR,"%s",getLastErrorMessage().c_str());
+                closeSockets();
+                return -1;
+            }
+            sockfds.push_back(sockfd);
+        }
+        size_t w = workerCount==0 ? 1 : workerCount;
+        counters.clear();
+        for(size_t i=0;i<n+w;i++){
+            counters.emplace_back(new ServerCounters);
+        }
+        for(size_t i=0;i<w;i++){
+            workers.emplace_back(new ConnectionWorker(sockfds[i%n],&err,counters[n+i].get()));
+            workers.back()->capture=capture;
+            workers.back()->localAddr=localAddr;
+            workers.back()->start();
         }
-        dispatchThread=std::thread(std::bind(&DnsServerChannel::dispatching,this));
         running.store(true);
-        Log::printf(LOG_INFO,"DnsServerChannel opened at %s",sockaddr_inStr(localAddr).c_str());
+        //a simulation has no thread to block, its reactors are loops watching their sockets
+        bool simulated = Simulation::current()!= nullptr;
+        for(size_t i=0;i<n;i++){
+            if(simulated){
+                int sockfd = sockfds[i];
+                auto state = make_shared<ReactorState>();
+                auto& c = *counters[i];
+                reactorLoops.emplace_back(new EventLoop);
+                reactorLoops.back()->watch(sockfd,[this,sockfd,state,&c](){
+                    while (recvBatch(sockfd,state->inBatch)>0){
+                        if(answerBatch(sockfd,*state,c)<0) break;
+                    }
+                });
+                reactorLoops.back()->start();
+                continue;
+            }
+            dispatchThreads.emplace_back(std::bind(&DnsServerChannel::dispatching,this,sockfds[i],std::ref(*counters[i])));
+            if(pinReactors && pinThread(dispatchThreads.back(),i)<0){
+                LOG_PRINTF(LOG_WARN,"failed to pin reactor %zu to a core",i);
+            }
+        }
+        LOG_PRINTF(LOG_INFO,"DnsServerChannel opened at %s with %zu reactor(s)",sockaddr_inStr(localAddr).c_str(),n);
         return 1;
     }
 
     void DnsServerChannel::close() {
         if(running.load()){
             running.store(false);
+            for(int sockfd : sockfds){
+                shutdownSocket(sockfd);
+            }
+            for(auto& th : dispatchThreads){
+                th.join();
+            }
+            dispatchThreads.clear();
+            for(auto& loop : reactorLoops){
+                loop->stop();
+            }
+            reactorLoops.clear();
+            manager->stopAll();
+            for(auto& worker : workers){
+                worker->stop();
+            }
+            workers.clear();
+            closeSockets();
+        }
+    }
+
+    void DnsServerChannel::closeSockets() {
+        for(int sockfd : sockfds){
             closeSocket(sockfd);
-            dispatchThread.join();
         }
+        sockfds.clear();
     }
 
     bool DnsServerChannel::authenticateUserId(const string &userId) {
@@ -149,251 +274,392 @@ namespace ucsmq{
         return whiteList.count(userId)>0;
     }
 
-    int DnsServerChannel::sendPacketResp(const Packet &packet) {
-        return sendPacketResp(packet,packet.source);
-    }
-
 
-    void ConnectionManager::add(session_id_t id, const ClientConnectionPtr &ptr) {
-        lock.lock();
-        conns.insert(make_pair(id , ptr));
-        lock.unlock();
-        acceptBuffer.push(ptr);
+    bool ConnectionManager::add(session_id_t id, const ClientConnectionPtr &ptr) {
+        bool inserted = conns.insert(id,ptr);
+        if(inserted) acceptBuffer.push(ptr);
+        return inserted;
     }
 
-    void ConnectionManager::remove(session_id_t id) {
-        lock_guard<mutex> guard(lock);
-        conns.erase(id);
+    bool ConnectionManager::remove(session_id_t id) {
+        return conns.remove(id)!= nullptr;
     }
 
     bool ConnectionManager::exist(session_id_t id) {
-        lock_guard<mutex> guard(lock);
-        return conns.count(id);
+        return conns.contains(id);
     }
 
     ClientConnectionPtr ConnectionManager::get(session_id_t id) {
-        lock_guard<mutex> guard(lock);
-        return conns[id];
+        return conns.get(id);
     }
 
-    ClientConnectionPtr ConnectionManager::accept() {
+    ClientConnectionPtr ConnectionManager::accept(int timeout) {
         weak_ptr<ClientConnection> ptr;
-        if(acceptBuffer.pop(ptr)!=POP_SUCCESSFULLY) return nullptr;
+        if(acceptBuffer.pop(ptr,timeout)!=POP_SUCCESSFULLY) return nullptr;
         return ptr.lock();
     }
 
+    void ConnectionManager::stopAll() {
+        for(size_t id=0;id<SESSION_TABLE_SIZE && conns.size()>0;id++){
+            auto ptr = conns.remove((session_id_t)id);
+            if(ptr) ptr->stop();
+        }
+    }
+
+    size_t ConnectionManager::size() const {
+        return conns.size();
+    }
+
+    void ConnectionManager::forEach(const function<void(const ClientConnectionPtr &)> &f) {
+        for(size_t id=0;id<SESSION_TABLE_SIZE && conns.size()>0;id++){
+            auto ptr = conns.get((session_id_t)id);
+            if(ptr) f(ptr);
+        }
+    }
+
     ConnectionManager::~ConnectionManager() {
         acceptBuffer.unblock();
     }
 
 
 
+    ConnectionWorker::ConnectionWorker(int sockfd_, std::atomic<int> *err_, ServerCounters* counters_) : sockfd(sockfd_),err(err_),counters(counters_),capture(nullptr),localAddr(ADDR_ZERO) {
+        loop.afterBurst=[this](){flush();};
+    }
+
+    void ConnectionWorker::start() {
+        loop.start();
+        loop.post([this](){collectRetired();});
+    }
+
+    void ConnectionWorker::collectRetired() {
+        Epoch::collect();
+        loop.runAfter(EPOCH_COLLECT_INTERVAL_MS,[this](){collectRetired();});
+    }
+
+    void ConnectionWorker::stop() {
+        loop.stop();
+        flush();
+    }
+
+    int ConnectionWorker::sendPacketResp(const Packet &packet) {
+        if(err->load()==DSCE_NETWORK_ERR) return -1;
+        ssize_t n = respBytes(packet,outBatch,*counters);
+        if(n<0 || !outBatch.add(n,packet.source)) return 0;
+        counters->responsesSent.add();
+        counters->wireBytesSent.add(n);
+        TRACE_PACKET(TRACE_RESPONSE_SENT,TRACE_SERVER,packet,n);
+        if(outBatch.full()) return flush();
+        return 1;
+    }
+
+    void ConnectionWorker::deliver(Delivery &&delivery) {
+        loop.post([delivery=std::move(delivery)]() mutable {
+            for(auto& pa : delivery){
+                pa.first->onPacket(pa.second);
+            }
+        });
+    }
+
+    int ConnectionWorker::flush() {
+        if(outBatch.size()==0) return 1;
+        if(capture!= nullptr) capture->writeBatch(outBatch,localAddr,false);
+        if (sendBatch(sockfd,outBatch)<0){
+            if(isDatagramDropped()){
+                LOG_LIMITED(LOG_WARN,"responses dropped : %s",getLastErrorMessage().c_str());
+                return 1;
+            }
+            LOG_PRINTF(LOG_ERROR,"%s",getLastErrorMessage().c_str());
+            err->store(DSCE_NETWORK_ERR);
+            return -1;
+        }
+        return 1;
+    }
+
+
     void ClientConnection::close() {
         auto ptr = manager.lock();
         if(ptr){
-            if(ptr->exist(sessionId)){
-                ptr->remove(sessionId);
-                Log::printf(LOG_TRACE,"ClientConnection '%s' closed",name.c_str());
+            if(ptr->remove(sessionId)){
+                LOG_PRINTF(LOG_TRACE,"ClientConnection '%s' closed",name.c_str());
             }else{
-                Log::printf(LOG_WARN,"failed to remove ClientConnection from ConnectionManager : invalid sessionId : %u",sessionId);
+                LOG_PRINTF(LOG_WARN,"failed to remove ClientConnection from ConnectionManager : invalid sessionId : %u",sessionId);
             }
         }
+        stop();
     }
 
     void ClientConnection::stop() {
         if(running.load()){
             running.store(false);
             closeBuffer();
-            downloadThread.join();
-            uploadThread.join();
-            Log::printf(LOG_TRACE,"ClientConnection '%s' stopped",name.c_str());
+            LOG_PRINTF(LOG_TRACE,"ClientConnection '%s' stopped",name.c_str());
         }
     }
 
     ClientConnection::~ClientConnection() {
         stop();
-        Log::printf(LOG_TRACE,"ClientConnection '%s' destroyed",name.c_str());
+        LOG_PRINTF(LOG_TRACE,"ClientConnection '%s' destroyed",name.c_str());
     }
 
-
-    void ClientConnection::uploading() {
-        vector<Packet> packets;
-        group_id_t groupId=0,dataId=DATA_SEG_START;
-
-        while (running.load()){
-            Packet packetUpload;
-            if (uploadBuffer.pop(packetUpload)==POP_INVALID) break;
-            if(!verifyPacket(packetUpload,groupId,dataId)) {
-                auto packetDiscard = packetUpload.getResponsePacket(PACKET_DISCARD);
-                sendPacketResp(packetDiscard);
-                continue;
-            }
-            auto packetAck = packetUpload.getResponsePacket(PACKET_ACK);
-            if(packetUpload.dataId==DATA_SEG_START){
-                newPacketGroup(groupId, dataId, packetUpload, packets);
-            }else if(packetUpload.type==PACKET_GROUP_END){
-                exportPackets(inboundBuffer,packets,groupId,dataId);
-                groupId++;
-            }else{
-                packetGroupAdd(groupId, dataId, packetUpload, packets);
-            }
-            sendPacketResp(packetAck);
+    void ClientConnection::onPacket(Packet &packet) {
+        if(!running.load() || !noConnErr()) return;
+        if(packet.type==PACKET_POLL){
+            onPoll(packet);
+        }else if(packet.type==PACKET_PROBE){
+            onProbe(packet);
+        }else{
+            onUpload(packet);
         }
     }
 
-    void ClientConnection::downloading() {
-        while (running.load()){
-            Packet packetPoll;
-            auto result = pollBuffer.pop(packetPoll,idleTimeout);
-            if(result==POP_INVALID) break;
-            if(result==POP_TIMEOUT) {
-                handleIdle();
+    //the client measures its path, probes are answered whatever the state of the transfers
+    void ClientConnection::onProbe(const Packet &packetProbe) {
+        auto br = packetProbe.data.reader();
+        if(br.readableBytes()<sizeof(uint8_t)) return;
+        count(&ConnectionCounters::probes);
+        auto packetResp = packetProbe.getResponsePacket(PACKET_PROBE);
+        switch (br.readNum<uint8_t>()) {
+            case PROBE_NAME:
+                break;
+            case PROBE_RESPONSE:{
+                if(br.readableBytes()<sizeof(uint16_t)) return;
+                size_t size = min<size_t>(br.readNum<uint16_t>(),PROBE_MAX_RESPONSE_DATA);
+                packetResp.data=Buffer::build(size,[size](uint8_t* p){
+                    memset(p,0,size);
+                    return size;
+                });
                 break;
             }
-
-            if(packetPoll.groupId!=connGroupId){
-                if(downloadPreviousPacket(packetPoll)<0) break;
-                continue;
-            }
-
-            if(downloadBuffer.size()==0){
-                auto packetResp = packetPoll.getResponsePacket(PACKET_DOWNLOAD_NOTHING);
-                if (sendPacketResp(packetResp)<0) break;
-            }else {
-                AggregatedPacket aggregatedPacket;
-                if (downloadBuffer.pop(aggregatedPacket) == POP_INVALID) break;
-                if (sendGroup(aggregatedPacket) < 0) break;
-                connGroupId++;
-            }
+            case PROBE_LIMITS:
+                for(int i=0;i<RECORD_TYPE_COUNT && br.readableBytes()>=sizeof(uint16_t);i++){
+                    auto limit = br.readNum<uint16_t>();
+                    //0: the type is not measured, its limit is kept
+                    if(limit>0) limits.responseData[i]=max<uint16_t>(PROBE_MIN_RESPONSE_DATA,min<uint16_t>(limit,PROBE_MAX_RESPONSE_DATA));
+                }
+                LOG_PRINTF(LOG_DEBUG,"ClientConnection '%s' downloads %u, %u and %u bytes a segment",name.c_str(),
+                           limits.responseData[0],limits.responseData[1],limits.responseData[2]);
+                break;
+            default:
+                count(&ConnectionCounters::discards);
+                packetResp.type=PACKET_DISCARD;
         }
+        sendPacketResp(packetResp);
     }
 
-    int ClientConnection::sendPacketResp(const Packet &packet) {
-        if(!noConnErr()) return -1;
-        char buf[4096];
-        Dns dns;
-        Packet::packetToDnsResp(dns,packet.dnsTransactionId,packet);
-        ssize_t n = Dns::bytes(dns, buf, sizeof(buf));
-        if (sendtoUdp(sockfd,buf,n,packet.source)<0){
-            if(running.load()) Log::printf(LOG_ERROR,getLastErrorMessage().c_str());
-            err->store(DSCE_NETWORK_ERR);
-            return -1;
+    void ClientConnection::onUpload(Packet &packetUpload) {
+        //the ack was lost and the client sends the segment again, ack it again or the client waits forever
+        bool received = packetUpload.groupId==uploadGroupId ? packetUpload.dataId<uploadDataId :
+                        packetUpload.type==PACKET_GROUP_END && (group_id_t)(packetUpload.groupId+1)==uploadGroupId;
+        if(received){
+            count(&ConnectionCounters::retransmits);
+            TRACE_PACKET(TRACE_RETRANSMIT,TRACE_SERVER,packetUpload,packetUpload.data.size);
+            auto packetAck = packetUpload.getResponsePacket(PACKET_ACK);
+            packetAck.setWindow(windowOf(inboundBuffer.room()));
+            sendPacketResp(packetAck);
+            return;
         }
-        return 1;
+        if(!verifyPacket(packetUpload,uploadGroupId,uploadDataId)) {
+            count(&ConnectionCounters::discards);
+            TRACE_PACKET(TRACE_DISCARD,TRACE_SERVER,packetUpload,packetUpload.data.size);
+            sendPacketResp(packetUpload.getResponsePacket(PACKET_DISCARD));
+            return;
+        }
+        count(&ConnectionCounters::uploads);
+        auto packetAck = packetUpload.getResponsePacket(PACKET_ACK);
+        if(packetUpload.dataId==DATA_SEG_START){
+            newPacketGroup(uploadGroupId, uploadDataId, packetUpload, uploadPackets);
+        }else if(packetUpload.type==PACKET_GROUP_END){
+            auto n = exportPackets(inboundBuffer,uploadPackets,uploadGroupId,uploadDataId);
+            if(n<0){
+                //the application is not reading, hold the ack back until it does
+                count(&ConnectionCounters::discards);
+                TRACE_PACKET(TRACE_DISCARD,TRACE_SERVER,packetUpload,0);
+                sendPacketResp(packetUpload.getResponsePacket(PACKET_DISCARD));
+                return;
+            }
+            count(&ConnectionCounters::goodputBytesUp,n);
+            TRACE_PACKET(TRACE_GROUP_EXPORTED,TRACE_SERVER,packetUpload,n);
+            uploadGroupId++;
+        }else{
+            packetGroupAdd(uploadGroupId, uploadDataId, packetUpload, uploadPackets);
+        }
+        packetAck.setWindow(windowOf(inboundBuffer.room()));
+        sendPacketResp(packetAck);
+    }
+
+    /*
+     * A poll either asks for a segment of the group being sent, repeats a request for a segment already sent,
+     * or, between groups, asks whether there is anything to download.
+     * */
+    void ClientConnection::onPoll(const Packet &packetPoll) {
+        lastPoll=Clock::now();
+        count(&ConnectionCounters::polls);
+        if(packetPoll.groupId!=connGroupId){
+            downloadPreviousPacket(packetPoll);
+            return;
+        }
+        if(!sendingGroup){
+            if(!groupPending && downloadBuffer.tryPop(downloadGroup)){
+                groupPending=true;
+            }
+            //nothing to send, or the client has no room for the group yet
+            if(!groupPending || packetPoll.window()<downloadGroup.data.size){
+                count(&ConnectionCounters::downloadNothing);
+                auto packetNothing = packetPoll.getResponsePacket(PACKET_DOWNLOAD_NOTHING);
+                packetNothing.setWindow(windowOf(inboundBuffer.room()));
+                sendPacketResp(packetNothing);
+                return;
+            }
+            groupPending=false;
+            downloadOffset=0;
+            sentSegments.clear();
+            sendingGroup=true;
+        }
+        sendSegment(packetPoll);
     }
 
-
-    static size_t readAggregatedPacket(BytesReader& br,Packet& packet){
-        if(br.readableBytes()==0) {
+    //limit: the payload a response to the poll carries on its path
+    static size_t readAggregatedPacket(const Buffer& group,size_t& offset,Packet& packet,size_t limit){
+        if(offset>=group.size) {
             packet.type=PACKET_GROUP_END;
             return 0;
         }
-        packet.data =  br.readBytes(MAX_RESPONSE_DATA_LEN);
+        packet.data = group.slice(offset,limit);
+        offset+=packet.data.size;
         return packet.data.size;
     }
 
-    int ClientConnection::sendGroup(const AggregatedPacket &aggregatedPacket) {
-        BytesReader br(aggregatedPacket.data);
-        data_id_t dataId = DATA_SEG_START;
-        vector<Packet> temp;
-        while (running.load()){
-            Packet packetPoll;
-            auto result=pollBuffer.pop(packetPoll,idleTimeout);
-            if(result==POP_INVALID) return -1;
-            if(result==POP_TIMEOUT){
-                handleIdle();
-                return -1;
-            }
-            //printf("poll %u,%u , conn %u,%u\n",packetPoll.groupId,packetPoll.dataId,connGroupId,dataId);
-            if(packetPoll.groupId!=connGroupId){
-                if(downloadPreviousPacket(packetPoll)<0) return -1;
-                continue;
+    int ClientConnection::sendSegment(const Packet &packetPoll) {
+        data_id_t dataId = sentSegments.size();
+        if(packetPoll.dataId==dataId){
+            auto packetDownload = packetPoll.getResponsePacket(PACKET_DOWNLOAD);
+            auto n =  readAggregatedPacket(downloadGroup.data,downloadOffset,packetDownload,limits.responseDataOf(packetPoll.dnsQueryType));
+            sentSegments.push_back({packetDownload.type,packetDownload.data});
+            count(&ConnectionCounters::goodputBytesDown,n);
+            TRACE_PACKET(TRACE_SEGMENT_CREATED,TRACE_SERVER,packetDownload,n);
+            if(n==0) {
+                addDownloadedPackets(connGroupId,sentSegments);
+                downloadGroup=AggregatedPacket();
+                sendingGroup=false;
+                connGroupId++;
             }
+            return sendPacketResp(packetDownload);
+        }else if(packetPoll.dataId<dataId){
+            //the response got lost, answer the new poll with the same segment
+            count(&ConnectionCounters::retransmits);
+            const auto& seg = sentSegments[packetPoll.dataId];
+            auto packetResp = packetPoll.getResponsePacket((packet_t)seg.type);
+            packetResp.data=seg.data;
+            TRACE_PACKET(TRACE_RETRANSMIT,TRACE_SERVER,packetResp,seg.data.size);
+            return sendPacketResp(packetResp);
+        }else{
+            LOG_LIMITED(LOG_WARN,"advanced data id in packetPoll : %u",packetPoll.dataId);
+            count(&ConnectionCounters::discards);
+            TRACE_PACKET(TRACE_DISCARD,TRACE_SERVER,packetPoll,0);
+            return sendPacketResp(packetPoll.getResponsePacket(PACKET_DISCARD));
+        }
+    }
 
-            if(packetPoll.dataId==dataId){
-                auto packetDownload = packetPoll.getResponsePacket(PACKET_DOWNLOAD);
-                auto n =  readAggregatedPacket(br,packetDownload);
-               // printf("down %u,%u,%s,n=%zu\n",packetDownload.groupId,packetDownload.dataId, packetTypeName(packetDownload.type),n);
-                if(sendPacketResp(packetDownload)<0) return -1;
-                if(temp.empty() || temp.back().dataId!= packetDownload.dataId){
-                    temp.push_back(std::move(packetDownload));
-                }
-                dataId++;
-                if(n==0) {
-                    addDownloadedPackets(connGroupId,temp);
-                    return 1;
-                }
-            }else if(packetPoll.dataId<dataId){
-                //printf("down1 %u,%u\n",connGroupId,packetPoll.dataId);
-                if(sendPacketResp(temp[packetPoll.dataId])<0) return -1;
-            }else{
-                Log::printf(LOG_WARN,"advanced data id in packetPoll : %u",packetPoll.dataId);
-                if(sendPacketResp(packetPoll.getResponsePacket(PACKET_DISCARD))<0) return -1;
-            }
+    void ClientConnection::checkIdle() {
+        if(!running.load()) return;
+        auto idle = Clock::now()-lastPoll;
+        if(idle>=chrono::seconds(idleTimeout)){
+            handleIdle();
+            return;
         }
-        return -1;
+        //rounded up, a timer due in less than a millisecond would fire at once and find the session not idle yet
+        auto remain = chrono::ceil<chrono::milliseconds>(chrono::seconds(idleTimeout)-idle).count();
+        weak_ptr<ClientConnection> weak = shared_from_this();
+        worker->loop.runAfter((int)remain,[weak](){
+            auto self = weak.lock();
+            if(self) self->checkIdle();
+        });
+    }
+
+    int ClientConnection::sendPacketResp(const Packet &packet) {
+        if(!noConnErr()) return -1;
+        return worker->sendPacketResp(packet);
     }
 
     void ClientConnection::open() {
         if(err->load()==DSCE_NULL && !running.load()) {
             running.store(true);
-            uploadThread=thread(std::bind(&ClientConnection::uploading,this));
-            downloadThread=thread(std::thread(&ClientConnection::downloading , this));
             name=std::to_string(sessionId)+"@"+user.id;
-            Log::printf(LOG_TRACE,"ClientConnection '%s' opened",name.c_str());
+            lastPoll=Clock::now();
+            auto self = shared_from_this();
+            worker->loop.post([self](){self->checkIdle();});
+            LOG_PRINTF(LOG_TRACE,"ClientConnection '%s' opened",name.c_str());
         }
     }
 
     ssize_t ClientConnection::read(void *dst, int timeout) {
         if(!running.load()){
-            Log::printf(LOG_ERROR,"writing data to a closed ClientConnection");
+            LOG_PRINTF(LOG_ERROR,"writing data to a closed ClientConnection");
             return -1;
         }
 
         if(!noConnErr()){
             return -1;
         }
-        AggregatedPacket packet;
-        if (inboundBuffer.pop(packet,timeout)==POP_SUCCESSFULLY){
-            memcpy(dst,packet.data.data,packet.data.size);
-            return packet.data.size;
+        BufferChain chain;
+        if (popInbound(inboundBuffer,chain,timeout)>0){
+            return chain.copyTo(dst,chain.size);
         }
         return -1;
     }
 
-    ssize_t ClientConnection::write(const void *src, size_t len) {
+    ssize_t ClientConnection::write(const void *src, size_t len, int timeout) {
         if(!running.load()){
-            Log::printf(LOG_ERROR,"writing data to a closed DnsClientChannel");
+            LOG_PRINTF(LOG_ERROR,"writing data to a closed DnsClientChannel");
             return -1;
         }
 
         if(!noConnErr()){
             return -1;
         }
-        AggregatedPacket aggregatedPacket={Bytes(src,len)};
-        downloadBuffer.push(std::move(aggregatedPacket));
+        AggregatedPacket aggregatedPacket={Buffer::copyOf(src,len)};
+        if(pushOutbound(downloadBuffer,std::move(aggregatedPacket),timeout)<0){
+            return -1;
+        }
         return len;
     }
 
     ssize_t ClientConnection::read(Bytes &dst, int timeout) {
+        BufferChain chain;
+        auto n = read(chain,timeout);
+        if(n>=0) dst=chain.toBytes();
+        return n;
+    }
+
+    ssize_t ClientConnection::write(const Bytes &src, int timeout) {
+        return write(Buffer::copyOf(src),timeout);
+    }
+
+    ssize_t ClientConnection::read(Buffer &dst, int timeout) {
+        BufferChain chain;
+        auto n = read(chain,timeout);
+        if(n>=0) dst=chain.contiguous();
+        return n;
+    }
+
+    ssize_t ClientConnection::read(BufferChain &dst, int timeout) {
         if(!running.load()){
-            Log::printf(LOG_ERROR,"writing data to a closed ClientConnection");
+            LOG_PRINTF(LOG_ERROR,"writing data to a closed ClientConnection");
             return -1;
         }
         if(!noConnErr()){
             return -1;
         }
-        AggregatedPacket packet;
-        if (inboundBuffer.pop(packet,timeout)==POP_SUCCESSFULLY){
-            dst=std::move(packet.data);
+        if (popInbound(inboundBuffer,dst,timeout)>0){
             return dst.size;
         }
         return -1;
     }
 
-    ssize_t ClientConnection::write(const Bytes &src) {
+    ssize_t ClientConnection::write(const Buffer &src, int timeout) {
         if(!running.load()){
-            Log::printf(LOG_ERROR,"writing data to a closed DnsClientChannel");
+            LOG_PRINTF(LOG_ERROR,"writing data to a closed DnsClientChannel");
             return -1;
         }
 
@@ -401,12 +667,14 @@ namespace ucsmq{
             return -1;
         }
         AggregatedPacket aggregatedPacket={src};
-        downloadBuffer.push(std::move(aggregatedPacket));
+        if(pushOutbound(downloadBuffer,std::move(aggregatedPacket),timeout)<0){
+            return -1;
+        }
         return src.size;
     }
 
     void ClientConnection::handleIdle() {
-        Log::printf(LOG_INFO,"ClientConnection '%s' is idle",name.c_str());
+        LOG_PRINTF(LOG_INFO,"ClientConnection '%s' is idle",name.c_str());
         connErr.store(CCE_IDLE);
         closeBuffer();
         close();
@@ -414,8 +682,6 @@ namespace ucsmq{
 
     void ClientConnection::closeBuffer() {
         downloadBuffer.unblock();
-        uploadBuffer.unblock();
-        pollBuffer.unblock();
         inboundBuffer.unblock();
     }
 
@@ -423,32 +689,116 @@ namespace ucsmq{
         return !(err->load()==DSCE_NETWORK_ERR || connErr.load()==CCE_IDLE);
     }
 
-    void ClientConnection::addDownloadedPackets(group_id_t groupId, vector <Packet> &packets) {
+    void ClientConnection::addDownloadedPackets(group_id_t groupId, vector <SentSegment> &segments) {
         if (downloadedPackets.size()>=downloadedPacketsStorageLimit){
             downloadedPackets.pop_front();
         }
-        downloadedPackets.push_back(make_pair(groupId,std::move(packets)));
+        downloadedPackets.push_back(make_pair(groupId,std::move(segments)));
     }
 
 
     int ClientConnection::downloadPreviousPacket(const Packet &packetPoll) {
         auto packetResp = packetPoll.getResponsePacket(PACKET_DISCARD);
         for(const auto& pa : downloadedPackets){
-            if(pa.first==packetPoll.groupId){
-                for(const auto& packet : pa.second){
-                    if(packet.dataId==packetPoll.dataId){
-                         packetResp.data=packet.data;
-                         packetResp.type=packet.type;
-                    }
-                }
+            if(pa.first==packetPoll.groupId && packetPoll.dataId<pa.second.size()){
+                const auto& seg = pa.second[packetPoll.dataId];
+                packetResp.data=seg.data;
+                packetResp.type=seg.type;
             }
         }
+        count(packetResp.type==PACKET_DISCARD ? &ConnectionCounters::discards : &ConnectionCounters::retransmits);
+        TRACE_PACKET(packetResp.type==PACKET_DISCARD ? TRACE_DISCARD : TRACE_RETRANSMIT,TRACE_SERVER,packetResp,packetResp.data.size);
         if(packetResp.type==PACKET_DISCARD){
-            Log::printf(LOG_WARN,"can not find previous packet , group id : %u,data id : %u , current group id %u:\n previous packets storage : \n %s",packetPoll.groupId,packetPoll.dataId,connGroupId,
+            LOG_LIMITED(LOG_WARN,"can not find previous packet , group id : %u,data id : %u , current group id %u:\n previous packets storage : \n %s",packetPoll.groupId,packetPoll.dataId,connGroupId,
                         lookupPreviousPacket(downloadedPackets).c_str());
         }else{
-            Log::printf(LOG_DEBUG,"send previous packet , group id : %u,data id : %u ",packetPoll.groupId,packetPoll.dataId);
+            LOG_PRINTF(LOG_DEBUG,"send previous packet , group id : %u,data id : %u ",packetPoll.groupId,packetPoll.dataId);
         }
         return sendPacketResp(packetResp);
     }
-}
+
+    void ClientConnection::count(Counter ConnectionCounters::*counter, uint64_t n) {
+        (counters.*counter).add(n);
+        (worker->counters->connections.*counter).add(n);
+    }
+
+    ConnectionMetrics ClientConnection::metrics() const {
+        ConnectionMetrics m;
+        m.add(counters);
+        m.sendQueueBytes=downloadBuffer.totalWeight();
+        m.recvQueueBytes=inboundBuffer.totalWeight();
+        return m;
+    }
+
+    void ConnectionMetrics::add(const ConnectionCounters &c) {
+        polls+=c.polls.value();
+        downloadNothing+=c.downloadNothing.value();
+        uploads+=c.uploads.value();
+        retransmits+=c.retransmits.value();
+        discards+=c.discards.value();
+        probes+=c.probes.value();
+        goodputBytesUp+=c.goodputBytesUp.value();
+        goodputBytesDown+=c.goodputBytesDown.value();
+    }
+
+    void ConnectionMetrics::writeTo(MetricsText &text, const string &labels, const string &prefix) const {
+        text.counter(prefix+"polls_total","Polls received",polls,labels);
+        text.counter(prefix+"download_nothing_total","Polls answered with nothing to download",downloadNothing,labels);
+        text.gauge(prefix+"download_nothing_ratio","Share of the polls answered with nothing to download",
+                   polls==0 ? 0 : (double)downloadNothing/(double)polls,labels);
+        text.counter(prefix+"uploads_total","Upload segments accepted",uploads,labels);
+        text.counter(prefix+"retransmits_total","Segments and acks sent again for the client",retransmits,labels);
+        text.counter(prefix+"discards_total","Queries answered with a discard",discards,labels);
+        text.counter(prefix+"probes_total","Probes of the path of the client answered",probes,labels);
+        text.counter(prefix+"goodput_up_bytes_total","Payload bytes of the groups uploaded",goodputBytesUp,labels);
+        text.counter(prefix+"goodput_down_bytes_total","Payload bytes of the segments downloaded",goodputBytesDown,labels);
+        text.gauge(prefix+"send_queue_bytes","Bytes waiting in the send buffers",(double)sendQueueBytes,labels);
+        text.gauge(prefix+"recv_queue_bytes","Bytes waiting in the receive buffers",(double)recvQueueBytes,labels);
+    }
+
+    ServerChannelMetrics DnsServerChannel::metrics() const {
+        ServerChannelMetrics m;
+        //the reactors come first in counters, then the workers
+        size_t w = workerCount==0 ? 1 : workerCount;
+        for(size_t i=0;i+w<counters.size();i++){
+            m.reactorQueries.push_back(counters[i]->queriesReceived.value());
+        }
+        for(const auto& c : counters){
+            m.queriesReceived+=c->queriesReceived.value();
+            m.wireBytesReceived+=c->wireBytesReceived.value();
+            m.invalidQueries+=c->invalidQueries.value();
+            m.sessionsNotFound+=c->sessionsNotFound.value();
+            m.authentications+=c->authentications.value();
+            m.authenticationFailures+=c->authenticationFailures.value();
+            m.responsesSent+=c->responsesSent.value();
+            m.wireBytesSent+=c->wireBytesSent.value();
+            m.oversizedResponses+=c->oversizedResponses.value();
+            m.connections.add(c->connections);
+        }
+        m.activeSessions=manager->size();
+        manager->forEach([&m](const ClientConnectionPtr& conn){
+            m.connections.sendQueueBytes+=conn->downloadBuffer.totalWeight();
+            m.connections.recvQueueBytes+=conn->inboundBuffer.totalWeight();
+        });
+        return m;
+    }
+
+    void ServerChannelMetrics::writeTo(MetricsText &text, const string &labels) const {
+        text.counter("dnstun_server_queries_received_total","Queries received",queriesReceived,labels);
+        text.counter("dnstun_server_wire_received_bytes_total","Bytes of the queries received",wireBytesReceived,labels);
+        text.counter("dnstun_server_invalid_queries_total","Queries that are not tunnel packets or of an unexpected type",invalidQueries,labels);
+        text.counter("dnstun_server_sessions_not_found_total","Queries of unknown sessions",sessionsNotFound,labels);
+        text.counter("dnstun_server_authentications_total","Sessions authenticated",authentications,labels);
+        text.counter("dnstun_server_authentication_failures_total","Authentications of users not in the white list",authenticationFailures,labels);
+        text.counter("dnstun_server_responses_sent_total","Responses sent",responsesSent,labels);
+        text.counter("dnstun_server_wire_sent_bytes_total","Bytes of the responses sent",wireBytesSent,labels);
+        text.counter("dnstun_server_oversized_responses_total","Responses too large for a datagram, answered with a server failure",oversizedResponses,labels);
+        text.gauge("dnstun_server_active_sessions","Sessions open",(double)activeSessions,labels);
+        for(size_t i=0;i<reactorQueries.size();i++){
+            auto reactor = string("reactor=\"")+to_string(i)+"\"";
+            text.counter("dnstun_server_reactor_queries_received_total","Queries received by a reactor",reactorQueries[i],
+                         labels.empty() ? reactor : labels+","+reactor);
+        }
+        connections.writeTo(text,labels,"dnstun_server_connection_");
+    }
+}
\ No newline at end of file
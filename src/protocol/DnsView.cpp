@@ -0,0 +1,144 @@
+#include "DnsView.h"
+#include "Log.h"
+
+namespace ucsmq{
+    static uint16_t readU16(const uint8_t* p){
+        return (uint16_t)((p[0]<<8)|p[1]);
+    }
+
+    static uint32_t readU32(const uint8_t* p){
+        return ((uint32_t)readU16(p)<<16)|readU16(p+2);
+    }
+
+    /*
+     * Read the name at pos and move pos past it. The labels before a pointer must end before limit,
+     * an open name (the data of a TXT record) may also end at limit instead of '\0'.
+     * Every pointer must point before the previous one, so a loop of pointers is rejected.
+     * A name that is not open takes at most DNS_VIEW_MAX_NAME_LEN bytes once its pointers are followed.
+     * */
+    static const char* readName(const uint8_t* buf,size_t size,size_t& pos,size_t limit,bool open,NameView* name){
+        size_t p=pos,lowest=pos,nameLen=1;
+        bool jumped=false;
+        if(name!= nullptr) name->count=0;
+        while (true){
+            if(p>=limit){
+                if(!open) return "name not terminated";
+                if(!jumped) pos=p;
+                return nullptr;
+            }
+            uint8_t len=buf[p];
+            if(len==0){
+                if(!jumped) pos=p+1;
+                return nullptr;
+            }
+            if((len&0xc0)==0xc0){
+                if(limit-p<2) return "locate domain pointer error";
+                size_t target=((len&0x3f)<<8)|buf[p+1];
+                if(target>=lowest) return "domain pointer does not point backwards";
+                if(!jumped) pos=p+2;
+                jumped=true;
+                lowest=target;
+                limit=size;
+                p=target;
+                continue;
+            }
+            if(len&0xc0) return "unknown label type";
+            if(limit-p-1<len) return "read domain";
+            nameLen+=1+len;
+            if(!open && nameLen>DNS_VIEW_MAX_NAME_LEN) return "name too long";
+            if(name!= nullptr){
+                if(name->count>=DNS_VIEW_MAX_LABELS) return "too many labels";
+                name->labels[name->count++]={(uint16_t)(p+1),len};
+            }
+            p+=1+len;
+        }
+    }
+
+    //answer==nullptr: check and skip the record
+    static const char* readRecord(const uint8_t* buf,size_t size,size_t& pos,AnswerView* answer){
+        auto err = readName(buf,size,pos,size, false, nullptr);
+        if(err!= nullptr) return err;
+        if(size-pos<10) return "read field error";
+        uint16_t type=readU16(buf+pos),dataLen=readU16(buf+pos+8);
+        if(size-pos-10<dataLen) return "data length exception";
+        if(answer!= nullptr){
+            answer->ansType=type;
+            answer->ansClass=readU16(buf+pos+2);
+            answer->ttl=readU32(buf+pos+4);
+            answer->dataOffset=(uint16_t)(pos+10);
+            answer->dataLen=dataLen;
+            answer->data.count=0;
+            if(USE_LABEL(type)){
+                size_t p=pos+10;
+                err = readName(buf,size,p,pos+10+dataLen, true,&answer->data);
+                if(err!= nullptr) return err;
+            }
+        }
+        pos+=10+dataLen;
+        return nullptr;
+    }
+
+    static const char* parseView(DnsView& view,size_t& pos){
+        auto buf=view.buf;
+        auto size=view.size;
+        if(size>UINT16_MAX) return "message too long";
+        if(size<12) return "read field error";
+        view.transactionId=readU16(buf);
+        view.flags=readU16(buf+2);
+        view.questions=readU16(buf+4);
+        view.answerRRs=readU16(buf+6);
+        view.authorityRRs=readU16(buf+8);
+        view.additionalRRs=readU16(buf+10);
+        if(view.questions>DNS_VIEW_MAX_QUERIES) return "too many questions";
+        if(view.answerRRs>DNS_VIEW_MAX_ANSWERS) return "too many answers";
+        pos=12;
+        const char* err;
+        for(uint16_t i=0;i<view.questions;i++){
+            auto& q=view.queries[i];
+            err = readName(buf,size,pos,size, false,&q.question);
+            if(err!= nullptr) return err;
+            if(size-pos<4) return "read field error";
+            q.queryType=readU16(buf+pos);
+            q.queryClass=readU16(buf+pos+2);
+            pos+=4;
+        }
+        for(uint16_t i=0;i<view.answerRRs;i++){
+            err = readRecord(buf,size,pos,&view.answers[i]);
+            if(err!= nullptr) return err;
+        }
+        for(uint32_t i=0;i<(uint32_t)view.authorityRRs+view.additionalRRs;i++){
+            err = readRecord(buf,size,pos, nullptr);
+            if(err!= nullptr) return err;
+        }
+        return nullptr;
+    }
+
+    ssize_t DnsView::parse(DnsView &view, const void *buf, size_t size) {
+        view.buf=(const uint8_t*)buf;
+        view.size=size;
+        size_t pos=0;
+        auto err = parseView(view,pos);
+        if(err!= nullptr){
+            LOG_PRINTF(LOG_ERROR,"%s : resolve dns exception : %s",__FUNCTION__ ,err);
+            return -1;
+        }
+        return (ssize_t)pos;
+    }
+
+    void DnsView::getFlags(int *pQR, int *pRCODE) const {
+        if(pQR!= nullptr) *pQR=(flags & QR_MASK) >> QR_SHIFT;
+        if(pRCODE!= nullptr) *pRCODE=(flags & RCODE_MASK) >> RCODE_SHIFT;
+    }
+
+    Query DnsView::toQuery(const QueryView &query) const {
+        Query q;
+        q.queryType=query.queryType;
+        q.queryClass=query.queryClass;
+        q.question.reserve(query.question.count);
+        for(uint16_t i=0;i<query.question.count;i++){
+            auto& label=query.question.labels[i];
+            q.question.emplace_back(labelData(label),label.len);
+        }
+        return q;
+    }
+}
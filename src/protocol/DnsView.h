@@ -0,0 +1,68 @@
+#ifndef DNS_DNSVIEW_H
+#define DNS_DNSVIEW_H
+#include "Dns.h"
+
+//a name of 255 bytes has at most 127 labels
+#define DNS_VIEW_MAX_LABELS 128
+#define DNS_VIEW_MAX_NAME_LEN 255
+#define DNS_VIEW_MAX_QUERIES 16
+#define DNS_VIEW_MAX_ANSWERS 16
+
+namespace ucsmq{
+    //a label inside the datagram
+    struct LabelView {
+        uint16_t offset;
+        uint8_t len;
+    };
+
+    struct NameView {
+        LabelView labels[DNS_VIEW_MAX_LABELS];
+        uint16_t count;
+    };
+
+    struct QueryView {
+        NameView question;
+        uint16_t queryType;
+        uint16_t queryClass;
+    };
+
+    //the owner name of an answer is skipped, only its data is kept
+    struct AnswerView {
+        uint16_t ansType;
+        uint16_t ansClass;
+        uint32_t ttl;
+        uint16_t dataOffset;
+        uint16_t dataLen;
+        //the labels of the data for NS, CNAME, TXT and PTR
+        NameView data;
+    };
+
+    /*
+     * A dns message parsed in place: the names are kept as label offsets into the datagram and compression pointers
+     * are followed without copying anything, so parse() makes no heap allocation. The view is only valid as long as the datagram.
+     * The questions and the answers are kept, the authority and additional records are checked and skipped.
+     * */
+    struct DnsView {
+        const uint8_t* buf;
+        size_t size;
+        uint16_t transactionId;
+        uint16_t flags;
+        uint16_t questions;
+        uint16_t answerRRs;
+        uint16_t authorityRRs;
+        uint16_t additionalRRs;
+        QueryView queries[DNS_VIEW_MAX_QUERIES];
+        AnswerView answers[DNS_VIEW_MAX_ANSWERS];
+
+        DnsView() : buf(nullptr),size(0),transactionId(0),flags(0),questions(0),answerRRs(0),authorityRRs(0),additionalRRs(0){}
+        DnsView(const DnsView&)=delete;
+        //return the parsed size, -1 if buf is not a dns message or holds more records than the view
+        static ssize_t parse(DnsView& view,const void* buf,size_t size);
+        void getFlags(int* pQR,int* pRCODE) const;
+        const uint8_t* labelData(const LabelView& label) const {return buf+label.offset;}
+        //copy a question out, e.g. to echo it in the response
+        Query toQuery(const QueryView& query) const;
+    };
+}
+
+#endif //DNS_DNSVIEW_H
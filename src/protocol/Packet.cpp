@@ -1,11 +1,14 @@
 #include "Packet.h"
 #include "../lib/base36.h"
+#include "../lib/Random.h"
 #include <algorithm>
 #include "Log.h"
 #include <cmath>
 #include <cstdlib>
 #define MAX_UNENCODED_DATA_LEN_OF_LABEL (MAX_LABEL_LEN/2 -3)
 #define MAX_ANSWER 5
+//the decoded fragments of one message, before they are ordered
+#define PAYLOAD_SCRATCH_SIZE (1024*16)
 
 using namespace std;
 namespace ucsmq{
@@ -13,110 +16,73 @@ namespace ucsmq{
     const uint32_t maxTTL=300;
     const ::uint32_t  minTTL=20;
 
-    struct Payload_{
-        uint8_t* hpDecoded;
-        size_t len;
-        Payload_(): hpDecoded(nullptr), len(0){}
-        bool operator<(const Payload_& other ) const{
-            return hpDecoded[0]<other.hpDecoded[0];
-        }
-        void destroy(){delete[] hpDecoded , len=0;}
+    //a segment of the payload, decoded from one question or answer. Its first byte orders it among the others
+    struct Fragment{
+        uint16_t offset;
+        uint16_t len;
     };
 
     static int randRange(int min,int max){
-        return min + rand()%(max-min);
-    }
-
-    static bool getPayloadFromLabeledData(Payload_& pld , const vector<Bytes>& data, size_t maxLen){
-        uint8_t *tmp = new uint8_t[maxLen];
-        BytesWriter bw(tmp,maxLen);
-        for(auto& b : data){
-            bw.writeBytes(b);
-        }
-        uint8_t* decoded = new uint8_t [maxLen/2+16];
-        auto n = base36decode(decoded,tmp,bw.writen());
-        delete[] tmp;
-        if(n<0){
-            delete[] decoded;
-            decoded= nullptr;
-            Log::printf(LOG_DEBUG,"fail to base36 decode from data");
-            return false;
-        }
-        pld.hpDecoded=decoded;
-        pld.len=(size_t)n;
-        return true;
-    }
-
-    static void clearPayloads(vector<Payload_>& payloads){
-        for(auto& p : payloads){
-            p.destroy();
-        }
+        return Random::local().range(min,max);
     }
 
-    static size_t splicePayloads(uint8_t* buf,size_t len,const vector<Payload_>& payloads){
-
-        BytesWriter bw(buf,len);
-        for(auto& pld : payloads){
-            if(pld.len>0){
-                bw.writeBytes(pld.hpDecoded+1,pld.len-1);
+    //base36 decode labels as if they were concatenated, a character pair may span two labels
+    static ssize_t decodeLabels(uint8_t* dst,size_t size,const DnsView& view,const LabelView* labels,uint16_t count){
+        uint8_t carry[2];
+        bool carrying=false;
+        size_t n=0;
+        for(uint16_t i=0;i<count;i++){
+            auto p = view.labelData(labels[i]);
+            size_t len = labels[i].len;
+            if(len==0) continue;
+            if(carrying){
+                carry[1]=*p++;
+                len--;
+                if(n>=size || base36decode(dst+n,carry,2)!=1) return -1;
+                n++;
+                carrying=false;
+            }
+            size_t even = len&~(size_t)1;
+            if(size-n<even/2 || base36decode(dst+n,p,even)!=(ssize_t)(even/2)) return -1;
+            n+=even/2;
+            if(len&1){
+                carry[0]=p[even];
+                carrying=true;
             }
         }
-        return bw.writen();
+        return carrying ? -1 : (ssize_t)n;
     }
 
-    static size_t splicePayloads(BytesWriter& bw,const vector<Payload_>& payloads){
+    //order the fragments in scratch and join them into bw without their order bytes
+    static size_t spliceFragments(BytesWriter& bw,const uint8_t* scratch,Fragment* fragments,size_t count){
+        sort(fragments,fragments+count,[scratch](const Fragment& x,const Fragment& y){
+            return scratch[x.offset]<scratch[y.offset];
+        });
         auto n0=bw.writen();
-        for(auto& pld : payloads){
-            if(pld.len>0){
-                bw.writeBytes(pld.hpDecoded+1,pld.len-1);
+        for(size_t i=0;i<count;i++){
+            if(fragments[i].len>0){
+                bw.writeBytes(scratch+fragments[i].offset+1,fragments[i].len-1);
             }
         }
         return bw.writen()-n0;
     }
 
-    static ssize_t getPayloadFromAnswers(BytesWriter &bw, const vector<Answer> &answers) {
-        vector<Payload_> payloads;
-        ssize_t n=-1;
-        for(const auto& ans : answers){
-            if(USE_LABEL(ans.ansType)){
-                Payload_ payload;
-                if(getPayloadFromLabeledData(payload,ans.data,bw.writableBytes())){
-                    payloads.push_back(payload);
-                }else{
-                    goto clear;
-                }
-            }
-        }
-        sort(payloads.begin(),payloads.end());
-        n=splicePayloads(bw,payloads);
-        clear:
-        clearPayloads(payloads);
-        return n;
-    }
-    static ssize_t getPayloadFromAdditional(BytesWriter& bw,const vector<Additional>& additional){
-        vector<Payload_> payloads;
-        ssize_t n=-1;
-        for(const auto& add : additional){
-            if(USE_LABEL(add.addType)){
-                Payload_ payloadInName;
-                if(getPayloadFromLabeledData(payloadInName,add.name,bw.writableBytes())){
-                    payloads.push_back(payloadInName);
-                }else{
-                    goto clear;
-                }
-                Payload_ payloadInData;
-                if(getPayloadFromLabeledData(payloadInData,add.data,bw.writableBytes())){
-                    payloads.push_back(payloadInData);
-                }else{
-                    goto clear;
-                }
+    static ssize_t getPayloadFromAnswers(BytesWriter &bw, const DnsView& view) {
+        uint8_t scratch[PAYLOAD_SCRATCH_SIZE];
+        Fragment fragments[DNS_VIEW_MAX_ANSWERS];
+        size_t count=0,used=0;
+        for(uint16_t i=0;i<view.answerRRs;i++){
+            auto& ans=view.answers[i];
+            if(!USE_LABEL(ans.ansType)) continue;
+            auto n = decodeLabels(scratch+used,sizeof(scratch)-used,view,ans.data.labels,ans.data.count);
+            if(n<0){
+                LOG_PRINTF(LOG_DEBUG,"fail to base36 decode from data");
+                return -1;
             }
+            fragments[count++]={(uint16_t)used,(uint16_t)n};
+            used+=n;
         }
-        sort(payloads.begin(),payloads.end());
-        n=splicePayloads(bw,payloads);
-        clear:
-        clearPayloads(payloads);
-        return n;
+        return (ssize_t)spliceFragments(bw,scratch,fragments,count);
     }
 
     static void writePacketHead(BytesWriter& bw,const Packet& packet){
@@ -128,54 +94,54 @@ namespace ucsmq{
 
     static int readPacketHead(Packet& packet,BytesReader& br){
         if(br.readableBytes()<sizeof(session_id_t)){
-            Log::printf(LOG_DEBUG,"readPacketHead: payload session id missing");
+            LOG_PRINTF(LOG_DEBUG,"readPacketHead: payload session id missing");
             return -1;
         }
         packet.sessionId=br.readNum<session_id_t>();
 
         if(br.readableBytes()<sizeof(group_id_t)){
-            Log::printf(LOG_DEBUG,"readPacketHead: payload group id missing");
+            LOG_PRINTF(LOG_DEBUG,"readPacketHead: payload group id missing");
             return -1;
         }
         packet.groupId=br.readNum<group_id_t>();
 
         if(br.readableBytes()<sizeof(data_id_t)){
-            Log::printf(LOG_DEBUG,"readPacketHead: payload data id missing");
+            LOG_PRINTF(LOG_DEBUG,"readPacketHead: payload data id missing");
             return -1;
         }
         packet.dataId=br.readNum<data_id_t>();
 
         if(br.readableBytes()<sizeof(packet_type_t)){
-            Log::printf(LOG_DEBUG,"readPacketHead: payload type missing");
+            LOG_PRINTF(LOG_DEBUG,"readPacketHead: payload type missing");
             return -1;
         }
         packet.type=br.readNum<packet_type_t>();
         return 0;
     }
 
-    int Packet::dnsRespToPacket(Packet &packet, const Dns &dns) {
+    int Packet::dnsRespToPacket(Packet &packet, const DnsView &dns) {
         int qr , rCode;
-        dns.getFlags(&qr, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr,&rCode);
+        dns.getFlags(&qr,&rCode);
         if(rCode!=NO_ERR) {
-            Log::printf(LOG_DEBUG,"dns has error:\n%s",dns.toString().c_str());
+            LOG_PRINTF(LOG_DEBUG,"dns has error : rcode %d",rCode);
             return -1;
         }
         if(qr!=DNS_RESP) {
-            Log::printf(LOG_DEBUG,"in function dnsRespToPacket , qr is not a dns response:\n%s",dns.toString().c_str());
+            LOG_PRINTF(LOG_DEBUG,"in function dnsRespToPacket , qr is not a dns response");
             return -1;
         }
         packet.qr=qr;
         packet.dnsTransactionId=dns.transactionId;
         uint8_t payload[BUF_SIZE];
         BytesWriter bw(payload, sizeof(payload));
-        auto payloadLen  = getPayloadFromAnswers(bw,dns.answers);
+        auto payloadLen  = getPayloadFromAnswers(bw,dns);
         if (payloadLen<0) return -1;
 
         BytesReader br(payload,payloadLen);
         if(readPacketHead(packet,br)<0){
             return -1;
         }
-        packet.data=br.readBytes(br.readableBytes());
+        packet.data=Buffer::copyOf(payload+br.readn(),br.readableBytes());
         return 0;
     }
 
@@ -189,19 +155,57 @@ namespace ucsmq{
 
     static uint8_t randLabelSize(){
         const uint8_t base = 5;
-        return (uint8_t)(base+1+abs(rand()) % (MAX_UNENCODED_DATA_LEN_OF_LABEL-base));
+        return (uint8_t)(base+1+Random::local().below(MAX_UNENCODED_DATA_LEN_OF_LABEL-base));
     }
 
+    static const record_t recordTypes[RECORD_TYPE_COUNT]={TXT,CNAME,PTR};
+
     record_t randRecordType(){
 #if 1
-        const static record_t t[]={TXT,CNAME,PTR};
-        const static auto n = sizeof(t)/sizeof(t[0]);
-         return  t[::rand()%n];
+         return  recordTypes[Random::local().below(RECORD_TYPE_COUNT)];
 #else
         return TXT;
 #endif
     }
 
+    record_t randRecordType(uint8_t mask){
+        mask&=ALL_RECORD_TYPES;
+        if(mask==0 || mask==ALL_RECORD_TYPES) return randRecordType();
+        int indexes[RECORD_TYPE_COUNT],n=0;
+        for(int i=0;i<RECORD_TYPE_COUNT;i++){
+            if(mask&(1<<i)) indexes[n++]=i;
+        }
+        return recordTypes[indexes[Random::local().below(n)]];
+    }
+
+    int recordTypeIndex(record_t type){
+        for(int i=0;i<RECORD_TYPE_COUNT;i++){
+            if(recordTypes[i]==type) return i;
+        }
+        return -1;
+    }
+
+    record_t recordTypeAt(int index){
+        return recordTypes[index];
+    }
+
+    PathLimits::PathLimits() {
+        for(int i=0;i<RECORD_TYPE_COUNT;i++){
+            queryName[i]=MAX_TOTAL_DOMAIN_LEN;
+            responseData[i]=MAX_RESPONSE_DATA_LEN;
+        }
+    }
+
+    size_t PathLimits::queryNameOf(record_t type) const {
+        auto i = recordTypeIndex(type);
+        return i<0 ? MAX_TOTAL_DOMAIN_LEN : queryName[i];
+    }
+
+    size_t PathLimits::responseDataOf(record_t type) const {
+        auto i = recordTypeIndex(type);
+        return i<0 ? MAX_RESPONSE_DATA_LEN : responseData[i];
+    }
+
     static Query writeToQuery(Readable& br ,record_t qType,const vector<Bytes>& domain,uint8_t cnt){
         uint8_t encodedPayload[1024], payload[512] , n =0,dlen = domainLen(domain) ,len ;
         Query q;
@@ -218,7 +222,7 @@ namespace ucsmq{
             bw.jmp();
         }
         if(q.question.empty()){
-            Log::printf(LOG_WARN, "write empty data to a query");
+            LOG_PRINTF(LOG_WARN, "write empty data to a query");
         }
         for(auto& b : domain){
             q.question.push_back(b);
@@ -249,7 +253,7 @@ namespace ucsmq{
         dns.transactionId=transactionId;
         BytesWriter bw(unencoded, sizeof(unencoded));
         writePacketHead(bw,packet);
-        bw.writeBytes(packet.data);
+        bw.writeBytes(packet.data.data,packet.data.size);
         dns.setFlag(QR_MASK,DNS_QUERY);
         dns.setFlag(RD_MASK,1);
         BytesReader br(unencoded,bw.writen());
@@ -287,118 +291,461 @@ namespace ucsmq{
     return move(a);
 }
 #endif
+    //the echoed questions of packet, read back into dns.queries
+    static void readQuestions(Dns& dns,const Packet& packet){
+        auto p = packet.questions.data , end = p+packet.questions.size;
+        for(uint16_t i=0;i<packet.questionCount && p<end;i++){
+            dns.queries.emplace_back();
+            auto& q = dns.queries.back();
+            while (p<end && *p!=0){
+                q.question.emplace_back(p+1,*p);
+                p+=1+*p;
+            }
+            if(end-p<5) break;
+            q.queryType=(uint16_t)((p[1]<<8)|p[2]);
+            q.queryClass=(uint16_t)((p[3]<<8)|p[4]);
+            p+=5;
+        }
+    }
+
+    //copy the questions of view once, every response to the packet shares them
+    static Buffer echoQuestions(const DnsView& view){
+        size_t n=0;
+        for(uint16_t i=0;i<view.questions;i++){
+            auto& name = view.queries[i].question;
+            for(uint16_t k=0;k<name.count;k++) n+=1+name.labels[k].len;
+            n+=1+2*sizeof(uint16_t);
+        }
+        return Buffer::build(n,[&view,n](uint8_t* p){
+            BytesWriter bw(p,n);
+            for(uint16_t i=0;i<view.questions;i++){
+                auto& q = view.queries[i];
+                for(uint16_t k=0;k<q.question.count;k++){
+                    auto& label = q.question.labels[k];
+                    bw.writeNum(label.len);
+                    bw.writeBytes(view.labelData(label),label.len);
+                }
+                bw.writeNum((uint8_t)0);
+                bw.writeNum(q.queryType);
+                bw.writeNum(q.queryClass);
+            }
+            return bw.writen();
+        });
+    }
+
     int Packet::packetToDnsResp(Dns &dns,uint16_t transactionId ,const Packet &packet) {
         dns.transactionId=transactionId;
-        dns.questions=packet.originalQueries.size();
+        readQuestions(dns,packet);
+        dns.questions=dns.queries.size();
+        dns.setFlag(QR_MASK,DNS_RESP);
         if(dns.questions==0){
-            Log::printf(LOG_WARN,"dns response without original questions");
+            LOG_LIMITED(LOG_WARN,"dns response without original questions");
+            return 0;
         }
-        dns.queries=packet.originalQueries;
-        dns.setFlag(QR_MASK,DNS_RESP);
 
         uint8_t unencoded[BUF_SIZE];
         BytesWriter bw(unencoded, sizeof(unencoded));
         writePacketHead(bw,packet);
-        bw.writeBytes(packet.data);
+        bw.writeBytes(packet.data.data,packet.data.size);
         BytesReader br(unencoded,bw.writen());
 
-        for(size_t i=0;i< br.readableBytes()>0 ;i++){
-            if(i>=UINT8_MAX-1) Log::printf(LOG_WARN,"in packetToDnsResp, ansCnt exceeds range of uint8_t");
-            dns.answers.push_back(writeToAnswer(br, packet.originalQueries.front(),i+1));
+        for(size_t i=0;br.readableBytes()>0 ;i++){
+            if(i>=UINT8_MAX-1) LOG_PRINTF(LOG_WARN,"in packetToDnsResp, ansCnt exceeds range of uint8_t");
+            dns.answers.push_back(writeToAnswer(br, dns.queries.front(),i+1));
         }
         dns.answerRRs=dns.answers.size();
 
         return 0;
     }
 
-    static bool cmpMyDomain(const vector<Bytes>& names,const vector<Bytes> &myDomain){
-        size_t n1=names.size() , n2=myDomain.size();
+    DomainSuffix::DomainSuffix(const vector<Bytes> &domain) : DomainSuffix() {
+        len=domainLen(domain);
+        if(len>=sizeof(bytes)){
+            LOG_PRINTF(LOG_ERROR,"domain is too long : %zu",len);
+            return;
+        }
+        BytesWriter bw(bytes,sizeof(bytes));
+        for(auto& b : domain){
+            bw.writeNum((uint8_t)b.size);
+            bw.writeBytes(b);
+        }
+        bw.writeNum((uint8_t)0);
+        size=bw.writen();
+    }
+
+    //the head of a packet followed by its data, read without copying them together
+    struct PacketReader : public Readable {
+        BytesReader& head;
+        BytesReader& data;
+        PacketReader(BytesReader& head_,BytesReader& data_) : head(head_),data(data_){}
+        size_t readBytes(void* dst,size_t len) override {
+            auto n = head.readBytes(dst,len);
+            return n+data.readBytes((uint8_t*)dst+n,len-n);
+        }
+        size_t readableBytes() const override {return head.readableBytes()+data.readableBytes();}
+    };
+
+    static bool hasRoom(const BytesWriter& bw,size_t n){
+        return bw.writableBytes()>=n;
+    }
+
+    static void writeHeader(void* buf,uint16_t transactionId,uint16_t flags,uint16_t questions,uint16_t answers){
+        BytesWriter bw(buf,DNS_HEADER_SIZE);
+        bw.writeNum(transactionId);
+        bw.writeNum(flags);
+        bw.writeNum(questions);
+        bw.writeNum(answers);
+        bw.writeNum((uint16_t)0);
+        bw.writeNum((uint16_t)0);
+    }
+
+    /*
+     * The labels carrying r, cnt first, of random lengths as writeToQuery and writeToLabeledData split them. They take
+     * at most budget bytes on the wire, length bytes included: the last label is cut short to fill the budget.
+     * Return the bytes written, -1 if bw is full.
+     * */
+    static ssize_t writeDataLabels(BytesWriter& bw,Readable& r,uint8_t cnt,size_t budget){
+        uint8_t payload[MAX_UNENCODED_DATA_LEN_OF_LABEL+1],encoded[sizeof(payload)*2];
+        size_t n=0,k=0;
+        payload[k++]=cnt;
+        while(r.readableBytes()>0){
+            //bytes the next label has room for, two characters each after its length byte
+            size_t room = budget>n+1 ? (budget-n-1)/2 : 0;
+            if(room<=k) break;
+            auto len = min<size_t>(randLabelSize(),room-k);
+            k+=r.readBytes(payload+k,len);
+            auto encodedN = base36encode(encoded,payload,k);
+            if(!hasRoom(bw,1+encodedN)) return -1;
+            bw.writeNum((uint8_t)encodedN);
+            bw.writeBytes(encoded,encodedN);
+            n+=1+encodedN;
+            k=0;
+        }
+        return n;
+    }
+
+    static int writeQuestion(BytesWriter& bw,Readable& r,uint8_t cnt,record_t type,const DomainSuffix& domain,size_t nameLimit){
+        nameLimit=min<size_t>(nameLimit,MAX_NAME_LEN);
+        size_t budget = domain.size<nameLimit ? nameLimit-domain.size : 0;
+        auto n = writeDataLabels(bw,r,cnt,budget);
+        if(n<0 || !hasRoom(bw,domain.size+2*sizeof(uint16_t))) return -1;
+        if(n==0){
+            LOG_PRINTF(LOG_WARN, "write empty data to a query");
+        }
+        bw.writeBytes(domain.bytes,domain.size);
+        bw.writeNum((uint16_t)type);
+        bw.writeNum((uint16_t)1);
+        return 0;
+    }
+
+    ssize_t Packet::queryBytes(void *buf, size_t size, const Packet &packet, const DomainSuffix &domain, size_t nameLimit) {
+        if(size<=DNS_HEADER_SIZE) return -1;
+        uint8_t head[16];
+        BytesWriter hw(head, sizeof(head));
+        writePacketHead(hw,packet);
+        BytesReader headBr(head,hw.writen()),dataBr(packet.data.data,packet.data.size);
+        PacketReader r(headBr,dataBr);
+
+        BytesWriter bw(buf,size);
+        bw.jmp(DNS_HEADER_SIZE);
+        uint16_t questions=0;
+        while(r.readableBytes()>0){
+            auto n0 = r.readableBytes();
+            if(writeQuestion(bw,r,(uint8_t)(++questions),packet.dnsQueryType,domain,nameLimit)<0) return -1;
+            if(r.readableBytes()==n0){
+                LOG_PRINTF(LOG_ERROR,"domain leaves no room for data in a query");
+                return -1;
+            }
+        }
+        writeHeader(buf,packet.dnsTransactionId,RD_MASK,questions,0);
+        return bw.writen();
+    }
+
+    ssize_t Packet::singleQueryBytes(void *buf, size_t size, const Packet &packet, BytesReader &br, const DomainSuffix &domain,
+                                     size_t nameLimit) {
+        if(size<=DNS_HEADER_SIZE) return -1;
+        uint8_t head[16];
+        BytesWriter hw(head, sizeof(head));
+        writePacketHead(hw,packet);
+        BytesReader headBr(head,hw.writen());
+        PacketReader r(headBr,br);
+
+        BytesWriter bw(buf,size);
+        bw.jmp(DNS_HEADER_SIZE);
+        if(writeQuestion(bw,r,1,packet.dnsQueryType,domain,nameLimit)<0) return -1;
+        writeHeader(buf,packet.dnsTransactionId,RD_MASK,1,0);
+        return bw.writen();
+    }
+
+    ssize_t Packet::responseBytes(void *buf, size_t size, const Packet &packet) {
+        if(size<=DNS_HEADER_SIZE+packet.questions.size) return -1;
+        BytesWriter bw(buf,size);
+        bw.jmp(DNS_HEADER_SIZE);
+        if(packet.questionCount==0){
+            LOG_LIMITED(LOG_WARN,"dns response without original questions");
+            writeHeader(buf,packet.dnsTransactionId,QR_MASK,0,0);
+            return bw.writen();
+        }
+        bw.writeBytes(packet.questions.data,packet.questions.size);
+
+        //every answer is named by a pointer to the first question and has its type and class
+        uint8_t answerHead[3*sizeof(uint16_t)];
+        BytesWriter aw(answerHead,sizeof(answerHead));
+        aw.writeNum((uint16_t)(0xc000u|DNS_HEADER_SIZE));
+        auto q = packet.questions.data;
+        while(*q!=0) q+=1+*q;
+        aw.writeBytes(q+1,2*sizeof(uint16_t));
+        auto type = (record_t)((q[1]<<8)|q[2]);
+
+        uint8_t head[16];
+        BytesWriter hw(head, sizeof(head));
+        writePacketHead(hw,packet);
+        BytesReader headBr(head,hw.writen()),dataBr(packet.data.data,packet.data.size);
+        PacketReader r(headBr,dataBr);
+        uint16_t answers=0;
+        while(r.readableBytes()>0){
+            if(answers>=UINT8_MAX-1) LOG_PRINTF(LOG_WARN,"in responseBytes, ansCnt exceeds range of uint8_t");
+            if(!hasRoom(bw,sizeof(answerHead)+sizeof(uint32_t)+sizeof(uint16_t))) return -1;
+            bw.writeBytes(answerHead,sizeof(answerHead));
+            bw.writeNum(randTTL());
+            auto dataLenPos = bw.writen();
+            bw.writeNum((uint16_t)0);
+            auto n = writeDataLabels(bw,r,(uint8_t)(++answers),MAX_TOTAL_DOMAIN_LEN);
+            if(n<0) return -1;
+            if(DATA_SHOULD_APPEND0(type) && n>0){
+                if(!bw.writeNum((uint8_t)0)) return -1;
+                n++;
+            }
+            BytesWriter(static_cast<uint8_t*>(buf)+dataLenPos,sizeof(uint16_t)).writeNum((uint16_t)n);
+        }
+        writeHeader(buf,packet.dnsTransactionId,QR_MASK,packet.questionCount,answers);
+        return bw.writen();
+    }
+
+    ssize_t Packet::failureBytes(void *buf, size_t size, const Packet &packet, uint16_t rcode) {
+        if(size<DNS_HEADER_SIZE) return -1;
+        writeHeader(buf,packet.dnsTransactionId,QR_MASK|(rcode&RCODE_MASK),0,0);
+        return DNS_HEADER_SIZE;
+    }
+
+    static bool cmpMyDomain(const DnsView& view,const NameView& names,const vector<Bytes> &myDomain){
+        size_t n1=names.count , n2=myDomain.size();
         for(size_t i =0;i<n2;i++){
-            if(names[n1-1-i] != myDomain[n2-1-i]) return false;
+            auto& label=names.labels[n1-1-i];
+            auto& b=myDomain[n2-1-i];
+            if(label.len!=b.size || memcmp(view.labelData(label),b.data,b.size)!=0) return false;
         }
         return true;
     }
-    static int getPayloadFromQuery(Payload_& payload, const vector<Bytes>& names, const vector<Bytes> &myDomain){
-        if(names.size()<=myDomain.size()) {
-            Log::printf(LOG_DEBUG,"getPayloadFromQuery: query domain length exception in request");
+
+    static ssize_t getPayloadFromQuery(uint8_t* dst,size_t size,const DnsView& view,const NameView& names,const vector<Bytes> &myDomain){
+        if(names.count<=myDomain.size()) {
+            LOG_PRINTF(LOG_DEBUG,"getPayloadFromQuery: query domain length exception in request");
             return -1;
         }
-        if(!cmpMyDomain(names,myDomain)){
-            Log::printf(LOG_WARN,"getPayloadFromQuery: parent domain error in query");
-        }
-        size_t endPos = names.size()-myDomain.size()  , dlen= domainLen(names);
-        uint8_t * tmp=new uint8_t[dlen];
-        BytesWriter bw(tmp,dlen);
-        for(size_t i=0;i<endPos;i++){
-            bw.writeBytes(names[i]);
+        if(!cmpMyDomain(view,names,myDomain)){
+            LOG_LIMITED(LOG_WARN,"getPayloadFromQuery: parent domain error in query");
         }
-        uint8_t *decodedPayload=new uint8_t[dlen/2+16];
-        auto decodeN = base36decode(decodedPayload, tmp, bw.writen());
-        delete[] tmp;
+        auto decodeN = decodeLabels(dst,size,view,names.labels,(uint16_t)(names.count-myDomain.size()));
         if(decodeN<0){
-            delete[] decodedPayload;
-            Log::printf(LOG_DEBUG,"getPayloadFromQuery: base36 decoding error");
+            LOG_PRINTF(LOG_DEBUG,"getPayloadFromQuery: base36 decoding error");
             return -1;
         }
-        payload.len=decodeN;
-        payload.hpDecoded=decodedPayload;
-        return 0;
+        return decodeN;
     }
 
-    static ssize_t getValuableQueryPayload(uint8_t* out,size_t size,const Dns& dns,const vector<Bytes> &myDomain){
-        vector<Payload_> queryPayloads;
-        ssize_t resultSize=0;
-
-        for(auto& q : dns.queries){
-            Payload_ payload;
-            if(getPayloadFromQuery(payload,q.question,myDomain)<0){
-                resultSize=-1;
-                goto clear;
-            }
-            queryPayloads.push_back(payload);
+    static ssize_t getValuableQueryPayload(BytesWriter& bw,const DnsView& view,const vector<Bytes> &myDomain){
+        uint8_t scratch[PAYLOAD_SCRATCH_SIZE];
+        Fragment fragments[DNS_VIEW_MAX_QUERIES];
+        size_t used=0;
+        for(uint16_t i=0;i<view.questions;i++){
+            auto n = getPayloadFromQuery(scratch+used,sizeof(scratch)-used,view,view.queries[i].question,myDomain);
+            if(n<0) return -1;
+            fragments[i]={(uint16_t)used,(uint16_t)n};
+            used+=n;
         }
-        sort(queryPayloads.begin(),queryPayloads.end());
-        resultSize+= splicePayloads(out,size,queryPayloads);
-
-        clear:
-        clearPayloads(queryPayloads);
-        return resultSize;
+        return (ssize_t)spliceFragments(bw,scratch,fragments,view.questions);
     }
 
-    int Packet::dnsQueryToPacket(Packet &packet, const Dns &dns, const vector<Bytes> &myDomain) {
+    int Packet::dnsQueryToPacket(Packet &packet, const DnsView &dns, const vector<Bytes> &myDomain) {
         int qr , rCode;
-        dns.getFlags(&qr, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr,&rCode);
+        dns.getFlags(&qr,&rCode);
         if(rCode!=NO_ERR) {
-            Log::printf(LOG_DEBUG,"dns has error");
+            LOG_PRINTF(LOG_DEBUG,"dns has error");
             return -1;
         }
         if(qr!=DNS_QUERY) {
-            Log::printf(LOG_DEBUG,"in function dnsRespToPacket , qr is not a dns response:\n%s",dns.toString().c_str());
+            LOG_PRINTF(LOG_DEBUG,"in function dnsQueryToPacket , qr is not a dns query");
             return -1;
         }
         packet.dnsTransactionId=dns.transactionId;
-        packet.originalQueries=dns.queries;
         packet.qr=qr;
         uint8_t payload[BUF_SIZE];
-        auto payloadLen  = getValuableQueryPayload(payload,sizeof(payload),dns,myDomain);
+        BytesWriter bw(payload, sizeof(payload));
+        auto payloadLen  = getValuableQueryPayload(bw,dns,myDomain);
         if (payloadLen<0) return -1;
 
         BytesReader br(payload,payloadLen);
-        readPacketHead(packet,br);
-        packet.data=br.readBytes(br.readableBytes());
+        if(readPacketHead(packet,br)<0){
+            return -1;
+        }
+        packet.data=Buffer::copyOf(payload+br.readn(),br.readableBytes());
+        packet.questions=echoQuestions(dns);
+        packet.questionCount=dns.questions;
+        packet.dnsQueryType=(record_t)dns.queries[0].queryType;
         return 0;
     }
 
+    //a question of a datagram, its labels carrying data lie in [start,end)
+    struct QuestionSpan{
+        uint16_t start;
+        uint16_t end;
+    };
+
+    //base36 decode the wire labels in [p,end), a character pair may span two labels
+    static ssize_t decodeWireLabels(uint8_t* dst,size_t size,const uint8_t* p,const uint8_t* end){
+        uint8_t carry[2];
+        bool carrying=false;
+        size_t n=0;
+        while(p<end){
+            size_t len = *p++;
+            if(len==0) continue;
+            if(carrying){
+                carry[1]=*p++;
+                len--;
+                if(n>=size || base36decode(dst+n,carry,2)!=1) return -1;
+                n++;
+                carrying=false;
+            }
+            size_t even = len&~(size_t)1;
+            if(size-n<even/2 || base36decode(dst+n,p,even)!=(ssize_t)(even/2)) return -1;
+            n+=even/2;
+            if(len&1){
+                carry[0]=p[even];
+                carrying=true;
+            }
+            p+=len;
+        }
+        return carrying ? -1 : (ssize_t)n;
+    }
+
+    //resolvers may randomize the case of the names they forward
+    static bool equalsIgnoreCase(const uint8_t* a,const uint8_t* b,size_t n){
+        for(size_t i=0;i<n;i++){
+            if(tolower(a[i])!=tolower(b[i])) return false;
+        }
+        return true;
+    }
+
+    int Packet::wireQueryToPacket(Packet &packet, const void *buf, size_t size, const DomainSuffix &domain) {
+        auto msg = static_cast<const uint8_t*>(buf);
+        if(size<DNS_HEADER_SIZE) return -1;
+        BytesReader hr(msg,DNS_HEADER_SIZE);
+        auto transactionId = hr.readNum<uint16_t>();
+        auto flags = hr.readNum<uint16_t>();
+        auto questions = hr.readNum<uint16_t>();
+        if((flags&RCODE_MASK)!=NO_ERR) {
+            LOG_PRINTF(LOG_DEBUG,"dns has error");
+            return -1;
+        }
+        if(flags&QR_MASK) {
+            LOG_PRINTF(LOG_DEBUG,"in function wireQueryToPacket , qr is not a dns query");
+            return -1;
+        }
+        //no query of a client carries data in more questions, nor does the full parser accept them
+        if(questions==0 || questions>DNS_VIEW_MAX_QUERIES){
+            LOG_PRINTF(LOG_DEBUG,"wireQueryToPacket: %u questions in query",questions);
+            return -1;
+        }
+
+        //walk the question section once, a name ends with the root label or a pointer
+        QuestionSpan spans[DNS_VIEW_MAX_QUERIES];
+        size_t pos=DNS_HEADER_SIZE,encoded=0;
+        uint16_t queryType=0;
+        for(uint16_t i=0;i<questions;i++){
+            size_t start=pos;
+            while(pos<size && msg[pos]!=0){
+                if((msg[pos]&0xc0)!=0) return (msg[pos]&0xc0)==0xc0 ? 0 : -1;
+                pos+=1+msg[pos];
+            }
+            if(pos+1+2*sizeof(uint16_t)>size) return -1;
+            size_t nameEnd = ++pos;
+            if(nameEnd-start>MAX_NAME_LEN){
+                LOG_PRINTF(LOG_DEBUG,"wireQueryToPacket: name of %zu bytes in query",nameEnd-start);
+                return -1;
+            }
+            if(i==0) queryType=(uint16_t)(msg[pos]<<8|msg[pos+1]);
+            pos+=2*sizeof(uint16_t);
+            if(nameEnd-start<=domain.size){
+                LOG_PRINTF(LOG_DEBUG,"wireQueryToPacket: query domain length exception in request");
+                return -1;
+            }
+            if(!equalsIgnoreCase(msg+nameEnd-domain.size,domain.bytes,domain.size)){
+                LOG_LIMITED(LOG_WARN,"wireQueryToPacket: parent domain error in query");
+            }
+            spans[i]={(uint16_t)start,(uint16_t)(nameEnd-domain.size)};
+            encoded+=spans[i].end-spans[i].start;
+        }
+
+        //one block: the question section as it is, then the payload decoded behind it
+        size_t sectionLen = pos-DNS_HEADER_SIZE;
+        Fragment fragments[DNS_VIEW_MAX_QUERIES];
+        bool inOrder=true;
+        auto block = Buffer::build(sectionLen+encoded/2,[&](uint8_t* p){
+            memcpy(p,msg+DNS_HEADER_SIZE,sectionLen);
+            size_t used=sectionLen;
+            for(uint16_t i=0;i<questions;i++){
+                auto n = decodeWireLabels(p+used,encoded/2+sectionLen-used,msg+spans[i].start,msg+spans[i].end);
+                if(n<=0) return (size_t)0;
+                fragments[i]={(uint16_t)used,(uint16_t)n};
+                if(i>0 && p[fragments[i-1].offset]>=p[used]) inOrder=false;
+                used+=n;
+            }
+            if(!inOrder){
+                uint8_t scratch[PAYLOAD_SCRATCH_SIZE];
+                memcpy(scratch,p+sectionLen,used-sectionLen);
+                for(uint16_t i=0;i<questions;i++) fragments[i].offset-=sectionLen;
+                BytesWriter bw(p+sectionLen,used-sectionLen);
+                return sectionLen+spliceFragments(bw,scratch,fragments,questions);
+            }
+            //drop the order bytes, the fragments move left in place
+            size_t n=sectionLen;
+            for(uint16_t i=0;i<questions;i++){
+                memmove(p+n,p+fragments[i].offset+1,fragments[i].len-1);
+                n+=fragments[i].len-1;
+            }
+            return n;
+        });
+        if(block.size<=sectionLen){
+            LOG_PRINTF(LOG_DEBUG,"wireQueryToPacket: base36 decoding error");
+            return -1;
+        }
+
+        packet.dnsTransactionId=transactionId;
+        packet.qr=DNS_QUERY;
+        auto br = block.slice(sectionLen,block.size-sectionLen).reader();
+        if(readPacketHead(packet,br)<0){
+            return -1;
+        }
+        packet.data=block.slice(sectionLen+br.readn(),br.readableBytes());
+        packet.questions=block.slice(0,sectionLen);
+        packet.questionCount=questions;
+        packet.dnsQueryType=(record_t)queryType;
+        return 1;
+    }
+
     std::string Packet::toString() const {
         stringstream ss;
         ss<<"sessionId: "<<sessionId<<endl;
         ss<<"groupId: "<<groupId<<endl;
         ss<<"dataId: "<<dataId<<endl;
         ss<<"type: "<<packetTypeName(type)<<endl;
-        if(originalQueries.size()>0){
-            cout<<"original queries from "<<sockaddr_inStr(source)<<": "<<endl;
-            for(const auto & q : originalQueries){
-                cout<<q.toString()<<endl;
+        if(questionCount>0){
+            Dns dns;
+            readQuestions(dns,*this);
+            ss<<"original queries from "<<sockaddr_inStr(source)<<": "<<endl;
+            for(const auto & q : dns.queries){
+                ss<<q.toString()<<endl;
             }
         }
         ss<<"data: "<<data.hexStr()<<endl;
@@ -430,38 +777,66 @@ namespace ucsmq{
         dns.queries.push_back(writeToQuery(mbr,dnsQueryType,myDomain,1));
         dns.questions=1;
         size_t d = br.readn()-n0;
-        packet.data = Bytes(d);
-        BytesWriter packetBw(packet.data);
-        copy(packetBw,packetBr,d);
+        packet.data = Buffer::build(d,[&packetBr,d](uint8_t* p){
+            return packetBr.readBytes(p,d);
+        });
         return d;
     }
 
     int Packet::authentication(Dns &dns, Packet &packet, const char *userId, const vector<Bytes> &myDomain) {
         BytesReader br(userId);
-        Packet::dataToSingleQuery(dns, packet, br, ::rand(), randRecordType(), packet.sessionId, 0, 0, PACKET_AUTHENTICATE, myDomain);
+        Packet::dataToSingleQuery(dns, packet, br, (uint16_t)Random::local().next(), randRecordType(), packet.sessionId, 0, 0, PACKET_AUTHENTICATE, myDomain);
         return br.readableBytes()==0 ? 1 : -1;
     }
 
     void
     Packet::poll(Dns &dns, Packet &packet, const std::vector<Bytes> &myDomain, session_id_t sessionId, group_id_t groupId,
-                 data_id_t dataId) {
+                 data_id_t dataId, uint32_t window) {
         packet.sessionId=sessionId;
         packet.groupId=groupId;
         packet.dataId=dataId;
         packet.type=PACKET_POLL;
         packet.dnsQueryType=randRecordType();
-        packet.data=std::to_string((short)rand());
-        Packet::packetToDnsQuery(dns,::rand(),packet,myDomain);
+        packet.setWindow(window);
+        Packet::packetToDnsQuery(dns,(uint16_t)Random::local().next(),packet,myDomain);
+    }
+
+    //the mark tells a window from the decimal noise older clients put in their polls
+    #define WINDOW_MARK 0xff
+
+    void Packet::setWindow(uint32_t window) {
+        uint8_t buf[sizeof(uint8_t)+sizeof(uint32_t)+sizeof(uint16_t)];
+        BytesWriter bw(buf,sizeof(buf));
+        bw.writeNum<uint8_t>(WINDOW_MARK);
+        bw.writeNum(window);
+        //keeps identical polls out of the resolvers' caches
+        bw.writeNum<uint16_t>((uint16_t)Random::local().next());
+        data=Buffer::copyOf(buf,bw.writen());
+    }
+
+    uint32_t Packet::window() const {
+        if(data.size<sizeof(uint8_t)+sizeof(uint32_t) || data.data[0]!=WINDOW_MARK){
+            return WINDOW_UNLIMITED;
+        }
+        auto br = data.reader();
+        br.readNum<uint8_t>();
+        return br.readNum<uint32_t>();
+    }
+
+    uint32_t windowOf(size_t room){
+        return room>=WINDOW_UNLIMITED ? WINDOW_UNLIMITED : (uint32_t)room;
     }
 
     Packet Packet::getResponsePacket(packet_t type, group_id_t groupId, data_id_t dataId) const {
         Packet packet;
         packet.source=source;
+        packet.sessionId=sessionId;
         packet.type=type;
         packet.groupId=groupId;
         packet.dataId=dataId;
         packet.dnsTransactionId=dnsTransactionId;
-        packet.originalQueries=originalQueries;
+        packet.questions=questions;
+        packet.questionCount=questionCount;
         return std::move(packet);
     }
 
@@ -473,27 +848,44 @@ namespace ucsmq{
 
     PacketGroup
     disaggregateToQueryPacketGroup(const AggregatedPacket &aggregatedPacket, session_id_t sessionId, group_id_t groupId,
-                                   record_t recordType, uint8_t packetType, const std::vector<Bytes> &myDomain) {
+                                   record_t recordType, uint8_t packetType, const DomainSuffix &domain, size_t nameLimit) {
         PacketGroup group;
-        BytesReader br (aggregatedPacket.data);
+        auto& random = Random::local();
+        auto br = aggregatedPacket.data.reader();
         uint16_t  dataId = DATA_SEG_START;
         while (br.readableBytes()>0 && dataId<UINT8_MAX){
-            Dns dns;Packet packet;
-            Packet::dataToSingleQuery(
-                    dns, packet, br,
-                    rand(), recordType, sessionId, groupId, dataId++, packetType,
-                    myDomain
-            );
-            group.segments.emplace_back(std::move(dns),std::move(packet));
-        }
-        Dns endDns;Packet endPacket;
+            Packet packet;
+            packet.dnsTransactionId=(uint16_t)random.next();
+            packet.sessionId=sessionId;
+            packet.groupId=groupId;
+            packet.dataId=dataId++;
+            packet.type=packetType;
+            packet.dnsQueryType=recordType;
+            auto offset = br.readn();
+            auto query = Buffer::build(DNS_SINGLE_QUERY_SIZE,[&](uint8_t* p){
+                auto n = Packet::singleQueryBytes(p,DNS_SINGLE_QUERY_SIZE,packet,br,domain,nameLimit);
+                return n<0 ? 0 : (size_t)n;
+            });
+            if(query.size==0 || br.readn()==offset){
+                LOG_PRINTF(LOG_ERROR,"failed to encode segment %u of group %u",packet.dataId,groupId);
+                break;
+            }
+            //the segments share the group instead of copying it
+            packet.data=aggregatedPacket.data.slice(offset,br.readn()-offset);
+            group.segments.emplace_back(std::move(query),std::move(packet));
+        }
+        Packet endPacket;
+        endPacket.dnsTransactionId=(uint16_t)random.next();
         endPacket.sessionId=sessionId;
         endPacket.dataId=dataId;
         endPacket.groupId=groupId;
         endPacket.dnsQueryType=recordType;
         endPacket.type=PACKET_GROUP_END;
-        Packet::packetToDnsQuery(endDns,rand(),endPacket,myDomain);
-        group.segments.emplace_back(std::move(endDns),std::move(endPacket));
+        auto endQuery = Buffer::build(DNS_SINGLE_QUERY_SIZE,[&endPacket,&domain,nameLimit](uint8_t* p){
+            auto n = Packet::queryBytes(p,DNS_SINGLE_QUERY_SIZE,endPacket,domain,nameLimit);
+            return n<0 ? 0 : (size_t)n;
+        });
+        group.segments.emplace_back(std::move(endQuery),std::move(endPacket));
         group.groupId=groupId;
         return std::move(group);
     }
@@ -532,6 +924,8 @@ namespace ucsmq{
                 return "PACKET_DATA_ID_SYN";
             case PACKET_DISCARD:
                 return "PACKET_DISCARD";
+            case PACKET_PROBE:
+                return "PACKET_PROBE";
             default:
                 return "UNKNOWN_PACKET_TYPE";
         }
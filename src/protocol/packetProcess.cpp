@@ -1,11 +1,13 @@
 #include "packetProcess.h"
+#include <cerrno>
 namespace ucsmq{
-    AggregatedPacket aggregatePackets(const std::vector<Packet>& packets){
-        AggregatedPacket aggregatedPacket;
+    BufferChain aggregatePackets(const std::vector<Packet>& packets){
+        BufferChain chain;
+        chain.reserve(packets.size());
         for(const auto & packet : packets){
-            aggregatedPacket.data+=packet.data;
+            chain.append(packet.data);
         }
-        return std::move(aggregatedPacket);
+        return chain;
     }
 
     void newPacketGroup(uint16_t& groupId, uint16_t& dataId, Packet& packetDown, std::vector<Packet>& packets){
@@ -18,11 +20,11 @@ namespace ucsmq{
 
     bool verifyPacket(const Packet& packetResp , group_id_t groupId ,data_id_t dataId){
         if(packetResp.groupId!=groupId){
-            Log::printf(LOG_ERROR, "unexpected group id ,got %u,expected %u\n%s",packetResp.groupId,groupId,packetResp.toString().c_str());
+            LOG_PRINTF(LOG_ERROR, "unexpected group id ,got %u,expected %u\n%s",packetResp.groupId,groupId,packetResp.toString().c_str());
             return false;
         }
         if(packetResp.dataId!=dataId){
-            Log::printf(LOG_DEBUG,"received packet ,data id : %u \n%s",packetResp.dataId,packetResp.toString().c_str());
+            LOG_PRINTF(LOG_DEBUG,"received packet ,data id : %u \n%s",packetResp.dataId,packetResp.toString().c_str());
             return false;
         }
         return true;
@@ -37,10 +39,54 @@ namespace ucsmq{
         return -1;
     }
 
-    void exportPackets(BlockingQueue<AggregatedPacket>& buffer,std::vector<Packet>& packets,uint16_t& groupId, uint16_t& dataId){
-        buffer.push(aggregatePackets(packets));
+    ssize_t exportPackets(InboundBuffer& buffer,std::vector<Packet>& packets,uint16_t& groupId, uint16_t& dataId){
+        auto chain = aggregatePackets(packets);
+        auto size = chain.size;
+        if(!buffer.tryPush(std::move(chain))){
+            return -1;
+        }
         packets.clear();
         dataId=DATA_SEG_START;
+        return (ssize_t)size;
+    }
+
+    int pushOutbound(OutboundBuffer& buffer,AggregatedPacket&& aggregatedPacket,int timeout){
+        switch (buffer.push(std::move(aggregatedPacket),timeout)) {
+            case PUSH_SUCCESSFULLY:
+                return 1;
+            case PUSH_AGAIN:
+                errno=EAGAIN;
+                return -1;
+            case PUSH_TIMEOUT:
+                errno=ETIMEDOUT;
+                return -1;
+            default:
+                return -1;
+        }
+    }
+
+    int popInbound(InboundBuffer& buffer,BufferChain& chain,int timeout){
+        switch (buffer.pop(chain,timeout)) {
+            case POP_SUCCESSFULLY:
+                return 1;
+            case POP_TIMEOUT:
+                errno = timeout<0 ? EAGAIN : ETIMEDOUT;
+                return -1;
+            default:
+                return -1;
+        }
+    }
+
+    ssize_t packetRespBytes(const Packet& packet,void* buf,size_t size){
+        return Packet::responseBytes(buf,size,packet);
+    }
+
+    int bytesToPacketResp(Packet& packet,const void* buf,size_t size){
+        DnsView dns;
+        if(DnsView::parse(dns, buf, size)<0){
+            return -1;
+        }
+        return Packet::dnsRespToPacket(packet,dns);
     }
 }
 
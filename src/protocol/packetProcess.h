@@ -4,13 +4,22 @@
 #include "udp.h"
 #include "Packet.h"
 #include <vector>
-#include "BlockingQueue.hpp"
+#include "LockFreeQueue.hpp"
 namespace ucsmq{
-    AggregatedPacket aggregatePackets(const std::vector<Packet>& packets);
+    BufferChain aggregatePackets(const std::vector<Packet>& packets);
     void newPacketGroup(uint16_t& groupId, uint16_t& dataId, Packet& packetDown, std::vector<Packet>& packets);
     bool verifyPacket(const Packet& packetResp , group_id_t groupId ,data_id_t dataId);
     int packetGroupAdd(uint16_t& groupId, uint16_t& dataId, Packet& packetDown, std:: vector<Packet>& packets);
-    void exportPackets(BlockingQueue<AggregatedPacket>& buffer,std::vector<Packet>& packets,uint16_t& groupId, uint16_t& dataId);
+    //return the bytes of the group, or -1 and keep the packets if the buffer is full, the peer will send the group end again
+    ssize_t exportPackets(InboundBuffer& buffer,std::vector<Packet>& packets,uint16_t& groupId, uint16_t& dataId);
+    //push a group written by the application, return -1 with errno EAGAIN or ETIMEDOUT if the buffer stays full
+    int pushOutbound(OutboundBuffer& buffer,AggregatedPacket&& aggregatedPacket,int timeout);
+    //pop a received group for the application, return -1 with errno EAGAIN or ETIMEDOUT if none arrives
+    int popInbound(InboundBuffer& buffer,BufferChain& chain,int timeout);
+    //serialize the dns response carrying packet into buf, return its size
+    ssize_t packetRespBytes(const Packet& packet,void* buf,size_t size);
+    //parse the packet carried by the dns response in buf, return -1 if it is not one
+    int bytesToPacketResp(Packet& packet,const void* buf,size_t size);
 }
 
 #endif //DNSTUN_PACKETPROCESS_H
@@ -0,0 +1,92 @@
+#include "testBuffer.h"
+#include "../src/lib/Buffer.h"
+#include <assert.h>
+#include <cstring>
+#include <string>
+using namespace std;
+using namespace ucsmq;
+
+#define TEST_BUFFER_LEN 100
+
+//a block goes back to the pool with its last view, and the pool hands out the last block it got back first
+static bool recycled(const uint8_t* data){
+    auto next = Buffer::copyOf(string(TEST_BUFFER_LEN,'x').data(),TEST_BUFFER_LEN);
+    return next.data==data;
+}
+
+void testBufferRefs(){
+    assert(Buffer::copyOf("",0).data== nullptr && Buffer::copyOf("",0).size==0);
+
+    string s="0123456789";
+    s.resize(TEST_BUFFER_LEN,'-');
+    auto buffer = Buffer::copyOf(s.data(),s.size());
+    auto data = buffer.data;
+    assert(buffer.size==TEST_BUFFER_LEN && (string)buffer==s);
+
+    //copies and slices share the block
+    Buffer copy(buffer);
+    auto slice = buffer.slice(2,3);
+    assert(copy.data==data && slice.data==data+2 && slice.size==3 && (string)slice=="234");
+    assert(buffer.slice(95,10).size==5 && buffer.slice(200,1).size==0);
+    buffer = Buffer();
+    copy = copy;
+    assert(copy.data==data && !recycled(data));
+    copy = slice;
+    assert(copy.data==data+2 && !recycled(data));
+
+    //a move hands the view over without a new reference
+    Buffer moved(std::move(copy));
+    assert(copy.data== nullptr && copy.size==0 && moved.data==data+2);
+    slice = std::move(moved);
+    assert(moved.data== nullptr && slice.data==data+2 && !recycled(data));
+    slice = std::move(slice);
+    assert(slice.data==data+2);
+    slice = Buffer();
+    assert(recycled(data));
+
+    //build fills the block in place
+    auto built = Buffer::build(TEST_BUFFER_LEN,[](uint8_t* p){
+        memcpy(p,"abc",3);
+        return 3;
+    });
+    assert(built.size==3 && (string)built=="abc" && built.toBytes().size==3);
+
+    //blocks above the largest size class come from the heap
+    string big((1<<BUFFER_POOL_MAX_SHIFT)+1,'b');
+    auto large = Buffer::copyOf(big.data(),big.size());
+    auto largeSlice = large.slice(big.size()-1,1);
+    large = Buffer();
+    assert(largeSlice.size==1 && largeSlice.data[0]=='b');
+}
+
+void testBufferChain(){
+    BufferChain empty;
+    assert(empty.size==0 && empty.contiguous().size==0 && empty.toBytes().size==0);
+
+    auto whole = Buffer::copyOf("hello, world",12);
+    BufferChain chain;
+    chain.append(whole.slice(0,5));
+    chain.append(Buffer());
+    assert(chain.parts.size()==1 && chain.size==5);
+    //a single part is shared, not copied
+    assert(chain.contiguous().data==whole.data);
+
+    chain.append(whole.slice(5,2));
+    chain.append(Buffer::copyOf("there",5));
+    assert(chain.parts.size()==3 && chain.size==12);
+    auto joined = chain.contiguous();
+    assert(joined.size==12 && joined.data!=whole.data && (string)joined=="hello, there");
+    auto bytes = chain.toBytes();
+    assert(bytes.size==12 && memcmp(bytes.data,"hello, there",12)==0);
+
+    char out[16];
+    assert(chain.copyTo(out,6)==6 && memcmp(out,"hello,",6)==0);
+    assert(chain.copyTo(out,sizeof(out))==12 && memcmp(out,"hello, there",12)==0);
+    assert(chain.copyTo(out,0)==0);
+
+    struct iovec iov[4];
+    assert(chain.toIovec(iov,2)==2);
+    assert(iov[0].iov_base==(void*)whole.data && iov[0].iov_len==5);
+    assert(iov[1].iov_base==(void*)(whole.data+5) && iov[1].iov_len==2);
+    assert(chain.toIovec(iov,4)==3 && iov[2].iov_len==5);
+}
@@ -0,0 +1,7 @@
+#ifndef DNSTUN_TESTBUFFER_H
+#define DNSTUN_TESTBUFFER_H
+
+void testBufferRefs();
+void testBufferChain();
+
+#endif //DNSTUN_TESTBUFFER_H
@@ -0,0 +1,47 @@
+#include "testBytes.h"
+#include "../src/lib/Bytes.hpp"
+#include <assert.h>
+#include <string>
+using namespace std;
+using namespace ucsmq;
+
+static string pattern(size_t n,int seed){
+    string s(n,0);
+    for(size_t i=0;i<n;i++) s[i]=(char)(i*31+seed);
+    return s;
+}
+
+//copy() moves more than its stack buffer at a time, across readers, and stops at the smaller side
+void testBytesCopy(){
+    auto a=pattern(700,1),b=pattern(900,2);
+    BytesReader ra(a),rb(b);
+    MultiBytesReader r({&ra,&rb});
+    Bytes dst(2000);
+    BytesWriter w(dst);
+    assert(copy(w,r,1500)==1500);
+    assert(memcmp(dst.data,a.data(),a.size())==0 && memcmp(dst.data+700,b.data(),800)==0);
+    assert(copy(w,r,SIZE_MAX)==100 && r.readableBytes()==0);
+    assert(memcmp(dst.data+1500,b.data()+800,100)==0);
+
+    BytesReader big(b);
+    Bytes small(600);
+    BytesWriter ws(small);
+    assert(copy(ws,big,SIZE_MAX)==600 && ws.writableBytes()==0 && big.readableBytes()==300);
+    assert(memcmp(small.data,b.data(),600)==0);
+    assert(copy(ws,big,SIZE_MAX)==0);
+}
+
+void testBytesAssign(){
+    Bytes a("hello"),b("world!");
+    a=b;
+    assert(a.size==6 && a.data!=b.data && memcmp(a.data,"world!",6)==0);
+    a=a;
+    assert(a.size==6 && memcmp(a.data,"world!",6)==0);
+    auto data=b.data;
+    a=std::move(b);
+    assert(a.data==data && a.size==6 && b.data== nullptr && b.size==0);
+    a=std::move(a);
+    assert(a.data==data && a.size==6);
+    Bytes c(a);
+    assert(c.size==6 && c.data!=a.data && memcmp(c.data,a.data,6)==0);
+}
@@ -0,0 +1,7 @@
+#ifndef DNSTUN_TESTBYTES_H
+#define DNSTUN_TESTBYTES_H
+
+void testBytesCopy();
+void testBytesAssign();
+
+#endif //DNSTUN_TESTBYTES_H
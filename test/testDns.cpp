@@ -1,6 +1,8 @@
 #include "testDns.h"
 #include "../src/protocol/Dns.h"
+#include "Packet.h"
 #include <assert.h>
+#include <string>
 using namespace std;
 using namespace ucsmq;
 unsigned char peer0_0[] = { /* Packet 5 */
@@ -39,3 +41,104 @@ void testDns() {
     assert(n>0);
     cout<<d.toString();
 }
+
+static Query question(const char* name){
+    Query q;
+    q.question=cstrToDomain(name);
+    q.queryType=TXT;
+    return q;
+}
+
+static Answer answer(const char* name,uint16_t type,const vector<Bytes>& data){
+    Answer a;
+    a.name=cstrToDomain(name);
+    a.ansType=type;
+    a.ttl=60;
+    a.data=data;
+    return a;
+}
+
+static size_t labelsLen(const vector<Bytes>& labels){
+    size_t n=0;
+    for(auto& b : labels) n+=1+b.size;
+    return n;
+}
+
+//the hash Dns::bytes files a name of one label under
+static uint32_t labelHash(const string& label){
+    uint32_t h=2166136261u;
+    for(auto c : label) h=(h^(uint8_t)c)*16777619u;
+    return (h^(uint32_t)label.size())*16777619u;
+}
+
+static void roundTrip(const Dns& d,uint8_t* buf,ssize_t n){
+    Dns r;
+    assert(Dns::resolve(r,buf,n)==n);
+    assert(r.queries.size()==d.queries.size() && r.answers.size()==d.answers.size());
+    for(size_t i=0;i<d.queries.size();i++) assert(r.queries[i].question==d.queries[i].question);
+    for(size_t i=0;i<d.answers.size();i++){
+        assert(r.answers[i].name==d.answers[i].name);
+        assert(r.answers[i].data==d.answers[i].data);
+    }
+}
+
+//names sharing their parent domain point at the first one written
+void testDnsCompressSharedSuffix(){
+    Dns d;
+    d.queries.push_back(question("a.tun.example.com"));
+    d.queries.push_back(question("b.tun.example.com"));
+    d.answers.push_back(answer("a.tun.example.com",CNAME,cstrToDomain("c.tun.example.com")));
+    d.questions=2;
+    d.answerRRs=1;
+    uint8_t buf[512];
+    auto n = Dns::bytes(d,buf,sizeof(buf));
+    //the first name in full, then a label and a pointer to tun.example.com for the others
+    size_t first = labelsLen(d.queries[0].question)+1;
+    assert(n==(ssize_t)(DNS_HEADER_SIZE+first+4+2+2+4+2+10+2+2));
+    size_t q2 = DNS_HEADER_SIZE+first+4;
+    assert(buf[q2+2]==0xc0 && buf[q2+3]==DNS_HEADER_SIZE+2);
+    size_t ans = q2+8;
+    assert(buf[ans]==0xc0 && buf[ans+1]==DNS_HEADER_SIZE);
+    roundTrip(d,buf,n);
+}
+
+//two names filed under the same slot of the table are told apart by the message itself
+void testDnsCompressSlotCollision(){
+    string l1="x0",l2;
+    for(int i=1;l2.empty();i++){
+        auto l = "x"+to_string(i);
+        if((labelHash(l)&127)==(labelHash(l1)&127) && labelHash(l)!=labelHash(l1)) l2=l;
+    }
+    Dns d;
+    d.queries.push_back(question(l1.c_str()));
+    d.queries.push_back(question(l2.c_str()));
+    d.answers.push_back(answer(l2.c_str(),CNAME,cstrToDomain(l1.c_str())));
+    d.questions=2;
+    d.answerRRs=1;
+    uint8_t buf[512];
+    auto n = Dns::bytes(d,buf,sizeof(buf));
+    size_t q2 = DNS_HEADER_SIZE+l1.size()+2+4;
+    size_t ans = q2+l2.size()+2+4;
+    assert(n==(ssize_t)(ans+2+10+2));
+    assert(buf[ans]==0xc0 && buf[ans+1]==q2);
+    assert(buf[ans+12]==0xc0 && buf[ans+13]==DNS_HEADER_SIZE);
+    roundTrip(d,buf,n);
+}
+
+//the strings of a TXT record spelling a name already written stay as they are
+void testDnsCompressSkipsTxt(){
+    Dns d;
+    d.queries.push_back(question("t.tun.example.com"));
+    d.answers.push_back(answer("t.tun.example.com",TXT,cstrToDomain("t.tun.example.com")));
+    d.questions=1;
+    d.answerRRs=1;
+    uint8_t buf[512];
+    auto n = Dns::bytes(d,buf,sizeof(buf));
+    size_t ans = DNS_HEADER_SIZE+labelsLen(d.queries[0].question)+1+4;
+    size_t rdata = ans+2+10;
+    size_t txtLen = labelsLen(d.answers[0].data);
+    assert(n==(ssize_t)(rdata+txtLen));
+    assert(((buf[rdata-2]<<8)|buf[rdata-1])==(int)txtLen);
+    assert(memcmp(buf+rdata,buf+DNS_HEADER_SIZE,txtLen)==0);
+    roundTrip(d,buf,n);
+}
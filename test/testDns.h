@@ -6,6 +6,9 @@
 #define DNSTUN_TESTDNS_H
 
 void testDns();
+void testDnsCompressSharedSuffix();
+void testDnsCompressSlotCollision();
+void testDnsCompressSkipsTxt();
 
 
 
@@ -0,0 +1,158 @@
+#include "testDnsView.h"
+#include "../src/protocol/DnsView.h"
+#include <assert.h>
+#include <cstring>
+#include <vector>
+using namespace std;
+using namespace ucsmq;
+
+typedef vector<uint8_t> Msg;
+
+static void putU16(Msg& m,uint16_t v){
+    m.push_back(v>>8);
+    m.push_back(v&0xff);
+}
+
+static void putName(Msg& m,const char* name){
+    while (*name){
+        auto dot=strchr(name,'.');
+        size_t len=dot ? dot-name : strlen(name);
+        m.push_back((uint8_t)len);
+        m.insert(m.end(),name,name+len);
+        name+=len;
+        if(dot) name++;
+    }
+    m.push_back(0);
+}
+
+static Msg header(uint16_t questions,uint16_t answers){
+    Msg m;
+    putU16(m,0x1234);
+    putU16(m,0x8180);
+    putU16(m,questions);
+    putU16(m,answers);
+    putU16(m,0);
+    putU16(m,0);
+    return m;
+}
+
+//a response to abc.xyz TXT, its answer points back at the question and holds the TXT data "hi!"
+static Msg response(){
+    auto m=header(1,1);
+    putName(m,"abc.xyz");
+    putU16(m,TXT);
+    putU16(m,1);
+    putU16(m,0xc00c);
+    putU16(m,TXT);
+    putU16(m,1);
+    putU16(m,0);
+    putU16(m,60);
+    putU16(m,4);
+    m.push_back(3);
+    m.insert(m.end(),{'h','i','!'});
+    return m;
+}
+
+static ssize_t parse(const Msg& m,size_t size){
+    DnsView view;
+    return DnsView::parse(view,m.data(),size);
+}
+
+static ssize_t parse(const Msg& m){
+    return parse(m,m.size());
+}
+
+void testDnsViewParse(){
+    auto m=response();
+    DnsView view;
+    assert(DnsView::parse(view,m.data(),m.size())==(ssize_t)m.size());
+    int qr,rcode;
+    view.getFlags(&qr,&rcode);
+    assert(view.transactionId==0x1234 && qr==1 && rcode==0);
+    assert(view.questions==1 && view.answerRRs==1);
+    auto& q=view.queries[0];
+    assert(q.queryType==TXT && q.question.count==2);
+    assert(q.question.labels[0].len==3 && memcmp(view.labelData(q.question.labels[0]),"abc",3)==0);
+    assert(q.question.labels[1].len==3 && memcmp(view.labelData(q.question.labels[1]),"xyz",3)==0);
+    auto& a=view.answers[0];
+    assert(a.ansType==TXT && a.ttl==60 && a.dataLen==4);
+    assert(a.data.count==1 && a.data.labels[0].len==3 && memcmp(view.labelData(a.data.labels[0]),"hi!",3)==0);
+}
+
+void testDnsViewMalformed(){
+    //every truncation of a valid message is rejected
+    auto m=response();
+    for(size_t n=0;n<m.size();n++){
+        assert(parse(m,n)==-1);
+    }
+
+    //a label longer than what is left
+    m=header(1,0);
+    m.push_back(0x3f);
+    m.insert(m.end(),{'a','b','c'});
+    assert(parse(m)==-1);
+
+    //the reserved label types
+    m=header(1,0);
+    m.insert(m.end(),{0x40,'a',0});
+    putU16(m,TXT);
+    putU16(m,1);
+    assert(parse(m)==-1);
+
+    //a pointer to itself, and a pointer forward
+    m=header(1,0);
+    m.insert(m.end(),{1,'a',0xc0,12});
+    putU16(m,TXT);
+    putU16(m,1);
+    assert(parse(m)==-1);
+    m=header(1,0);
+    m.insert(m.end(),{0xc0,18,0,0,0,0});
+    putName(m,"abc");
+    assert(parse(m)==-1);
+
+    //two names pointing at each other
+    m=header(2,0);
+    m.insert(m.end(),{1,'a',0xc0,20});
+    putU16(m,TXT);
+    putU16(m,1);
+    m.insert(m.end(),{1,'b',0xc0,12});
+    putU16(m,TXT);
+    putU16(m,1);
+    assert(parse(m)==-1);
+
+    //a name of more than 255 bytes
+    m=header(1,0);
+    for(int i=0;i<5;i++){
+        m.push_back(63);
+        m.insert(m.end(),63,'a');
+    }
+    m.push_back(0);
+    putU16(m,TXT);
+    putU16(m,1);
+    assert(parse(m)==-1);
+
+    //more records than the view holds
+    m=response();
+    m[4]=0;
+    m[5]=DNS_VIEW_MAX_QUERIES+1;
+    assert(parse(m)==-1);
+    m=response();
+    m[6]=0;
+    m[7]=DNS_VIEW_MAX_ANSWERS+1;
+    assert(parse(m)==-1);
+
+    //an rdlength past the end, and TXT data whose label overruns the rdlength
+    m=response();
+    m[m.size()-5]=5;
+    assert(parse(m)==-1);
+    m=response();
+    m[m.size()-4]=4;
+    assert(parse(m)==-1);
+
+    //an authority record cut short
+    m=response();
+    m[9]=1;
+    putU16(m,0xc00c);
+    putU16(m,TXT);
+    assert(parse(m)==-1);
+}
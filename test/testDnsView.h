@@ -0,0 +1,7 @@
+#ifndef DNSTUN_TESTDNSVIEW_H
+#define DNSTUN_TESTDNSVIEW_H
+
+void testDnsViewParse();
+void testDnsViewMalformed();
+
+#endif //DNSTUN_TESTDNSVIEW_H
@@ -0,0 +1,37 @@
+#include "testEventLoop.h"
+#include "EventLoop.h"
+#include "ClientReactor.h"
+#include <assert.h>
+#include <future>
+using namespace std;
+using namespace ucsmq;
+
+#define TEST_PORT 18955
+
+//a task stopping its own loop leaves the thread to the owner, who joins it and may start the loop again
+void testEventLoopStopInLoop(){
+    for(int i=0;i<100;i++){
+        auto loop = make_unique<EventLoop>();
+        assert(loop->start()>0);
+        promise<void> stopped;
+        loop->post([&](){
+            loop->stop();
+            stopped.set_value();
+        });
+        stopped.get_future().wait();
+        if(i%2==0){
+            assert(loop->start()>0);
+            promise<void> ran;
+            loop->post([&](){ran.set_value();});
+            ran.get_future().wait();
+        }
+        loop.reset();
+    }
+}
+
+//every loop gets a socket, only the first one on the port asked for
+void testClientReactorSharedPorts(){
+    ClientReactor reactor(3,true,inetAddr("127.0.0.1",TEST_PORT));
+    assert(reactor.start()>0);
+    reactor.stop();
+}
@@ -0,0 +1,7 @@
+#ifndef DNSTUN_TESTEVENTLOOP_H
+#define DNSTUN_TESTEVENTLOOP_H
+
+void testEventLoopStopInLoop();
+void testClientReactorSharedPorts();
+
+#endif //DNSTUN_TESTEVENTLOOP_H
@@ -0,0 +1,84 @@
+#include "testLog.h"
+#include "Log.h"
+#include <assert.h>
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#include <thread>
+#include <vector>
+using namespace std;
+using namespace ucsmq;
+
+//well below LOG_RING_CAPACITY, no record may be dropped
+#define LOG_TEST_THREADS 4
+#define LOG_TEST_RECORDS 200
+
+//the outs are only read by whoever drains the ring, under Log::lock
+static vector<ostream*> swapOuts(const vector<ostream*>& outs){
+    Log::flush();
+    lock_guard<mutex> guard(Log::lock);
+    auto old = Log::outs;
+    Log::outs=outs;
+    return old;
+}
+
+static vector<string> linesWith(const string& text,const char* tag){
+    vector<string> lines;
+    istringstream in(text);
+    string line;
+    while (getline(in,line)){
+        if(line.find(tag)!=string::npos) lines.push_back(line);
+    }
+    return lines;
+}
+
+void testLogThreads(){
+    ostringstream out;
+    auto old = swapOuts({&out});
+    auto level = Log::level.load();
+    Log::level.store(LOG_TRACE);
+    vector<thread> threads;
+    for(int t=0;t<LOG_TEST_THREADS;t++){
+        threads.emplace_back([t](){
+            for(int i=0;i<LOG_TEST_RECORDS;i++) Log::printf(LOG_INFO,"logtest %d %d",t,i);
+        });
+    }
+    for(auto& th : threads) th.join();
+    Log::flush();
+    swapOuts(old);
+    Log::level.store(level);
+
+    //every record is written once, and the records of a thread in the order it logged them
+    int next[LOG_TEST_THREADS]={0};
+    for(auto& line : linesWith(out.str(),"logtest ")){
+        assert(line.compare(0,6,"INFO: ")==0);
+        int t,i;
+        assert(sscanf(line.c_str()+line.find("logtest "),"logtest %d %d",&t,&i)==2);
+        assert(t>=0 && t<LOG_TEST_THREADS && i==next[t]);
+        next[t]++;
+    }
+    for(int n : next) assert(n==LOG_TEST_RECORDS);
+}
+
+void testLogLimited(){
+    ostringstream out;
+    auto old = swapOuts({&out});
+    auto level = Log::level.load();
+    Log::level.store(LOG_TRACE);
+    //one call site: the first message passes, the next two are held back until the interval ends
+    for(int i=0;i<4;i++){
+        if(i==3) this_thread::sleep_for(chrono::milliseconds(LOG_LIMIT_INTERVAL_MS+50));
+        LOG_LIMITED(LOG_WARN,"limitedtest %d",i);
+    }
+    Log::flush();
+    swapOuts(old);
+    Log::level.store(level);
+
+    auto lines = linesWith(out.str(),"limitedtest ");
+    assert(lines.size()==2);
+    assert(lines[0].find("limitedtest 0")!=string::npos && lines[1].find("limitedtest 3")!=string::npos);
+    //the count follows the message it was held back for
+    auto all = out.str();
+    auto suppressed = all.find("2 similar messages suppressed");
+    assert(suppressed!=string::npos && suppressed>all.find("limitedtest 3"));
+}
@@ -0,0 +1,7 @@
+#ifndef DNSTUN_TESTLOG_H
+#define DNSTUN_TESTLOG_H
+
+void testLogThreads();
+void testLogLimited();
+
+#endif //DNSTUN_TESTLOG_H
@@ -0,0 +1,142 @@
+#include "testPacket.h"
+#include "Packet.h"
+#include "udp.h"
+#include "../src/protocol/Dns.h"
+#include "../src/protocol/DnsView.h"
+#include "../src/protocol/packetProcess.h"
+#include <assert.h>
+#include <cstring>
+#include <string>
+using namespace std;
+using namespace ucsmq;
+
+#define TEST_DOMAIN "tun.k72vb42ffx.xyz"
+
+static bool sameBuffer(const Buffer& a,const Buffer& b){
+    return a.size==b.size && memcmp(a.data,b.data,a.size)==0;
+}
+
+static string payload(size_t n){
+    string s(n,0);
+    for(size_t i=0;i<n;i++) s[i]=(char)(i*131+7);
+    return s;
+}
+
+//the header of a query and its questions, each a name of labels holding label bytes
+static size_t rawQuery(uint8_t* buf,uint16_t questions,size_t labels,uint8_t label,const DomainSuffix& suffix){
+    BytesWriter bw(buf,UINT16_MAX);
+    bw.writeNum((uint16_t)0x1234);
+    bw.writeNum((uint16_t)RD_MASK);
+    bw.writeNum(questions);
+    for(int i=0;i<3;i++) bw.writeNum((uint16_t)0);
+    for(uint16_t q=0;q<questions;q++){
+        for(size_t i=0;i<labels;i++){
+            bw.writeNum(label);
+            for(uint8_t j=0;j<label;j++) bw.writeNum((uint8_t)'a');
+        }
+        bw.writeBytes(suffix.bytes,suffix.size);
+        bw.writeNum((uint16_t)TXT);
+        bw.writeNum((uint16_t)1);
+    }
+    return bw.writen();
+}
+
+//both decoders must read the same packet from what a client sends
+void testWireQueryMatchesView(){
+    auto domain = cstrToDomain(TEST_DOMAIN);
+    DomainSuffix suffix(domain);
+    size_t sizes[]={0,1,20,100,300,900};
+    size_t nameLimits[]={60,120,MAX_NAME_LEN};
+    for(auto size : sizes){
+        for(auto nameLimit : nameLimits){
+            Packet packet;
+            packet.dnsTransactionId=0x5a5a;
+            packet.sessionId=4321;
+            packet.groupId=7;
+            packet.dataId=3;
+            packet.type=PACKET_UPLOAD;
+            packet.dnsQueryType=CNAME;
+            auto data = payload(size);
+            packet.data=Buffer::copyOf(data.data(),data.size());
+            uint8_t query[UDP_DATAGRAM_SIZE*2];
+            auto n = Packet::queryBytes(query,sizeof(query),packet,suffix,nameLimit);
+            assert(n>0);
+            if(((query[4]<<8)|query[5])>DNS_VIEW_MAX_QUERIES) continue;
+
+            Packet wire,viewed;
+            DnsView dns;
+            assert(Packet::wireQueryToPacket(wire,query,n,suffix)==1);
+            assert(DnsView::parse(dns,query,n)==n);
+            assert(Packet::dnsQueryToPacket(viewed,dns,domain)==0);
+            assert(wire.dnsTransactionId==viewed.dnsTransactionId && wire.dnsTransactionId==packet.dnsTransactionId);
+            assert(wire.sessionId==viewed.sessionId && wire.sessionId==packet.sessionId);
+            assert(wire.groupId==viewed.groupId && wire.dataId==viewed.dataId && wire.type==viewed.type);
+            assert(wire.dnsQueryType==viewed.dnsQueryType && wire.dnsQueryType==CNAME);
+            assert(wire.questionCount==viewed.questionCount);
+            assert(sameBuffer(wire.questions,viewed.questions));
+            assert(sameBuffer(wire.data,viewed.data) && sameBuffer(wire.data,packet.data));
+        }
+    }
+}
+
+void testWireQueryLimits(){
+    auto domain = cstrToDomain(TEST_DOMAIN);
+    DomainSuffix suffix(domain);
+    uint8_t query[UINT16_MAX];
+    Packet packet;
+    DnsView dns;
+
+    //four labels of 60 bytes and the domain make a name over 255 bytes
+    auto n = rawQuery(query,1,4,60,suffix);
+    assert(Packet::wireQueryToPacket(packet,query,n,suffix)<0);
+    assert(DnsView::parse(dns,query,n)<0);
+    n = rawQuery(query,1,3,60,suffix);
+    assert(DnsView::parse(dns,query,n)==(ssize_t)n);
+
+    //the data of more questions than a client sends is not taken
+    n = rawQuery(query,DNS_VIEW_MAX_QUERIES+1,1,20,suffix);
+    assert(Packet::wireQueryToPacket(packet,query,n,suffix)<0);
+    assert(DnsView::parse(dns,query,n)<0);
+}
+
+//a response probe asks for a payload size, the server answers with that many bytes
+void testProbeRoundTrip(){
+    auto domain = cstrToDomain(TEST_DOMAIN);
+    DomainSuffix suffix(domain);
+    uint8_t probeData[3];
+    BytesWriter bw(probeData,sizeof(probeData));
+    bw.writeNum((uint8_t)PROBE_RESPONSE);
+    bw.writeNum((uint16_t)300);
+    Packet probe;
+    probe.dnsTransactionId=0x1111;
+    probe.sessionId=99;
+    probe.groupId=2;
+    probe.dataId=0x1203;
+    probe.type=PACKET_PROBE;
+    probe.dnsQueryType=PTR;
+    BytesReader br(probeData,sizeof(probeData));
+    uint8_t query[UDP_DATAGRAM_SIZE],resp[UDP_DATAGRAM_SIZE];
+    auto n = Packet::singleQueryBytes(query,sizeof(query),probe,br,suffix);
+    assert(n>0 && br.readableBytes()==0);
+
+    Packet received;
+    assert(Packet::wireQueryToPacket(received,query,n,suffix)==1);
+    assert(received.type==PACKET_PROBE && received.sessionId==99 && received.groupId==2 && received.dataId==0x1203);
+    assert(received.dnsQueryType==PTR && received.data.size==sizeof(probeData));
+    assert(memcmp(received.data.data,probeData,sizeof(probeData))==0);
+
+    auto answer = received.getResponsePacket(PACKET_PROBE);
+    auto data = payload(300);
+    answer.data=Buffer::copyOf(data.data(),data.size());
+    auto m = Packet::responseBytes(resp,sizeof(resp),answer);
+    assert(m>0);
+    Packet back;
+    assert(bytesToPacketResp(back,resp,m)>=0);
+    assert(back.type==PACKET_PROBE && back.dnsTransactionId==0x1111 && back.groupId==2 && back.dataId==0x1203);
+    assert(back.data.size==300 && memcmp(back.data.data,data.data(),300)==0);
+
+    //a resolver without EDNS cuts the response to its header, nothing of the probe comes back
+    resp[2]|=0x02;
+    Packet cut;
+    assert(bytesToPacketResp(cut,resp,DNS_HEADER_SIZE)<0);
+}
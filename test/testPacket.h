@@ -0,0 +1,8 @@
+#ifndef DNSTUN_TESTPACKET_H
+#define DNSTUN_TESTPACKET_H
+
+void testWireQueryMatchesView();
+void testWireQueryLimits();
+void testProbeRoundTrip();
+
+#endif //DNSTUN_TESTPACKET_H
@@ -0,0 +1,171 @@
+#include "testQueue.h"
+#include "LockFreeQueue.hpp"
+#include "BlockingQueue.hpp"
+#include <assert.h>
+#include <string>
+#include <thread>
+using namespace std;
+using namespace ucsmq;
+
+#define PRODUCERS 4
+#define PUSHES_PER_PRODUCER 20000
+
+template <typename Ring>
+static void fillAndDrain(Ring& ring){
+    //several rounds, so the positions wrap around the ring
+    for(int round=0;round<3;round++){
+        for(size_t i=0;i<ring.capacity();i++){
+            int v=(int)i;
+            assert(ring.tryPush(v));
+        }
+        int extra=-1;
+        assert(!ring.tryPush(extra) && extra==-1);
+        assert(ring.size()==ring.capacity());
+        int out;
+        for(size_t i=0;i<ring.capacity();i++){
+            assert(ring.tryPop(out) && out==(int)i);
+        }
+        assert(!ring.tryPop(out) && ring.size()==0);
+    }
+}
+
+void testRings(){
+    SpscRing<int> spsc(8);
+    fillAndDrain(spsc);
+    MpscRing<int> mpsc(8);
+    fillAndDrain(mpsc);
+}
+
+//every element pushed by the producers comes out once, in the order of its producer
+void testParkingQueue(){
+    MpscQueue<int> queue(64);
+    assert(queue.capacity()==64);
+    vector<thread> producers;
+    for(int p=0;p<PRODUCERS;p++){
+        producers.emplace_back([&queue,p](){
+            for(int i=0;i<PUSHES_PER_PRODUCER;i++){
+                assert(queue.push(p*PUSHES_PER_PRODUCER+i));
+            }
+        });
+    }
+    vector<int> last(PRODUCERS,-1);
+    for(int n=0;n<PRODUCERS*PUSHES_PER_PRODUCER;n++){
+        int v;
+        assert(queue.pop(v)==POP_SUCCESSFULLY);
+        int p=v/PUSHES_PER_PRODUCER;
+        assert(v%PUSHES_PER_PRODUCER==last[p]+1);
+        last[p]=v%PUSHES_PER_PRODUCER;
+    }
+    for(auto& th : producers) th.join();
+    int v;
+    assert(!queue.tryPop(v) && queue.size()==0);
+
+    //a consumer waiting on an empty queue and a producer waiting on a full one both return once it is unblocked
+    SpscQueue<string> small(2);
+    assert(small.tryPush("a") && small.tryPush("b") && !small.tryPush("c"));
+    assert(small.push("c",-1)==PUSH_AGAIN);
+    thread producer([&small](){
+        assert(!small.push(string("c")));
+    });
+    this_thread::sleep_for(chrono::milliseconds(50));
+    small.unblock();
+    producer.join();
+    string s;
+    assert(small.pop(s)==POP_SUCCESSFULLY && s=="a");
+    assert(small.pop(s)==POP_SUCCESSFULLY && s=="b");
+    assert(small.pop(s)==POP_INVALID);
+}
+
+struct StringBytes {
+    size_t operator()(const string& s) const {return s.size();}
+};
+
+//the weight limit bounds the bytes queued, but an empty queue still takes an element heavier than it
+void testQueueWeightLimit(){
+    SpscQueue<string,StringBytes> queue(16,10);
+    assert(queue.room()==SIZE_MAX && queue.totalWeight()==0);
+    assert(queue.tryPush(string(6,'a')));
+    assert(queue.totalWeight()==6 && queue.room()==4);
+    assert(!queue.tryPush(string(5,'b')));
+    assert(queue.push(string(5,'b'),-1)==PUSH_AGAIN);
+    assert(queue.tryPush(string(4,'c')));
+    assert(queue.totalWeight()==10 && queue.room()==0);
+    assert(!queue.tryPush(string(1,'d')));
+
+    string s;
+    assert(queue.pop(s)==POP_SUCCESSFULLY && s.size()==6);
+    assert(queue.totalWeight()==4 && queue.room()==6);
+    assert(queue.pop(s)==POP_SUCCESSFULLY && s.size()==4);
+    assert(queue.totalWeight()==0 && queue.room()==SIZE_MAX);
+
+    assert(queue.tryPush(string(32,'e')));
+    assert(queue.totalWeight()==32 && queue.room()==0);
+    assert(!queue.tryPush(string(1,'f')));
+    assert(queue.pop(s)==POP_SUCCESSFULLY && s.size()==32);
+
+    //lifting the limit lets the queue fill up to its capacity
+    queue.setWeightLimit(0);
+    for(size_t i=0;i<queue.capacity();i++){
+        assert(queue.tryPush(string(8,'g')));
+    }
+    assert(queue.totalWeight()==8*queue.capacity() && queue.room()==SIZE_MAX);
+    assert(!queue.tryPush(string(1,'h')));
+}
+
+//the batch calls keep the order, stop at max and give the taken weight back
+void testQueueBatch(){
+    SpscQueue<string,StringBytes> queue(16,20);
+    for(int i=0;i<5;i++){
+        assert(queue.tryPush(to_string(i)+"___"));
+    }
+    assert(queue.totalWeight()==20 && queue.room()==0);
+    vector<string> out;
+    assert(queue.popBatch(out,2)==POP_SUCCESSFULLY);
+    assert(out.size()==2 && out[0]=="0___" && out[1]=="1___");
+    assert(queue.totalWeight()==12 && queue.room()==8);
+    assert(queue.drainTo(out)==3);
+    assert(out.size()==5 && out[4]=="4___");
+    assert(queue.totalWeight()==0 && queue.size()==0);
+    assert(queue.drainTo(out)==0);
+
+    //a producer waiting for room is woken by drainTo
+    assert(queue.tryPush(string(20,'a')));
+    thread producer([&queue](){
+        assert(queue.push(string(5,'b')));
+    });
+    this_thread::sleep_for(chrono::milliseconds(50));
+    out.clear();
+    assert(queue.drainTo(out,1)==1 && out[0].size()==20);
+    producer.join();
+    assert(queue.totalWeight()==5);
+    queue.unblock();
+    out.clear();
+    assert(queue.popBatch(out,4)==POP_SUCCESSFULLY && out.size()==1);
+    assert(queue.popBatch(out,4)==POP_INVALID);
+
+    BlockingQueue<int> blocking;
+    blocking.pushBatch({});
+    assert(blocking.size()==0);
+    vector<int> values={1,2,3,4,5};
+    blocking.pushBatch(std::move(values));
+    assert(values.empty() && blocking.size()==5);
+    vector<int> got;
+    assert(blocking.popBatch(got,3)==POP_SUCCESSFULLY);
+    assert(got==vector<int>({1,2,3}));
+    assert(blocking.drainTo(got)==2);
+    assert(got==vector<int>({1,2,3,4,5}));
+    assert(blocking.drainTo(got)==0);
+
+    //a consumer waiting in popBatch takes the whole batch pushed under one lock
+    thread consumer([&blocking](){
+        vector<int> batch;
+        assert(blocking.popBatch(batch,10)==POP_SUCCESSFULLY);
+        assert(batch.size()==3 && batch[0]==6 && batch[2]==8);
+    });
+    this_thread::sleep_for(chrono::milliseconds(50));
+    blocking.pushBatch({6,7,8});
+    consumer.join();
+    blocking.unblock();
+    got.clear();
+    assert(blocking.popBatch(got,10)==POP_INVALID && got.empty());
+}
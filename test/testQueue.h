@@ -0,0 +1,9 @@
+#ifndef DNSTUN_TESTQUEUE_H
+#define DNSTUN_TESTQUEUE_H
+
+void testRings();
+void testParkingQueue();
+void testQueueWeightLimit();
+void testQueueBatch();
+
+#endif //DNSTUN_TESTQUEUE_H
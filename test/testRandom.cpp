@@ -0,0 +1,50 @@
+#include "testRandom.h"
+#include "../src/lib/Random.h"
+#include <assert.h>
+#include <thread>
+#include <vector>
+using namespace std;
+using namespace ucsmq;
+
+#define DRAWS 16
+
+static vector<uint64_t> draw(Random& random){
+    vector<uint64_t> v;
+    for(int i=0;i<DRAWS;i++) v.push_back(random.next());
+    return v;
+}
+
+//the draws of the calling thread, then of a new thread, right after seedAll(seed)
+static void seededRun(uint64_t seed,vector<uint64_t>& mine,vector<uint64_t>& other){
+    Random::seedAll(seed);
+    mine=draw(Random::local());
+    thread th([&other](){
+        other=draw(Random::local());
+    });
+    th.join();
+}
+
+void testRandomSeedAll(){
+    Random a(7),b(7),c(8);
+    auto seq=draw(a);
+    assert(seq==draw(b) && seq!=draw(c));
+    for(int i=0;i<1000;i++){
+        assert(a.below(10)<10);
+        auto r=a.range(-3,3);
+        assert(r>=-3 && r<3);
+    }
+
+    vector<uint64_t> mine,other,mine2,other2;
+    seededRun(42,mine,other);
+    seededRun(42,mine2,other2);
+    assert(mine==mine2 && other==other2);
+    //each thread gets its own stream
+    assert(mine!=other);
+    seededRun(43,mine2,other2);
+    assert(mine!=mine2 && other!=other2);
+    //a thread keeps drawing from its stream until the next seedAll()
+    Random::seedAll(42);
+    auto& local=Random::local();
+    assert(draw(local)==mine);
+    assert(draw(Random::local())!=mine);
+}
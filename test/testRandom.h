@@ -0,0 +1,6 @@
+#ifndef DNSTUN_TESTRANDOM_H
+#define DNSTUN_TESTRANDOM_H
+
+void testRandomSeedAll();
+
+#endif //DNSTUN_TESTRANDOM_H
@@ -0,0 +1,232 @@
+#include "testServer.h"
+#include "DnsServerChannel.h"
+#include "DnsClientChannel.h"
+#include "Simulation.h"
+#include "udp.h"
+#include "../src/protocol/Dns.h"
+#include "../src/protocol/DnsView.h"
+#include <assert.h>
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+using namespace std;
+using namespace ucsmq;
+
+#define TEST_DOMAIN "tun.k72vb42ffx.xyz"
+#define TEST_PORT 18953
+//seconds between the probe rounds, and of virtual time a round or an open may take
+#define PROBE_TEST_INTERVAL 2
+#define PROBE_TEST_TIMEOUT 10
+//responses larger than this are cut by the simulated path
+#define PROBE_TEST_RESPONSE_SIZE 300
+//sessions spread over the reactors, and the seconds of virtual time they take to connect or echo
+#define SERVER_TEST_REACTORS 3
+#define SERVER_TEST_CLIENTS 8
+#define SERVER_TEST_TIMEOUT 10
+#define SERVER_TEST_LATENCY_MS 20
+
+//the largest query a datagram holds, its questions are echoed and leave no room for an answer
+static ssize_t oversizedQuery(uint8_t* buf,size_t size,const DomainSuffix& suffix){
+    Packet packet;
+    packet.dnsTransactionId=0x4242;
+    packet.sessionId=777;
+    packet.type=PACKET_POLL;
+    packet.dnsQueryType=TXT;
+    for(size_t n=UDP_DATAGRAM_SIZE;n>0;n-=8){
+        string data(n,'x');
+        packet.data=Buffer::copyOf(data.data(),data.size());
+        auto len = Packet::queryBytes(buf,size,packet,suffix,MAX_NAME_LEN);
+        if(len>0 && ((buf[4]<<8)|buf[5])<=DNS_VIEW_MAX_QUERIES) return len;
+    }
+    return -1;
+}
+
+void testOversizedResponse(){
+    auto domain = cstrToDomain(TEST_DOMAIN);
+    DomainSuffix suffix(domain);
+    uint8_t query[UDP_DATAGRAM_SIZE],resp[UDP_DATAGRAM_SIZE];
+    auto queryLen = oversizedQuery(query,sizeof(query),suffix);
+    assert(queryLen>UDP_DATAGRAM_SIZE-MAX_NAME_LEN);
+
+    //neither an error nor the largest probe answer fit behind the echoed questions
+    Packet received;
+    assert(Packet::wireQueryToPacket(received,query,queryLen,suffix)==1);
+    assert(Packet::responseBytes(resp,sizeof(resp),received.getResponsePacket(PACKET_SESSION_NOT_FOUND))<0);
+    auto probe = received.getResponsePacket(PACKET_PROBE);
+    string probeData(PROBE_MAX_RESPONSE_DATA,0);
+    probe.data=Buffer::copyOf(probeData.data(),probeData.size());
+    assert(Packet::responseBytes(resp,sizeof(resp),probe)<0);
+
+    //the server answers with a bare server failure instead of a broken datagram
+    SA_IN addr = inetAddr("127.0.0.1",TEST_PORT);
+    DnsServerChannel server(addr,TEST_DOMAIN);
+    server.reactorCount=1;
+    server.workerCount=1;
+    assert(server.open()>=0);
+    int sockfd = dialUdp(addr, nullptr);
+    assert(sockfd>=0);
+    assert(sendUdp(sockfd,query,queryLen)==queryLen);
+    auto n = recvUdp(sockfd,resp,sizeof(resp),3);
+    assert(n==DNS_HEADER_SIZE);
+    DnsView view;
+    assert(DnsView::parse(view,resp,n)>=0);
+    int qr=0,rcode=0;
+    view.getFlags(&qr,&rcode);
+    assert(qr==1 && rcode==SERVER_FAILURE);
+    assert(memcmp(resp,query,sizeof(uint16_t))==0);
+    assert(server.metrics().oversizedResponses==1);
+    closeSocket(sockfd);
+    server.close();
+}
+
+//a response cut by the path is not an answer to its probe, so the next round settles on a smaller payload
+void testProbeShrinksLimits(){
+    Simulation simulation(7);
+    auto serverAddr = inetAddr("10.0.0.53",53);
+    DnsServerChannel server(serverAddr,TEST_DOMAIN);
+    assert(server.open()>=0);
+    ClientReactor reactor;
+    DnsClientChannel client(serverAddr,TEST_DOMAIN,"probe",reactor);
+    client.probeInterval=PROBE_TEST_INTERVAL;
+    assert(client.open(PROBE_TEST_TIMEOUT)>=0);
+
+    //the first round measures a path that carries everything
+    PathLimits defaults;
+    assert(simulation.runUntil([&client,&defaults](){
+        return memcmp(client.pathLimits().responseData,defaults.responseData,sizeof(defaults.responseData))!=0;
+    },chrono::seconds(PROBE_TEST_TIMEOUT)));
+    auto wide = client.pathLimits();
+    for(int t=0;t<RECORD_TYPE_COUNT;t++){
+        assert(wide.responseData[t]>defaults.responseData[t]);
+    }
+
+    simulation.network().impairment.maxResponseSize=PROBE_TEST_RESPONSE_SIZE;
+    assert(simulation.runUntil([&client,&wide](){
+        return memcmp(client.pathLimits().responseData,wide.responseData,sizeof(wide.responseData))!=0;
+    },chrono::seconds(PROBE_TEST_INTERVAL+PROBE_TEST_TIMEOUT)));
+    auto narrow = client.pathLimits();
+    for(int t=0;t<RECORD_TYPE_COUNT;t++){
+        assert(narrow.responseData[t]<wide.responseData[t]);
+        assert(narrow.responseData[t]<PROBE_TEST_RESPONSE_SIZE);
+    }
+    assert(simulation.network().stats().truncated>0);
+    client.close();
+    server.close();
+}
+
+//echo what every accepted session sent, return how many messages went back
+static size_t echoAll(vector<ClientConnectionPtr>& conns){
+    size_t n=0;
+    for(auto& conn : conns){
+        Buffer buf;
+        while (conn->read(buf,NO_WAIT)>=0){
+            assert(conn->write(buf,NO_WAIT)>=0);
+            n++;
+        }
+    }
+    return n;
+}
+
+//accept the sessions of clients and check every one of them gets its message echoed
+static void echoSessions(Simulation& simulation,DnsServerChannel& server,vector<unique_ptr<DnsClientChannel>>& clients,
+                         vector<ClientConnectionPtr>& conns){
+    assert(simulation.runUntil([&server,&conns,&clients](){
+        while (auto conn = server.accept(NO_WAIT)) conns.push_back(conn);
+        return conns.size()==clients.size();
+    },chrono::seconds(SERVER_TEST_TIMEOUT)));
+    for(size_t i=0;i<clients.size();i++){
+        auto msg = "echo "+to_string(i);
+        assert(clients[i]->write(msg.data(),msg.size(),NO_WAIT)==(ssize_t)msg.size());
+    }
+    vector<bool> echoed(clients.size(),false);
+    assert(simulation.runUntil([&](){
+        echoAll(conns);
+        for(size_t i=0;i<clients.size();i++){
+            Buffer buf;
+            if(clients[i]->read(buf,NO_WAIT)<0) continue;
+            auto msg = "echo "+to_string(i);
+            assert(buf.size==msg.size() && memcmp(buf.data,msg.data(),msg.size())==0);
+            echoed[i]=true;
+        }
+        return count(echoed.begin(),echoed.end(),true)==(long)clients.size();
+    },chrono::seconds(SERVER_TEST_TIMEOUT)));
+}
+
+//the sources are spread among the reactors, the sessions they route all run on the worker pool
+void testReactorsShareWorkers(){
+    Simulation simulation(11);
+    auto serverAddr = inetAddr("10.0.0.53",53);
+    DnsServerChannel server(serverAddr,TEST_DOMAIN);
+    server.reactorCount=SERVER_TEST_REACTORS;
+    server.workerCount=2;
+    assert(server.open()>=0);
+    ClientReactor reactor;
+    vector<unique_ptr<DnsClientChannel>> clients;
+    for(int i=0;i<SERVER_TEST_CLIENTS;i++){
+        clients.emplace_back(new DnsClientChannel(serverAddr,TEST_DOMAIN,"reactor"+to_string(i),reactor));
+        assert(clients.back()->open(SERVER_TEST_TIMEOUT)>=0);
+    }
+    vector<ClientConnectionPtr> conns;
+    echoSessions(simulation,server,clients,conns);
+
+    auto m = server.metrics();
+    assert(m.activeSessions==SERVER_TEST_CLIENTS && m.authentications==SERVER_TEST_CLIENTS);
+    assert(m.reactorQueries.size()==SERVER_TEST_REACTORS);
+    uint64_t total=0;
+    for(auto q : m.reactorQueries){
+        assert(q>0);
+        total+=q;
+    }
+    assert(total==m.queriesReceived);
+    for(auto& c : clients) c->close();
+    server.close();
+}
+
+//one worker runs every session, the ones whose client went away are reclaimed once idle
+void testWorkerReclaimsIdle(){
+    Simulation simulation(13);
+    //the polls of the sessions kept open go back and forth for seconds, a latency keeps their count low
+    simulation.network().impairment.latencyMs=SERVER_TEST_LATENCY_MS;
+    auto serverAddr = inetAddr("10.0.0.53",53);
+    DnsServerChannel server(serverAddr,TEST_DOMAIN);
+    server.workerCount=1;
+    assert(server.open()>=0);
+    ClientReactor reactor;
+    vector<unique_ptr<DnsClientChannel>> clients;
+    for(int i=0;i<SERVER_TEST_CLIENTS;i++){
+        clients.emplace_back(new DnsClientChannel(serverAddr,TEST_DOMAIN,"worker"+to_string(i),reactor));
+        assert(clients.back()->open(SERVER_TEST_TIMEOUT)>=0);
+    }
+    vector<ClientConnectionPtr> conns;
+    echoSessions(simulation,server,clients,conns);
+    assert(server.metrics().activeSessions==SERVER_TEST_CLIENTS);
+
+    //the client closes without a word, its session stops polling
+    for(int i=0;i<SERVER_TEST_CLIENTS/2;i++) clients[i]->close();
+    assert(simulation.runUntil([&conns](){
+        return count_if(conns.begin(),conns.end(),[](const ClientConnectionPtr& conn){return !conn->noConnErr();})==SERVER_TEST_CLIENTS/2;
+    },chrono::seconds(DEFAULT_CLIENT_IDLE_TIMEOUT+SERVER_TEST_TIMEOUT)));
+    assert(server.metrics().activeSessions==SERVER_TEST_CLIENTS-SERVER_TEST_CLIENTS/2);
+    for(auto& conn : conns){
+        bool closed = stoi(conn->user.id.substr(strlen("worker")))<SERVER_TEST_CLIENTS/2;
+        assert(conn->noConnErr()==!closed);
+        Buffer buf;
+        if(closed) assert(conn->read(buf,NO_WAIT)<0);
+    }
+
+    //the sessions still polling keep running on the worker
+    simulation.runFor(chrono::seconds(DEFAULT_CLIENT_IDLE_TIMEOUT+1));
+    assert(server.metrics().activeSessions==SERVER_TEST_CLIENTS-SERVER_TEST_CLIENTS/2);
+    for(int i=SERVER_TEST_CLIENTS/2;i<SERVER_TEST_CLIENTS;i++){
+        assert(clients[i]->write("again",5,NO_WAIT)==5);
+    }
+    size_t echoed=0;
+    assert(simulation.runUntil([&conns,&echoed](){
+        echoed+=echoAll(conns);
+        return echoed==SERVER_TEST_CLIENTS-SERVER_TEST_CLIENTS/2;
+    },chrono::seconds(SERVER_TEST_TIMEOUT)));
+    for(auto& c : clients) c->close();
+    server.close();
+}
@@ -0,0 +1,9 @@
+#ifndef DNSTUN_TESTSERVER_H
+#define DNSTUN_TESTSERVER_H
+
+void testOversizedResponse();
+void testProbeShrinksLimits();
+void testReactorsShareWorkers();
+void testWorkerReclaimsIdle();
+
+#endif //DNSTUN_TESTSERVER_H
@@ -0,0 +1,35 @@
+#include "testSessionTable.h"
+#include "SessionTable.hpp"
+#include <assert.h>
+using namespace std;
+using namespace ucsmq;
+
+//a removed session is freed by the collections that follow, without another removal
+void testSessionTableCollect(){
+    SessionTable<int> table;
+    auto ptr = make_shared<int>(1);
+    weak_ptr<int> weak = ptr;
+    assert(table.insert(7,ptr) && !table.insert(7,ptr));
+    assert(table.size()==1 && *table.get(7)==1);
+    ptr.reset();
+    assert(table.remove(7)!= nullptr && table.size()==0 && table.get(7)== nullptr);
+    //the box may still be read by a guard pinned before the removal
+    assert(!weak.expired());
+    for(int i=0;i<3;i++) Epoch::collect();
+    assert(weak.expired());
+}
+
+//a table going away frees the boxes it retired, whatever the epoch
+void testSessionTableRelease(){
+    weak_ptr<int> weak;
+    {
+        SessionTable<int> table;
+        auto ptr = make_shared<int>(2);
+        weak=ptr;
+        table.insert(9,ptr);
+        ptr.reset();
+        table.remove(9);
+        assert(!weak.expired());
+    }
+    assert(weak.expired());
+}
@@ -0,0 +1,7 @@
+#ifndef DNSTUN_TESTSESSIONTABLE_H
+#define DNSTUN_TESTSESSIONTABLE_H
+
+void testSessionTableCollect();
+void testSessionTableRelease();
+
+#endif //DNSTUN_TESTSESSIONTABLE_H
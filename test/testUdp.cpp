@@ -0,0 +1,41 @@
+#include "testUdp.h"
+#include "udp.h"
+#include <assert.h>
+#include <cerrno>
+#include <cstring>
+using namespace std;
+using namespace ucsmq;
+
+#define TEST_PORT 18954
+
+void testUdpBatch(){
+    SA_IN addr = inetAddr("127.0.0.1",TEST_PORT);
+    //a datagram to port 0 is refused by the kernel
+    SA_IN badAddr = inetAddr("127.0.0.1",0);
+    int receiver = udpSocket(&addr);
+    int sender = udpSocket();
+    assert(receiver>=0 && sender>=0);
+
+    UdpBatch batch(4);
+    assert(!batch.add(0,addr));
+    assert(!batch.add(batch.bufferSize()+1,addr));
+    assert(batch.size()==0);
+    const char* msgs[]={"first","dropped","third"};
+    const SA_IN* addrs[]={&addr,&badAddr,&addr};
+    for(int i=0;i<3;i++){
+        memcpy(batch.back(),msgs[i],strlen(msgs[i]));
+        assert(batch.add(strlen(msgs[i]),*addrs[i]));
+    }
+    assert(batch.add(1,addr) && batch.full());
+    assert(!batch.add(1,addr));
+
+    //the refused datagram is reported, the ones around it still leave
+    assert(sendBatch(sender,batch)<0 && isDatagramDropped());
+    assert(batch.size()==0);
+    char buf[64];
+    assert(recvUdp(receiver,buf,sizeof(buf),1)==5 && memcmp(buf,"first",5)==0);
+    assert(recvUdp(receiver,buf,sizeof(buf),1)==5 && memcmp(buf,"third",5)==0);
+    assert(recvUdp(receiver,buf,sizeof(buf),1)==1);
+    closeSocket(sender);
+    closeSocket(receiver);
+}
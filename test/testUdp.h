@@ -0,0 +1,6 @@
+#ifndef DNSTUN_TESTUDP_H
+#define DNSTUN_TESTUDP_H
+
+void testUdpBatch();
+
+#endif //DNSTUN_TESTUDP_H
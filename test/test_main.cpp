@@ -5,6 +5,17 @@
 #include "DiscardClient.h"
 #include "TimeServer.hpp"
 #include "testDns.h"
+#include "testQueue.h"
+#include "testSessionTable.h"
+#include "testDnsView.h"
+#include "testBytes.h"
+#include "testBuffer.h"
+#include "testRandom.h"
+#include "testServer.h"
+#include "testPacket.h"
+#include "testUdp.h"
+#include "testEventLoop.h"
+#include "testLog.h"
 
 #define ALIYUN "tun.k72vb42ffx.xyz"
 
@@ -91,4 +102,32 @@ int main(int argc,char** args){
     //testDiscardClient();
    // testTimeServer(argc,args);
    testDns();
+   testDnsCompressSharedSuffix();
+   testDnsCompressSlotCollision();
+   testDnsCompressSkipsTxt();
+   testRings();
+   testParkingQueue();
+   testQueueWeightLimit();
+   testQueueBatch();
+   testSessionTableCollect();
+   testSessionTableRelease();
+   testDnsViewParse();
+   testDnsViewMalformed();
+   testBytesCopy();
+   testBytesAssign();
+   testBufferRefs();
+   testBufferChain();
+   testRandomSeedAll();
+   testOversizedResponse();
+   testWireQueryMatchesView();
+   testWireQueryLimits();
+   testUdpBatch();
+   testEventLoopStopInLoop();
+   testClientReactorSharedPorts();
+   testProbeShrinksLimits();
+   testProbeRoundTrip();
+   testLogThreads();
+   testLogLimited();
+   testReactorsShareWorkers();
+   testWorkerReclaimsIdle();
 }
\ No newline at end of file
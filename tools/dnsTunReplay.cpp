@@ -0,0 +1,240 @@
+/*
+ * Replays the queries of a capture into the receive path of a server and measures how fast it gets through them.
+ *     dnsTunReplay [-D domain] [-p port] [-x speed] [-n runs] [-R reactors] [-W workers] capture.pcap
+ * The queries are those sent to port (any port by default). They are first parsed, then decoded as the reactors of
+ * DnsServerChannel do, each pass alone and over and over; then a DnsServerChannel of domain gets them all from their
+ * original source addresses, inside a Simulation: the reactors, the workers and the sessions do all their work, only
+ * the network is in memory. -x 1 keeps the original spacing of the queries in virtual time, 2 halves it, 0 (the default)
+ * sends them as fast as the server takes them. The application accepts the sessions and discards what they upload, it
+ * never writes: polls for groups the original server sent are answered with nothing.
+ * A server writes the capture of its own traffic when DnsServerChannel::capture is set, e.g. by dnsTunLoad -w.
+ * */
+#include "DnsServerChannel.h"
+#include "Packet.h"
+#include "Pcap.h"
+#include "Simulation.h"
+#include "Log.h"
+#include "../src/protocol/DnsView.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+#define REPLAY_DOMAIN "tun.k72vb42ffx.xyz"
+//a stage is run over the queries until it took that long
+#define REPLAY_STAGE_SECONDS 0.5
+//queries sent at once at full speed, then the simulation runs for REPLAY_BURST_GAP_US
+#define REPLAY_BURST 256
+#define REPLAY_BURST_GAP_US 1000
+//virtual time the server gets once every query is sent, to answer the last ones
+#define REPLAY_DRAIN_MS 1000
+#define DNS_QR_BIT 0x80
+
+using namespace std;
+using namespace ucsmq;
+
+struct Options {
+    const char* file= nullptr;
+    const char* domain=REPLAY_DOMAIN;
+    int port=0;
+    double speed=0;
+    int runs=1;
+    size_t reactors=1;
+    size_t workers=1;
+};
+
+struct StageResult {
+    uint64_t datagrams=0;
+    uint64_t failed=0;
+    double seconds=0;
+    double nsPer() const {return datagrams>0 ? seconds*1e9/(double)datagrams : 0;}
+};
+
+static size_t totalBytes(const vector<PcapDatagram>& queries){
+    size_t n=0;
+    for(const auto& q : queries) n+=q.payload.size();
+    return n;
+}
+
+//run f over every query until REPLAY_STAGE_SECONDS have passed, f returns false for a query it could not take
+static StageResult stage(const vector<PcapDatagram>& queries,const function<bool(const PcapDatagram&)>& f){
+    StageResult r;
+    auto start = chrono::steady_clock::now();
+    do{
+        for(const auto& q : queries){
+            if(!f(q)) r.failed++;
+        }
+        r.datagrams+=queries.size();
+        r.seconds=chrono::duration<double>(chrono::steady_clock::now()-start).count();
+    } while (r.seconds<REPLAY_STAGE_SECONDS);
+    return r;
+}
+
+struct ReplayResult {
+    StageResult pipeline;
+    uint64_t responses=0;
+    //sources the simulated network could not bind, their queries were left out
+    uint64_t skipped=0;
+    double virtualSeconds=0;
+    ServerChannelMetrics server;
+};
+
+static ReplayResult replay(const Options& options,const vector<PcapDatagram>& queries){
+    ReplayResult r;
+    Simulation simulation;
+    auto& net = simulation.network();
+    auto serverAddr = inetAddr("10.0.0.53",53);
+    DnsServerChannel server(serverAddr,options.domain);
+    server.reactorCount=options.reactors;
+    server.workerCount=options.workers;
+    if(server.open()<0) return r;
+    //a socket per source of the capture, so that the responses go back where the queries came from
+    map<pair<uint32_t,uint16_t>,int> sources;
+    auto socketOf = [&](const SA_IN& addr){
+        auto key = make_pair(addr.sin_addr.s_addr,addr.sin_port);
+        auto it = sources.find(key);
+        if(it==sources.end()) it = sources.emplace(key,net.open(&addr,false)).first;
+        return it->second;
+    };
+    uint8_t sink[UDP_DATAGRAM_SIZE];
+    vector<ClientConnectionPtr> conns;
+    auto run = [&](Clock::duration d){
+        simulation.runFor(d);
+        for(const auto& pa : sources){
+            while (pa.second>=0 && net.recvfrom(pa.second,sink,sizeof(sink), nullptr)>=0) r.responses++;
+        }
+        //the application reads what is uploaded, so that the receive buffers of the sessions never fill
+        while (auto conn = server.accept(NO_WAIT)){
+            conns.push_back(conn);
+        }
+        for(auto& conn : conns){
+            BufferChain chain;
+            while (conn->read(chain,NO_WAIT)>=0){
+                chain=BufferChain();
+            }
+        }
+    };
+    auto start = simulation.now();
+    auto wallStart = chrono::steady_clock::now();
+    size_t burst=0;
+    for(const auto& q : queries){
+        if(options.speed>0){
+            auto due = start+chrono::nanoseconds((int64_t)((double)(q.time-queries.front().time)/options.speed));
+            if(due>simulation.now()) run(due-simulation.now());
+        }else if(burst==REPLAY_BURST){
+            run(chrono::microseconds(REPLAY_BURST_GAP_US));
+            burst=0;
+        }
+        int fd = socketOf(q.source);
+        if(fd<0 || net.sendto(fd,q.payload.data(),q.payload.size(),&serverAddr)<0){
+            r.skipped++;
+            continue;
+        }
+        burst++;
+        r.pipeline.datagrams++;
+    }
+    run(chrono::milliseconds(REPLAY_DRAIN_MS));
+    r.pipeline.seconds=chrono::duration<double>(chrono::steady_clock::now()-wallStart).count();
+    r.virtualSeconds=chrono::duration<double>(simulation.now()-start).count();
+    r.server=server.metrics();
+    conns.clear();
+    server.close();
+    for(const auto& pa : sources){
+        if(pa.second>=0) net.close(pa.second);
+    }
+    return r;
+}
+
+static void printStage(const char* name,const StageResult& r,size_t bytes,size_t count){
+    double mb = (double)bytes*((double)r.datagrams/(double)count)/1e6;
+    printf("%-9s %12.0f queries/s %9.1f MB/s %9.1f ns/query",name,(double)r.datagrams/r.seconds,mb/r.seconds,r.nsPer());
+    if(r.failed>0) printf(", %llu of %llu not taken",(unsigned long long)r.failed,(unsigned long long)r.datagrams);
+    printf("\n");
+}
+
+static void usage(const char* name){
+    fprintf(stderr,"usage: %s [-D domain] [-p port] [-x speed] [-n runs] [-R reactors] [-W workers] capture.pcap\n",name);
+    exit(2);
+}
+
+int main(int argc,char** args){
+    Options options;
+    for(int i=1;i<argc;i++){
+        if(args[i][0]!='-'){
+            if(options.file!= nullptr) usage(args[0]);
+            options.file=args[i];
+            continue;
+        }
+        if(i+1>=argc || strlen(args[i])!=2) usage(args[0]);
+        const char* v = args[++i];
+        switch (args[i-1][1]) {
+            case 'D': options.domain=v; break;
+            case 'p': options.port=atoi(v); break;
+            case 'x': options.speed=atof(v); break;
+            case 'n': options.runs=atoi(v); break;
+            case 'R': options.reactors=(size_t)atol(v); break;
+            case 'W': options.workers=(size_t)atol(v); break;
+            default: usage(args[0]);
+        }
+    }
+    if(options.file== nullptr || options.speed<0 || options.runs<=0) usage(args[0]);
+    //the sessions were opened by the original server, the polls for its groups are expected to miss
+    Log::level=LOG_ERROR;
+
+    vector<PcapDatagram> datagrams;
+    PcapStats stats;
+    if(readPcap(options.file,datagrams,&stats)<0) return 1;
+    vector<PcapDatagram> queries;
+    for(auto& d : datagrams){
+        if(d.payload.size()<DNS_HEADER_SIZE || (d.payload[2]&DNS_QR_BIT)!=0) continue;
+        if(options.port!=0 && ntohs(d.destination.sin_port)!=options.port) continue;
+        queries.push_back(std::move(d));
+    }
+    printf("%s: %llu frames, %llu udp datagrams, %zu queries", options.file,(unsigned long long)stats.frames,
+           (unsigned long long)stats.datagrams,queries.size());
+    if(!queries.empty()){
+        printf(" over %.3f s",(double)(queries.back().time-queries.front().time)/1e9);
+    }
+    printf(" (skipped: %llu not IPv4, %llu not udp, %llu fragments, %llu truncated)\n",(unsigned long long)stats.notIpv4,
+           (unsigned long long)stats.notUdp,(unsigned long long)stats.fragments,(unsigned long long)stats.truncated);
+    if(queries.empty()) return 1;
+    size_t bytes = totalBytes(queries);
+
+    DnsView dns;
+    auto parse = stage(queries,[&dns](const PcapDatagram& q){
+        return DnsView::parse(dns,q.payload.data(),q.payload.size())>=0;
+    });
+    auto myDomain = cstrToDomain(options.domain);
+    DomainSuffix suffix(myDomain);
+    //what DnsServerChannel::resolvePacketQuery does, compressed names go through the parser
+    auto decode = stage(queries,[&](const PcapDatagram& q){
+        Packet packet;
+        auto decoded = Packet::wireQueryToPacket(packet,q.payload.data(),q.payload.size(),suffix);
+        if(decoded<0) return false;
+        return decoded>0 || (DnsView::parse(dns,q.payload.data(),q.payload.size())>=0 && Packet::dnsQueryToPacket(packet,dns,myDomain)>=0);
+    });
+    printStage("parse",parse,bytes,queries.size());
+    printStage("decode",decode,bytes,queries.size());
+
+    for(int run=0;run<options.runs;run++){
+        auto r = replay(options,queries);
+        if(r.pipeline.datagrams==0){
+            fprintf(stderr,"no query could be replayed\n");
+            return 1;
+        }
+        printStage("pipeline",r.pipeline,bytes,queries.size());
+        //the receive path decodes, then dispatches to the sessions, which answer
+        printf("          %.1f ns/query past the decoding, %.3f s of virtual time, %llu sources left out\n",
+               r.pipeline.nsPer()-decode.nsPer(),r.virtualSeconds,(unsigned long long)r.skipped);
+        const auto& m = r.server;
+        printf("          server: %llu queries, %llu invalid, %llu sessions not found, %llu authentications, %llu polls, %llu uploads, "
+               "%llu responses (%llu back at the sources)\n",(unsigned long long)m.queriesReceived,(unsigned long long)m.invalidQueries,
+               (unsigned long long)m.sessionsNotFound,(unsigned long long)m.authentications,(unsigned long long)m.connections.polls,
+               (unsigned long long)m.connections.uploads,(unsigned long long)m.responsesSent,(unsigned long long)r.responses);
+    }
+    return 0;
+}
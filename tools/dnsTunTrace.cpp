@@ -0,0 +1,212 @@
+/*
+ * Reads the dumps written by Trace::dump and prints, per session, what happened to its packets and where the time went.
+ *     dnsTunTrace [-t] [-s session] dump...
+ * -t prints every event as a timeline, -s keeps a single session. The dumps of a client and a server on the same host
+ * share the clock, given together the group transfer times span both of them.
+ * */
+#include "Trace.h"
+#include "Metrics.h"
+#include "Packet.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <tuple>
+
+using namespace std;
+using namespace ucsmq;
+
+enum query_kind_t {
+    KIND_NONE,
+    KIND_UPLOAD,
+    KIND_POLL
+};
+
+static query_kind_t queryKind(int type){
+    switch (type) {
+        case PACKET_UPLOAD:
+        case PACKET_GROUP_END:
+            return KIND_UPLOAD;
+        case PACKET_POLL:
+            return KIND_POLL;
+    }
+    return KIND_NONE;
+}
+
+//a discard answers either kind of query
+static query_kind_t responseKind(int type){
+    switch (type) {
+        case PACKET_ACK:
+            return KIND_UPLOAD;
+        case PACKET_DOWNLOAD:
+        case PACKET_GROUP_END:
+        case PACKET_DOWNLOAD_NOTHING:
+            return KIND_POLL;
+    }
+    return KIND_NONE;
+}
+
+using QueryKey = tuple<uint16_t,int,uint16_t,uint16_t>;
+
+struct Pending {
+    uint64_t time;
+    bool retransmitted;
+};
+
+struct SessionStats {
+    uint64_t counts[2][TRACE_GROUP_EXPORTED+1]={};
+    uint64_t bytes[2][TRACE_GROUP_EXPORTED+1]={};
+    Histogram rtt;
+    Histogram dwell;
+    Histogram upload;
+    Histogram download;
+    //queries waiting for their response, by the side that waits
+    map<QueryKey,Pending> pending[2];
+    //the first segment of a group, by the side that created it
+    map<pair<uint16_t,uint16_t>,uint64_t> groups[2];
+};
+
+static void printHistogram(const char* name,const Histogram& h){
+    auto s = h.snapshot();
+    if(s.count==0) return;
+    printf("    %-22s count %-8llu p50 %-10.3f p90 %-10.3f p99 %-10.3f max %.3f ms\n",name,(unsigned long long)s.count,
+           (double)s.quantile(0.5)/1e6,(double)s.quantile(0.9)/1e6,(double)s.quantile(0.99)/1e6,(double)s.max/1e6);
+}
+
+static const char* sideName(int side){
+    return side==TRACE_CLIENT ? "client" : "server";
+}
+
+//the query of the response, if the side is waiting for one
+static map<QueryKey,Pending>::iterator findQuery(map<QueryKey,Pending>& pending,const TraceEvent& e){
+    auto kind = responseKind(e.packetType);
+    if(kind!=KIND_NONE) return pending.find(QueryKey(e.sessionId,kind,e.groupId,e.dataId));
+    if(e.packetType!=PACKET_DISCARD) return pending.end();
+    auto it = pending.find(QueryKey(e.sessionId,KIND_UPLOAD,e.groupId,e.dataId));
+    return it!=pending.end() ? it : pending.find(QueryKey(e.sessionId,KIND_POLL,e.groupId,e.dataId));
+}
+
+static void account(SessionStats& stats,const TraceEvent& e){
+    int side = e.side==TRACE_CLIENT ? TRACE_CLIENT : TRACE_SERVER;
+    if(e.event>=1 && e.event<=TRACE_GROUP_EXPORTED){
+        stats.counts[side][e.event]++;
+        stats.bytes[side][e.event]+=e.size;
+    }
+    auto& pending = stats.pending[side];
+    switch (e.event) {
+        case TRACE_QUERY_SENT:
+        case TRACE_QUERY_RECEIVED: {
+            auto kind = queryKind(e.packetType);
+            if(kind==KIND_NONE) break;
+            //a query sent again keeps the time of the first one, and is not sampled
+            auto it = pending.find(QueryKey(e.sessionId,kind,e.groupId,e.dataId));
+            if(it==pending.end()) pending.emplace(QueryKey(e.sessionId,kind,e.groupId,e.dataId),Pending{e.time,false});
+            else it->second.retransmitted=true;
+            break;
+        }
+        case TRACE_RETRANSMIT: {
+            auto kind = queryKind(e.packetType);
+            if(side==TRACE_CLIENT && kind!=KIND_NONE){
+                auto it = pending.find(QueryKey(e.sessionId,kind,e.groupId,e.dataId));
+                if(it!=pending.end()) it->second.retransmitted=true;
+            }
+            break;
+        }
+        case TRACE_RESPONSE_RECEIVED:
+        case TRACE_RESPONSE_SENT: {
+            auto it = findQuery(pending,e);
+            if(it==pending.end()) break;
+            if(!it->second.retransmitted && e.time>=it->second.time){
+                (side==TRACE_CLIENT ? stats.rtt : stats.dwell).record(e.time-it->second.time);
+            }
+            pending.erase(it);
+            break;
+        }
+        case TRACE_SEGMENT_CREATED:
+            stats.groups[side].emplace(make_pair(e.sessionId,e.groupId),e.time);
+            break;
+        case TRACE_GROUP_EXPORTED: {
+            //uploads are created by the client and exported by the server, downloads the other way round
+            int creator = side==TRACE_CLIENT ? TRACE_SERVER : TRACE_CLIENT;
+            auto it = stats.groups[creator].find(make_pair(e.sessionId,e.groupId));
+            if(it==stats.groups[creator].end()) break;
+            if(e.time>=it->second) (creator==TRACE_CLIENT ? stats.upload : stats.download).record(e.time-it->second);
+            stats.groups[creator].erase(it);
+            break;
+        }
+    }
+}
+
+static void usage(const char* name){
+    fprintf(stderr,"usage: %s [-t] [-s session] dump...\n",name);
+    exit(2);
+}
+
+int main(int argc,char** args){
+    bool timeline=false;
+    long session=-1;
+    vector<TraceEvent> events;
+    int files=0;
+    for(int i=1;i<argc;i++){
+        if(strcmp(args[i],"-t")==0){
+            timeline=true;
+        }else if(strcmp(args[i],"-s")==0){
+            if(++i>=argc) usage(args[0]);
+            session=strtol(args[i], nullptr,10);
+        }else if(args[i][0]=='-'){
+            usage(args[0]);
+        }else{
+            if(Trace::load(args[i],events)<0) return 1;
+            files++;
+        }
+    }
+    if(files==0) usage(args[0]);
+    stable_sort(events.begin(),events.end(),[](const TraceEvent& a,const TraceEvent& b){return a.time<b.time;});
+    if(session>=0){
+        events.erase(remove_if(events.begin(),events.end(),[session](const TraceEvent& e){return e.sessionId!=session;}),events.end());
+    }
+    if(events.empty()){
+        printf("no events\n");
+        return 0;
+    }
+
+    uint64_t start=events.front().time;
+    if(timeline){
+        printf("%14s %-6s %-6s %-7s %-18s %-30s %-6s %-6s %s\n","us","side","thread","session","event","packet","group","data","size");
+        for(const auto& e : events){
+            printf("%14.3f %-6s %-6u %-7u %-18s %-30s %-6u %-6u %u\n",(double)(e.time-start)/1000,sideName(e.side),e.thread,
+                   e.sessionId,Trace::eventName(e.event),packetTypeName(e.packetType),e.groupId,e.dataId,e.size);
+        }
+        printf("\n");
+    }
+
+    map<uint16_t,unique_ptr<SessionStats>> sessions;
+    for(const auto& e : events){
+        auto& stats = sessions[e.sessionId];
+        if(!stats) stats.reset(new SessionStats);
+        account(*stats,e);
+    }
+    printf("%zu events over %.3f ms\n",events.size(),(double)(events.back().time-start)/1e6);
+    for(const auto& pa : sessions){
+        const auto& stats = *pa.second;
+        printf("\nsession %u\n",pa.first);
+        for(int side : {TRACE_CLIENT,TRACE_SERVER}){
+            bool any=false;
+            for(int event=1;event<=TRACE_GROUP_EXPORTED;event++){
+                if(stats.counts[side][event]==0) continue;
+                if(!any) printf("  %s\n",sideName(side));
+                any=true;
+                printf("    %-22s %-8llu %llu bytes\n",Trace::eventName(event),(unsigned long long)stats.counts[side][event],
+                       (unsigned long long)stats.bytes[side][event]);
+            }
+        }
+        printf("  latency\n");
+        printHistogram("client rtt",stats.rtt);
+        printHistogram("server dwell",stats.dwell);
+        printHistogram("upload group",stats.upload);
+        printHistogram("download group",stats.download);
+    }
+    return 0;
+}